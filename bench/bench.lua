@@ -0,0 +1,126 @@
+--[[
+  Latency of each method of the Lua module.
+
+    lua bench.lua [iterations]
+
+  Run it on the same kind of display as xbench, with some windows already
+  listed by the window manager (run.sh keeps xbench's open with -H). Each
+  call is timed by the module's own statistics, which start and stop inside
+  the method, so the numbers leave out the Lua call itself but include
+  everything the binding does. The results are printed as JSON lines in the
+  same form as xbench's, under the suite name "lua".
+]]
+
+package.cpath="../src/?.so;"..package.cpath
+local xctrl=require("xctrl")
+
+local iterations=tonumber(arg[1]) or 1000
+local backend=os.getenv("XBENCH_BACKEND") or "xlib"
+
+local xc=assert(xctrl.new())
+local wins=assert(xc:get_win_list())
+assert(#wins>=2, "bench.lua needs some windows to work with")
+local win=wins[1]
+local i=0
+
+local function other_win()
+  return wins[2+(i%(#wins-1))]
+end
+
+-- Methods, their arguments, and a smaller count for the slow ones, in the
+-- order of the module's method table. Ones that wait for the user, start
+-- a listener or measure the others are left out.
+local methods={
+  {"get_win_list"},
+  {"snapshot"},
+  {"get_win_title", function() return win end},
+  {"set_win_title", function() return win,"xbench window 0" end},
+  {"get_win_class", function() return win end},
+  {"activate_win", function() return other_win() end},
+  {"iconify_win", function() return other_win() end},
+  {"set_win_state", function() return win,"toggle","above" end},
+  {"get_win_state", function() return win end},
+  {"set_win_geom", function() return win,{x=i%100,y=50,w=200,h=100} end},
+  {"get_win_geom", function() return win end},
+  {"get_win_frame", function() return win end},
+  {"get_win_type", function() return win end},
+  {"set_win_decor", function() return win,{"none"} end},
+  {"get_active_win"},
+  {"root_win"},
+  {"set_desk_of_win", function() return win,1+(i%2) end},
+  {"get_desk_of_win", function() return win end},
+  {"get_pid_of_win", function() return win end},
+  {"get_win_client", function() return win end},
+  {"get_num_desks"},
+  {"set_num_desks", function() return 4 end},
+  {"get_curr_desk"},
+  {"set_curr_desk", function() return 1+(i%2) end},
+  {"get_display"},
+  {"get_wm_win"},
+  {"get_wm_name"},
+  {"get_wm_class"},
+  {"get_wm_pid"},
+  {"wm_supports", function() return "_NET_WM_STATE_HIDDEN" end},
+  {"get_desk_name", function() return 1 end},
+  {"get_workarea", function() return 1 end},
+  {"get_desk_geom", function() return 1 end},
+  {"set_desk_vport", function() return 0,0 end},
+  {"get_showing_desk"},
+  {"set_showing_desk", function() return false end},
+  {"send_keys", function() return win,"a" end},
+  {"do_events", nil, 10}, -- sleeps 100ms a time
+  {"convert_locale", function() return "xbench window title","UTF-8","ISO-8859-1" end},
+  {"set_selection", function() return "xbench","b" end},
+  {"get_selection", function() return "b" end},
+  {"get_dropped"},
+  {"get_atoms_saved"},
+}
+
+
+local function percentile(sorted, pct)
+  local rank=math.ceil(#sorted*pct/100)
+  return sorted[rank>0 and rank or 1]
+end
+
+
+local function report(name, samples, trips, err)
+  local line=string.format('{"key":"lua/%s","suite":"lua","name":"%s","backend":"%s","n":%d',
+    name, name, backend, #samples)
+  if #samples>0 then
+    local total=0
+    for _,v in ipairs(samples) do total=total+v end
+    table.sort(samples)
+    line=line..string.format(',"p50_us":%.3f,"p90_us":%.3f,"p99_us":%.3f,"max_us":%.3f',
+      percentile(samples,50), percentile(samples,90), percentile(samples,99), samples[#samples])
+    if total>0 then line=line..string.format(',"ops_per_s":%.1f', #samples*1e6/total) end
+    line=line..string.format(',"round_trips":%.2f', trips/#samples)
+  end
+  if err then line=line..string.format(',"error":"%s"', (tostring(err):gsub('[%c"\\]',' '))) end
+  print(line..'}')
+  io.stdout:flush()
+end
+
+
+xc:set_stats(true)
+for _,m in ipairs(methods) do
+  local name,args=m[1],m[2] or function() end
+  local method=xc[name]
+  local samples={}
+  local trips=0
+  local err=nil
+  for n=1,math.min(iterations, m[3] or iterations) do
+    i=n
+    xc:reset_stats()
+    local ok,msg=pcall(method,xc,args())
+    if not ok then
+      err=msg
+      break
+    end
+    local st=xc:stats().apis[name]
+    samples[#samples+1]=st.time_ms*1000
+    trips=trips+st.round_trips
+  end
+  report(name, samples, trips, err)
+end
+xc:set_stats(false)
+xc:activate_win(win)
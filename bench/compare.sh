@@ -0,0 +1,114 @@
+#!/bin/sh
+#
+# Print or compare benchmark results.
+#
+#   compare.sh results_file
+#   compare.sh [-t percent] base_file new_file
+#
+# With one file, prints its results as a table. With two, matches the
+# measurements by key and prints the change in median latency, throughput
+# and round trips from base_file to new_file. A measurement whose median
+# got more than "percent" slower (default 10), or that now takes more round
+# trips, is marked as a regression and makes the exit status 1.
+#
+
+threshold=10
+
+while getopts "t:" opt; do
+  case $opt in
+    t) threshold=$OPTARG ;;
+    *) echo "usage: $0 [-t percent] [base_file] results_file" >&2; exit 2 ;;
+  esac
+done
+shift `expr $OPTIND - 1`
+
+if [ $# -lt 1 ] || [ $# -gt 2 ]; then
+  echo "usage: $0 [-t percent] [base_file] results_file" >&2
+  exit 2
+fi
+
+for f in "$@"; do
+  if [ ! -r "$f" ]; then
+    echo "$0: can't read $f" >&2
+    exit 2
+  fi
+done
+
+awk -v threshold="$threshold" -v single=`expr $# = 1` '
+# The value of "field" in one line of results, or "" if it is not there
+function get(line, field,   v) {
+  if (!match(line, "\"" field "\":(\"[^\"]*\"|[-0-9.e+]+)")) { return "" }
+  v=substr(line, RSTART+length(field)+3, RLENGTH-length(field)-3)
+  gsub(/"/, "", v)
+  return v
+}
+
+function change(a, b) {
+  if ((a=="") || (b=="") || (a+0==0)) { return "-" }
+  return sprintf("%+.1f%%", (b-a)*100/a)
+}
+
+FNR==1 { fileno++ }
+
+!single && (fileno==1) {
+  key=get($0, "key")
+  if (key!="") {
+    base_p50[key]=get($0, "p50_us")
+    base_ops[key]=get($0, "ops_per_s")
+    base_trips[key]=get($0, "round_trips")
+  }
+  next
+}
+
+{
+  key=get($0, "key")
+  if (key=="") { next }
+  if (single) {
+    if (!header++) {
+      printf("%-44s %10s %10s %10s %12s %6s\n", "key", "p50_us", "p99_us", "max_us", "ops/s", "trips")
+    }
+    err=get($0, "error")
+    if (err!="") {
+      printf("%-44s error: %s\n", key, err)
+      next
+    }
+    printf("%-44s %10s %10s %10s %12s %6s\n", key, get($0, "p50_us"), get($0, "p99_us"),
+      get($0, "max_us"), get($0, "ops_per_s"), get($0, "round_trips"))
+    next
+  }
+  if (!(key in base_p50)) {
+    added[key]=1
+    next
+  }
+  seen[key]=1
+  if (!header++) {
+    printf("%-44s %10s %10s %8s %12s %8s %9s\n", "key", "base_p50", "new_p50", "change", "new_ops/s", "change", "trips")
+  }
+  err=get($0, "error")
+  if (err!="") {
+    printf("%-44s error: %s\n", key, err)
+    next
+  }
+  p50=get($0, "p50_us")
+  trips=get($0, "round_trips")
+  mark=""
+  if ((base_p50[key]!="") && (p50!="") && (p50+0 > base_p50[key]*(1+threshold/100))) { mark=" SLOWER" }
+  if ((base_trips[key]!="") && (trips!="") && (trips+0 > base_trips[key]+0)) { mark=mark " MORE-TRIPS" }
+  if (mark!="") { regressions++ }
+  t=(base_trips[key]==trips)?trips:(base_trips[key] "->" trips)
+  printf("%-44s %10s %10s %8s %12s %8s %9s%s\n", key, base_p50[key], p50, change(base_p50[key], p50),
+    get($0, "ops_per_s"), change(base_ops[key], get($0, "ops_per_s")), t, mark)
+}
+
+END {
+  if (single) { exit 0 }
+  for (key in base_p50) {
+    if (!(key in seen)) { print "only in base: " key }
+  }
+  for (key in added) { print "only in new:  " key }
+  if (regressions) {
+    printf("%d regression(s) over %s%%\n", regressions, threshold)
+    exit 1
+  }
+}
+' "$@"
@@ -0,0 +1,74 @@
+--[[
+  Events per second through listen(), one call per event and batched.
+
+    lua listen.lua [titles]
+
+  For each mode, starts "xbench -T titles" ($XBENCH, default ./xbench) as
+  the event source, and listens to it until it closes its windows. The
+  retitling outruns the listener, so the events queue up and the rate is
+  set by how fast the listener takes them. It is measured in CPU time, so
+  the waits between the source's steps don't count. The results are
+  printed as JSON lines in the same form as xbench's, under the suite name
+  "lua", with the title events delivered as "n".
+]]
+
+package.cpath="../src/?.so;"..package.cpath
+local xctrl=require("xctrl")
+
+local titles=tonumber(arg[1]) or 20000
+local backend=os.getenv("XBENCH_BACKEND") or "xlib"
+local source=(os.getenv("XBENCH") or "./xbench").." -T "..titles.." -w 10"
+
+local xc=assert(xctrl.new())
+
+-- The options for listen(), nil for one call per event
+local modes={
+  {"per_event"},
+  {"batch/16", {batch=16, max_delay_ms=10}},
+  {"batch/256", {batch=256, max_delay_ms=10}},
+}
+
+
+local function report(name, n, cpu, err)
+  local line=string.format('{"key":"lua/listen/%s","suite":"lua","name":"listen","backend":"%s","n":%d',
+    name, backend, n)
+  if (n>0) and (cpu>0) then line=line..string.format(',"ops_per_s":%.1f', n/cpu) end
+  if err then line=line..string.format(',"error":"%s"', (tostring(err):gsub('[%c"\\]',' '))) end
+  print(line..'}')
+  io.stdout:flush()
+end
+
+
+-- Count the title events, and stop at the first window the source closes
+local count=0
+
+local function on_event(ev)
+  if ev=="t" then
+    count=count+1
+  elseif ev=="x" then
+    return false
+  end
+  return true
+end
+
+local function on_batch(batch, n)
+  local go=true
+  for j=1,n do
+    if not on_event(batch[j][1]) then go=false end
+  end
+  return go
+end
+
+
+for _,m in ipairs(modes) do
+  local name,opts=m[1],m[2] or {}
+  opts.events="wxt"
+  count=0
+  local p=assert(io.popen(source))
+  local start=os.clock()
+  local ok,err=pcall(xc.listen, xc, m[2] and on_batch or on_event, opts)
+  local cpu=os.clock()-start
+  p:close()
+  if ok and (count==0) then err="no title events arrived" end
+  report(name, count, cpu, err)
+end
@@ -0,0 +1,167 @@
+#!/bin/sh
+#
+# Run the benchmarks on a private Xvfb server and save the results.
+#
+#   run.sh [-o results_file] [-n iterations] [-w windows] [-b backend | -X] [suite...]
+#
+# The results are written as JSON lines, one per measurement, to
+# results_file, or by default to results/<date>-<commit>.json, and printed
+# as a table when done. Pass two such files to compare.sh to compare builds.
+#
+# The backend is "xlib" (xbench, the default) or "xcb" (xbench-xcb, see
+# "make xbench-xcb"). With -X, the same workload is run with both, one
+# after the other on the same server, the XCB results are saved next to
+# the others with "-xcb" added to the name, and the two are compared.
+# The Lua module is built separately, so its suite is only run once.
+#
+# The "threads" suite is run by xbench-mt, the thread-safe build, and only
+# for the Xlib backend.
+#
+# The Lua methods, and the event rate through listen() with and without
+# batching, are measured too (as the "lua" suite) if the module has been
+# built in ../src and $LUA (default "lua") can load it; naming suites on
+# the command line leaves them out unless "lua" is one of them.
+#
+# Exits with status 77 if Xvfb is not installed.
+#
+
+here=`pwd`
+cd `dirname "$0"` || exit 1
+
+LUA=${LUA:-lua}
+out=
+backend=xlib
+both=
+iterations=1000
+windows=50
+
+usage() {
+  echo "usage: $0 [-o results_file] [-n iterations] [-w windows] [-b backend | -X] [suite...]" >&2
+  exit 2
+}
+
+# Everything below the option parsing runs twice: first to start the
+# server, then again inside it with --inside as the first argument.
+inside=
+if [ "$1" = "--inside" ]; then
+  inside=1
+  shift
+fi
+
+while getopts "o:n:w:b:X" opt; do
+  case $opt in
+    b) backend=$OPTARG ;;
+    X) both=1 ;;
+    o) case $OPTARG in /*) out=$OPTARG ;; *) out=$here/$OPTARG ;; esac ;;
+    n) iterations=$OPTARG ;;
+    w) windows=$OPTARG ;;
+    *) usage ;;
+  esac
+done
+shift `expr $OPTIND - 1`
+
+case $backend in
+  xlib) xbench=./xbench ;;
+  xcb) xbench=./xbench-xcb ;;
+  *) usage ;;
+esac
+
+if [ -z "$inside" ]; then
+  if [ -z "$out" ]; then
+    mkdir -p results
+    rev=`git rev-parse --short HEAD 2>/dev/null || echo unknown`
+    out=results/`date +%Y%m%d-%H%M%S`-$rev.json
+  fi
+  if [ -n "$both" ]; then
+    xcb_out=`echo "$out" | sed 's/\.json$//'`-xcb.json
+    for b in xbench xbench-xcb; do
+      if [ ! -x $b ]; then
+        echo "run.sh: $b has not been built" >&2
+        exit 1
+      fi
+    done
+    ../tools/xrun.sh sh -c './run.sh --inside -b xlib -o "$0" -n $2 -w $3 $4 &&
+      XBENCH_NO_LUA=1 ./run.sh --inside -b xcb -o "$1" -n $2 -w $3 $4' \
+      "$out.tmp" "$xcb_out.tmp" $iterations $windows "$*"
+  else
+    ../tools/xrun.sh ./run.sh --inside -b $backend -o "$out.tmp" -n $iterations -w $windows "$@"
+  fi
+  status=$?
+  if [ $status -ne 0 ]; then
+    rm -f "$out.tmp" "$xcb_out.tmp"
+    exit $status
+  fi
+  mv "$out.tmp" "$out"
+  if [ -n "$both" ]; then
+    mv "$xcb_out.tmp" "$xcb_out"
+    echo "Xlib (base) against XCB (new):"
+    ./compare.sh -t 0 "$out" "$xcb_out"
+    echo "Results saved in $out and $xcb_out"
+  else
+    ./compare.sh "$out"
+    echo "Results saved in $out"
+  fi
+  exit 0
+fi
+
+if [ ! -x $xbench ]; then
+  echo "run.sh: $xbench has not been built" >&2
+  exit 1
+fi
+
+: > "$out"
+
+# Split the suites between xbench, xbench-mt and bench.lua
+suites=
+lua=1
+threads=1
+if [ $# -gt 0 ]; then
+  lua=
+  threads=
+  for s in "$@"; do
+    case $s in
+      lua) lua=1 ;;
+      threads) threads=1 ;;
+      *) suites="$suites $s" ;;
+    esac
+  done
+fi
+
+if [ $# -eq 0 ] || [ -n "$suites" ]; then
+  $xbench -n $iterations -w $windows $suites >> "$out" || exit 1
+fi
+
+# The thread-safe build is Xlib only
+if [ -n "$threads" ] && [ "$backend" = "xlib" ]; then
+  if [ ! -x ./xbench-mt ]; then
+    echo "run.sh: xbench-mt has not been built, skipping the threads suite" >&2
+  else
+    ./xbench-mt -n $iterations -w $windows threads >> "$out" || exit 1
+  fi
+fi
+
+if [ -n "$lua" ] && [ -z "$XBENCH_NO_LUA" ]; then
+  if [ ! -f ../src/xctrl.so ] || ! $LUA -e 'package.cpath="../src/?.so;"..package.cpath; require("xctrl")' 2>/dev/null; then
+    echo "run.sh: the Lua module is not built or $LUA can't load it, skipping the lua suite" >&2
+  else
+    ready=`mktemp -u /tmp/xbench.XXXXXX`
+    $xbench -H -w $windows -r "$ready" &
+    hpid=$!
+    i=0
+    while [ ! -e "$ready" ] && kill -0 $hpid 2>/dev/null && [ $i -lt 300 ]; do
+      sleep 0.1
+      i=`expr $i + 1`
+    done
+    status=1
+    if [ -e "$ready" ]; then
+      XBENCH_BACKEND=$backend $LUA bench.lua $iterations >> "$out"
+      status=$?
+    fi
+    kill $hpid 2>/dev/null
+    wait $hpid 2>/dev/null
+    rm -f "$ready"
+    [ $status -eq 0 ] || exit 1
+    XBENCH=$xbench XBENCH_BACKEND=$backend $LUA listen.lua `expr $iterations \* 20` >> "$out" || exit 1
+  fi
+fi
+exit 0
@@ -0,0 +1,1316 @@
+/*
+Benchmarks for the X11 control library.
+
+  Usage: xbench [-n iterations] [-w windows] [suite...]
+         xbench -H [-w windows] [-r ready_file]
+         xbench -T titles [-w windows]
+
+Runs the named suites, or all of them, against $DISPLAY, which should be a
+private server with an EWMH window manager on it, such as the one that
+../tools/xrun.sh starts. Each result is written to stdout as one line of
+JSON, keyed by "suite/name", with the latency percentiles in microseconds,
+the throughput, and where they were measured, the round trips and reply
+bytes per call. See run.sh and compare.sh for running and comparing them.
+
+With -H, it only opens the windows and holds them open until it is killed,
+creating ready_file, if given, once the window manager has listed them all.
+That gives bench.lua something to work with.
+
+With -T, it opens the windows, gives a listener a moment to notice them,
+retitles them round-robin "titles" times as fast as it can, and closes
+them again. That is the event source for listen.lua.
+
+Built thread-safe, as xbench-mt, it also has a "threads" suite, which
+times calls made from 1 to 16 threads at once.
+
+This program is free software, released under the GNU General Public
+License. You may redistribute and/or modify this program under the terms
+of that license as published by the Free Software Foundation; either
+version 2 of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+*/
+
+#include <X11/Xlib.h>
+#define XCTRL_API static
+#include "../src/xctrl.c"
+
+#ifdef XCTRL_USE_XCB
+# define BACKEND "xcb"
+#else
+# define BACKEND "xlib"
+#endif
+
+#define STATS_CALLS 10      /* calls counted to find the round trips per call */
+#define CLIENT_WAIT_MS 10000
+#define LISTEN_SETTLE_MS 250 /* for a listener to select the new windows */
+
+
+typedef struct _Bench {
+  Display*disp;
+  Window*wins;        /* the dummy clients */
+  ulong count;
+  ulong iterations;
+  ulong i;            /* the current iteration */
+  char buf[1024];
+} Bench;
+
+/* What one measurement is reported as */
+typedef struct _Result {
+  const char*suite;
+  const char*name;
+  const char*param;   /* appended to the key if not NULL */
+  double*samples;     /* microseconds per operation */
+  ulong n;
+  double total_us;    /* time taken for all "ops" operations */
+  double ops;
+  double trips;       /* round trips per operation, <0 if not measured */
+  double bytes;       /* bytes per operation, <0 if not measured */
+  double copied;      /* bytes copied per operation, <0 if not measured */
+} Result;
+
+
+
+static ulong x_errors=0;
+
+
+
+/* Windows come and go under some of the calls; count the errors rather than exit. */
+static int on_error(Display*disp, XErrorEvent*ev)
+{
+  x_errors++;
+  return 0;
+}
+
+
+
+static double bench_us(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec*1e6+ts.tv_nsec/1e3;
+}
+
+
+
+static int cmp_double(const void*a, const void*b)
+{
+  double x=*(const double*)a;
+  double y=*(const double*)b;
+  return (x>y)-(x<y);
+}
+
+
+
+/* Nearest-rank percentile of sorted samples */
+static double percentile(const double*sorted, ulong n, int pct)
+{
+  ulong rank=(n*pct+99)/100;
+  return n?sorted[rank?rank-1:0]:0;
+}
+
+
+
+static void report(Result*r)
+{
+  printf("{\"key\":\"%s/%s%s%s\",\"suite\":\"%s\",\"name\":\"%s\",\"backend\":\"%s\",\"n\":%lu",
+    r->suite, r->name, r->param?"/":"", r->param?r->param:"", r->suite, r->name, BACKEND, r->n);
+  if (r->samples && r->n) {
+    qsort(r->samples, r->n, sizeof(double), cmp_double);
+    printf(",\"p50_us\":%.3f,\"p90_us\":%.3f,\"p99_us\":%.3f,\"max_us\":%.3f",
+      percentile(r->samples, r->n, 50), percentile(r->samples, r->n, 90),
+      percentile(r->samples, r->n, 99), r->samples[r->n-1]);
+  }
+  if (r->total_us>0) { printf(",\"ops_per_s\":%.1f", r->ops*1e6/r->total_us); }
+  if (r->trips>=0) { printf(",\"round_trips\":%.2f", r->trips); }
+  if (r->bytes>=0) { printf(",\"bytes\":%.0f", r->bytes); }
+  if (r->copied>=0) { printf(",\"copied_bytes\":%.0f", r->copied); }
+  printf("}\n");
+  fflush(stdout);
+}
+
+
+
+static void result_init(Result*r, const char*suite, const char*name, ulong n)
+{
+  memset(r, 0, sizeof(*r));
+  r->suite=suite;
+  r->name=name;
+  r->n=n;
+  r->trips=-1;
+  r->bytes=-1;
+  r->copied=-1;
+  r->samples=(double*)calloc(n?n:1, sizeof(double));
+  if (!r->samples) {
+    fprintf(stderr, "xbench: out of memory\n");
+    exit(1);
+  }
+}
+
+
+
+static void result_done(Result*r)
+{
+  report(r);
+  free(r->samples);
+  r->samples=NULL;
+}
+
+
+
+/*********************************************************************/
+/* * * * * * * * * * * * * *  Dummy clients * * * * * * * * * * * * * */
+/*********************************************************************/
+
+static Window make_client(Display*disp, ulong n, const char*title)
+{
+  Window win=XCreateSimpleWindow(disp, DefaultRootWindow(disp), (n*13)%800, (n*7)%600, 200, 100, 0, 0, 0);
+  XClassHint hint;
+  long pid=getpid();
+  const char*host="localhost";
+  hint.res_name="xbench";
+  hint.res_class="XBench";
+  XStoreName(disp, win, title);
+  XChangeProperty(disp, win, XInternAtom(disp, "_NET_WM_NAME", False), XInternAtom(disp, "UTF8_STRING", False),
+    8, PropModeReplace, (uchar*)title, strlen(title));
+  XSetClassHint(disp, win, &hint);
+  XChangeProperty(disp, win, XInternAtom(disp, "_NET_WM_PID", False), XA_CARDINAL, 32, PropModeReplace, (uchar*)&pid, 1);
+  XChangeProperty(disp, win, XA_WM_CLIENT_MACHINE, XA_STRING, 8, PropModeReplace, (uchar*)host, strlen(host));
+  XMapWindow(disp, win);
+  return win;
+}
+
+
+
+/* Wait until the window manager lists at least "count" clients */
+static Bool wait_clients(Display*disp, ulong count)
+{
+  ulong start=now_ms();
+  XSync(disp, False);
+  for (;;) {
+    ulong size=0;
+    Window*list=get_window_list(disp, &size);
+    sfree(list);
+    if (size>=count) { return True; }
+    if (now_ms()-start>CLIENT_WAIT_MS) {
+      fprintf(stderr, "xbench: only %lu of %lu windows were listed by the window manager\n", size, count);
+      return False;
+    }
+    usleep(10000);
+  }
+}
+
+
+
+static Window*make_clients(Display*disp, ulong count)
+{
+  Window*wins=(Window*)calloc(count?count:1, sizeof(Window));
+  ulong before=0;
+  ulong i;
+  Window*list=get_window_list(disp, &before);
+  sfree(list);
+  if (!wins) { return NULL; }
+  for (i=0; i<count; i++) {
+    char title[64];
+    sprintf(title, "xbench window %lu", i);
+    wins[i]=make_client(disp, i, title);
+  }
+  if (!wait_clients(disp, before+count)) {
+    free(wins);
+    return NULL;
+  }
+  return wins;
+}
+
+
+
+static void destroy_clients(Display*disp, Window*wins, ulong count)
+{
+  ulong i;
+  for (i=0; i<count; i++) { XDestroyWindow(disp, wins[i]); }
+  XSync(disp, False);
+  free(wins);
+}
+
+
+
+/*********************************************************************/
+/* * * * * * * * * * * * * * * * API suite  * * * * * * * * * * * * * */
+/*********************************************************************/
+
+/*
+  Every public function in xctrl.h that can be called over and over without
+  a person at the mouse. The listener, replay and statistics functions have
+  suites of their own, or are what the measuring is done with.
+*/
+enum {
+  API_GET_WINDOW_LIST,
+  API_GET_ACTIVE_WINDOW,
+  API_GET_WINDOW_CLASS,
+  API_GET_WINDOW_TITLE,
+  API_GET_WINDOW_GEOM,
+  API_GET_WINDOW_FRAME,
+  API_GET_WINDOW_TYPE,
+  API_GET_DESKTOP_OF_WINDOW,
+  API_GET_WIN_PID,
+  API_GET_CLIENT_MACHINE,
+  API_GET_WINDOW_STATE,
+  API_XCTRL_SNAPSHOT,
+  API_GET_WINDOW_TITLE_INTO,
+  API_GET_WINDOW_CLASS_INTO,
+  API_GET_WINDOW_TYPE_INTO,
+  API_GET_CLIENT_MACHINE_INTO,
+  API_GET_DESKTOP_NAME_INTO,
+  API_GET_SHOWING_DESKTOP,
+  API_GET_DESKTOP_NAME,
+  API_GET_WORKAREA_GEOM,
+  API_GET_DESKTOP_GEOM,
+  API_GET_NUMBER_OF_DESKTOPS,
+  API_GET_CURRENT_DESKTOP,
+  API_SUPPORTING_WM_CHECK,
+  API_GET_WM_NAME,
+  API_GET_WM_CLASS,
+  API_GET_WM_PID,
+  API_WM_SUPPORTS,
+  API_XCTRL_ATOM,
+  API_XCTRL_INIT,
+  API_LOCALE_TO_UTF8,
+  API_UTF8_TO_LOCALE,
+  API_CONVERT_LOCALE,
+  API_SET_SELECTION,
+  API_GET_SELECTION,
+  API_ACTIVATE_WINDOW,
+  API_SET_WINDOW_STATE,
+  API_ICONIFY_WINDOW,
+  API_SET_WINDOW_TITLE,
+  API_SET_WINDOW_GEOM,
+  API_SET_WINDOW_MWM_HINTS,
+  API_SEND_WINDOW_TO_DESKTOP,
+  API_SEND_KEYSTROKES,
+  API_SET_SHOWING_DESKTOP,
+  API_CHANGE_GEOMETRY,
+  API_CHANGE_VIEWPORT,
+  API_SET_NUMBER_OF_DESKTOPS,
+  API_SET_CURRENT_DESKTOP,
+  API_CLOSE_WINDOW,
+  API_COUNT
+};
+
+static const char*api_names[API_COUNT]={
+  "get_window_list",
+  "get_active_window",
+  "get_window_class",
+  "get_window_title",
+  "get_window_geom",
+  "get_window_frame",
+  "get_window_type",
+  "get_desktop_of_window",
+  "get_win_pid",
+  "get_client_machine",
+  "get_window_state",
+  "xctrl_snapshot",
+  "get_window_title_into",
+  "get_window_class_into",
+  "get_window_type_into",
+  "get_client_machine_into",
+  "get_desktop_name_into",
+  "get_showing_desktop",
+  "get_desktop_name",
+  "get_workarea_geom",
+  "get_desktop_geom",
+  "get_number_of_desktops",
+  "get_current_desktop",
+  "supporting_wm_check",
+  "get_wm_name",
+  "get_wm_class",
+  "get_wm_pid",
+  "wm_supports",
+  "xctrl_atom",
+  "xctrl_init",
+  "locale_to_utf8",
+  "utf8_to_locale",
+  "convert_locale",
+  "set_selection",
+  "get_selection",
+  "activate_window",
+  "set_window_state",
+  "iconify_window",
+  "set_window_title",
+  "set_window_geom",
+  "set_window_mwm_hints",
+  "send_window_to_desktop",
+  "send_keystrokes",
+  "set_showing_desktop",
+  "change_geometry",
+  "change_viewport",
+  "set_number_of_desktops",
+  "set_current_desktop",
+  "close_window"
+};
+
+
+
+static void api_call(Bench*b, int api)
+{
+  Display*disp=b->disp;
+  Window win=b->wins[0];
+  Geometry geom;
+  ulong n;
+  long l[4];
+  switch (api) {
+    case API_GET_WINDOW_LIST: free(get_window_list(disp, &n)); break;
+    case API_GET_ACTIVE_WINDOW: get_active_window(disp); break;
+    case API_GET_WINDOW_CLASS: free(get_window_class(disp, win)); break;
+    case API_GET_WINDOW_TITLE: free(get_window_title(disp, win)); break;
+    case API_GET_WINDOW_GEOM: get_window_geom(disp, win, &geom); break;
+    case API_GET_WINDOW_FRAME: get_window_frame(disp, win, &l[0], &l[1], &l[2], &l[3]); break;
+    case API_GET_WINDOW_TYPE: free(get_window_type(disp, win)); break;
+    case API_GET_DESKTOP_OF_WINDOW: get_desktop_of_window(disp, win); break;
+    case API_GET_WIN_PID: get_win_pid(disp, win); break;
+    case API_GET_CLIENT_MACHINE: free(get_client_machine(disp, win)); break;
+    case API_GET_WINDOW_STATE: get_window_state(disp, win); break;
+    case API_XCTRL_SNAPSHOT: free(xctrl_snapshot(disp, &n)); break;
+    case API_GET_WINDOW_TITLE_INTO: get_window_title_into(disp, win, b->buf, sizeof(b->buf)); break;
+    case API_GET_WINDOW_CLASS_INTO: get_window_class_into(disp, win, b->buf, sizeof(b->buf)); break;
+    case API_GET_WINDOW_TYPE_INTO: get_window_type_into(disp, win, b->buf, sizeof(b->buf)); break;
+    case API_GET_CLIENT_MACHINE_INTO: get_client_machine_into(disp, win, b->buf, sizeof(b->buf)); break;
+    case API_GET_DESKTOP_NAME_INTO: get_desktop_name_into(disp, 0, True, b->buf, sizeof(b->buf)); break;
+    case API_GET_SHOWING_DESKTOP: get_showing_desktop(disp); break;
+    case API_GET_DESKTOP_NAME: free(get_desktop_name(disp, 0, True)); break;
+    case API_GET_WORKAREA_GEOM: get_workarea_geom(disp, &geom, 0); break;
+    case API_GET_DESKTOP_GEOM: get_desktop_geom(disp, 0, &geom); break;
+    case API_GET_NUMBER_OF_DESKTOPS: get_number_of_desktops(disp); break;
+    case API_GET_CURRENT_DESKTOP: get_current_desktop(disp); break;
+    case API_SUPPORTING_WM_CHECK: supporting_wm_check(disp); break;
+    case API_GET_WM_NAME: free(get_wm_name(disp)); break;
+    case API_GET_WM_CLASS: free(get_wm_class(disp)); break;
+    case API_GET_WM_PID: get_wm_pid(disp); break;
+    case API_WM_SUPPORTS: wm_supports(disp, "_NET_WM_STATE_HIDDEN"); break;
+    case API_XCTRL_ATOM: xctrl_atom(disp, "_NET_WM_STATE_ABOVE"); break;
+    case API_XCTRL_INIT: xctrl_init(disp); break;
+    case API_LOCALE_TO_UTF8: free(locale_to_utf8("xbench window title")); break;
+    case API_UTF8_TO_LOCALE: free(utf8_to_locale("xbench window title")); break;
+    case API_CONVERT_LOCALE: free(convert_locale("xbench window title", "UTF-8", "ISO-8859-1")); break;
+    case API_SET_SELECTION: set_selection(disp, 'b', "xbench", False); break;
+    case API_GET_SELECTION: free(get_selection(disp, 'b', False)); break;
+    case API_ACTIVATE_WINDOW: activate_window(disp, b->wins[b->i%b->count], False); break;
+    case API_SET_WINDOW_STATE: set_window_state(disp, win, 2, "_NET_WM_STATE_ABOVE", NULL); break;
+    case API_ICONIFY_WINDOW: iconify_window(disp, b->wins[b->count>1?1+b->i%(b->count-1):0]); break;
+    case API_SET_WINDOW_TITLE: set_window_title(disp, win, "xbench window 0", 'T'); break;
+    case API_SET_WINDOW_GEOM: set_window_geom(disp, win, 0, 0, b->i%100, 50, 200, 100); break;
+    case API_SET_WINDOW_MWM_HINTS: set_window_mwm_hints(disp, win, 2, 0, 1, 0); break;
+    case API_SEND_WINDOW_TO_DESKTOP: send_window_to_desktop(disp, win, b->i%2); break;
+    case API_SEND_KEYSTROKES: send_keystrokes(disp, win, "a"); break;
+    case API_SET_SHOWING_DESKTOP: set_showing_desktop(disp, 0); break;
+    case API_CHANGE_GEOMETRY: change_geometry(disp, DisplayWidth(disp, DefaultScreen(disp)), DisplayHeight(disp, DefaultScreen(disp))); break;
+    case API_CHANGE_VIEWPORT: change_viewport(disp, 0, 0); break;
+    case API_SET_NUMBER_OF_DESKTOPS: set_number_of_desktops(disp, 4); break;
+    case API_SET_CURRENT_DESKTOP: set_current_desktop(disp, b->i%2); break;
+    case API_CLOSE_WINDOW: close_window(disp, b->wins[b->i]); break;
+  }
+}
+
+
+
+/*
+  Time "n" calls one by one, then count the round trips and reply bytes
+  of a few more. Setters return as soon as their request is queued, so the
+  throughput includes the XSync() that waits for the server to catch up.
+*/
+static void api_measure(Bench*b, int api, ulong n)
+{
+  Result r;
+  XCtrlStats st;
+  double start;
+  ulong i;
+  result_init(&r, "api", api_names[api], n);
+  if (api!=API_CLOSE_WINDOW) {
+    for (b->i=0; b->i<(n<10?n:10); b->i++) { api_call(b, api); } /* warm up */
+  }
+  XSync(b->disp, False);
+  start=bench_us();
+  for (b->i=0; b->i<n; b->i++) {
+    double t=bench_us();
+    api_call(b, api);
+    r.samples[b->i]=bench_us()-t;
+  }
+  XSync(b->disp, False);
+  r.total_us=bench_us()-start;
+  r.ops=n;
+  if (api!=API_CLOSE_WINDOW) {
+    xctrl_set_stats(b->disp, True);
+    for (i=0; i<STATS_CALLS; i++) {
+      b->i=i;
+      xctrl_stats_begin(b->disp, api_names[api]);
+      api_call(b, api);
+      xctrl_stats_end(b->disp);
+    }
+    if (xctrl_get_stats(b->disp, api_names[api], &st)) {
+      r.trips=(double)st.round_trips/STATS_CALLS;
+      r.bytes=(double)st.reply_bytes/STATS_CALLS;
+    }
+    xctrl_set_stats(b->disp, False);
+    XSync(b->disp, False);
+  }
+  result_done(&r);
+}
+
+
+
+static void suite_api(Bench*b)
+{
+  Window*keep=b->wins;
+  ulong count=b->count;
+  int api;
+  for (api=0; api<API_CLOSE_WINDOW; api++) { api_measure(b, api, b->iterations); }
+  /* Closing uses up a window per call, so it gets windows of its own */
+  count=b->iterations<200?b->iterations:200;
+  b->wins=make_clients(b->disp, count);
+  if (b->wins) {
+    api_measure(b, API_CLOSE_WINDOW, count);
+    free(b->wins);
+  }
+  b->wins=keep;
+  activate_window(b->disp, b->wins[0], False);
+  XSync(b->disp, False);
+}
+
+
+
+/*********************************************************************/
+/* * * * * * * * * * * * * * *  Property suite  * * * * * * * * * * * */
+/*********************************************************************/
+
+/* Property sizes on the wire, and how much to cut the iterations by */
+static const struct {
+  const char*name;
+  ulong bytes;
+  ulong div;
+} prop_sizes[]={
+  {"1k", 1024, 1},
+  {"64k", 65536, 10},
+  {"4m", 4194304, 100},
+  {NULL, 0, 0}
+};
+
+#define LEGACY_CHUNK 1024
+
+
+
+/*
+  get_prop() as it was before it sized its reads: a zero-length request
+  for the type, then 1024 longs at a time, growing the result for each.
+  Counts the round trips, and the bytes copied by memcpy() and by each
+  realloc() that had to move the block.
+*/
+static char*legacy_get_prop(Display*d, Window w, Atom type, Atom a, ulong*count, ulong*trips, ulong*copied)
+{
+  Atom ret_type;
+  int format=0;
+  ulong nitems=0;
+  ulong after=0;
+  uchar*retp=NULL;
+  ulong total_bytes=0;
+  ulong offset=0;
+  char*all=NULL;
+  *trips=1;
+  *copied=0;
+  XGetWindowProperty(d,w,a,0,0,False,AnyPropertyType,&ret_type,&format,&nitems,&after,&retp);
+  if (retp) { XFree(retp); }
+  if (type!=ret_type) { return NULL; }
+  all=(char*)malloc(1);
+  do {
+    retp=NULL;
+    XGetWindowProperty(d,w,a,offset,LEGACY_CHUNK,False,ret_type,&ret_type,&format,&nitems,&after,&retp);
+    (*trips)++;
+    if (retp) {
+      ulong chunk_bytes=nitems*PropItemSize(format);
+      uintptr_t old=(uintptr_t)all;
+      char*tmp=(char*)realloc(all,chunk_bytes+total_bytes+1);
+      if (!tmp) {
+        XFree(retp);
+        free(all);
+        return NULL;
+      }
+      all=tmp;
+      if ((uintptr_t)all!=old) { *copied+=total_bytes; }
+      memcpy(&(all[total_bytes]), retp, chunk_bytes);
+      *copied+=chunk_bytes;
+      total_bytes+=chunk_bytes;
+      offset+=(nitems*(format/8))/4;
+      XFree(retp);
+    }
+  } while (after!=0 && nitems!=0);
+  *count=total_bytes/PropItemSize(format);
+  return all;
+}
+
+
+
+/*
+  Read a 32-bit property of each size with get_prop() and with the old
+  way of doing it. get_prop() copies each byte it receives once, into a
+  buffer allocated once, so what it copied is what it returned.
+*/
+static void suite_props(Bench*b)
+{
+  Atom prop=XInternAtom(b->disp, "_XBENCH_PROP", False);
+  Window win=b->wins[0];
+  int s;
+  for (s=0; prop_sizes[s].name; s++) {
+    ulong items=prop_sizes[s].bytes/4;
+    ulong n=b->iterations/prop_sizes[s].div;
+    long*data=(long*)calloc(items, sizeof(long));
+    Result r;
+    XCtrlStats st;
+    ulong count=0;
+    ulong trips=0;
+    ulong copied=0;
+    ulong i;
+    double start;
+    if (!data) { continue; }
+    if (n<5) { n=5; }
+    for (i=0; i<items; i++) { data[i]=i; }
+    XChangeProperty(b->disp, win, prop, XA_CARDINAL, 32, PropModeReplace, (uchar*)data, items);
+    XSync(b->disp, False);
+    free(data);
+
+    result_init(&r, "props", "get_prop", n);
+    r.param=prop_sizes[s].name;
+    start=bench_us();
+    for (i=0; i<n; i++) {
+      double t=bench_us();
+      free(get_prop(b->disp, win, XA_CARDINAL, prop, &count));
+      r.samples[i]=bench_us()-t;
+    }
+    r.total_us=bench_us()-start;
+    r.ops=n;
+    xctrl_set_stats(b->disp, True);
+    xctrl_stats_begin(b->disp, "get_prop");
+    free(get_prop(b->disp, win, XA_CARDINAL, prop, &count));
+    xctrl_stats_end(b->disp);
+    if (xctrl_get_stats(b->disp, "get_prop", &st)) {
+      r.trips=st.round_trips;
+      r.bytes=st.reply_bytes;
+    }
+    xctrl_set_stats(b->disp, False);
+    r.copied=count*sizeof(long);
+    if (count!=items) { fprintf(stderr, "xbench: get_prop read %lu of %lu items\n", count, items); }
+    result_done(&r);
+
+    result_init(&r, "props", "legacy_get_prop", n);
+    r.param=prop_sizes[s].name;
+    start=bench_us();
+    for (i=0; i<n; i++) {
+      double t=bench_us();
+      free(legacy_get_prop(b->disp, win, XA_CARDINAL, prop, &count, &trips, &copied));
+      r.samples[i]=bench_us()-t;
+    }
+    r.total_us=bench_us()-start;
+    r.ops=n;
+    r.trips=trips;
+    r.copied=copied;
+    result_done(&r);
+    XDeleteProperty(b->disp, win, prop);
+  }
+}
+
+
+
+/*********************************************************************/
+/* * * * * * * * * * * * * * * Replay suite * * * * * * * * * * * * * */
+/*********************************************************************/
+
+static const ulong replay_sizes[]={10, 1000, 10000, 0};
+
+#define REPLAY_ATOM 1000      /* the log says which atom is the client list */
+#define REPLAY_FIRST_ID 0x400000
+#define LEGACY_BUDGET 2e8     /* comparisons the old diff may spend per size */
+
+/*
+  A run of client lists: the first has "count" windows, and each one after
+  it has one window closed and a new one opened at the end, as a window
+  manager would list them.
+*/
+typedef struct _ListGen {
+  Window*ids;
+  ulong count;
+  Window next;
+} ListGen;
+
+
+
+static Bool listgen_init(ListGen*g, ulong count)
+{
+  ulong i;
+  g->ids=(Window*)malloc(count*sizeof(Window));
+  if (!g->ids) { return False; }
+  for (i=0; i<count; i++) { g->ids[i]=REPLAY_FIRST_ID+i; }
+  g->count=count;
+  g->next=REPLAY_FIRST_ID+count;
+  return True;
+}
+
+
+
+static void listgen_step(ListGen*g, ulong k)
+{
+  ulong p=(k*7919)%g->count;
+  memmove(&g->ids[p], &g->ids[p+1], (g->count-p-1)*sizeof(Window));
+  g->ids[g->count-1]=g->next++;
+}
+
+
+
+/* Write the log a listener would have recorded for the run, using its own writer. */
+static Bool replay_write_log(FILE*f, ulong count, ulong changes)
+{
+  Listener lst;
+  ListGen g;
+  XEvent ev;
+  int64_t desk=0;
+  uint64_t*ids=(uint64_t*)malloc(count*sizeof(uint64_t));
+  ulong i, k;
+  Bool ok;
+  if (!ids || !listgen_init(&g, count)) {
+    sfree(ids);
+    fclose(f);
+    return False;
+  }
+  memset(&lst, 0, sizeof(lst));
+  lst.root=1;
+  lst.mask=XCTRL_EVENT_MASK_ALL;
+  lst.track_clients=True;
+  event_slot_add(&lst, REPLAY_ATOM, EV_NET_CLIENT_LIST);
+  listener_start_record(&lst, f);
+  if (lst.record) { rec_write(&lst, REC_DESKTOP, &desk, sizeof(desk)); }
+  if (lst.record) { rec_write(&lst, REC_CLIENT_LIST, NULL, 0); } /* nobody there when we start */
+  memset(&ev, 0, sizeof(ev));
+  ev.type=PropertyNotify;
+  ev.xproperty.window=lst.root;
+  ev.xproperty.atom=REPLAY_ATOM;
+  for (k=0; (k<=changes) && lst.record; k++) {
+    if (k) { listgen_step(&g, k); }
+    for (i=0; i<count; i++) { ids[i]=g.ids[i]; }
+    rec_write_event(&lst, &ev);
+    if (lst.record) { rec_write(&lst, REC_CLIENT_LIST, ids, count*sizeof(uint64_t)); }
+  }
+  ok=(lst.record!=NULL);
+  if (lst.record) { ok=(fclose(lst.record)==0); }
+  free(ids);
+  free(g.ids);
+  return ok;
+}
+
+
+
+typedef struct _ReplayCount {
+  ulong windows;
+  ulong inserts;
+  ulong deletes;
+  double startup_us;  /* when the first list had been delivered */
+  double last;
+  double*samples;     /* time from one INSERT to the next after that */
+  ulong n;
+} ReplayCount;
+
+
+
+static int replay_cb(int ev, Window win, void*cb_data)
+{
+  ReplayCount*rc=(ReplayCount*)cb_data;
+  if (ev==XCTRL_EVENT_WINDOW_LIST_DELETE) {
+    rc->deletes++;
+  } else if (ev==XCTRL_EVENT_WINDOW_LIST_INSERT) {
+    double t=bench_us();
+    if (++rc->inserts==rc->windows) {
+      rc->startup_us=t-rc->last;
+    } else if (rc->inserts>rc->windows) {
+      rc->samples[rc->n++]=t-rc->last;
+    }
+    if (rc->inserts>=rc->windows) { rc->last=t; }
+  }
+  return 1;
+}
+
+
+
+typedef struct _LegacyItem {
+  struct _LegacyItem*next;
+  Window win;
+} LegacyItem;
+
+
+
+/* The diff event_loop() used to do: nested loops, and a walk to the tail for each insert */
+static void legacy_diff(LegacyItem**list, Window*clients, ulong n, ulong*events)
+{
+  LegacyItem*p1=*list;
+  ulong i;
+  while (p1) {
+    LegacyItem*p2=p1->next;
+    Bool found=False;
+    for (i=0; i<n; i++) {
+      if (p1->win==clients[i]) {
+        found=True;
+        break;
+      }
+    }
+    if (!found) {
+      LegacyItem*cur;
+      LegacyItem*prv=NULL;
+      for (cur=*list; cur; prv=cur, cur=cur->next) {
+        if (cur->win==p1->win) {
+          if (prv) { prv->next=cur->next; } else { *list=cur->next; }
+          free(cur);
+          break;
+        }
+      }
+      (*events)++;
+    }
+    p1=p2;
+  }
+  for (i=0; i<n; i++) {
+    Bool found=False;
+    for (p1=*list; p1; p1=p1->next) {
+      if (clients[i]==p1->win) {
+        found=True;
+        break;
+      }
+    }
+    if (!found) {
+      LegacyItem*t=(LegacyItem*)calloc(1, sizeof(LegacyItem));
+      if (!t) { continue; }
+      t->win=clients[i];
+      if (!*list) {
+        *list=t;
+      } else {
+        LegacyItem*p=*list;
+        while (p->next) { p=p->next; }
+        p->next=t;
+      }
+      (*events)++;
+    }
+  }
+}
+
+
+
+static void replay_legacy(ulong count, ulong changes, const char*param)
+{
+  Result r;
+  ListGen g;
+  LegacyItem*list=NULL;
+  ulong events=0;
+  ulong k;
+  double t, start;
+  if (!listgen_init(&g, count)) { return; }
+  t=bench_us();
+  legacy_diff(&list, g.ids, g.count, &events);
+  result_init(&r, "replay", "legacy_startup", 1);
+  r.param=param;
+  r.samples[0]=bench_us()-t;
+  result_done(&r);
+  result_init(&r, "replay", "legacy_change", changes);
+  r.param=param;
+  start=bench_us();
+  for (k=1; k<=changes; k++) {
+    listgen_step(&g, k);
+    t=bench_us();
+    legacy_diff(&list, g.ids, g.count, &events);
+    r.samples[k-1]=bench_us()-t;
+  }
+  r.total_us=bench_us()-start;
+  r.ops=changes;
+  result_done(&r);
+  while (list) {
+    LegacyItem*next=list->next;
+    free(list);
+    list=next;
+  }
+  free(g.ids);
+}
+
+
+
+/*
+  Replay a run of client lists through the listener and time the startup,
+  when every window is new, and each change after it. For comparison, the
+  old diff is run on the same lists in memory, without reading a log, so it
+  is, if anything, flattered; it is given fewer changes at the larger sizes.
+*/
+static void suite_replay(Bench*b)
+{
+  int s;
+  for (s=0; replay_sizes[s]; s++) {
+    ulong count=replay_sizes[s];
+    ulong changes=b->iterations;
+    ulong legacy=(ulong)(LEGACY_BUDGET/((double)count*count));
+    char path[]="/tmp/xbench-replay.XXXXXX";
+    char param[24];
+    ReplayCount rc;
+    Result r;
+    FILE*f;
+    int fd=mkstemp(path);
+    long got;
+    if (fd<0) { continue; }
+    f=fdopen(fd, "wb");
+    if (!f || !replay_write_log(f, count, changes)) {
+      fprintf(stderr, "xbench: can't write %s\n", path);
+      unlink(path);
+      continue;
+    }
+    sprintf(param, "%lu", count);
+    memset(&rc, 0, sizeof(rc));
+    rc.windows=count;
+    result_init(&r, "replay", "change", changes);
+    r.param=param;
+    rc.samples=r.samples;
+    rc.last=bench_us();
+    got=xctrl_replay(path, replay_cb, &rc, False);
+    unlink(path);
+    if ((got!=(long)changes+1) || (rc.inserts!=count+changes) || (rc.deletes!=changes)) {
+      fprintf(stderr, "xbench: replay of %lu windows gave %ld events, %lu inserts and %lu deletes\n",
+        count, got, rc.inserts, rc.deletes);
+    }
+    r.n=rc.n;
+    for (r.total_us=0, r.ops=rc.n; rc.n; rc.n--) { r.total_us+=rc.samples[rc.n-1]; }
+    result_done(&r);
+    result_init(&r, "replay", "startup", 1);
+    r.param=param;
+    r.samples[0]=rc.startup_us;
+    result_done(&r);
+    replay_legacy(count, legacy<5?5:legacy>changes?changes:legacy, param);
+  }
+}
+
+
+
+/*********************************************************************/
+/* * * * * * * * * * * * * * * Charset suite * * * * * * * * * * * * * */
+/*********************************************************************/
+
+#define CORPUS_TITLES 8
+#define LOCALE_CHARSET "ISO-8859-1"
+
+/* Window titles as the X server would hand them over, in UTF-8 */
+static const char*ascii_titles[CORPUS_TITLES]={
+  "Terminal - user@host: ~/src/xctrl",
+  "Inbox (3) - Mozilla Thunderbird",
+  "xctrl.c - GNU Emacs",
+  "README - Text Editor",
+  "Mozilla Firefox",
+  "make bench - bash",
+  "Document 1 - LibreOffice Writer",
+  "htop",
+};
+
+static const char*latin_titles[CORPUS_TITLES]={
+  "Caf\xc3\xa9 cr\xc3\xa8me - Notes",
+  "R\xc3\xa9sum\xc3\xa9.pdf - Lecteur de documents",
+  "\xc3\x9c""bersicht - Dateien",
+  "Ma\xc3\xb1""ana - Calendario",
+  "Stra\xc3\x9f""e und G\xc3\xa4rten.jpg - Bildbetrachter",
+  "Se\xc3\xb1or Garc\xc3\xad""a - Correo",
+  "\xc3\x89l\xc3\xa8ve.odt - LibreOffice Writer",
+  "Fa\xc3\xa7""ade - GIMP",
+};
+
+static const char*cjk_titles[CORPUS_TITLES]={
+  "\xe6\x96\x87\xe4\xbb\xb6\xe7\xae\xa1\xe7\x90\x86\xe5\x99\xa8",
+  "\xe6\x96\xb0\xe3\x81\x97\xe3\x81\x84\xe3\x82\xbf\xe3\x83\x96 - Mozilla Firefox",
+  "\xe7\xbb\x88\xe7\xab\xaf - user@host",
+  "\xe6\x9c\xaa\xe5\x91\xbd\xe5\x90\x8d\xe6\x96\x87\xe6\xa1\xa3 - \xe6\x96\x87\xe6\x9c\xac\xe7\xbc\x96\xe8\xbe\x91\xe5\x99\xa8",
+  "\xe4\xbc\x9a\xe8\xad\xb0\xe3\x83\xa1\xe3\x83\xa2.txt",
+  "\xed\x95\x9c\xea\xb5\xad\xec\x96\xb4 \xeb\xac\xb8\xec\x84\x9c",
+  "\xe6\x9d\xb1\xe4\xba\xac\xe3\x81\xae\xe5\xa4\xa9\xe6\xb0\x97 - Chromium",
+  "\xe5\x8b\x95\xe7\x94\xbb\xe3\x83\x97\xe3\x83\xac\xe3\x82\xa4\xe3\x83\xa4\xe3\x83\xbc",
+};
+
+static const char*jp_titles[CORPUS_TITLES]={
+  "\xe6\x96\xb0\xe3\x81\x97\xe3\x81\x84\xe3\x82\xbf\xe3\x83\x96 - Mozilla Firefox",
+  "\xe4\xbc\x9a\xe8\xad\xb0\xe3\x83\xa1\xe3\x83\xa2.txt",
+  "\xe6\x9d\xb1\xe4\xba\xac\xe3\x81\xae\xe5\xa4\xa9\xe6\xb0\x97 - Chromium",
+  "\xe5\x8b\x95\xe7\x94\xbb\xe3\x83\x97\xe3\x83\xac\xe3\x82\xa4\xe3\x83\xa4\xe3\x83\xbc",
+  "\xe7\xab\xaf\xe6\x9c\xab - user@host",
+  "\xe7\x84\xa1\xe9\xa1\x8c\xe3\x81\xae\xe3\x83\x89\xe3\x82\xad\xe3\x83\xa5\xe3\x83\xa1\xe3\x83\xb3\xe3\x83\x88 - \xe3\x83\x86\xe3\x82\xad\xe3\x82\xb9\xe3\x83\x88\xe3\x82\xa8\xe3\x83\x87\xe3\x82\xa3\xe3\x82\xbf",
+  "\xe5\x8f\x97\xe4\xbf\xa1\xe3\x83\x88\xe3\x83\xac\xe3\x82\xa4 (3) - Thunderbird",
+  "\xe8\xa8\xad\xe5\xae\x9a",
+};
+
+/*
+  latin_titles in the locale's charset, and jp_titles in ISO-2022-JP, where
+  they are all 7-bit, filled in by suite_charset()
+*/
+static const char*latin1_titles[CORPUS_TITLES];
+static const char*iso2022_titles[CORPUS_TITLES];
+
+typedef char*(*CharsetFunc)(const char*src, const char*from, const char*to);
+
+typedef struct _CharsetCase {
+  const char*name;
+  const char*legacy;   /* the name for the same conversion done the old way */
+  CharsetFunc func;
+  const char*param;
+  const char**corpus;
+  const char*from;
+  const char*to;
+} CharsetCase;
+
+
+
+static char*call_convert_locale(const char*src, const char*from, const char*to)
+{
+  return convert_locale(src, from, to);
+}
+
+
+
+static char*call_locale_to_utf8(const char*src, const char*from, const char*to)
+{
+  return locale_to_utf8(src);
+}
+
+
+
+static char*call_utf8_to_locale(const char*src, const char*from, const char*to)
+{
+  return utf8_to_locale(src);
+}
+
+
+
+/*
+  How convert_locale() used to do it: a descriptor opened and closed for
+  every call, and every string run through iconv, even plain ASCII.
+*/
+static char*legacy_convert(const char*src, const char*from, const char*to)
+{
+  iconv_t cd=iconv_open(to, from);
+  char*out;
+  if (cd==(iconv_t)-1) { return NULL; }
+  out=convert_iconv(cd, src, from);
+  iconv_close(cd);
+  return out;
+}
+
+
+
+static const CharsetCase charset_cases[]={
+  {"convert_locale", "legacy_convert_locale", call_convert_locale, "ascii", ascii_titles, "UTF-8", LOCALE_CHARSET},
+  {"convert_locale", "legacy_convert_locale", call_convert_locale, "latin", latin_titles, "UTF-8", LOCALE_CHARSET},
+  {"convert_locale", "legacy_convert_locale", call_convert_locale, "cjk", cjk_titles, "UTF-8", "GB18030"},
+  {"convert_locale", "legacy_convert_locale", call_convert_locale, "cjk-utf8", cjk_titles, "UTF-8", "UTF-8"},
+  {"convert_locale", "legacy_convert_locale", call_convert_locale, "iso2022", iso2022_titles, "ISO-2022-JP", "UTF-8"},
+  {"locale_to_utf8", "legacy_locale_to_utf8", call_locale_to_utf8, "ascii", ascii_titles, LOCALE_CHARSET, "UTF-8"},
+  {"locale_to_utf8", "legacy_locale_to_utf8", call_locale_to_utf8, "latin1", latin1_titles, LOCALE_CHARSET, "UTF-8"},
+  {"utf8_to_locale", "legacy_utf8_to_locale", call_utf8_to_locale, "ascii", ascii_titles, "UTF-8", LOCALE_CHARSET},
+  {"utf8_to_locale", "legacy_utf8_to_locale", call_utf8_to_locale, "latin", latin_titles, "UTF-8", LOCALE_CHARSET},
+  {NULL, NULL, NULL, NULL, NULL, NULL, NULL}
+};
+
+
+
+static void charset_run(Bench*b, const CharsetCase*c, Bool legacy)
+{
+  Result r;
+  double start;
+  ulong i;
+  result_init(&r, "charset", legacy?c->legacy:c->name, b->iterations);
+  r.param=c->param;
+  start=bench_us();
+  for (i=0; i<b->iterations; i++) {
+    const char*src=c->corpus[i%CORPUS_TITLES];
+    double t=bench_us();
+    char*out=legacy?legacy_convert(src, c->from, c->to):c->func(src, c->from, c->to);
+    r.samples[i]=bench_us()-t;
+    sfree(out);
+  }
+  r.total_us=bench_us()-start;
+  r.ops=b->iterations;
+  result_done(&r);
+}
+
+
+
+static void corpus_free(const char**corpus)
+{
+  int i;
+  for (i=0; i<CORPUS_TITLES; i++) {
+    sfree((char*)corpus[i]);
+    corpus[i]=NULL;
+  }
+}
+
+
+
+/* Convert a corpus from UTF-8 */
+static Bool corpus_encode(const char**out, const char**in, const char*to)
+{
+  int i;
+  for (i=0; i<CORPUS_TITLES; i++) {
+    out[i]=legacy_convert(in[i], "UTF-8", to);
+    if (!out[i]) {
+      fprintf(stderr, "xbench: iconv can't convert from UTF-8 to %s\n", to);
+      corpus_free(out);
+      return False;
+    }
+  }
+  return True;
+}
+
+
+
+/*
+  The text conversions on a corpus of window titles, each next to the
+  uncached conversion they replaced. The locale is taken to be Latin-1,
+  whatever the environment says, so the results don't depend on it.
+*/
+static void suite_charset(Bench*b)
+{
+  char*saved=default_charset;
+  int c;
+  int i;
+  if (!corpus_encode(latin1_titles, latin_titles, LOCALE_CHARSET)) { return; }
+  if (!corpus_encode(iso2022_titles, jp_titles, "ISO-2022-JP")) {
+    corpus_free(latin1_titles);
+    return;
+  }
+  default_charset=LOCALE_CHARSET;
+  for (c=0; charset_cases[c].name; c++) {
+    const CharsetCase*cc=&charset_cases[c];
+    for (i=0; i<CORPUS_TITLES; i++) {
+      char*got=cc->func(cc->corpus[i], cc->from, cc->to);
+      char*want=legacy_convert(cc->corpus[i], cc->from, cc->to);
+      if (!got || !want || (strcmp(got, want)!=0)) {
+        fprintf(stderr, "xbench: %s of %s title %d differs from iconv's\n", cc->name, cc->param, i);
+      }
+      sfree(got);
+      sfree(want);
+    }
+    charset_run(b, cc, False);
+    charset_run(b, cc, True);
+  }
+  corpus_free(latin1_titles);
+  corpus_free(iso2022_titles);
+  default_charset=saved;
+}
+
+
+
+#ifdef XCTRL_THREADS
+
+/*********************************************************************/
+/* * * * * * * * * * * * * * * Threads suite * * * * * * * * * * * * * */
+/*********************************************************************/
+
+#define MAX_THREADS 16
+
+static const int thread_counts[]={1, 2, 4, 8, MAX_THREADS, 0};
+
+typedef struct _ThreadRun {
+  Bench*b;
+  pthread_mutex_t lock;
+  double*samples;
+  int next;           /* the next worker's share of the samples */
+} ThreadRun;
+
+
+
+/* One worker: "iterations" calls to get_window_title() on a connection of its own */
+static void*thread_titles(Display*disp, void*data)
+{
+  ThreadRun*run=(ThreadRun*)data;
+  Bench*b=run->b;
+  double*samples;
+  ulong i;
+  pthread_mutex_lock(&run->lock);
+  samples=run->samples+(run->next++)*b->iterations;
+  pthread_mutex_unlock(&run->lock);
+  for (i=0; i<b->iterations; i++) {
+    double t=bench_us();
+    char*title=get_window_title(disp, b->wins[i%b->count]);
+    samples[i]=bench_us()-t;
+    sfree(title);
+  }
+  return NULL;
+}
+
+
+
+/*
+  get_window_title() on 1 to 16 threads at once through xctrl_fanout(),
+  each thread with a connection of its own. The connections are opened in
+  an untimed first pass, so only the calls are measured; the throughput
+  is for all the threads together.
+*/
+static void suite_threads(Bench*b)
+{
+  FanoutTarget targets[MAX_THREADS];
+  ThreadRun run;
+  int t, i;
+  memset(targets, 0, sizeof(targets));
+  memset(&run, 0, sizeof(run));
+  run.b=b;
+  pthread_mutex_init(&run.lock, NULL);
+  for (t=0; thread_counts[t]; t++) {
+    int threads=thread_counts[t];
+    char param[16];
+    double start;
+    Result r;
+    Bool ok=True;
+    result_init(&r, "threads", "get_window_title", threads*b->iterations);
+    sprintf(param, "%d", threads);
+    r.param=param;
+    run.samples=r.samples;
+    run.next=0;
+    xctrl_fanout(targets, threads, threads, thread_titles, &run);
+    for (i=0; i<threads; i++) { ok=ok && targets[i].disp; }
+    if (!ok) {
+      fprintf(stderr, "xbench: can't open %d connections\n", threads);
+      free(r.samples);
+      break;
+    }
+    run.next=0;
+    start=bench_us();
+    xctrl_fanout(targets, threads, threads, thread_titles, &run);
+    r.total_us=bench_us()-start;
+    r.ops=threads*b->iterations;
+    result_done(&r);
+  }
+  for (i=0; i<MAX_THREADS; i++) {
+    if (targets[i].disp) { XCloseDisplay(targets[i].disp); }
+  }
+  pthread_mutex_destroy(&run.lock);
+}
+
+#endif
+
+
+
+/*********************************************************************/
+/* * * * * * * * * * * * * * * * * Main * * * * * * * * * * * * * * * */
+/*********************************************************************/
+
+typedef struct {
+  const char*name;
+  void (*run)(Bench*b);
+} Suite;
+
+static const Suite suites[]={
+  {"api", suite_api},
+  {"props", suite_props},
+  {"replay", suite_replay},
+  {"charset", suite_charset},
+#ifdef XCTRL_THREADS
+  {"threads", suite_threads},
+#endif
+  {NULL, NULL}
+};
+
+
+
+static void usage(const char*argv0)
+{
+  int i;
+  fprintf(stderr, "usage: %s [-n iterations] [-w windows] [suite...]\n", argv0);
+  fprintf(stderr, "       %s -H [-w windows] [-r ready_file]\n", argv0);
+  fprintf(stderr, "       %s -T titles [-w windows]\nsuites:", argv0);
+  for (i=0; suites[i].name; i++) { fprintf(stderr, " %s", suites[i].name); }
+  fprintf(stderr, "\n");
+  exit(2);
+}
+
+
+
+/* The -T event source: set_window_title() is only requests, so it runs as fast as the server */
+static void retitle(Bench*b, ulong titles)
+{
+  ulong k;
+  usleep(LISTEN_SETTLE_MS*1000);
+  for (k=0; k<titles; k++) {
+    sprintf(b->buf, "xbench title %lu", k);
+    set_window_title(b->disp, b->wins[k%b->count], b->buf, 'N');
+  }
+  XSync(b->disp, False);
+}
+
+
+
+static const Suite*find_suite(const char*name)
+{
+  int i;
+  for (i=0; suites[i].name; i++) {
+    if (!strcmp(suites[i].name, name)) { return &suites[i]; }
+  }
+  return NULL;
+}
+
+
+
+int main(int argc, char*argv[])
+{
+  Bench b;
+  Bool hold=False;
+  const char*ready=NULL;
+  ulong titles=0;
+  int opt;
+  int i;
+  memset(&b, 0, sizeof(b));
+  b.iterations=1000;
+  b.count=50;
+  while ((opt=getopt(argc, argv, "n:w:Hr:T:"))!=-1) {
+    switch (opt) {
+      case 'n': b.iterations=strtoul(optarg, NULL, 10); break;
+      case 'w': b.count=strtoul(optarg, NULL, 10); break;
+      case 'H': hold=True; break;
+      case 'r': ready=optarg; break;
+      case 'T': titles=strtoul(optarg, NULL, 10); break;
+      default: usage(argv[0]);
+    }
+  }
+  if ((b.iterations<1) || (b.count<2)) { usage(argv[0]); }
+  for (i=optind; i<argc; i++) {
+    if (!find_suite(argv[i])) { usage(argv[0]); }
+  }
+#ifdef XCTRL_THREADS
+  if (!xctrl_threads_init()) {
+    fprintf(stderr, "xbench: can't initialize Xlib threads\n");
+    return 1;
+  }
+#endif
+  b.disp=XOpenDisplay(NULL);
+  if (!b.disp) {
+    fprintf(stderr, "xbench: can't open display\n");
+    return 1;
+  }
+  if (!supporting_wm_check(b.disp)) {
+    fprintf(stderr, "xbench: no EWMH window manager is running\n");
+    return 1;
+  }
+  XSetErrorHandler(on_error);
+  init_charset(False, NULL);
+  b.wins=make_clients(b.disp, b.count);
+  if (!b.wins) { return 1; }
+  if (hold) {
+    if (ready) {
+      FILE*f=fopen(ready, "w");
+      if (f) { fclose(f); }
+    }
+    for (;;) { pause(); } /* the server cleans up when we are killed */
+  }
+  if (titles) {
+    retitle(&b, titles);
+  } else if (optind==argc) {
+    for (i=0; suites[i].name; i++) { suites[i].run(&b); }
+  } else {
+    for (i=optind; i<argc; i++) { find_suite(argv[i])->run(&b); }
+  }
+  destroy_clients(b.disp, b.wins, b.count);
+  XCloseDisplay(b.disp);
+  if (x_errors) { fprintf(stderr, "xbench: %lu X errors\n", x_errors); }
+  return 0;
+}
@@ -45,31 +45,54 @@ Free Software Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
 
 #define ERR_BUF_SIZE 128
 
-static char lwmc_error_buffer[ERR_BUF_SIZE];
-
-static int lwmc_handle_error(Display*dpy, XErrorEvent*ev)
-{
-  memset(lwmc_error_buffer, '\0', ERR_BUF_SIZE);
-  if ( !ev ) {
-    strncpy(lwmc_error_buffer, "NULL event\n", ERR_BUF_SIZE-1);
-  } else if ( !dpy ) {
-    strncpy(lwmc_error_buffer, "NULL display\n", ERR_BUF_SIZE-1);
-  } else {
-    XGetErrorText(dpy, ev->error_code, lwmc_error_buffer, ERR_BUF_SIZE-1);
-  }
-  return -1;
-}
+typedef struct {
+  int i;
+  lua_State *L;
+} cbdata;
 
 
 
 typedef struct _XCtrl {
+  struct _XCtrl*next;
   Display* dpy;
   char *dpyname;
   char* charset;
-  XErrorHandler old_err_handler;
+  Bool listening; /* started by listen_fd() */
+  Bool dispatching; /* inside dispatch(), which frees listen_cb if unlisten() was called */
+  cbdata listen_cb;
+  Bool stats;     /* counting calls, see set_stats() */
+  Bool trace;     /* tracing calls, see set_trace() */
+  char error_buffer[ERR_BUF_SIZE];
 } XCtrl;
 
-static XCtrl*wm=NULL;
+
+/*
+  X error handlers are per process, so the handler finds the object for
+  the display the error came from in this list of open objects.
+*/
+static XCtrl*lwmc_objects=NULL;
+
+static XErrorHandler lwmc_old_err_handler=NULL;
+
+static int lwmc_stats_users=0; /* objects with stats or tracing enabled */
+
+
+
+static int lwmc_handle_error(Display*dpy, XErrorEvent*ev)
+{
+  XCtrl*ud;
+  for (ud=lwmc_objects; ud; ud=ud->next) {
+    if (ud->dpy==dpy) { break; }
+  }
+  if (!ud) { return 0; }
+  memset(ud->error_buffer, '\0', ERR_BUF_SIZE);
+  if ( !ev ) {
+    strncpy(ud->error_buffer, "NULL event\n", ERR_BUF_SIZE-1);
+  } else {
+    XGetErrorText(dpy, ev->error_code, ud->error_buffer, ERR_BUF_SIZE-1);
+  }
+  return -1;
+}
 
 
 static XCtrl*lwmc_check_obj(lua_State*L) {
@@ -87,31 +110,47 @@ static int lwmc_failure(lua_State*L, const char*msg)
 
 
 
+/* Push a new object for a display already opened, or return NULL without pushing anything if it wasn't. */
+static XCtrl*lwmc_wrap(lua_State*L, const char*req_dpyname, Display*dpy)
+{
+  char*act_dpyname=XDisplayName(req_dpyname);
+  XCtrl*ud;
+  if (!dpy) { return NULL; }
+  ud=(XCtrl*)lua_newuserdata(L,sizeof(XCtrl));
+  memset(ud,0,sizeof(XCtrl));
+  if (act_dpyname) { ud->dpyname=strdup(act_dpyname); }
+  ud->dpy=dpy;
+  xctrl_init(dpy);
+  luaL_getmetatable(L, XCTRL_META_NAME);
+  lua_setmetatable(L, -2);
+  if (!lwmc_objects) { lwmc_old_err_handler=XSetErrorHandler(lwmc_handle_error); }
+  ud->next=lwmc_objects;
+  lwmc_objects=ud;
+  return ud;
+}
+
+
+
+/* Push a new object for the display, or return NULL without pushing anything. */
+static XCtrl*lwmc_open(lua_State*L, const char*req_dpyname)
+{
+  return lwmc_wrap(L,req_dpyname,XOpenDisplay(req_dpyname));
+}
+
+
+
 static int lwmc_new(lua_State*L)
 {
-  if (wm==NULL) {
-    const char*req_dpyname=luaL_optstring(L,1,NULL);
-    char*act_dpyname=XDisplayName(req_dpyname);
-    Display*dpy=XOpenDisplay(req_dpyname);
-    if (!dpy) {
-      return lwmc_failure(L, "Can't open display.");
-    }
-    wm=(XCtrl*)lua_newuserdata(L,sizeof(XCtrl));
-    memset(wm,0,sizeof(XCtrl));
-    if (act_dpyname) { wm->dpyname=strdup(act_dpyname); }
-    wm->dpy=dpy;
-    luaL_getmetatable(L, XCTRL_META_NAME);
-    lua_setmetatable(L, -2);
-    wm->old_err_handler=XSetErrorHandler(lwmc_handle_error);
-    if (lua_gettop(L)>1) {
-      int force_utf8=lua_toboolean(L,2);
-      const char*charset=luaL_optstring(L,3,NULL);
-      if (charset) { wm->charset=strdup(charset); }
-      init_charset(force_utf8,wm->charset);
-    }
-  } else {
-    luaL_error(L,"Only one instance of "XCTRL_META_NAME" is allowed.");
-    return 0;
+  XCtrl*ud=lwmc_open(L,luaL_optstring(L,1,NULL));
+  if (!ud) {
+    return lwmc_failure(L, "Can't open display.");
+  }
+  if (lua_gettop(L)>1) {
+    int force_utf8=lua_toboolean(L,2);
+    const char*charset=luaL_optstring(L,3,NULL);
+    if (charset) { ud->charset=strdup(charset); }
+    xctrl_set_charset(ud->dpy,force_utf8,ud->charset);
+    if (!ud->next) { init_charset(force_utf8,ud->charset); }
   }
   return 1;
 }
@@ -121,11 +160,25 @@ static int lwmc_new(lua_State*L)
 static int lwmc_gc(lua_State*L)
 {
   XCtrl*ud=lwmc_check_obj(L);
-  XSetErrorHandler(wm->old_err_handler);
+  XCtrl**pp;
+  if (ud->listening) {
+    xctrl_listen_end(ud->dpy);
+    luaL_unref(L,LUA_REGISTRYINDEX,ud->listen_cb.i);
+  }
+  for (pp=&lwmc_objects; *pp; pp=&(*pp)->next) {
+    if (*pp==ud) {
+      *pp=ud->next;
+      break;
+    }
+  }
+  if (!lwmc_objects) { XSetErrorHandler(lwmc_old_err_handler); }
+  if (ud->stats||ud->trace) { lwmc_stats_users--; }
   XCloseDisplay(ud->dpy);
-  if (wm->dpyname) { free(ud->dpyname); }
-  if (wm->charset) { free(ud->charset); }
-  wm=NULL;
+  if (ud->dpyname) { free(ud->dpyname); }
+  if (ud->charset) {
+    if (default_charset==ud->charset) { default_charset=DEFAULT_CHARSET; }
+    free(ud->charset);
+  }
   return 1;
 }
 
@@ -181,6 +234,15 @@ static int lwmc_get_showing_desktop(lua_State*L)
 
 
 
+static int lwmc_get_atoms_saved(lua_State*L)
+{
+  XCtrl*ud=lwmc_check_obj(L);
+  lua_pushnumber(L,xctrl_atom_trips_saved(ud->dpy));
+  return 1;
+}
+
+
+
 static int lwmc_get_display(lua_State*L)
 {
   XCtrl*ud=lwmc_check_obj(L);
@@ -193,7 +255,7 @@ static int lwmc_get_display(lua_State*L)
 static Window check_window(lua_State*L, XCtrl*ud, int argnum)
 {
   Window win;
-  memset(lwmc_error_buffer, '\0', ERR_BUF_SIZE);
+  memset(ud->error_buffer, '\0', ERR_BUF_SIZE);
   luaL_argcheck(L,lua_isnumber(L,argnum), argnum, "expected window id");
   win=lua_tonumber(L,argnum);
   return win;
@@ -203,10 +265,18 @@ static Window check_window(lua_State*L, XCtrl*ud, int argnum)
 
 static Bool lwmc_success(lua_State*L, XCtrl*ud)
 {
-  XSync(ud->dpy,False);
-  if (lwmc_error_buffer[0]!=0) {
+#ifdef XCTRL_USE_XCB
+  /* Xlib's sequence numbers don't see the requests sent through xcb */
+  stats_sync(ud->dpy);
+#else
+  /* No need to sync if the server has already answered everything we sent */
+  if (NextRequest(ud->dpy)-1 != LastKnownRequestProcessed(ud->dpy)) {
+    stats_sync(ud->dpy);
+  }
+#endif
+  if (ud->error_buffer[0]!=0) {
     lua_pushnil(L); \
-    lua_pushstring(L,lwmc_error_buffer);
+    lua_pushstring(L,ud->error_buffer);
     return False;
   }
   return True;
@@ -214,19 +284,64 @@ static Bool lwmc_success(lua_State*L, XCtrl*ud)
 
 
 
+#define LWMC_BUF_SIZE 512
+
+enum { INTO_TITLE, INTO_CLASS, INTO_TYPE, INTO_CLIENT, INTO_DESK_NAME };
+
+/* Call one of the *_into() getters; "id" is the window, or the desktop number. */
+static long lwmc_into(XCtrl*ud, int kind, long id, Bool force_utf8, char*buf, size_t size)
+{
+  switch (kind) {
+    case INTO_TITLE: return get_window_title_into(ud->dpy, id, buf, size);
+    case INTO_CLASS: return get_window_class_into(ud->dpy, id, buf, size);
+    case INTO_TYPE: return get_window_type_into(ud->dpy, id, buf, size);
+    case INTO_CLIENT: return get_client_machine_into(ud->dpy, id, buf, size);
+    default: return get_desktop_name_into(ud->dpy, id, force_utf8, buf, size);
+  }
+}
+
+
+
+/*
+  Push a string from one of the *_into() getters. Values that fit are read
+  into a buffer on the C stack, so lua_pushlstring() makes the only copy.
+  Returns 1, or 0 if there is no value, or 2 if "check" is set and an X
+  error was pushed instead.
+*/
+static int lwmc_push_into(lua_State*L, XCtrl*ud, int kind, long id, Bool force_utf8, Bool check)
+{
+  char buf[LWMC_BUF_SIZE];
+  long len=lwmc_into(ud, kind, id, force_utf8, buf, sizeof(buf));
+  if (check && !lwmc_success(L,ud)) { return 2; }
+  if (len<0) { return 0; }
+  if ((size_t)len<sizeof(buf)) {
+    lua_pushlstring(L, buf, len);
+  } else {
+    size_t size=len+1;
+    char*big=(char*)lua_newuserdata(L, size);
+    len=lwmc_into(ud, kind, id, force_utf8, big, size);
+    if (len<0) {
+      lua_pop(L,1);
+      return 0;
+    }
+    lua_pushlstring(L, big, ((size_t)len<size)?(size_t)len:size-1);
+    lua_remove(L,-2);
+  }
+  return 1;
+}
+
+
+
 static int lwmc_get_win_class(lua_State*L)
 {
   XCtrl*ud=lwmc_check_obj(L);
   Window win=check_window(L,ud,2);
-  char*s=get_window_class(ud->dpy, win);
-  if (lwmc_success(L,ud)) {
-    lua_pushstring(L,s?s:"");
-    if (s) { free(s); }
+  int rv=lwmc_push_into(L, ud, INTO_CLASS, win, False, True);
+  if (rv==0) {
+    lua_pushstring(L,"");
     return 1;
-  } else {
-    if (s) { free(s); }
-    return 2;
   }
+  return rv;
 }
 
 
@@ -235,15 +350,12 @@ static int lwmc_get_win_title(lua_State*L)
 {
   XCtrl*ud=lwmc_check_obj(L);
   Window win=check_window(L,ud,2);
-  char*s=get_window_title(ud->dpy, win);
-  if (lwmc_success(L,ud)) {
-    lua_pushstring(L,s?s:"");
-    if (s) { free(s); }
+  int rv=lwmc_push_into(L, ud, INTO_TITLE, win, False, True);
+  if (rv==0) {
+    lua_pushstring(L,"");
     return 1;
-  } else {
-    if (s) { free(s); }
-    return 2;
   }
+  return rv;
 }
 
 
@@ -460,19 +572,9 @@ static int lwmc_get_win_client(lua_State*L)
 {
   XCtrl*ud=lwmc_check_obj(L);
   Window win=check_window(L,ud,2);
-  char*cm=get_client_machine(ud->dpy,win);
-  if (lwmc_success(L,ud)) {
-    if ( cm ) {
-      lua_pushstring(L,cm);
-      free(cm);
-      return 1;
-    } else {
-      return lwmc_failure(L,"unknown client");
-    }
-  } else {
-    if (cm) { free(cm); }
-    return 2;
-  }
+  int rv=lwmc_push_into(L, ud, INTO_CLIENT, win, False, True);
+  if (rv==0) { return lwmc_failure(L,"unknown client"); }
+  return rv;
 }
 
 
@@ -583,13 +685,21 @@ static int lwmc_get_win_frame(lua_State*L)
 
 
 
+static int lwmc_wm_supports(lua_State*L)
+{
+  XCtrl*ud=lwmc_check_obj(L);
+  const char*prop=luaL_checkstring(L,2);
+  lua_pushboolean(L,wm_supports(ud->dpy,prop));
+  return 1;
+}
+
+
+
 static int lwmc_get_win_type(lua_State*L)
 {
   XCtrl*ud=lwmc_check_obj(L);
   Window win=check_window(L,ud,2);
-  char*type=get_window_type(ud->dpy, win);
-  lua_pushstring(L,type);
-  free(type);
+  lwmc_push_into(L, ud, INTO_TYPE, win, False, False);
   return 1;
 }
 
@@ -742,9 +852,106 @@ static int lwmc_get_win_list(lua_State*L)
 
 
 
+static void lwmc_push_state(lua_State*L, ulong state)
+{
+  static const char*state_names[XCTRL_STATE_COUNT]={
+    "modal",
+    "sticky",
+    "maximized_vert",
+    "maximized_horz",
+    "shaded",
+    "skip_taskbar",
+    "skip_pager",
+    "hidden",
+    "fullscreen",
+    "above",
+    "below",
+    "demands_attention"
+  };
+  int i,n=0;
+  lua_newtable(L);
+  for (i=0; i<XCTRL_STATE_COUNT; i++) {
+    if (state&(1L<<i)) {
+      lua_pushstring(L,state_names[i]);
+      lua_rawseti(L,-2,++n);
+    }
+  }
+}
+
+
+
+static void lwmc_push_win_info(lua_State*L, WindowInfo*wi)
+{
+  lua_createtable(L,0,9);
+  SetTableNum("id", wi->win);
+  SetTableStr("title", wi->title?wi->title:"");
+  SetTableStr("class", wi->class_name?wi->class_name:"");
+  if (wi->pid>0) { SetTableNum("pid", wi->pid); }
+  if (wi->desktop>-2) { SetTableNum("desk", wi->desktop==-1?-1:wi->desktop+1); }
+  SetTableStr("type", wi->type);
+  lua_pushstring(L,"geom");
+  lua_createtable(L,0,4);
+  SetTableNum("x", wi->geom.x);
+  SetTableNum("y", wi->geom.y);
+  SetTableNum("w", wi->geom.w);
+  SetTableNum("h", wi->geom.h);
+  lua_rawset(L,-3);
+  if (wi->frame_left>=0) {
+    lua_pushstring(L,"frame");
+    lua_createtable(L,0,4);
+    SetTableNum("l", wi->frame_left);
+    SetTableNum("r", wi->frame_right);
+    SetTableNum("t", wi->frame_top);
+    SetTableNum("b", wi->frame_bottom);
+    lua_rawset(L,-3);
+  }
+  lua_pushstring(L,"state");
+  lwmc_push_state(L,wi->state);
+  lua_rawset(L,-3);
+}
+
+
+
+static int lwmc_snapshot(lua_State*L)
+{
+  XCtrl*ud=lwmc_check_obj(L);
+  ulong i,n=0;
+  WindowInfo*list;
+  list=xctrl_snapshot(ud->dpy, &n);
+  memset(ud->error_buffer, '\0', ERR_BUF_SIZE); /* windows that vanished were skipped */
+  if (list) {
+    lua_createtable(L,n,0);
+    for (i=0; i<n; i++) {
+      lwmc_push_win_info(L,&list[i]);
+      lua_rawseti(L,-2,i+1);
+    }
+    free(list);
+    return 1;
+  } else {
+    return lwmc_failure(L,"Failed to retreive client list.");
+  }
+}
+
+
+
+static int lwmc_get_win_state(lua_State*L)
+{
+  XCtrl*ud=lwmc_check_obj(L);
+  Window win=check_window(L,ud,2);
+  ulong state=get_window_state(ud->dpy,win);
+  if (lwmc_success(L,ud)) {
+    lwmc_push_state(L,state);
+    return 1;
+  } else {
+    return 2;
+  }
+}
+
+
+
 static int lwmc_tostring(lua_State*L)
 {
-  lua_pushfstring(L,"%s (%p)", XCTRL_META_NAME, wm);
+  lua_pushfstring(L,"%s (%p)", XCTRL_META_NAME, lua_touserdata(L,1));
   return 1;
 }
 
@@ -762,9 +969,7 @@ static int lwmc_get_desk_name(lua_State*L)
   XCtrl*ud=lwmc_check_obj(L);
   int desknum=luaL_checknumber(L,2);
   int force_utf8 = (lua_gettop(L)>2) ? lua_toboolean(L,3) : 0;
-  char*name=get_desktop_name(ud->dpy, desknum-1, force_utf8);
-  lua_pushstring(L, name);
-  if (name) { free(name); }
+  if (!lwmc_push_into(L, ud, INTO_DESK_NAME, desknum-1, force_utf8, False)) { lua_pushnil(L); }
   return 1;
 }
 
@@ -882,7 +1087,7 @@ static int lwmc_do_events(lua_State*L)
   int i;
   for (i=0; i<n; i++) {
     usleep(100000);
-    XSync(ud->dpy,False);
+    stats_sync(ud->dpy);
   }
   return 0;
 }
@@ -916,31 +1121,271 @@ static int lwmc_set_selection(lua_State*L)
 
 
 
-typedef struct {
-  int i;
-  lua_State *L;
-} cbdata;
+static const char* evmap[] = {
+  "w", /* XCTRL_EVENT_WINDOW_LIST_INSERT */
+  "x", /* XCTRL_EVENT_WINDOW_LIST_DELETE */
+  "a", /* XCTRL_EVENT_WINDOW_FOCUS_GAINED */
+  "i", /* XCTRL_EVENT_WINDOW_FOCUS_LOST */
+  "g", /* XCTRL_EVENT_WINDOW_MOVE_RESIZE */
+  "t", /* XCTRL_EVENT_WINDOW_TITLE */
+  "s", /* XCTRL_EVENT_WINDOW_STATE */
+  "d", /* XCTRL_EVENT_DESKTOP_SWITCH */
+};
 
 
 
 static int lwmc_listen_cb(int ev, Window id, void*p)
 {
-  const char* evmap[] = {
-    "w", /* XCTRL_EVENT_WINDOW_LIST_INSERT */
-    "x", /* XCTRL_EVENT_WINDOW_LIST_DELETE */
-    "a", /* XCTRL_EVENT_WINDOW_FOCUS_GAINED */
-    "i", /* XCTRL_EVENT_WINDOW_FOCUS_LOST */
-    "g", /* XCTRL_EVENT_WINDOW_MOVE_RESIZE */
-    "t", /* XCTRL_EVENT_WINDOW_TITLE */
-    "s", /* XCTRL_EVENT_WINDOW_STATE */
-    "d", /* XCTRL_EVENT_DESKTOP_SWITCH */
-  };
   cbdata*c=(cbdata*)p;
+  int rv;
   lua_rawgeti(c->L, LUA_REGISTRYINDEX, c->i);
   lua_pushstring(c->L, evmap[ev]);
   lua_pushnumber(c->L, (ev==XCTRL_EVENT_DESKTOP_SWITCH)?id+1:id);
   lua_pcall(c->L, 2, 1, 0);
-  return lua_toboolean(c->L,-1); 
+  rv=lua_toboolean(c->L,-1);
+  lua_pop(c->L,1);
+  return rv;
+}
+
+
+
+#define lwmc_set_num(L,k,v,ok) \
+  if (ok) { lua_pushnumber(L,v); } else { lua_pushnil(L); } \
+  lua_setfield(L,-2,k);
+
+/*
+  Fill in the event table on top of the stack. Fields that don't apply to
+  the event are set to nil, so a table can be reused from one event to the
+  next.
+*/
+static void lwmc_fill_event(lua_State*L, const EventInfo*info)
+{
+  int ev=info->ev;
+  Bool is_geom=(ev==XCTRL_EVENT_WINDOW_MOVE_RESIZE);
+  Bool is_desk=(ev==XCTRL_EVENT_DESKTOP_SWITCH);
+  Bool is_focus=(ev==XCTRL_EVENT_WINDOW_FOCUS_GAINED)||(ev==XCTRL_EVENT_WINDOW_FOCUS_LOST);
+  lua_pushstring(L, evmap[ev]);
+  lua_setfield(L,-2,"ev");
+  lwmc_set_num(L,"id",is_desk?info->new_desktop+1:info->win,True);
+  lwmc_set_num(L,"x",info->geom.x,is_geom);
+  lwmc_set_num(L,"y",info->geom.y,is_geom);
+  lwmc_set_num(L,"w",info->geom.w,is_geom);
+  lwmc_set_num(L,"h",info->geom.h,is_geom);
+  if (is_geom) { lua_pushboolean(L,info->geom_root); } else { lua_pushnil(L); }
+  lua_setfield(L,-2,"root");
+  if (info->title) { lua_pushstring(L,info->title); } else { lua_pushnil(L); }
+  lua_setfield(L,-2,"title");
+  lwmc_set_num(L,"old",info->old_desktop+1,is_desk);
+  lwmc_set_num(L,"new",info->new_desktop+1,is_desk);
+  lwmc_set_num(L,"mode",info->focus_mode,is_focus);
+  lwmc_set_num(L,"detail",info->focus_detail,is_focus);
+}
+
+
+
+static int lwmc_listen_cb_ex(const EventInfo*info, void*p)
+{
+  cbdata*c=(cbdata*)p;
+  int rv;
+  lua_rawgeti(c->L, LUA_REGISTRYINDEX, c->i);
+  lua_createtable(c->L,0,4);
+  lwmc_fill_event(c->L, info);
+  lua_pcall(c->L, 1, 1, 0);
+  rv=lua_toboolean(c->L,-1);
+  lua_pop(c->L,1);
+  return rv;
+}
+
+
+
+static int lwmc_set_mirror(lua_State*L)
+{
+  XCtrl*ud=lwmc_check_obj(L);
+  luaL_argcheck(L, lua_gettop(L)>1, 2, "expected boolean");
+  xctrl_set_mirror(ud->dpy, lua_toboolean(L,2));
+  return 0;
+}
+
+
+
+static int lwmc_set_coalesce(lua_State*L)
+{
+  XCtrl*ud=lwmc_check_obj(L);
+  int interval=luaL_checknumber(L,2);
+  xctrl_set_coalesce(ud->dpy, interval);
+  return 0;
+}
+
+
+
+static int lwmc_get_dropped(lua_State*L)
+{
+  XCtrl*ud=lwmc_check_obj(L);
+  lua_pushnumber(L,xctrl_events_dropped(ud->dpy));
+  return 1;
+}
+
+
+
+/*
+  In batched mode the events are written into one reusable array of
+  {ev,id} records, and the handler is called with the array and the
+  number of records filled, once it is full or its oldest event has
+  waited max_delay_ms.
+*/
+typedef struct {
+  lua_State *L;
+  int handler;
+  int batch;
+  int size;
+  int count;
+  ulong first;  /* when the oldest event in the batch arrived */
+  int max_delay;
+} batchdata;
+
+
+
+static int lwmc_batch_flush(batchdata*b)
+{
+  int rv;
+  lua_rawgeti(b->L, LUA_REGISTRYINDEX, b->handler);
+  lua_rawgeti(b->L, LUA_REGISTRYINDEX, b->batch);
+  lua_pushnumber(b->L, b->count);
+  lua_setfield(b->L, -2, "n");
+  lua_pushnumber(b->L, b->count);
+  b->count=0;
+  lua_pcall(b->L, 2, 1, 0);
+  rv=lua_toboolean(b->L,-1);
+  lua_pop(b->L,1);
+  return rv;
+}
+
+
+
+/* Push the batch table and the record for the next event onto the stack */
+static void lwmc_batch_slot(batchdata*b)
+{
+  lua_rawgeti(b->L, LUA_REGISTRYINDEX, b->batch);
+  lua_rawgeti(b->L, -1, b->count+1);
+  if (lua_isnil(b->L,-1)) {
+    lua_pop(b->L,1);
+    lua_createtable(b->L,2,0);
+    lua_pushvalue(b->L,-1);
+    lua_rawseti(b->L, -3, b->count+1);
+  }
+}
+
+
+
+static int lwmc_batch_cb_ex(const EventInfo*info, void*p)
+{
+  batchdata*b=(batchdata*)p;
+  lwmc_batch_slot(b);
+  lwmc_fill_event(b->L, info);
+  lua_pop(b->L,2);
+  if (b->count++ == 0) { b->first=now_ms(); }
+  return (b->count<b->size)?1:lwmc_batch_flush(b);
+}
+
+
+
+static int lwmc_batch_cb(int ev, Window id, void*p)
+{
+  batchdata*b=(batchdata*)p;
+  lwmc_batch_slot(b);
+  lua_pushstring(b->L, evmap[ev]);
+  lua_rawseti(b->L, -2, 1);
+  lua_pushnumber(b->L, (ev==XCTRL_EVENT_DESKTOP_SWITCH)?id+1:id);
+  lua_rawseti(b->L, -2, 2);
+  lua_pop(b->L,2);
+  if (b->count++ == 0) { b->first=now_ms(); }
+  return (b->count<b->size)?1:lwmc_batch_flush(b);
+}
+
+
+
+static void lwmc_listen_batched(lua_State*L, XCtrl*ud, int size, int max_delay, Bool details)
+{
+  batchdata b;
+  int i;
+  Bool started;
+  memset(&b,0,sizeof(b));
+  b.L=L;
+  b.size=size;
+  b.max_delay=max_delay;
+  lua_createtable(L,size,1);
+  for (i=1; i<=size; i++) {
+    lua_createtable(L,2,0);
+    lua_rawseti(L,-2,i);
+  }
+  b.batch=luaL_ref(L,LUA_REGISTRYINDEX);
+  b.handler=luaL_ref(L,LUA_REGISTRYINDEX);
+  if (details) {
+    started=xctrl_listen_begin_ex(ud->dpy,lwmc_batch_cb_ex,&b);
+  } else {
+    started=xctrl_listen_begin(ud->dpy,lwmc_batch_cb,&b);
+  }
+  if (started) {
+    while (1) {
+      int timeout=-1;
+      int rv;
+      if (b.count) {
+        ulong waited=now_ms()-b.first;
+        timeout=(waited<(ulong)max_delay)?(int)((ulong)max_delay-waited):0;
+      }
+      rv=xctrl_event_dispatch(ud->dpy,timeout);
+      if (b.count && (!rv || ((now_ms()-b.first)>=(ulong)max_delay))) {
+        if (!lwmc_batch_flush(&b)) { break; }
+      }
+      if (!rv) { break; }
+    }
+    xctrl_listen_end(ud->dpy);
+  }
+  luaL_unref(L,LUA_REGISTRYINDEX,b.handler);
+  luaL_unref(L,LUA_REGISTRYINDEX,b.batch);
+}
+
+
+
+/* Read the {details=true} option from the table at "idx", if any. */
+static Bool lwmc_want_details(lua_State*L, int idx)
+{
+  Bool details=False;
+  if (lua_istable(L,idx)) {
+    lua_getfield(L,idx,"details");
+    details=lua_toboolean(L,-1);
+    lua_pop(L,1);
+  }
+  return details;
+}
+
+
+
+/*
+  Apply the "events" and "window" options from the table at "idx". Without
+  them the listener gets every event for every window.
+*/
+static void lwmc_listen_select(lua_State*L, XCtrl*ud, int idx)
+{
+  ulong mask=XCTRL_EVENT_MASK_ALL;
+  Window win=None;
+  if (lua_istable(L,idx)) {
+    lua_getfield(L,idx,"events");
+    if (lua_isstring(L,-1)) {
+      const char*p;
+      int i;
+      mask=0;
+      for (p=lua_tostring(L,-1); *p; p++) {
+        for (i=0; i<=XCTRL_EVENT_DESKTOP_SWITCH; i++) {
+          if (*p==evmap[i][0]) { mask|=XCTRL_EVENT_MASK(i); }
+        }
+      }
+    }
+    lua_getfield(L,idx,"window");
+    if (lua_isnumber(L,-1)) { win=lua_tonumber(L,-1); }
+    lua_pop(L,2);
+  }
+  xctrl_listen_select(ud->dpy, mask, win);
 }
 
 
@@ -949,25 +1394,398 @@ static int lwmc_listen(lua_State*L)
 { 
   cbdata c;
   XCtrl*ud=lwmc_check_obj(L);
+  Bool details=lwmc_want_details(L,3);
   luaL_argcheck(L,lua_isfunction(L,2),2,"expected function");
+  lwmc_listen_select(L,ud,3);
+  if (lua_istable(L,3)) {
+    int size;
+    int max_delay;
+    lua_getfield(L,3,"batch");
+    size=luaL_optnumber(L,-1,1);
+    lua_getfield(L,3,"max_delay_ms");
+    max_delay=luaL_optnumber(L,-1,0);
+    lua_settop(L,2);
+    if (size>1) {
+      lwmc_listen_batched(L,ud,size,(max_delay>0)?max_delay:0,details);
+      return 0;
+    }
+  }
+  lua_settop(L,2);
   c.L=L;
   c.i=luaL_ref(L,LUA_REGISTRYINDEX);
-  event_loop(ud->dpy,lwmc_listen_cb,&c);
+  if (details) {
+    event_loop_ex(ud->dpy,lwmc_listen_cb_ex,&c);
+  } else {
+    event_loop(ud->dpy,lwmc_listen_cb,&c);
+  }
   luaL_unref(L,LUA_REGISTRYINDEX,c.i);
   return 0;
 }
 
 
 
+static int lwmc_listen_fd(lua_State*L)
+{
+  XCtrl*ud=lwmc_check_obj(L);
+  Bool details=lwmc_want_details(L,3);
+  Bool started;
+  luaL_argcheck(L,lua_isfunction(L,2),2,"expected function");
+  if (ud->listening || ud->dispatching) { return lwmc_failure(L, "Already listening."); }
+  lwmc_listen_select(L,ud,3);
+  lua_settop(L,2);
+  ud->listen_cb.L=L;
+  ud->listen_cb.i=luaL_ref(L,LUA_REGISTRYINDEX);
+  if (details) {
+    started=xctrl_listen_begin_ex(ud->dpy,lwmc_listen_cb_ex,&ud->listen_cb);
+  } else {
+    started=xctrl_listen_begin(ud->dpy,lwmc_listen_cb,&ud->listen_cb);
+  }
+  if (!started) {
+    luaL_unref(L,LUA_REGISTRYINDEX,ud->listen_cb.i);
+    return lwmc_failure(L, "Can't start the event listener.");
+  }
+  ud->listening=True;
+  lua_pushnumber(L,xctrl_listen_fd(ud->dpy));
+  return 1;
+}
+
+
+
+static int lwmc_dispatch(lua_State*L)
+{
+  XCtrl*ud=lwmc_check_obj(L);
+  int timeout=luaL_optnumber(L,2,0);
+  int rv;
+  int due;
+  if (!ud->listening) { return lwmc_failure(L, "Not listening."); }
+  ud->listen_cb.L=L;
+  ud->dispatching=True;
+  rv=xctrl_event_dispatch(ud->dpy, timeout);
+  ud->dispatching=False;
+  if (!ud->listening) { /* the callback called unlisten(), and the listener is gone now */
+    luaL_unref(L,LUA_REGISTRYINDEX,ud->listen_cb.i);
+  }
+  lua_pushboolean(L,rv);
+  due=xctrl_listen_timeout(ud->dpy);
+  if (rv && (due>=0)) {
+    lua_pushnumber(L,due);
+    return 2;
+  }
+  return 1;
+}
+
+
+
+static int lwmc_unlisten(lua_State*L)
+{
+  XCtrl*ud=lwmc_check_obj(L);
+  if (ud->listening) {
+    xctrl_listen_end(ud->dpy);
+    if (!ud->dispatching) { luaL_unref(L,LUA_REGISTRYINDEX,ud->listen_cb.i); }
+    ud->listening=False;
+  }
+  return 0;
+}
+
+
+
+static int lwmc_record(lua_State*L)
+{
+  XCtrl*ud=lwmc_check_obj(L);
+  const char*path=luaL_optstring(L,2,NULL);
+  if (!xctrl_listen_record(ud->dpy, path)) { return lwmc_failure(L, "Can't create the event log."); }
+  lua_pushboolean(L,True);
+  return 1;
+}
+
+
+
+static int lwmc_replay(lua_State*L)
+{
+  cbdata c;
+  const char*path;
+  long count;
+  Bool details=lwmc_want_details(L,4);
+  Bool realtime=False;
+  lwmc_check_obj(L);
+  path=luaL_checkstring(L,2);
+  luaL_argcheck(L,lua_isfunction(L,3),3,"expected function");
+  if (lua_istable(L,4)) {
+    lua_getfield(L,4,"realtime");
+    realtime=lua_toboolean(L,-1);
+  }
+  lua_settop(L,3);
+  c.L=L;
+  c.i=luaL_ref(L,LUA_REGISTRYINDEX);
+  if (details) {
+    count=xctrl_replay_ex(path,lwmc_listen_cb_ex,&c,realtime);
+  } else {
+    count=xctrl_replay(path,lwmc_listen_cb,&c,realtime);
+  }
+  luaL_unref(L,LUA_REGISTRYINDEX,c.i);
+  if (count<0) { return lwmc_failure(L, "Can't read the event log."); }
+  lua_pushnumber(L,count);
+  return 1;
+}
+
+
+
+#ifdef XCTRL_THREADS
+/* The threads only open the displays, Lua can't run on them */
+static void*lwmc_fanout_nop(Display*disp, void*data)
+{
+  return NULL;
+}
+
+
+
+/*
+  Open the displays named in the targets table at index 1, all at once,
+  one thread each. Returns one entry for each name, in the table's order.
+*/
+static FanoutTarget*lwmc_fanout_connect(lua_State*L, int n)
+{
+  FanoutTarget*conns;
+  int i;
+  int count=0;
+  for (i=1; i<=n; i++) { /* raise any error before there is anything to leak */
+    lua_rawgeti(L,1,i);
+    if (lua_type(L,-1)!=LUA_TSTRING) { luaL_checkudata(L,-1,XCTRL_META_NAME); }
+    lua_pop(L,1);
+  }
+  conns=(FanoutTarget*)calloc(n+1,sizeof(FanoutTarget));
+  if (!conns) { return NULL; }
+  for (i=1; i<=n; i++) {
+    lua_rawgeti(L,1,i);
+    if (lua_type(L,-1)==LUA_TSTRING) { conns[count++].dpyname=lua_tostring(L,-1); } /* kept by the table */
+    lua_pop(L,1);
+  }
+  xctrl_fanout(conns,count,count,lwmc_fanout_nop,NULL);
+  return conns;
+}
+#endif
+
+
+
+/*
+  fanout(targets, func, ...) calls func(xc, ...) once for each entry of
+  targets, which may be display names or xctrl objects, and returns a
+  list of results with the time spent connecting and running. The calls
+  are made one after another. In the thread-safe build the named displays
+  are opened in parallel first, so only the connecting overlaps.
+*/
+static int lwmc_fanout(lua_State*L)
+{
+  int n, i, j, nargs, results;
+#ifdef XCTRL_THREADS
+  FanoutTarget*conns;
+  int k=0;
+#endif
+  luaL_checktype(L,1,LUA_TTABLE);
+  luaL_checktype(L,2,LUA_TFUNCTION);
+  nargs=lua_gettop(L)-2;
+  n=TableLength(L,1);
+#ifdef XCTRL_THREADS
+  conns=lwmc_fanout_connect(L,n);
+  if (!conns) { return lwmc_failure(L, "Out of memory."); }
+#endif
+  lua_newtable(L);
+  results=lua_gettop(L);
+  for (i=1; i<=n; i++) {
+    XCtrl*ud;
+    const char*name=NULL;
+    double connect_ms=0;
+    ulong start;
+    lua_rawgeti(L,1,i);
+    if (lua_type(L,-1)==LUA_TSTRING) {
+      name=lua_tostring(L,-1);
+#ifdef XCTRL_THREADS
+      connect_ms=conns[k].connect_ms;
+      ud=lwmc_wrap(L,name,conns[k++].disp);
+#else
+      start=now_us();
+      ud=lwmc_open(L,name);
+      connect_ms=(now_us()-start)/1000.0;
+#endif
+      if (ud) { lua_remove(L,-2); }
+    } else {
+      ud=(XCtrl*)luaL_checkudata(L,-1,XCTRL_META_NAME);
+    }
+    lua_newtable(L);
+    SetTableNum("connect_ms",connect_ms);
+    if (ud) {
+      int ok;
+      double run_ms;
+      if (ud->dpyname) { SetTableStr("display",ud->dpyname); }
+      lua_pushstring(L,"xc");
+      lua_pushvalue(L,-3);
+      lua_rawset(L,-3);
+      lua_pushvalue(L,2);
+      lua_pushvalue(L,-3);
+      for (j=1; j<=nargs; j++) { lua_pushvalue(L,2+j); }
+      start=now_us();
+      ok=(lua_pcall(L,1+nargs,1,0)==0);
+      run_ms=(now_us()-start)/1000.0;
+      lua_pushstring(L,ok?"result":"error");
+      lua_insert(L,-2);
+      lua_rawset(L,-3);
+      SetTableNum("run_ms",run_ms);
+      SetTableBool("ok",ok);
+    } else {
+      SetTableStr("display",name);
+      SetTableBool("ok",False);
+      SetTableStr("error","Can't open display.");
+    }
+    lua_rawseti(L,results,i);
+    lua_pop(L,1);
+  }
+#ifdef XCTRL_THREADS
+  free(conns);
+#endif
+  return 1;
+}
+
+
+
+static void lwmc_set_counting(XCtrl*ud, Bool stats, Bool trace)
+{
+  Bool was=ud->stats||ud->trace;
+  ud->stats=stats;
+  ud->trace=trace;
+  if (was!=(stats||trace)) { lwmc_stats_users+=was?-1:1; }
+}
+
+
+
+static int lwmc_set_stats(lua_State*L)
+{
+  XCtrl*ud=lwmc_check_obj(L);
+  Bool enable=lua_toboolean(L,2);
+  lwmc_set_counting(ud,enable,ud->trace);
+  xctrl_set_stats(ud->dpy,enable);
+  return 0;
+}
+
+
+
+static int lwmc_set_trace(lua_State*L)
+{
+  XCtrl*ud=lwmc_check_obj(L);
+  long size=luaL_optnumber(L,2,0);
+  if (size<0) { size=0; }
+  if (!xctrl_set_trace(ud->dpy,size)) {
+    return lwmc_failure(L, "Can't allocate the trace buffer.");
+  }
+  lwmc_set_counting(ud,ud->stats,size>0);
+  lua_pushboolean(L,True);
+  return 1;
+}
+
+
+
+static int lwmc_trace_dump(lua_State*L)
+{
+  XCtrl*ud=lwmc_check_obj(L);
+  long count=xctrl_trace_dump(ud->dpy,luaL_checkstring(L,2));
+  if (count<0) { return lwmc_failure(L, "Can't write the trace."); }
+  lua_pushnumber(L,count);
+  return 1;
+}
+
+
+
+static void lwmc_push_stats(lua_State*L, XCtrlStats*st)
+{
+  lua_newtable(L);
+  SetTableNum("calls",st->calls);
+  SetTableNum("requests",st->requests);
+  SetTableNum("round_trips",st->round_trips);
+  SetTableNum("reply_bytes",st->reply_bytes);
+  SetTableNum("alloc_bytes",st->alloc_bytes);
+  SetTableNum("wait_ms",st->wait_us/1000.0);
+  SetTableNum("time_ms",st->time_us/1000.0);
+}
+
+
+
+static int lwmc_stats(lua_State*L)
+{
+  XCtrl*ud=lwmc_check_obj(L);
+  XCtrlStats st;
+  const char*api;
+  int i;
+  if (!xctrl_get_stats(ud->dpy,NULL,&st)) { return 0; }
+  lwmc_push_stats(L,&st);
+  lua_pushstring(L,"apis");
+  lua_newtable(L);
+  for (i=0; (api=xctrl_stats_api(ud->dpy,i)); i++) {
+    if (xctrl_get_stats(ud->dpy,api,&st)) {
+      lua_pushstring(L,api);
+      lwmc_push_stats(L,&st);
+      lua_rawset(L,-3);
+    }
+  }
+  lua_rawset(L,-3);
+  return 1;
+}
+
+
+
+static int lwmc_reset_stats(lua_State*L)
+{
+  XCtrl*ud=lwmc_check_obj(L);
+  xctrl_reset_stats(ud->dpy);
+  return 0;
+}
+
+
+
+/*
+  Every method is registered through this wrapper, which counts the call
+  under the method's name when stats are enabled for the object. Errors
+  are caught and raised again after the count, so that it is always ended.
+*/
+static int lwmc_counted(lua_State*L)
+{
+  XCtrl*ud=NULL;
+  int n=lua_gettop(L);
+  if (lwmc_stats_users && lua_getmetatable(L,1)) {
+    luaL_getmetatable(L,XCTRL_META_NAME);
+    if (lua_rawequal(L,-1,-2)) {
+      ud=(XCtrl*)lua_touserdata(L,1);
+      if (!ud->stats && !ud->trace) { ud=NULL; }
+    }
+    lua_pop(L,2);
+  }
+  lua_pushvalue(L,lua_upvalueindex(1));
+  lua_insert(L,1);
+  if (ud) {
+    xctrl_stats_begin(ud->dpy,lua_tostring(L,lua_upvalueindex(2)));
+    if (n>1 && lua_type(L,3)==LUA_TNUMBER) { xctrl_stats_window(ud->dpy,lua_tonumber(L,3)); }
+  }
+  if (!ud) {
+    lua_call(L,n,LUA_MULTRET);
+  } else {
+    int err=lua_pcall(L,n,LUA_MULTRET,0);
+    xctrl_stats_end(ud->dpy);
+    if (err) { lua_error(L); }
+  }
+  return lua_gettop(L);
+}
+
+
+
 static const struct luaL_Reg lwmc_funcs[] = {
   {"new",             lwmc_new},
   {"get_win_list",    lwmc_get_win_list},
+  {"snapshot",        lwmc_snapshot},
   {"get_win_title",   lwmc_get_win_title},
   {"set_win_title",   lwmc_set_win_title},
   {"get_win_class",   lwmc_get_win_class},
   {"activate_win",    lwmc_activate_win},
   {"iconify_win",     lwmc_iconify_win},
   {"set_win_state",   lwmc_set_win_state},
+  {"get_win_state",   lwmc_get_win_state},
   {"set_win_geom",    lwmc_set_win_geom},
   {"get_win_geom",    lwmc_get_win_geom},
   {"get_win_frame",   lwmc_get_win_frame},
@@ -990,6 +1808,7 @@ static const struct luaL_Reg lwmc_funcs[] = {
   {"get_wm_name",     lwmc_get_wm_name},
   {"get_wm_class",    lwmc_get_wm_class},
   {"get_wm_pid",      lwmc_get_wm_pid},
+  {"wm_supports",     lwmc_wm_supports},
   {"get_desk_name",   lwmc_get_desk_name},
   {"get_workarea",    lwmc_get_workarea},
   {"get_desk_geom",   lwmc_get_desk_geom},
@@ -1003,14 +1822,53 @@ static const struct luaL_Reg lwmc_funcs[] = {
   {"get_selection",   lwmc_get_selection},
   {"set_selection",   lwmc_set_selection},
   {"listen",          lwmc_listen},
+  {"listen_fd",       lwmc_listen_fd},
+  {"dispatch",        lwmc_dispatch},
+  {"unlisten",        lwmc_unlisten},
+  {"record",          lwmc_record},
+  {"replay",          lwmc_replay},
+  {"fanout",          lwmc_fanout},
+  {"set_mirror",      lwmc_set_mirror},
+  {"set_coalesce",    lwmc_set_coalesce},
+  {"get_dropped",     lwmc_get_dropped},
+  {"set_stats",       lwmc_set_stats},
+  {"stats",           lwmc_stats},
+  {"reset_stats",     lwmc_reset_stats},
+  {"set_trace",       lwmc_set_trace},
+  {"trace_dump",      lwmc_trace_dump},
+  {"get_atoms_saved", lwmc_get_atoms_saved},
   {NULL,NULL}
 };
 
 
+/*
+  Replace the methods in the metatable at "idx" with counted wrappers,
+  except for the ones that turn the counters on or off or reset them.
+*/
+static void lwmc_wrap_methods(lua_State*L, int idx)
+{
+  const struct luaL_Reg*f;
+  lua_pushvalue(L,idx);
+  for (f=&lwmc_funcs[1]; f->name; f++) {
+    if ((f->func==lwmc_set_stats)||(f->func==lwmc_reset_stats)||(f->func==lwmc_set_trace)) { continue; }
+    lua_pushstring(L,f->name);
+    lua_pushcfunction(L,f->func);
+    lua_pushstring(L,f->name);
+    lua_pushcclosure(L,lwmc_counted,2);
+    lua_rawset(L,-3);
+  }
+  lua_pop(L,1);
+}
+
+
+
 int luaopen_xctrl(lua_State*L);
 
 int luaopen_xctrl(lua_State*L)
 {
+#ifdef XCTRL_THREADS
+  xctrl_threads_init();
+#endif
   luaL_newmetatable(L, XCTRL_META_NAME);
   lua_pushstring(L, "__index");
   lua_pushvalue(L, -2);
@@ -1027,8 +1885,10 @@ int luaopen_xctrl(lua_State*L)
 #if LUA_VERSION_NUM < 502
   luaL_register(L, NULL, &lwmc_funcs[1]);
   luaL_register(L, XCTRL_META_NAME, lwmc_funcs);
+  lwmc_wrap_methods(L,-2);
 #else
   luaL_setfuncs(L,lwmc_funcs,0);
+  lwmc_wrap_methods(L,-1);
 #endif
   return 1;
 }
@@ -38,6 +38,7 @@ Free Software Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
 #include <unistd.h>
 #include <stdio.h>
 #include <string.h>
+#include <strings.h>
 #include <ctype.h>
 
 #include <X11/Xlib.h>
@@ -45,13 +46,27 @@ Free Software Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
 #include <X11/cursorfont.h>
 #include <X11/Xmu/WinUtil.h>
 
+#ifdef XCTRL_USE_XCB
+# include <X11/Xlib-xcb.h>
+#endif
+
 #include <iconv.h>
 #include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <stdint.h>
+#ifdef __SSE2__
+# include <emmintrin.h>
+#endif
+#ifdef XCTRL_THREADS
+# include <pthread.h>
+#endif
 #include "xctrl.h"
 
 
 #define DefRootWin DefaultRootWindow(disp)
-#define GetUTF8Atom() XInternAtom(disp, "UTF8_STRING", False)
+#define GetAtom(id) get_atom(disp, id)
+#define GetUTF8Atom() GetAtom(ATOM_UTF8_STRING)
 #define sfree(p) if (p) { free(p); }
 
 #define DEFAULT_CHARSET "ISO_8859-1"
@@ -61,9 +76,254 @@ XCTRL_API char* default_charset=DEFAULT_CHARSET;
 XCTRL_API Bool envir_utf8;
 
 
-XCTRL_API char* convert_locale(const char*asrc,const char*from, const char*to)
-{
+/*
+  Conversions are cached per display as (from, to) pairs, since opening
+  an iconv descriptor costs far more than most window titles take to
+  convert. Strings that need no conversion skip iconv altogether.
+*/
+typedef struct _IconvItem {
+  struct _IconvItem*next;
+  char*from;
+  char*to;
   iconv_t cd;
+  Bool ascii_safe; /* both charsets encode ASCII as plain ASCII */
+  Bool utf8_copy;  /* both charsets are UTF-8 */
+} IconvItem;
+
+
+
+static Bool charset_is_utf8(const char*name)
+{
+  return (strcasecmp(name,"UTF-8")==0)||(strcasecmp(name,"UTF8")==0);
+}
+
+
+
+/*
+  Can ASCII text be passed through unconverted? Not for the wide encodings,
+  nor for the 7-bit ones that switch charsets with escapes, where text that
+  looks like ASCII may be anything.
+*/
+static Bool charset_ascii_safe(const char*name)
+{
+  static const char*unsafe[]={"UTF-16","UTF16","UTF-32","UTF32","UCS-2","UCS2","UCS-4","UCS4","UTF-7","UTF7",
+    "ISO-2022","ISO2022","ISO_2022","CSISO2022","HZ",NULL};
+  int i;
+  for (i=0; unsafe[i]; i++) {
+    if (strncasecmp(name,unsafe[i],strlen(unsafe[i]))==0) { return False; }
+  }
+  return strstr(name,"EBCDIC")?False:True;
+}
+
+
+
+/*
+  Property text is classified in a single pass before deciding whether it
+  needs converting. Runs of ASCII, which is most of any window title, are
+  skipped 16 bytes at a time with SSE2, or a word at a time without it;
+  only the bytes around non-ASCII characters are checked one by one.
+*/
+enum { TEXT_ASCII, TEXT_UTF8, TEXT_OTHER };
+
+#define HIGH_BITS ((ulong)-1/0xFF*0x80)
+
+
+
+/* Length of the run of ASCII bytes at the start of s. */
+static size_t ascii_prefix(const uchar*s, size_t len)
+{
+  size_t i=0;
+#ifdef __SSE2__
+  for (; i+16<=len; i+=16) {
+    int mask=_mm_movemask_epi8(_mm_loadu_si128((const __m128i*)(s+i)));
+    if (mask) { return i+__builtin_ctz(mask); }
+  }
+#else
+  for (; i+sizeof(ulong)<=len; i+=sizeof(ulong)) {
+    ulong word;
+    memcpy(&word, s+i, sizeof(ulong));
+    if (word&HIGH_BITS) { break; }
+  }
+#endif
+  for (; (i<len)&&(s[i]<0x80); i++) { }
+  return i;
+}
+
+
+
+/* Length of the UTF-8 sequence at the start of s, or 0 if it isn't valid. */
+static size_t utf8_sequence(const uchar*s, size_t len)
+{
+  size_t n, i;
+  if ((s[0]&0xE0)==0xC0) {
+    if (s[0]<0xC2) { return 0; }
+    n=2;
+  } else if ((s[0]&0xF0)==0xE0) {
+    n=3;
+  } else if ((s[0]&0xF8)==0xF0) {
+    if (s[0]>0xF4) { return 0; }
+    n=4;
+  } else {
+    return 0;
+  }
+  if (n>len) { return 0; }
+  for (i=1; i<n; i++) {
+    if ((s[i]&0xC0)!=0x80) { return 0; }
+  }
+  /* overlong forms, surrogates and code points past U+10FFFF */
+  if ((s[0]==0xE0)&&(s[1]<0xA0)) { return 0; }
+  if ((s[0]==0xED)&&(s[1]>=0xA0)) { return 0; }
+  if ((s[0]==0xF0)&&(s[1]<0x90)) { return 0; }
+  if ((s[0]==0xF4)&&(s[1]>=0x90)) { return 0; }
+  return n;
+}
+
+
+
+static int text_class(const char*str, size_t len)
+{
+  const uchar*s=(const uchar*)str;
+  size_t i=ascii_prefix(s, len);
+  int rv=TEXT_ASCII;
+  while (i<len) {
+    size_t n=utf8_sequence(s+i, len-i);
+    if (!n) { return TEXT_OTHER; }
+    rv=TEXT_UTF8;
+    i+=n;
+    i+=ascii_prefix(s+i, len-i);
+  }
+  return rv;
+}
+
+
+
+/* Whether src reads differently in the two charsets described by the flags. */
+static Bool convert_needed(const char*src, Bool ascii_safe, Bool utf8_copy)
+{
+  if (!ascii_safe && !utf8_copy) { return True; }
+  switch (text_class(src, strlen(src))) {
+    case TEXT_ASCII: return False;
+    case TEXT_UTF8: return !utf8_copy;
+    default: return True;
+  }
+}
+
+
+
+/*
+  A growable buffer. The *_into() getters keep two of these with each
+  display, so that once they are big enough nothing needs allocating.
+*/
+typedef struct _Scratch {
+  char*data;
+  size_t size;
+} Scratch;
+
+
+
+static char*scratch_reserve(Scratch*sb, size_t size)
+{
+  if (size>sb->size) {
+    char*tmp=(char*)realloc(sb->data, size);
+    if (!tmp) { return NULL; }
+    sb->data=tmp;
+    sb->size=size;
+  }
+  return sb->data;
+}
+
+
+
+/*
+  A bump allocator for memory that only lives as long as one call. Its
+  chunks are kept when it is reset, so once an arena has grown to fit the
+  work it does, doing it again allocates nothing, and releasing everything
+  at once is just a reset.
+*/
+typedef struct _ArenaChunk {
+  struct _ArenaChunk*next;
+  size_t size;
+  size_t used;
+} ArenaChunk;
+
+typedef struct _Arena {
+  ArenaChunk*head;
+  ArenaChunk*cur;   /* the chunk being allocated from */
+  ulong grown;      /* bytes of chunks malloc'd, for the stats */
+} Arena;
+
+#define ARENA_MIN 4096
+#define ARENA_ALIGN 16 /* also keeps the chunk data aligned after its header */
+#define ARENA_HEADER ((sizeof(ArenaChunk)+ARENA_ALIGN-1)&~(size_t)(ARENA_ALIGN-1))
+#define ArenaData(c) ((char*)(c)+ARENA_HEADER)
+
+
+
+static void*arena_alloc(Arena*a, size_t n)
+{
+  ArenaChunk*c;
+  size_t size;
+  n=n?(n+ARENA_ALIGN-1)&~(size_t)(ARENA_ALIGN-1):ARENA_ALIGN;
+  for (c=a->cur; c; c=c->next) {
+    if (c!=a->cur) { c->used=0; }
+    a->cur=c;
+    if (c->size-c->used>=n) {
+      c->used+=n;
+      return ArenaData(c)+c->used-n;
+    }
+  }
+  size=a->cur?2*a->cur->size:ARENA_MIN;
+  if (size<n) { size=n; }
+  c=(ArenaChunk*)malloc(ARENA_HEADER+size);
+  if (!c) { return NULL; }
+  c->next=NULL;
+  c->size=size;
+  c->used=n;
+  if (a->cur) { a->cur->next=c; } else { a->head=c; }
+  a->cur=c;
+  a->grown+=size;
+  return ArenaData(c);
+}
+
+
+
+static char*arena_strdup(Arena*a, const char*s)
+{
+  char*rv=NULL;
+  if (s) {
+    size_t n=strlen(s)+1;
+    rv=(char*)arena_alloc(a, n);
+    if (rv) { memcpy(rv, s, n); }
+  }
+  return rv;
+}
+
+
+
+/* Release everything allocated from the arena, keeping its chunks. */
+static void arena_reset(Arena*a)
+{
+  a->cur=a->head;
+  if (a->head) { a->head->used=0; }
+}
+
+
+
+static void arena_free(Arena*a)
+{
+  while (a->head) {
+    ArenaChunk*c=a->head;
+    a->head=c->next;
+    free(c);
+  }
+  a->cur=NULL;
+}
+
+
+
+/* Convert into sb, which keeps its memory whether or not this succeeds. */
+static char*convert_iconv_buf(iconv_t cd, const char*asrc, const char*from, Scratch*sb)
+{
   size_t out_remain;
   size_t out_size;
   char* psrc=(char*)asrc;
@@ -71,16 +331,14 @@ XCTRL_API char* convert_locale(const char*asrc,const char*from, const char*to)
   char* pdst;
   Bool from_utf16 = (strcmp("UTF-16BE", from)==0)||(strcmp("UTF-16", from)==0);
   const char space[] = { 0x00, 0x20 };
-  size_t srclen=asrc?strlen(asrc):0;
+  size_t srclen=strlen(asrc);
   out_size = srclen > 0 ? srclen : 1024;
-  out_base = (char*)malloc(out_size + 1);
+  if (sb->size>out_size+1) { out_size=sb->size-1; }
+  out_base = scratch_reserve(sb, out_size + 1);
   if(!out_base) { return NULL; }
   out_remain = out_size;
   pdst = out_base;
-  if ((cd = iconv_open(to, from)) == (iconv_t)-1) {
-    free(out_base);
-    return NULL;
-  }
+  iconv(cd, NULL, NULL, NULL, NULL); /* a cached descriptor may hold state */
   do {
     if (iconv(cd, &psrc, &srclen, &pdst, &out_remain) == (size_t)-1) {
       switch(errno) {
@@ -90,7 +348,6 @@ XCTRL_API char* convert_locale(const char*asrc,const char*from, const char*to)
             size_t tmp_length = 2;
             if(iconv(cd, &tmp, &tmp_length, &pdst, &out_remain) == (size_t)-1) {
               if (errno != E2BIG) {
-                free(out_base);
                 return NULL;
               } else {
                 /* fall thru to E2BIG below */
@@ -101,33 +358,121 @@ XCTRL_API char* convert_locale(const char*asrc,const char*from, const char*to)
               break;
             }
           } else {
-            free(out_base);
             return NULL;
           }
         }
         case E2BIG: {
           int length = pdst - out_base;
           out_size *= 2;
-          out_base = (char*)realloc(out_base, out_size + 1);
+          out_base = scratch_reserve(sb, out_size + 1);
           if (!out_base) { return NULL; }
           pdst = out_base + length;
           out_remain = out_size - length;
           break;
         }
         default: {
-          free(out_base);
           return NULL;
         }
       }
     }
   } while(srclen > 0);
-  iconv_close(cd);
   pdst[0]='\0';
   return out_base;
 }
 
 
 
+static char*convert_iconv(iconv_t cd, const char*src, const char*from)
+{
+  Scratch sb={NULL,0};
+  char*out=convert_iconv_buf(cd, src, from, &sb);
+  if (!out) { sfree(sb.data); }
+  return out;
+}
+
+
+
+static void convert_cache_free(IconvItem*cache)
+{
+  while (cache) {
+    IconvItem*n=cache->next;
+    iconv_close(cache->cd);
+    sfree(cache->from);
+    sfree(cache->to);
+    free(cache);
+    cache=n;
+  }
+}
+
+
+
+/* Find or open the descriptor for (from, to) in *cache. */
+static IconvItem*convert_lookup(IconvItem**cache, const char*from, const char*to)
+{
+  IconvItem*p;
+  iconv_t cd;
+  for (p=*cache; p; p=p->next) {
+    if ((strcmp(p->from,from)==0)&&(strcmp(p->to,to)==0)) { return p; }
+  }
+  cd=iconv_open(to, from);
+  if (cd==(iconv_t)-1) { return NULL; }
+  p=(IconvItem*)calloc(1,sizeof(IconvItem));
+  if (!p) {
+    iconv_close(cd);
+    return NULL;
+  }
+  p->from=strdup(from);
+  p->to=strdup(to);
+  p->cd=cd;
+  if (!p->from || !p->to) {
+    convert_cache_free(p);
+    return NULL;
+  }
+  p->ascii_safe=charset_ascii_safe(from) && charset_ascii_safe(to);
+  p->utf8_copy=charset_is_utf8(from) && charset_is_utf8(to);
+  p->next=*cache;
+  *cache=p;
+  return p;
+}
+
+
+
+/* Like convert_locale(), but keeps the descriptor in *cache for next time. */
+static char*convert_cached(IconvItem**cache, const char*asrc, const char*from, const char*to)
+{
+  IconvItem*p=convert_lookup(cache, from, to);
+  const char*src=asrc?asrc:"";
+  if (!p) { return NULL; }
+  if (!convert_needed(src, p->ascii_safe, p->utf8_copy)) { return strdup(src); }
+  return convert_iconv(p->cd, src, from);
+}
+
+
+
+/*
+  Conversions without a display share one cache, which only grows by one
+  descriptor for each (from, to) pair ever asked for.
+*/
+static IconvItem*convert_shared=NULL;
+#ifdef XCTRL_THREADS
+static pthread_mutex_t convert_lock=PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+XCTRL_API char* convert_locale(const char*src,const char*from, const char*to)
+{
+  char*out;
+#ifdef XCTRL_THREADS
+  pthread_mutex_lock(&convert_lock);
+#endif
+  out=convert_cached(&convert_shared, src, from, to);
+#ifdef XCTRL_THREADS
+  pthread_mutex_unlock(&convert_lock);
+#endif
+  return out;
+}
+
+
+
 XCTRL_API char *locale_to_utf8(const char*src) {
   return convert_locale( src, default_charset, "UTF-8");
 }
@@ -178,460 +523,767 @@ XCTRL_API void init_charset(Bool force_utf8, char*charset)
 
 
 
-static Bool client_msg(Display *disp, Window win, char *msg, ulong d0, ulong d1, ulong d2, ulong d3, ulong d4) {
-  XEvent event;
-  long mask = SubstructureRedirectMask | SubstructureNotifyMask;
-  event.type = ClientMessage;
-  event.xclient.type = ClientMessage;
-  event.xclient.serial = 0;
-  event.xclient.send_event = True;
-  event.xclient.message_type = XInternAtom(disp, msg, False);
-  event.xclient.window = win;
-  event.xclient.format = 32;
-  event.xclient.data.l[0] = d0;
-  event.xclient.data.l[1] = d1;
-  event.xclient.data.l[2] = d2;
-  event.xclient.data.l[3] = d3;
-  event.xclient.data.l[4] = d4;
-  return XSendEvent(disp, DefRootWin, False, mask, &event)?True:False;
+static ulong now_us(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (ulong)ts.tv_sec*1000000+(ulong)ts.tv_nsec/1000;
 }
 
 
 
-static char *get_output_str(char*str, Bool is_utf8) {
-  char *out;
-  if (!str) { return NULL; }
-  if (envir_utf8) {
-    if (is_utf8) {
-      out = strdup(str);
-    } else {
-      out=locale_to_utf8(str);
-      if (!out) { out = strdup(str); }
-    }
-  } else {
-    if (is_utf8) {
-      out = utf8_to_locale(str);
-      if (!out) { out = strdup(str); }
-    } else {
-      out = strdup(str);
-    }
-  }
-  return out;
+static ulong now_ms(void)
+{
+  return now_us()/1000;
 }
 
 
 
-#define get_uprop(wn,pn,sz) (ulong*)get_prop(disp, wn, XA_CARDINAL, pn, sz)
+/*********************************************************************/
+/* * * * * * * * * * * *  Per-display context  * * * * * * * * * * * */
+/*********************************************************************/
 
-static char *get_prop(Display*d, Window w, Atom type, const char*name, ulong*count) {
-  Atom a=XInternAtom(d, name, False);
-  Atom ret_type;
-  int format=0;
-  ulong nitems=0;
-  ulong after=0;
-  uchar *retp=NULL;
-  ulong total_bytes=0;
-  char*all=NULL;
-  XGetWindowProperty(d,w,a,0,0,False,AnyPropertyType,&ret_type,&format,&nitems,&after,&retp);
-  if (retp) { XFree(retp); }
-  if (type!=ret_type) {
-    if (count) { *count=0; }
-    return NULL;
-  }
-  all=(char*)malloc(1);
-  do {
-    XGetWindowProperty(d,w,a,total_bytes/4,1024,False,ret_type,&ret_type,&format,&nitems,&after,&retp);
-    if (retp) {
-      uint chunk_bytes = (format/8)*nitems;
-      if (format == 32) { chunk_bytes *= sizeof(long) / 4; } /* Fix x86_64 handling 32-bit data */
-      all = (char*)realloc(all,chunk_bytes+total_bytes+1);
-      memcpy(&(all[total_bytes]), retp, chunk_bytes);
-      total_bytes+=chunk_bytes;
-      XFree(retp);
-    }
-  } while (after!=0);
-  if (total_bytes) {
-    all[total_bytes] = '\0';
-    if (count) {
-      *count=total_bytes/(format/8);
-      if (format == 32) { *count /= sizeof(long) / 4; } /* Fix x86_64 handling 32-bit data */
-    }
-    return(all);
-  } else {
-    free(all);
-    return NULL;
-  }
-}
+/*
+  Every atom the library uses is interned in a single XInternAtoms()
+  batch the first time we see a display, so that looking one up later
+  costs nothing. The names below must stay in the same order as the
+  ATOM_* enumeration.
+*/
+enum {
+  ATOM_UTF8_STRING,
+  ATOM_NET_SUPPORTED,
+  ATOM_NET_SUPPORTING_WM_CHECK,
+  ATOM_WIN_SUPPORTING_WM_CHECK,
+  ATOM_NET_WM_NAME,
+  ATOM_NET_WM_ICON_NAME,
+  ATOM_NET_WM_PID,
+  ATOM_NET_WM_DESKTOP,
+  ATOM_WIN_WORKSPACE,
+  ATOM_NET_SHOWING_DESKTOP,
+  ATOM_NET_DESKTOP_VIEWPORT,
+  ATOM_NET_DESKTOP_GEOMETRY,
+  ATOM_NET_NUMBER_OF_DESKTOPS,
+  ATOM_WIN_WORKSPACE_COUNT,
+  ATOM_NET_CURRENT_DESKTOP,
+  ATOM_NET_DESKTOP_NAMES,
+  ATOM_WIN_WORKSPACE_NAMES,
+  ATOM_NET_WORKAREA,
+  ATOM_WIN_WORKAREA,
+  ATOM_NET_CLIENT_LIST,
+  ATOM_WIN_CLIENT_LIST,
+  ATOM_NET_ACTIVE_WINDOW,
+  ATOM_NET_CLOSE_WINDOW,
+  ATOM_NET_MOVERESIZE_WINDOW,
+  ATOM_NET_FRAME_EXTENTS,
+  ATOM_NET_WM_STATE,
+  ATOM_NET_WM_STATE_MODAL,
+  ATOM_NET_WM_STATE_STICKY,
+  ATOM_NET_WM_STATE_MAXIMIZED_VERT,
+  ATOM_NET_WM_STATE_MAXIMIZED_HORZ,
+  ATOM_NET_WM_STATE_SHADED,
+  ATOM_NET_WM_STATE_SKIP_TASKBAR,
+  ATOM_NET_WM_STATE_SKIP_PAGER,
+  ATOM_NET_WM_STATE_HIDDEN,
+  ATOM_NET_WM_STATE_FULLSCREEN,
+  ATOM_NET_WM_STATE_ABOVE,
+  ATOM_NET_WM_STATE_BELOW,
+  ATOM_NET_WM_STATE_DEMANDS_ATTENTION,
+  ATOM_NET_WM_WINDOW_TYPE,
+  ATOM_NET_WM_WINDOW_TYPE_DESKTOP,
+  ATOM_NET_WM_WINDOW_TYPE_DOCK,
+  ATOM_NET_WM_WINDOW_TYPE_TOOLBAR,
+  ATOM_NET_WM_WINDOW_TYPE_MENU,
+  ATOM_NET_WM_WINDOW_TYPE_UTILITY,
+  ATOM_NET_WM_WINDOW_TYPE_SPLASH,
+  ATOM_NET_WM_WINDOW_TYPE_DIALOG,
+  ATOM_NET_WM_WINDOW_TYPE_NORMAL,
+  ATOM_MOTIF_WM_HINTS,
+  ATOM_WM_STATE,
+  ATOM_CLIPBOARD,
+  ATOM_TARGETS,
+  ATOM_INCR,
+  ATOM_XCLIP_OUT,
+  ATOM_COUNT
+};
+
+static char*atom_names[ATOM_COUNT]={
+  "UTF8_STRING",
+  "_NET_SUPPORTED",
+  "_NET_SUPPORTING_WM_CHECK",
+  "_WIN_SUPPORTING_WM_CHECK",
+  "_NET_WM_NAME",
+  "_NET_WM_ICON_NAME",
+  "_NET_WM_PID",
+  "_NET_WM_DESKTOP",
+  "_WIN_WORKSPACE",
+  "_NET_SHOWING_DESKTOP",
+  "_NET_DESKTOP_VIEWPORT",
+  "_NET_DESKTOP_GEOMETRY",
+  "_NET_NUMBER_OF_DESKTOPS",
+  "_WIN_WORKSPACE_COUNT",
+  "_NET_CURRENT_DESKTOP",
+  "_NET_DESKTOP_NAMES",
+  "_WIN_WORKSPACE_NAMES",
+  "_NET_WORKAREA",
+  "_WIN_WORKAREA",
+  "_NET_CLIENT_LIST",
+  "_WIN_CLIENT_LIST",
+  "_NET_ACTIVE_WINDOW",
+  "_NET_CLOSE_WINDOW",
+  "_NET_MOVERESIZE_WINDOW",
+  "_NET_FRAME_EXTENTS",
+  "_NET_WM_STATE",
+  "_NET_WM_STATE_MODAL",
+  "_NET_WM_STATE_STICKY",
+  "_NET_WM_STATE_MAXIMIZED_VERT",
+  "_NET_WM_STATE_MAXIMIZED_HORZ",
+  "_NET_WM_STATE_SHADED",
+  "_NET_WM_STATE_SKIP_TASKBAR",
+  "_NET_WM_STATE_SKIP_PAGER",
+  "_NET_WM_STATE_HIDDEN",
+  "_NET_WM_STATE_FULLSCREEN",
+  "_NET_WM_STATE_ABOVE",
+  "_NET_WM_STATE_BELOW",
+  "_NET_WM_STATE_DEMANDS_ATTENTION",
+  "_NET_WM_WINDOW_TYPE",
+  "_NET_WM_WINDOW_TYPE_DESKTOP",
+  "_NET_WM_WINDOW_TYPE_DOCK",
+  "_NET_WM_WINDOW_TYPE_TOOLBAR",
+  "_NET_WM_WINDOW_TYPE_MENU",
+  "_NET_WM_WINDOW_TYPE_UTILITY",
+  "_NET_WM_WINDOW_TYPE_SPLASH",
+  "_NET_WM_WINDOW_TYPE_DIALOG",
+  "_NET_WM_WINDOW_TYPE_NORMAL",
+  "_MOTIF_WM_HINTS",
+  "WM_STATE",
+  "CLIPBOARD",
+  "TARGETS",
+  "INCR",
+  "XCLIP_OUT"
+};
+
+
+
+/* Atoms outside the table above are interned on demand and kept here. */
+typedef struct _AtomCacheItem {
+  struct _AtomCacheItem*next;
+  char*name;
+  Atom atom;
+} AtomCacheItem;
+
+
+typedef struct _TraceItem {
+  const char*name;
+  const char*in;   /* for an XSync(), the API it was made from, if any */
+  Window win;
+  ulong round_trips;
+  ulong begin_us;
+  ulong end_us;
+} TraceItem;
 
 
+typedef struct _StatsItem {
+  struct _StatsItem*next;
+  char*api;
+  XCtrlStats stats;
+} StatsItem;
+
+
+/* One xctrl_stats_begin() that hasn't been ended yet */
+typedef struct _StatsFrame {
+  StatsItem*item;  /* NULL if the call isn't being counted under an API */
+  ulong start_us;
+  ulong start_trips;
+  Window win;      /* the window the call is about */
+} StatsFrame;
+
+/* Calls nested deeper than this are only counted in the totals */
+#define STATS_DEPTH 16
 
-static char* get_prop_utf8(Display*disp, Window win, const char*what)
-{
-  Bool name_is_utf8 = True;
-  char*result=NULL;
-  char*tmp=get_prop(disp, win, GetUTF8Atom(), what, NULL);
-  if (!tmp) {
-    name_is_utf8 = False;
-    tmp = get_prop(disp, win, XA_STRING, what, NULL);
-  }
-  result=get_output_str(tmp, name_is_utf8);
-  sfree(tmp);
-  return result;
-}
 
 
+/* Bits for WinListItem.valid, saying which mirrored values are current */
+#define MIRROR_TITLE   (1 << 0)
+#define MIRROR_CLASS   (1 << 1)
+#define MIRROR_GEOM    (1 << 2)
+#define MIRROR_DESKTOP (1 << 3)
+#define MIRROR_STATE   (1 << 4)
+#define MIRROR_PID     (1 << 5)
+
 /*
-  Save the value of p, free p, and return the
-  saved value, or return ifnull if p is NULL.
+  One of these is kept for every client the event listener is watching.
+  When the mirror is turned on, it also holds the last values the getters
+  fetched for the window, until an event says they have changed.
 */
-static ulong ptr_to_ulong(ulong*p, ulong ifnull)
+typedef struct _WinListItem {
+  struct _WinListItem*next; /* next item in the same hash bucket */
+  Window win;
+  ulong generation;         /* last client list this window was seen in */
+  int valid;
+  char*title;
+  char*class_name;
+  Geometry geom;
+  long desktop;
+  ulong state;
+  ulong pid;
+  Bool configure_pending;   /* a MOVE_RESIZE is being held back */
+  ulong configure_time;     /* when the last MOVE_RESIZE was delivered */
+  Geometry configure_geom;  /* from the latest ConfigureNotify */
+  Bool configure_root;      /* configure_geom is relative to the root */
+  XPoint parent_pos;        /* where the window sits in its parent (frame) */
+  Bool parent_pos_valid;
+} WinListItem;
+
+
+
+/* The set of clients being watched, hashed on the window id. */
+typedef struct _WinSet {
+  WinListItem**buckets;
+  ulong size;  /* always a power of two */
+  int bits;    /* log2(size) */
+  ulong count;
+  ulong pending; /* items with configure_pending set */
+} WinSet;
+
+#define WINSET_MIN_SIZE 64
+
+/*
+  Window ids are a client's base id with a small counter in the low bits,
+  so the bucket is taken from the top bits of a 32-bit multiplicative hash,
+  which depend on every bit of the id, rather than from the low bits.
+*/
+#define WinSetHash(set,win) ((ulong)((uint32_t)((uint32_t)(win)*2654435761U)>>(32-(set)->bits)))
+
+
+
+static WinListItem*winset_find(WinSet*set, Window win)
 {
-  if (p) {
-    ulong rv=*p;
-    free(p);
-    return rv;
-  } else {
-    return ifnull;
+  WinListItem*p;
+  if (!set->buckets) { return NULL; }
+  for (p=set->buckets[WinSetHash(set,win)]; p; p=p->next) {
+    if (p->win==win) { return p; }
   }
+  return NULL;
 }
 
 
 
-XCTRL_API Window supporting_wm_check(Display*disp)
+static void winset_grow(WinSet*set)
 {
-  Window *p=(Window*)get_prop(disp, DefRootWin, XA_WINDOW, "_NET_SUPPORTING_WM_CHECK", NULL);
-  if (!p) {
-    p=(Window*)get_prop(disp, DefRootWin, XA_CARDINAL, "_WIN_SUPPORTING_WM_CHECK", NULL);
+  ulong newsize=set->size?set->size*2:WINSET_MIN_SIZE;
+  WinListItem**old=set->buckets;
+  ulong oldsize=set->size;
+  ulong i;
+  WinListItem**buckets=(WinListItem**)calloc(newsize,sizeof(WinListItem*));
+  if (!buckets) { return; }
+  set->buckets=buckets;
+  set->size=newsize;
+  for (set->bits=0; (1UL<<set->bits)<newsize; set->bits++) { }
+  for (i=0; i<oldsize; i++) {
+    WinListItem*p=old[i];
+    while (p) {
+      WinListItem*n=p->next;
+      ulong h=WinSetHash(set,p->win);
+      p->next=set->buckets[h];
+      set->buckets[h]=p;
+      p=n;
+    }
   }
-  return (Window)ptr_to_ulong((ulong*)p,0);
+  sfree(old);
 }
 
 
 
-XCTRL_API char* get_wm_name(Display*disp)
+static WinListItem*winset_add(WinSet*set, Window win)
 {
-  Window win = supporting_wm_check(disp);
-  return win?get_prop_utf8(disp, win, "_NET_WM_NAME"):NULL;
+  WinListItem*t;
+  ulong h;
+  if (set->count>=set->size) { winset_grow(set); }
+  if (!set->buckets) { return NULL; }
+  t=(WinListItem*)calloc(1,sizeof(WinListItem));
+  if (!t) { return NULL; }
+  t->win=win;
+  h=WinSetHash(set,win);
+  t->next=set->buckets[h];
+  set->buckets[h]=t;
+  set->count++;
+  return t;
 }
 
 
 
-XCTRL_API char* get_wm_class(Display*disp)
+/* Unlink an item from the set; the caller frees it. */
+static void winset_unlink(WinSet*set, WinListItem*item)
 {
-  Window win = supporting_wm_check(disp);
-  return win?get_prop_utf8(disp, win, "WM_CLASS"):NULL;
+  WinListItem**pp=&set->buckets[WinSetHash(set,item->win)];
+  while (*pp) {
+    if (*pp==item) {
+      *pp=item->next;
+      set->count--;
+      if (item->configure_pending) { set->pending--; }
+      return;
+    }
+    pp=&(*pp)->next;
+  }
 }
 
 
-
-XCTRL_API ulong get_wm_pid(Display*disp)
+#define BITS_PER_LONG (8*sizeof(ulong))
+
+typedef struct _XCtrlContext {
+  Display*disp;
+  Atom atoms[ATOM_COUNT];
+  AtomCacheItem*extra_atoms;
+  /* Which of atoms[] have been asked for. Xlib remembers the atoms it has
+     interned, so only the first lookup of each would have gone to the server. */
+  ulong atoms_used[(ATOM_COUNT+BITS_PER_LONG-1)/BITS_PER_LONG];
+  ulong atoms_used_count;
+  /* Cached copy of the root window's _NET_SUPPORTED list */
+  Bool supported_valid;
+  ulong supported_bits[(ATOM_COUNT+BITS_PER_LONG-1)/BITS_PER_LONG];
+  Atom*supported;
+  ulong supported_count;
+  ulong supported_ms; /* when it was read */
+  Bool listening;    /* the event loop is consuming root events for us */
+  WinSet winlist;
+  Bool mirror;
+  struct _Listener*listener; /* set while the event listener is running */
+  Bool mirror_live;        /* the listener is selecting what the mirror needs */
+  ulong listen_ignore;     /* XCTRL_EVENT_MASK() bits the next listener should skip */
+  Window listen_window;    /* if set, the next listener only watches this client */
+  FILE*listen_record;      /* if set, the next listener records to this */
+  Bool charset_set;        /* use the settings below instead of init_charset()'s */
+  Bool utf8;
+  char*charset;
+  int coalesce_ms;         /* minimum time between MOVE_RESIZE events per window */
+  ulong events_dropped;    /* ConfigureNotify events coalesced away */
+  IconvItem*iconv_cache;
+  Scratch prop_buf;        /* working memory for the *_into() getters */
+  Scratch text_buf;
+  Arena arena;             /* working memory for xctrl_snapshot() */
+  Bool stats_on;
+  XCtrlStats stats;        /* totals for the display */
+  StatsItem*stats_apis;    /* per-API counters, see xctrl_stats_begin() */
+  StatsFrame stats_stack[STATS_DEPTH]; /* the API calls being counted */
+  int stats_depth;         /* may be more than STATS_DEPTH */
+  TraceItem*trace;         /* ring buffer of the last trace_size calls */
+  ulong trace_size;
+  ulong trace_next;        /* total number of items ever written */
+#ifdef XCTRL_USE_XCB
+  unsigned int stats_sent;   /* the last request sent through XCB */
+  unsigned int stats_waited; /* what had been sent when a reply was last waited for */
+#endif
+} XCtrlContext;
+
+
+typedef struct _Listener Listener;
+
+static void listener_free(XCtrlContext*ctx);
+static void stats_free(XCtrlContext*ctx);
+static void stats_set_active(XCtrlContext*ctx, Bool stats_on, ulong trace_size);
+static Bool listener_mirror_ok(XCtrlContext*ctx);
+
+
+
+static void context_free(XCtrlContext*ctx)
 {
-  Window win = supporting_wm_check(disp);
-  if (win) {
-    ulong *wm_pid = get_uprop(win, "_NET_WM_PID", NULL);
-    return ptr_to_ulong(wm_pid, 0);
-  } else {
-    return 0;
+  AtomCacheItem*p=ctx->extra_atoms;
+  while (p) {
+    AtomCacheItem*n=p->next;
+    free(p->name);
+    free(p);
+    p=n;
   }
+  sfree(ctx->supported);
+  listener_free(ctx);
+  if (ctx->listen_record) { fclose(ctx->listen_record); }
+  sfree(ctx->charset);
+  convert_cache_free(ctx->iconv_cache);
+  sfree(ctx->prop_buf.data);
+  sfree(ctx->text_buf.data);
+  arena_free(&ctx->arena);
+  stats_set_active(ctx, False, False);
+  stats_free(ctx);
+  free(ctx);
 }
 
 
 
-XCTRL_API int get_showing_desktop(Display*disp)
+/*
+  Each display's context hangs off the display's own extension data, so
+  finding it never takes a global lock, and Xlib frees it through
+  free_private from XCloseDisplay(), so it never outlives its display.
+  Real extensions are numbered from zero up, so this can't clash with one.
+*/
+#define CONTEXT_EXT_NUMBER 0x78637472
+
+static int context_free_ext(XExtData*ext)
 {
-  ulong *p=get_uprop(DefRootWin, "_NET_SHOWING_DESKTOP", NULL);
-  return ptr_to_ulong(p,-1);
+  context_free((XCtrlContext*)ext->private_data);
+  return 0;
 }
 
 
 
-XCTRL_API int set_showing_desktop(Display*disp, ulong state)
+static XCtrlContext*find_context(Display*disp)
 {
-  return client_msg(disp, DefRootWin, "_NET_SHOWING_DESKTOP", state, 0, 0, 0, 0);
+  XEDataObject obj;
+  XExtData*ext;
+  obj.display=disp;
+  ext=XFindOnExtensionList(XEHeadOfExtensionList(obj), CONTEXT_EXT_NUMBER);
+  return ext?(XCtrlContext*)ext->private_data:NULL;
 }
 
 
 
-XCTRL_API int change_viewport(Display*disp, ulong x, ulong y) {
-  return client_msg(disp, DefRootWin, "_NET_DESKTOP_VIEWPORT", x, y, 0, 0, 0);
+static XCtrlContext*get_context(Display*disp)
+{
+  XCtrlContext*ctx=find_context(disp);
+  XCtrlContext*other;
+  XEDataObject obj;
+  XExtData*ext;
+  if (ctx) { return ctx; }
+  ctx=(XCtrlContext*)calloc(1,sizeof(XCtrlContext));
+  ext=(XExtData*)calloc(1,sizeof(XExtData)); /* freed by Xlib */
+  if (!(ctx && ext && XInternAtoms(disp,atom_names,ATOM_COUNT,False,ctx->atoms))) {
+    sfree(ctx);
+    sfree(ext);
+    return NULL;
+  }
+  ctx->disp=disp;
+  ext->number=CONTEXT_EXT_NUMBER;
+  ext->private_data=(XPointer)ctx;
+  ext->free_private=context_free_ext;
+  obj.display=disp;
+  XLockDisplay(disp); /* in case another thread got here first */
+  other=find_context(disp);
+  if (!other) { XAddToExtensionList(XEHeadOfExtensionList(obj), ext); }
+  XUnlockDisplay(disp);
+  if (other) {
+    free(ext);
+    free(ctx);
+    return other;
+  }
+  return ctx;
 }
 
 
 
-XCTRL_API int change_geometry(Display*disp, ulong x, ulong y) {
-  return client_msg(disp, DefRootWin, "_NET_DESKTOP_GEOMETRY", x, y, 0, 0, 0);
+/*
+  When enabled, the wrappers below count what each call costs. The totals
+  are kept per display, and also per API between xctrl_stats_begin() and
+  xctrl_stats_end(). With tracing, each of those calls is also logged.
+  While no display has either one turned on, the wrappers only test
+  stats_displays.
+*/
+static int stats_displays=0;
+
+#ifdef XCTRL_THREADS
+/* Read by every wrapper on every thread, so it is atomic rather than locked */
+# define StatsActive() (__atomic_load_n(&stats_displays, __ATOMIC_RELAXED)>0)
+# define StatsDisplaysAdd(n) __atomic_add_fetch(&stats_displays, (n), __ATOMIC_RELAXED)
+#else
+# define StatsActive() (stats_displays>0)
+# define StatsDisplaysAdd(n) (stats_displays+=(n))
+#endif
+
+static XCtrlContext*stats_context(Display*disp)
+{
+  XCtrlContext*ctx;
+  if (!StatsActive()) { return NULL; }
+  ctx=get_context(disp);
+  return (ctx && (ctx->stats_on||ctx->trace))?ctx:NULL;
 }
 
 
 
-XCTRL_API int set_number_of_desktops(Display*disp, ulong n)
+static void stats_set_active(XCtrlContext*ctx, Bool stats_on, ulong trace_size)
 {
-  return client_msg(disp, DefRootWin, "_NET_NUMBER_OF_DESKTOPS", n, 0, 0, 0, 0);
+  Bool was=ctx->stats_on||ctx->trace;
+  TraceItem*trace=NULL;
+  if (trace_size!=ctx->trace_size) {
+    if (trace_size) {
+      trace=(TraceItem*)calloc(trace_size,sizeof(TraceItem));
+      if (!trace) { trace_size=0; }
+    }
+    sfree(ctx->trace);
+    ctx->trace=trace;
+    ctx->trace_size=trace_size;
+    ctx->trace_next=0;
+  }
+  ctx->stats_on=stats_on;
+  if (was!=(stats_on||ctx->trace)) {
+    StatsDisplaysAdd(was?-1:1);
+  }
+  ctx->stats_depth=0;
 }
 
 
 
-XCTRL_API long get_number_of_desktops(Display*disp)
+/* The innermost call being counted, or NULL */
+static StatsFrame*stats_top(XCtrlContext*ctx)
 {
-  ulong *p;
-  p = get_uprop(DefRootWin, "_NET_NUMBER_OF_DESKTOPS", NULL);
-  if (!p) {
-    p = get_uprop(DefRootWin, "_WIN_WORKSPACE_COUNT", NULL);
-  }
-  return ptr_to_ulong(p,-1);
+  if (ctx->stats_depth<1 || ctx->stats_depth>STATS_DEPTH) { return NULL; }
+  return &ctx->stats_stack[ctx->stats_depth-1];
 }
 
 
 
-XCTRL_API int set_current_desktop(Display*disp, ulong target) {
-  return client_msg(disp, DefRootWin, "_NET_CURRENT_DESKTOP", target, 0, 0, 0, 0);
+static TraceItem*trace_add(XCtrlContext*ctx, const char*name, Window win, ulong round_trips, ulong begin_us, ulong end_us)
+{
+  TraceItem*t=&ctx->trace[ctx->trace_next%ctx->trace_size];
+  t->name=name;
+  t->in=NULL;
+  t->win=win;
+  t->round_trips=round_trips;
+  t->begin_us=begin_us;
+  t->end_us=end_us;
+  ctx->trace_next++;
+  return t;
 }
 
 
 
-XCTRL_API long get_current_desktop(Display*disp)
+/* Add to the totals, and to the innermost API call being counted. */
+static void stats_add(XCtrlContext*ctx, ulong requests, ulong round_trips, ulong reply_bytes, ulong alloc_bytes, ulong wait_us)
 {
-  ulong *p;
-  p = get_uprop(DefRootWin, "_NET_CURRENT_DESKTOP", NULL);
-  if (!p) {
-    p = get_uprop(DefRootWin, "_WIN_WORKSPACE", NULL);
+  StatsFrame*top=stats_top(ctx);
+  XCtrlStats*st=&ctx->stats;
+  for (;;) {
+    st->requests+=requests;
+    st->round_trips+=round_trips;
+    st->reply_bytes+=reply_bytes;
+    st->alloc_bytes+=alloc_bytes;
+    st->wait_us+=wait_us;
+    if (!top || !top->item || st==&top->item->stats) { break; }
+    st=&top->item->stats;
   }
-  return (signed long)ptr_to_ulong(p,-1);
 }
 
 
 
-static void replace_prop(Display*disp, Window win, Atom what, Atom type, char*newval)
+/*
+  For requests the wrappers below don't cover. "start" is when the caller
+  began waiting for the replies, or 0 if it didn't wait.
+*/
+static void stats_count(Display*disp, ulong requests, ulong round_trips, ulong reply_bytes, ulong start)
 {
-  XChangeProperty(disp,win,what,type,8,PropModeReplace,(unsigned char*)newval,strlen(newval));
+  XCtrlContext*ctx=stats_context(disp);
+  if (ctx) { stats_add(ctx, requests, round_trips, reply_bytes, 0, start?now_us()-start:0); }
 }
 
 
 
-XCTRL_API void set_window_title(Display*disp, Window win, const char*title, char mode) {
-  char *title_utf8;
-  char *title_local;
-  Atom utf8_atom = GetUTF8Atom();
-  if (envir_utf8) {
-    title_utf8 = strdup(title);
-    title_local = NULL;
-  } else {
-    title_utf8 = locale_to_utf8(title);
-    if (!title_utf8) { title_utf8 = strdup(title); }
-    title_local = strdup(title);
-  }
-  if (mode == 'T' || mode == 'N') {
-    if (title_local) {
-      replace_prop(disp, win, XA_WM_NAME, XA_STRING,title_local);
-    } else {
-      XDeleteProperty(disp, win, XA_WM_NAME);
-    }
-    replace_prop(disp, win, XInternAtom(disp,"_NET_WM_NAME",False), utf8_atom, title_utf8);
-  }
-  if (mode == 'T' || mode == 'I') {
-    if (title_local) {
-      replace_prop(disp, win, XA_WM_ICON_NAME, XA_STRING, title_local);
-    } else {
-      XDeleteProperty(disp, win, XA_WM_ICON_NAME);
-    }
-    replace_prop(disp, win, XInternAtom(disp, "_NET_WM_ICON_NAME", False), utf8_atom, title_utf8);
-  }
-  sfree(title_utf8);
-  sfree(title_local);
+static void stats_alloc(Display*disp, ulong bytes)
+{
+  XCtrlContext*ctx=stats_context(disp);
+  if (ctx) { stats_add(ctx, 0, 0, 0, bytes, 0); }
 }
 
 
 
-XCTRL_API int send_window_to_desktop(Display*disp, Window win, int desktop) {
-  return client_msg(disp, win, "_NET_WM_DESKTOP", (ulong)desktop, 0, 0, 0, 0);
+static int stats_get_property(Display*disp, Window w, Atom property, long offset, long length,
+  Bool del, Atom req_type, Atom*actual_type, int*format, ulong*nitems, ulong*after, uchar**prop)
+{
+  XCtrlContext*ctx=stats_context(disp);
+  ulong start=ctx?now_us():0;
+  int rv=XGetWindowProperty(disp,w,property,offset,length,del,req_type,actual_type,format,nitems,after,prop);
+  if (ctx) {
+    ulong bytes=(rv==Success && *format)?(*nitems)*(*format/8):0;
+    stats_add(ctx, 1, 1, bytes, 0, now_us()-start);
+  }
+  return rv;
 }
 
 
 
-XCTRL_API Bool activate_window(Display*disp, Window win, Bool switch_desk) {
-  if (switch_desk) {
-    long desktop = get_desktop_of_window(disp,win);
-    if (desktop>=0) {
-      if (desktop!=get_current_desktop(disp)) {
-        set_current_desktop(disp, desktop);
-      }
-    }
-  }
-  client_msg(disp, win, "_NET_ACTIVE_WINDOW", 2, 0, 0, 0, 0);
-  XSetInputFocus(disp, win, RevertToNone, CurrentTime);
-  XMapRaised(disp, win);
-  return True;
+static Status stats_send_event(Display*disp, Window w, Bool propagate, long mask, XEvent*ev)
+{
+  XCtrlContext*ctx=stats_context(disp);
+  if (ctx) { stats_add(ctx, 1, 0, 0, 0, 0); }
+  return XSendEvent(disp, w, propagate, mask, ev);
 }
 
 
 
-XCTRL_API Bool iconify_window(Display*disp, Window win)
+static void stats_sync(Display*disp)
 {
-  return XIconifyWindow(disp, win, DefaultScreen(disp))?True:False;
+  XCtrlContext*ctx=stats_context(disp);
+  ulong start=ctx?now_us():0;
+  XSync(disp, False);
+  if (ctx) {
+    ulong end=now_us();
+    StatsFrame*top=stats_top(ctx);
+    stats_add(ctx, 1, 1, 0, 0, end-start);
+    if (ctx->trace && top && top->item) {
+      trace_add(ctx, "XSync", top->win, 1, start, end)->in=top->item->api;
+    } else if (ctx->trace) {
+      trace_add(ctx, "XSync", None, 1, start, end);
+    }
+  }
 }
 
 
 
-XCTRL_API Window get_active_window(Display*disp) {
-  Window*win = (Window*)get_prop(disp, DefRootWin, XA_WINDOW, "_NET_ACTIVE_WINDOW", NULL);
-  return (Window) ptr_to_ulong((ulong*)win,0);
+static Atom stats_intern_atom(Display*disp, const char*name)
+{
+  XCtrlContext*ctx=stats_context(disp);
+  ulong start=ctx?now_us():0;
+  Atom a=XInternAtom(disp, name, False);
+  if (ctx) { stats_add(ctx, 1, 1, 0, 0, now_us()-start); }
+  return a;
 }
 
 
 
-XCTRL_API int close_window(Display*disp, Window win) {
-  return client_msg(disp, win, "_NET_CLOSE_WINDOW", 0, 0, 0, 0, 0);
+static void stats_free(XCtrlContext*ctx)
+{
+  StatsItem*p=ctx->stats_apis;
+  while (p) {
+    StatsItem*n=p->next;
+    free(p->api);
+    free(p);
+    p=n;
+  }
+  ctx->stats_apis=NULL;
+  ctx->stats_depth=0;
 }
 
 
 
-static ulong wm_state_atom(Display*disp, const char*prop) {
-  Atom atom=0;
-  char tmp_prop[64];
-  char*p;
-  memset(tmp_prop,0,sizeof(tmp_prop));
-  strcpy(tmp_prop, "_NET_WM_STATE_");
-  strncat(tmp_prop,prop,(sizeof(tmp_prop)-strlen(tmp_prop))-1);
-  for (p=tmp_prop; *p; p++) {
-    if (((signed char)*p)>0) { *p=toupper(*p); }
-  }
-  atom = XInternAtom(disp, tmp_prop, False);
-  return (ulong)atom;
+XCTRL_API void xctrl_set_stats(Display*disp, Bool enable)
+{
+  XCtrlContext*ctx=get_context(disp);
+  if (ctx) { stats_set_active(ctx, enable, ctx->trace_size); }
 }
 
 
 
-XCTRL_API int set_window_state(Display*disp, Window win, ulong action, const char*p1, const char*p2)
+/*
+  Keep the last "size" calls made between xctrl_stats_begin() and _end(),
+  plus every XSync(), for xctrl_trace_dump(). Zero turns tracing off.
+*/
+XCTRL_API Bool xctrl_set_trace(Display*disp, ulong size)
 {
-  ulong xa_prop1=p1?wm_state_atom(disp,p1):0;
-  ulong xa_prop2=p2?wm_state_atom(disp,p2):0;
-  return client_msg(disp,win,"_NET_WM_STATE",action,xa_prop1,xa_prop2, 0, 0);
+  XCtrlContext*ctx=get_context(disp);
+  if (!ctx) { return False; }
+  stats_set_active(ctx, ctx->stats_on, size);
+  return (ctx->trace_size==size);
 }
 
 
 
-XCTRL_API Bool wm_supports(Display*disp, const char*prop) {
-  Atom xa_prop = XInternAtom(disp, prop, False);
-  ulong size=0;
+/*
+  Zero the counters. The per-API records are kept, since a call that is
+  being counted (such as the one doing the reset) still points at its own,
+  and calls still open count from here on.
+*/
+XCTRL_API void xctrl_reset_stats(Display*disp)
+{
+  XCtrlContext*ctx=get_context(disp);
+  StatsItem*p;
   int i;
-  Atom *list=(Atom*)get_prop(disp, DefRootWin, XA_ATOM, "_NET_SUPPORTED", &size);
-  if (!list) { return False; }
-  for (i = 0; i < size; i++) {
-    if (list[i] == xa_prop) {
-      free(list);
-      return True;
-    }
+  if (!ctx) { return; }
+  for (p=ctx->stats_apis; p; p=p->next) { memset(&p->stats, 0, sizeof(XCtrlStats)); }
+  memset(&ctx->stats, 0, sizeof(XCtrlStats));
+  for (i=0; (i<ctx->stats_depth) && (i<STATS_DEPTH); i++) {
+    ctx->stats_stack[i].start_trips=0;
+    ctx->stats_stack[i].start_us=now_us();
   }
-  free(list);
-  return False;
+  ctx->trace_next=0;
 }
 
 
-XCTRL_API char*get_window_type(Display*disp, Window win)
+
+static StatsItem*stats_find(XCtrlContext*ctx, const char*api)
 {
-  static const char*shortnames[]={
-    "desktop",
-    "dock",
-    "toolbar",
-    "menu",
-    "utility",
-    "splash",
-    "dialog",
-    "normal"
-  };
-  const char*type="unsupported";
-  if (wm_supports(disp,"_NET_WM_WINDOW_TYPE")) {
-    ulong size=0;
-    Atom*atom=NULL;
-    static Atom wintypes[8]={0,0,0,0,0,0,0,0};
-    if (wintypes[0]==0) {
-      static char*netnames[]={
-      "_NET_WM_WINDOW_TYPE_DESKTOP",
-      "_NET_WM_WINDOW_TYPE_DOCK",
-      "_NET_WM_WINDOW_TYPE_TOOLBAR",
-      "_NET_WM_WINDOW_TYPE_MENU",
-      "_NET_WM_WINDOW_TYPE_UTILITY",
-      "_NET_WM_WINDOW_TYPE_SPLASH",
-      "_NET_WM_WINDOW_TYPE_DIALOG",
-      "_NET_WM_WINDOW_TYPE_NORMAL"
-      };
-      if (!XInternAtoms(disp,netnames,8,False,wintypes)) {
-        return strdup(type);
-      }
-    }
-    type="";
-    atom=(Atom*)get_prop(disp, win,XA_ATOM,"_NET_WM_WINDOW_TYPE",&size);
-    if (atom) {
-      int i;
-      for (i=0; i<8;i++) {
-        if (*atom==wintypes[i]) {
-          type=shortnames[i];
-          break;
-        }
-      }
-      sfree(atom);
-    }
-    if (type[0]=='\0') {
-      Window tw=0;
-      if (XGetTransientForHint(disp, win, &tw)) { 
-        type="dialog";
-      } else { type="normal"; }
-    }
+  StatsItem*p;
+  for (p=ctx->stats_apis; p; p=p->next) {
+    if (strcmp(p->api,api)==0) { return p; }
   }
-  return strdup(type);
+  p=(StatsItem*)calloc(1,sizeof(StatsItem));
+  if (!p) { return NULL; }
+  p->api=strdup(api);
+  if (!p->api) {
+    free(p);
+    return NULL;
+  }
+  p->next=ctx->stats_apis;
+  ctx->stats_apis=p;
+  return p;
 }
 
 
 
-typedef struct {
-  unsigned long flags;
-  unsigned long functions;
-  unsigned long decorations;
-  long inputmode;
-  unsigned long status;
-} MotifHints;
+/*
+  Count everything up to the matching xctrl_stats_end() under "api" as
+  well. Calls may nest, for instance from a listener's callback; what is
+  sent to the server counts towards the innermost one.
+*/
+XCTRL_API void xctrl_stats_begin(Display*disp, const char*api)
+{
+  XCtrlContext*ctx=stats_context(disp);
+  StatsFrame*f;
+  if (!ctx) { return; }
+  ctx->stats_depth++; /* even if it can't be counted, so that _end() matches */
+  f=stats_top(ctx);
+  if (!f) { return; }
+  f->item=api?stats_find(ctx, api):NULL;
+  f->win=None;
+  f->start_trips=ctx->stats.round_trips;
+  f->start_us=now_us();
+}
 
 
 
-XCTRL_API void set_window_mwm_hints(Display*disp, Window win, ulong flags, ulong funcs, ulong decors, ulong imode)
+/* Note the window the current call is about, for the trace. */
+XCTRL_API void xctrl_stats_window(Display*disp, Window win)
 {
-  Atom atom=0;
-  MotifHints hints;
-  hints.flags=flags;
-  hints.functions=funcs;
-  hints.decorations=decors;
-  hints.inputmode=imode;
-  hints.status=0;
-  if (!atom) { atom=XInternAtom(disp, "_MOTIF_WM_HINTS", False); }
-  XChangeProperty(disp,win,atom,atom,32,PropModeReplace,(unsigned char*)&hints,4);
+  XCtrlContext*ctx=stats_context(disp);
+  StatsFrame*f=ctx?stats_top(ctx):NULL;
+  if (f) { f->win=win; }
 }
 
 
 
-XCTRL_API void get_window_geom(Display*disp, Window win, Geometry*geom)
+XCTRL_API void xctrl_stats_end(Display*disp)
 {
-  int x, y;
-  unsigned int bw, depth;
-  Window root;
-  memset(geom,0,sizeof(Geometry));
-  XGetGeometry(disp, win, &root, &x, &y, &geom->w, &geom->h, &bw, &depth);
-  XTranslateCoordinates(disp, win, root, x, y, &geom->x, &geom->y, &root);
+  XCtrlContext*ctx=stats_context(disp);
+  StatsFrame*f;
+  ulong end;
+  ulong elapsed;
+  if (!ctx || ctx->stats_depth<1) { return; }
+  f=stats_top(ctx);
+  ctx->stats_depth--;
+  if (!f) { return; }
+  end=now_us();
+  elapsed=end-f->start_us;
+  if (f->item) {
+    if (ctx->trace) {
+      trace_add(ctx, f->item->api, f->win, ctx->stats.round_trips-f->start_trips, f->start_us, end);
+    }
+    f->item->stats.calls++;
+    f->item->stats.time_us+=elapsed;
+  }
+  ctx->stats.calls++;
+  if (ctx->stats_depth==0) { ctx->stats.time_us+=elapsed; } /* nested calls are inside it */
 }
 
 
 
-XCTRL_API Bool get_window_frame(Display*disp, Window win, long*left, long*right, long*top, long*bottom)
+/* Copy the totals, or the counters for "api" if it isn't NULL. */
+XCTRL_API Bool xctrl_get_stats(Display*disp, const char*api, XCtrlStats*stats)
 {
-  if (wm_supports(disp, "_NET_FRAME_EXTENTS")) {
-    ulong size=0;
-    ulong*extents=get_uprop(win,"_NET_FRAME_EXTENTS",&size);
-    *left=*right=*top=*bottom=-1;
-    if (extents) {
-      *left=extents[0];
-      *right=extents[1];
-      *top=extents[2];
-      *bottom=extents[3];
-      sfree(extents);
+  XCtrlContext*ctx=get_context(disp);
+  StatsItem*p;
+  if (!ctx) { return False; }
+  if (!api) {
+    *stats=ctx->stats;
+    return True;
+  }
+  for (p=ctx->stats_apis; p; p=p->next) {
+    if (strcmp(p->api,api)==0) {
+      *stats=p->stats;
       return True;
     }
   }
@@ -640,1022 +1292,3670 @@ XCTRL_API Bool get_window_frame(Display*disp, Window win, long*left, long*right,
 
 
 
-XCTRL_API int set_window_geom(Display*disp, Window win, long grav, long flags, long x, long y, long w, long h)
+/*
+  Write the trace as Chrome trace-event JSON, which chrome://tracing and
+  Perfetto can load. Returns the number of events written, or -1.
+*/
+XCTRL_API long xctrl_trace_dump(Display*disp, const char*path)
 {
-  if (wm_supports(disp, "_NET_MOVERESIZE_WINDOW")) {
-    return client_msg( disp, win, "_NET_MOVERESIZE_WINDOW",
-                       grav|flags, (ulong)x, (ulong)y, (ulong)w, (ulong)h);
-  } else {
-    Bool move=False;
-    Bool size=False;
-    Geometry geom;
-    get_window_geom(disp,win,&geom);
-    if (flags&(XCTRL_GEOM_USE_X|XCTRL_GEOM_USE_Y)) {
-      move=True;
-      if (!(flags&XCTRL_GEOM_USE_X)) { x=geom.x; }
-      if (!(flags&XCTRL_GEOM_USE_Y)) { y=geom.y; }
-    }
-    if (flags&(XCTRL_GEOM_USE_W|XCTRL_GEOM_USE_H)) {
-      size=True;
-      if (!(flags&XCTRL_GEOM_USE_W)) { w=geom.w; }
-      if (!(flags&XCTRL_GEOM_USE_H)) { h=geom.h; }
-    }
-    if (size&&move) {
-      XMoveResizeWindow(disp, win, x, y, w, h);
-    } else if (size) {
-      XResizeWindow(disp, win, w, h);
-    } else if (move) {
-      XMoveWindow(disp, win, x, y); 
-    }
-    return True;
+  XCtrlContext*ctx=get_context(disp);
+  FILE*f;
+  ulong i;
+  long count=0;
+  if (!ctx || !ctx->trace) { return -1; }
+  f=fopen(path, "w");
+  if (!f) { return -1; }
+  fputs("{\"traceEvents\":[", f);
+  i=(ctx->trace_next>ctx->trace_size)?ctx->trace_next-ctx->trace_size:0;
+  for (; i<ctx->trace_next; i++) {
+    TraceItem*t=&ctx->trace[i%ctx->trace_size];
+    fprintf(f, "%s\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%lu,\"dur\":%lu,"
+      "\"args\":{\"win\":\"0x%lx\",\"round_trips\":%lu%s%s%s}}",
+      count?",":"", t->name, (int)getpid(), ConnectionNumber(disp), t->begin_us, t->end_us-t->begin_us,
+      t->win, t->round_trips, t->in?",\"in\":\"":"", t->in?t->in:"", t->in?"\"":"");
+    count++;
   }
+  fputs("\n]}\n", f);
+  if (fclose(f)!=0) { return -1; }
+  return count;
 }
 
 
 
-XCTRL_API Window *get_window_list(Display*disp, ulong*size)
+/* The name of the index'th API with counters, or NULL past the last one. */
+XCTRL_API const char*xctrl_stats_api(Display*disp, int index)
+{
+  XCtrlContext*ctx=get_context(disp);
+  StatsItem*p;
+  if (!ctx) { return NULL; }
+  for (p=ctx->stats_apis; p && index>0; p=p->next) { index--; }
+  return p?p->api:NULL;
+}
+
+
+
+static void atom_used(XCtrlContext*ctx, int id)
 {
-  Window *client_list;
-  client_list = (Window*)get_prop(disp, DefRootWin, XA_WINDOW, "_NET_CLIENT_LIST", size);
-  if (!client_list) {
-    client_list = (Window*)get_prop(disp, DefRootWin, XA_CARDINAL, "_WIN_CLIENT_LIST", size);
+  ulong bit=1UL<<(id%BITS_PER_LONG);
+  if (!(ctx->atoms_used[id/BITS_PER_LONG]&bit)) {
+    ctx->atoms_used[id/BITS_PER_LONG]|=bit;
+    ctx->atoms_used_count++;
   }
-  return client_list;
 }
 
 
 
-XCTRL_API char *get_window_class(Display*disp, Window win)
+static Atom get_atom(Display*disp, int id)
 {
-  char *class_utf8;
-  char *wm_class;
-  ulong size=0;
-  wm_class = get_prop(disp, win, XA_STRING, "WM_CLASS", &size);
-  if (wm_class) {
-    char *p_0 = strchr(wm_class, '\0');
-    if (wm_class + size - 1 > p_0) { *(p_0) = '.'; }
-    class_utf8 = locale_to_utf8(wm_class);
+  XCtrlContext*ctx=get_context(disp);
+  if (ctx) {
+    atom_used(ctx, id);
+    return ctx->atoms[id];
   } else {
-    class_utf8 = NULL;
+    return stats_intern_atom(disp, atom_names[id]);
   }
-  sfree(wm_class);
-  return class_utf8;
 }
 
 
 
-XCTRL_API char *get_window_title(Display*disp, Window win)
+/* Look up an atom by name, interning it (once) if it isn't already known. */
+XCTRL_API Atom xctrl_atom(Display*disp, const char*name)
 {
-  char *wm_name = get_prop(disp, win, GetUTF8Atom(), "_NET_WM_NAME", NULL);
-  if (wm_name) {
-    return wm_name;
-  } else {
-    char *title_utf8 = NULL;
-    wm_name = get_prop(disp, win, XA_STRING, "WM_NAME", NULL);
-    if (wm_name) {
-      title_utf8 = locale_to_utf8(wm_name);
-      free(wm_name);
-    } else {
-      title_utf8 = NULL;
+  XCtrlContext*ctx=get_context(disp);
+  AtomCacheItem*p;
+  int i;
+  if (!ctx) { return stats_intern_atom(disp, name); }
+  for (i=0; i<ATOM_COUNT; i++) {
+    if (strcmp(name,atom_names[i])==0) {
+      atom_used(ctx, i);
+      return ctx->atoms[i];
     }
-    return title_utf8;
   }
+  for (p=ctx->extra_atoms; p; p=p->next) {
+    if (strcmp(name,p->name)==0) { return p->atom; }
+  }
+  p=(AtomCacheItem*)calloc(1,sizeof(AtomCacheItem));
+  if (!p) { return stats_intern_atom(disp, name); }
+  p->name=strdup(name);
+  p->atom=stats_intern_atom(disp, name);
+  p->next=ctx->extra_atoms;
+  ctx->extra_atoms=p;
+  return p->atom;
 }
 
 
 
-static void pass_click_to_client(Display*disp, Window root, XEvent*event, int mask, Cursor cursor)
+XCTRL_API Bool xctrl_init(Display*disp)
 {
-  usleep(1000);
-  XSync(disp,False);
-  event->xbutton.window=event->xbutton.subwindow;
-  XSendEvent(disp, event->xbutton.subwindow, True, mask, event);
-  usleep(1000);
-  XSync(disp,False);
+  return get_context(disp)?True:False;
 }
 
 
-#define GrabMouse() ( \
-  XGrabPointer(disp,root,False,ButtonPressMask|ButtonReleaseMask, \
-    GrabModeSync,GrabModeAsync,root,cursor,CurrentTime) == GrabSuccess )
 
+/*
+  Like init_charset(), but only for this display, so that connections
+  with different settings can be used side by side.
+*/
+XCTRL_API void xctrl_set_charset(Display*disp, Bool force_utf8, const char*charset)
+{
+  XCtrlContext*ctx=get_context(disp);
+  if (!ctx) { return; }
+  sfree(ctx->charset);
+  ctx->utf8 = force_utf8?True:is_envar_utf8("LANG") || is_envar_utf8("LC_CTYPE");
+  ctx->charset = strdup(charset ? charset : getenv("CHARSET") ? getenv("CHARSET") : DEFAULT_CHARSET);
+  ctx->charset_set = (ctx->charset!=NULL);
+}
 
-/* Routine to let user select a window using the mouse adapted from xfree86. */
-XCTRL_API Window select_window(Display*disp, int button)
+
+
+static Bool display_utf8(Display*disp)
 {
-  Cursor cursor;
-  XEvent event;
-  Window target_win = None;
-  Window root = DefaultRootWindow(disp);
-  int buttons = 0;
-  int dumi;
-  unsigned int dum;
-  cursor = XCreateFontCursor(disp, XC_crosshair);
-  if (!GrabMouse()) {
-    XFreeCursor(disp,cursor);
-    return 0;
-  }
-  while ((target_win == None) || (buttons != 0)) {
-    XAllowEvents(disp, SyncPointer, CurrentTime);
-    XWindowEvent(disp, root, ButtonPressMask|ButtonReleaseMask, &event);
-    switch (event.type) {
-      case ButtonPress:
-        if ((button==-1)||(event.xbutton.button==button)) {
-          if (target_win == None) {
-            target_win = event.xbutton.subwindow; /* window selected */
-            if (target_win == None) target_win = root;
-          }
-        } else {
-          pass_click_to_client(disp,root,&event,ButtonPressMask,cursor);
-        }
-        buttons++;
-        break;
-      case ButtonRelease:
-        if (buttons > 0) { buttons--; }
-        if ((button!=-1)&&(event.xbutton.button!=button)) {
-          pass_click_to_client(disp,root,&event,ButtonReleaseMask,cursor);
-        }
-        break;
-    }
-  }
-  XUngrabPointer(disp, CurrentTime);
-  if (XGetGeometry(disp,target_win,&root,&dumi,&dumi,&dum,&dum,&dum,&dum)&&target_win!=root) {
-    target_win = XmuClientWindow(disp, target_win);
-  }
-  return(target_win);
+  XCtrlContext*ctx=get_context(disp);
+  return (ctx && ctx->charset_set)?ctx->utf8:envir_utf8;
 }
 
 
 
-XCTRL_API char* get_desktop_name(Display*disp, int desknum, Bool force_utf8)
+static char*display_to_utf8(Display*disp, const char*src)
 {
-  char *name_list = NULL;
-  ulong name_list_size = 0;
-  char *name = NULL;
-  Bool names_are_utf8 = True;
-  Window root = DefRootWin;
-  char*rv=NULL;
-  if (desknum<0) { return NULL; }
-  if (force_utf8) {
-    name_list = get_prop(disp, root, GetUTF8Atom(), "_NET_DESKTOP_NAMES", &name_list_size);
-  }
-  if (!name_list) {
-    names_are_utf8 = False;
-    name_list = get_prop(disp, root, XA_STRING, "_WIN_WORKSPACE_NAMES", &name_list_size);
-  }
-  if (name_list) {
-    if (desknum>0) {
-      int id=1;
-      char*p=name_list;
-      do {
-        p=strchr(p,'\0')+1;
-        if (id==desknum) {
-          name=p;
-          break;
-        }
-        id++;
-      } while (p<(name_list+name_list_size));
-    } else { name=name_list; }
-    if (name && *name) { rv = get_output_str(name, names_are_utf8); }
-    free(name_list);
+  XCtrlContext*ctx=get_context(disp);
+  if (ctx) {
+    return convert_cached(&ctx->iconv_cache, src, ctx->charset_set?ctx->charset:default_charset, "UTF-8");
   }
-  return rv;
+  return locale_to_utf8(src);
 }
 
 
 
-XCTRL_API int get_workarea_geom(Display*disp, Geometry*geom, int desknum)
+/*
+  Convert src to or from UTF-8, taking ownership of it. Text that reads the
+  same either way is handed back as it is instead of being copied. If the
+  conversion fails, src is returned if "keep" is set, or freed otherwise.
+*/
+static char*display_convert(Display*disp, char*src, Bool to_utf8, Bool keep)
 {
-  ulong *wkarea = NULL;
-  ulong wkarea_size = 0;
-  int rv=0;
-  if (desknum<0) { return 0; }
-  if (get_number_of_desktops(disp)<=desknum) { return 0; }
-  wkarea = get_uprop(DefRootWin, "_NET_WORKAREA", &wkarea_size);
-  if (!wkarea) {
-    wkarea = get_uprop(DefRootWin, "_WIN_WORKAREA", &wkarea_size);
+  XCtrlContext*ctx=get_context(disp);
+  IconvItem*p;
+  char*out;
+  if (!src) { return NULL; }
+  if (ctx) {
+    const char*charset=ctx->charset_set?ctx->charset:default_charset;
+    p=to_utf8?convert_lookup(&ctx->iconv_cache, charset, "UTF-8"):convert_lookup(&ctx->iconv_cache, "UTF-8", charset);
+    if (p && !convert_needed(src, p->ascii_safe, p->utf8_copy)) { return src; }
+    out=p?convert_iconv(p->cd, src, p->from):NULL;
+  } else {
+    out=to_utf8?locale_to_utf8(src):utf8_to_locale(src);
   }
-  if (wkarea && wkarea_size > 0) {
-    if (wkarea_size == (4*sizeof(*wkarea))) {
-      geom->x=wkarea[0];
-      geom->y=wkarea[1];
-      geom->w=wkarea[2];
-      geom->h=wkarea[3];
-      rv=1;
-    } else {
-      if (desknum < (wkarea_size/4)) {
-        geom->x=wkarea[desknum*4];
-        geom->y=wkarea[desknum*4+1];
-        geom->w=wkarea[desknum*4+2];
-        geom->h=wkarea[desknum*4+3];
-        rv=1;
-      }
-    }
-    sfree(wkarea);
+  if (out || !keep) {
+    free(src);
+    return out;
   }
-  return rv;
+  return src;
+}
+
+/* Like display_convert(), but leaves src alone and converts into sb if need be. */
+static const char*display_convert_buf(XCtrlContext*ctx, const char*src, Bool to_utf8, Scratch*sb)
+{
+  const char*charset=ctx->charset_set?ctx->charset:default_charset;
+  IconvItem*p=to_utf8?convert_lookup(&ctx->iconv_cache, charset, "UTF-8"):convert_lookup(&ctx->iconv_cache, "UTF-8", charset);
+  if (!p) { return NULL; }
+  if (!convert_needed(src, p->ascii_safe, p->utf8_copy)) { return src; }
+  return convert_iconv_buf(p->cd, src, p->from, sb);
 }
 
 
 
-XCTRL_API int get_desktop_geom(Display*disp, int desknum, Geometry*geom)
+/*
+  Copy str into buf the way the *_into() getters do: truncated to fit and
+  always terminated. Returns the full length, or -1 if str is NULL.
+*/
+static long copy_out(const char*str, char*buf, size_t size)
 {
-  ulong *desk_geom   =  NULL;
-  ulong geom_size = 0;
-  ulong *vport  = NULL;
-  ulong vport_size = 0;
-  int rv=0;
-  if (desknum<0) { return 0; }
-  if (get_number_of_desktops(disp)<=desknum) { return 0; }
-  desk_geom = get_uprop(DefRootWin, "_NET_DESKTOP_GEOMETRY", &geom_size);
-  vport = get_uprop(DefRootWin, "_NET_DESKTOP_VIEWPORT", &vport_size);
-  if (desk_geom && geom_size > 0) {
-    if (geom_size == 2 * sizeof(*desk_geom)) {
-      geom->w=desk_geom[0];
-      geom->h=desk_geom[1];
-    } else {
-      geom->w=desk_geom[desknum*2];
-      geom->h=desk_geom[desknum*2+1];
-    }
-    rv=1;
-  }
-  if (vport && vport_size > 0) {
-    if (vport_size == 2 * sizeof(*vport)) {
-      geom->x=vport[0];
-      geom->y=vport[1];
-    } else {
-      if (desknum < vport_size / sizeof(*vport) / 2) {
-        geom->x=vport[desknum*2];
-        geom->y=vport[desknum*2+1];
-      }
-    }
-    rv=1;
+  size_t len;
+  if (!str) { return -1; }
+  len=strlen(str);
+  if (buf && size) {
+    size_t n=(len<size)?len:size-1;
+    memcpy(buf, str, n);
+    buf[n]='\0';
   }
-  sfree(desk_geom);
-  sfree(vport);
-  return rv;
+  return len;
 }
 
 
 
-XCTRL_API long get_desktop_of_window(Display*disp, Window win)
+/* Copy a malloc'd value from one of the plain getters, and free it. */
+static long copy_out_free(char*str, char*buf, size_t size)
 {
-  ulong *p = get_uprop(win, "_NET_WM_DESKTOP", NULL);
-  if (!p) {
-    p = get_uprop(win, "_WIN_WORKSPACE", NULL);
-  }
-  return (signed long)ptr_to_ulong(p,-2);
+  long rv=copy_out(str, buf, size);
+  sfree(str);
+  return rv;
 }
 
+#define DisplayToUTF8(s) display_to_utf8(disp, s)
 
 
-XCTRL_API ulong get_win_pid(Display*disp, Window win)
+
+#ifdef XCTRL_THREADS
+
+/*********************************************************************/
+/* * * * * * * * * * * * *  Connection pool  * * * * * * * * * * * * */
+/*********************************************************************/
+
+/*
+  Xlib serialises all requests on a connection, so threads that share one
+  Display wait for each other. A pool hands each thread a connection of its
+  own, opening new ones on demand up to "size".
+*/
+struct _XCtrlPool {
+  char*dpyname;
+  int size;
+  int opened;
+  int idle;
+  Display**all;
+  Display**free_list; /* the first "idle" entries are available */
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+};
+
+
+
+XCTRL_API Bool xctrl_threads_init(void)
 {
-  ulong *p=get_uprop(win, "_NET_WM_PID", NULL);
-  return ptr_to_ulong(p,0);
+  return XInitThreads()?True:False;
 }
 
 
-XCTRL_API char*get_client_machine(Display *disp, Window win)
+
+XCTRL_API XCtrlPool*xctrl_pool_new(const char*dpyname, int size)
 {
-  return get_prop(disp, win, XA_STRING, "WM_CLIENT_MACHINE", NULL);
+  XCtrlPool*pool;
+  if (size<1) { return NULL; }
+  pool=(XCtrlPool*)calloc(1,sizeof(XCtrlPool));
+  if (!pool) { return NULL; }
+  pool->all=(Display**)calloc(size,sizeof(Display*));
+  pool->free_list=(Display**)calloc(size,sizeof(Display*));
+  if (!pool->all || !pool->free_list) {
+    sfree(pool->all);
+    sfree(pool->free_list);
+    free(pool);
+    return NULL;
+  }
+  if (dpyname) { pool->dpyname=strdup(dpyname); }
+  pool->size=size;
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->cond, NULL);
+  return pool;
 }
 
 
 
 /*
-  Send "fake" keystroke events to an X window.
-  Adapted from the (public domain) example by by Adam Pierce --
-    http://www.doctort.org/adam/nerd-notes/x11-fake-keypress-event.html
+  Take a connection from the pool, waiting for one to be returned if all
+  of them are in use. Returns NULL if a new connection can't be opened.
 */
-XCTRL_API void send_keystrokes(Display*disp, Window win, const char*keys)
+XCTRL_API Display*xctrl_pool_get(XCtrlPool*pool)
 {
-  Bool escaped=0;
-  const char* numkeys_upper="~!@#$%^&*()_+|";
-  const char* numkeys_lower="`1234567890-=\\";
-  int navkeys[]={XK_Insert,XK_End,XK_Down,XK_Page_Down,XK_Left,-1,XK_Right,XK_Home,XK_Up,XK_Page_Up};
-  int funkeys[]={XK_F1,XK_F2,XK_F3,XK_F4,XK_F5,XK_F6,XK_F7,XK_F8,XK_F9,XK_F10,XK_F11,XK_F12};
-  unsigned const char*p;
-  char*n;
-  XEvent ev;
-  memset(&ev.xkey,0,sizeof(XKeyEvent));
-  ev.xkey.subwindow=None;
-  ev.xkey.serial=1;
-  ev.xkey.display=disp;
-  ev.xkey.window=win;
-  ev.xkey.root=DefRootWin;
-  ev.xkey.same_screen=1;
-  for (p=(unsigned const char*)keys; *p; p++) {
-    int c;
-    switch (*p) {
-      case '\n':
-        c=XK_Return;
-        break;
-      case '\t':
-        c=XK_Tab;
-        break;
-      case '\033':
-        c=XK_Escape;
-        break;
-      case '\b':
-        c=XK_BackSpace;
-        break;
-      case '%':
-        if (!escaped) {
-          escaped=True;
-          continue;
-        } else {
-          c=*p;
-          break;
-        }
-      case '^':
-        if (!escaped) {
-          ev.xkey.state|=ControlMask;
-          continue;
-        }
-      case '~':
-        if (!escaped) {
-          ev.xkey.state|=Mod1Mask;
-          continue;
-        }
-      case '+':
-        if (!escaped) {
-          ev.xkey.state|=ShiftMask;
-          continue;
-        }
-      case 'f':
-      case 'F': {
-        int f;
-        if (escaped && p[1] && strchr("01", p[1]) && (p[2]>='0') && (p[2]<='9')) {
-          char num[3]={0,0,0};
-          if (p[1]=='1') {
-            strncpy(num,(char*)p+1,2);
-          } else {
-            num[0]=p[2];
-          }
-          f=atoi(num);
-          c= ((f>0)&&(f<13)) ? funkeys[f-1] : *p;
-          p+=2;
-        } else {
-          c=*p;
-        }
-        break;
-      }
-      case '.':
-        c=escaped?XK_Delete:*p;
-        break;
-      default:
-      c=*p;
-    }
-    n=strchr(numkeys_upper,c);
-    if (n) {
-      c=numkeys_lower[n-numkeys_upper];
-      ev.xkey.state|=ShiftMask;
-    } else {
-      if (escaped && (c>='0') && (c<='9') && (c!='5')) {
-        c=navkeys[c-48];
-      } else {
-        ev.xkey.state|=isupper(c)?ShiftMask:0;
-      }
+  Display*disp=NULL;
+  pthread_mutex_lock(&pool->lock);
+  while (pool->idle==0 && pool->opened==pool->size) {
+    pthread_cond_wait(&pool->cond, &pool->lock);
+  }
+  if (pool->idle>0) {
+    disp=pool->free_list[--pool->idle];
+  } else {
+    disp=XOpenDisplay(pool->dpyname);
+    if (disp) {
+      xctrl_init(disp);
+      pool->all[pool->opened++]=disp;
     }
-    ev.xkey.keycode=XKeysymToKeycode(disp,c);
-    ev.xkey.type=KeyPress;
-    XSendEvent(disp, win, True, KeyPressMask,&ev);
-    usleep(1000);
-    XSync(disp, False);
-    ev.xkey.time=CurrentTime;
-    ev.xkey.type=KeyRelease;
-    XSendEvent(disp, win, True, KeyPressMask,&ev);
-    usleep(1000);
-    XSync(disp, False);
-    ev.xkey.state=0;
-    escaped=False;
   }
+  pthread_mutex_unlock(&pool->lock);
+  return disp;
 }
 
-/*********************************************************************/
-/* * * * * * * * * Clipboard and selection functions * * * * * * * * */
-/*********************************************************************/
-#include <X11/Xmu/Atoms.h>
-/* xcout() contexts */
-#define XCLIB_XCOUT_NONE  0  /* no context */
-#define XCLIB_XCOUT_SENTCONVSEL  1  /* sent a request */
-#define XCLIB_XCOUT_INCR  2  /* in an incr loop */
-#define XCLIB_XCOUT_FALLBACK  3  /* UTF8_STRING failed, need fallback to XA_STRING */
 
-/* xcin() contexts */
-#define XCLIB_XCIN_NONE    0
-#define XCLIB_XCIN_INCR    2
 
-/* Retrieves the contents of a selections. Arguments are:
- *
- * A display that has been opened.
- * A window
- * An event to process
- * The selection to return
- * The target(UTF8_STRING or XA_STRING) to return
- * A pointer to a char array to put the selection into.
- * A pointer to a long to record the length of the char array
- * A pointer to an int to record the context in which to process the event
- * Returns ONE if retrieval of selection data is complete, or ZERO otherwise.
- */
-static int xcout(Display*dpy, Window win, XEvent evt, Atom sel, Atom trg, uchar**txt, ulong*len, uint*ctx)
+XCTRL_API void xctrl_pool_put(XCtrlPool*pool, Display*disp)
 {
-    static Atom prop; /* for other windows to put their selection into */
-    static Atom inc;
-    Atom prop_type;
-    Atom atomUTF8String;
-    int prop_fmt;
-    uchar *buffer;  /* buffer for XGetWindowProperty to dump data into */
-    ulong prop_size;
-    ulong prop_items;
-    uchar *ltxt = *txt;   /* local buffer of text to return */
+  pthread_mutex_lock(&pool->lock);
+  pool->free_list[pool->idle++]=disp;
+  pthread_cond_signal(&pool->cond);
+  pthread_mutex_unlock(&pool->lock);
+}
 
-    if (!prop) { prop = XInternAtom(dpy, "XCLIP_OUT", False); }
-    if (!inc) { inc = XInternAtom(dpy, "INCR", False); }
 
-    switch (*ctx) {
-      case XCLIB_XCOUT_NONE: { /* there is no context, do an XConvertSelection() */
-        if (*len > 0) {   /* initialise return length to 0 */
-          free(*txt);
-          *len = 0;
-        }
-        XConvertSelection(dpy, sel, trg, prop, win, CurrentTime);   /* send selection request */
-        *ctx = XCLIB_XCOUT_SENTCONVSEL;
-        return (0);
-      }
-      case XCLIB_XCOUT_SENTCONVSEL: {
-        atomUTF8String = XInternAtom(dpy, "UTF8_STRING", False);
-        if (evt.type != SelectionNotify)
-            return (0);
 
-        /* fallback to XA_STRING when UTF8_STRING failed */
-        if (trg == atomUTF8String && evt.xselection.property == None) {
-            *ctx = XCLIB_XCOUT_FALLBACK;
-            return (0);
-        }
+/* Closes every connection; none of them may still be in use. */
+XCTRL_API void xctrl_pool_free(XCtrlPool*pool)
+{
+  int i;
+  for (i=0; i<pool->opened; i++) { XCloseDisplay(pool->all[i]); }
+  pthread_mutex_destroy(&pool->lock);
+  pthread_cond_destroy(&pool->cond);
+  sfree(pool->dpyname);
+  free(pool->all);
+  free(pool->free_list);
+  free(pool);
+}
 
-        /* find the size and format of the data in property */
-        XGetWindowProperty( dpy, win, prop, 0, 0, False, AnyPropertyType,
-                              &prop_type, &prop_fmt, &prop_items, &prop_size, &buffer );
-        XFree(buffer);
+#endif
 
-        if (prop_type == inc) {
-          XDeleteProperty(dpy, win, prop);  /* start INCR mechanism by deleting property */
-          XFlush(dpy);
-          *ctx = XCLIB_XCOUT_INCR;
-          return (0);
-        }
 
-        /* if not incr, and not format == 8, it's nothing we understand anyway. */
-        if (prop_fmt != 8) {
-          *ctx = XCLIB_XCOUT_NONE;
-          return (0);
-        }
 
-        /* not using INCR mechanism, just read the property */
-        XGetWindowProperty( dpy, win, prop, 0, (long) prop_size, False, AnyPropertyType,
-                              &prop_type, &prop_fmt, &prop_items, &prop_size, &buffer );
+/*
+  Round trips saved by interning the library's atoms in one batch: one for
+  each of them that has been used, less the one the batch itself cost.
+*/
+XCTRL_API ulong xctrl_atom_trips_saved(Display*disp)
+{
+  XCtrlContext*ctx=get_context(disp);
+  return (ctx && ctx->atoms_used_count)?ctx->atoms_used_count-1:0;
+}
 
-        /* finished with property, delete it */
-        XDeleteProperty(dpy, win, prop);
 
-        /* copy the buffer to the pointer for returned data */
-        ltxt = (uchar*) malloc(prop_items);
-        memcpy(ltxt, buffer, prop_items);
 
-        /* set the length of the returned data */
-        *len = prop_items;
-        *txt = ltxt;
+/*
+  While the event listener is running, the getters for window properties
+  can answer from the listener's own records instead of asking the server.
+  A value is fetched once, then kept until a PropertyNotify (or for the
+  geometry, a ConfigureNotify) says it has changed.
+*/
+XCTRL_API void xctrl_set_mirror(Display*disp, Bool enable)
+{
+  XCtrlContext*ctx=get_context(disp);
+  if (ctx) {
+    ctx->mirror=enable;
+    ctx->mirror_live=enable && ctx->listener && listener_mirror_ok(ctx);
+  }
+}
 
-        /* free the buffer */
-        XFree(buffer);
 
-        *ctx = XCLIB_XCOUT_NONE;
 
-        /* complete contents of selection fetched, return 1 */
-        return (1);
-      }
-      case XCLIB_XCOUT_INCR: {
-        /* To use the INCR method, we delete the property with the selection in it,
-           wait for an event indicating that the property has been created,
-           then read it, delete it, etc. */
+/*
+  Tell the next listener to only deliver the events in "mask" (built from
+  XCTRL_EVENT_MASK() bits), and if "win" is not None, only the ones that
+  concern that window. X events are only requested for what is wanted.
+*/
+XCTRL_API void xctrl_listen_select(Display*disp, ulong mask, Window win)
+{
+  XCtrlContext*ctx=get_context(disp);
+  if (ctx) {
+    ctx->listen_ignore=XCTRL_EVENT_MASK_ALL&~mask;
+    ctx->listen_window=win;
+  }
+}
 
-        if (evt.type != PropertyNotify) { return (0); }
-        if (evt.xproperty.state != PropertyNewValue) { return (0); }
 
-        /* check size and format of the property */
-        XGetWindowProperty( dpy, win, prop, 0, 0, False, AnyPropertyType,
-                              &prop_type, &prop_fmt, &prop_items, &prop_size, &buffer );
 
-        if (prop_fmt != 8) {
-          /* property is not text, deleting tells other client to send next property */
-          XFree(buffer);
-          XDeleteProperty(dpy, win, prop);
-          return (0);
-        }
+/*
+  Deliver at most one MOVE_RESIZE event per window in each interval of
+  "interval_ms" milliseconds, keeping only the latest configure for each
+  window. Zero turns coalescing off.
+*/
+XCTRL_API void xctrl_set_coalesce(Display*disp, int interval_ms)
+{
+  XCtrlContext*ctx=get_context(disp);
+  if (ctx) { ctx->coalesce_ms=(interval_ms>0)?interval_ms:0; }
+}
 
-        if (prop_size == 0) { /* no more data, exit from loop */
-          XFree(buffer);
-          XDeleteProperty(dpy, win, prop);
-          *ctx = XCLIB_XCOUT_NONE;
-          return (1); /* INCR transfer completed */
-        }
-        XFree(buffer);
 
-        /* if we have come this far, the propery contains text, and we know the size. */
-        XGetWindowProperty( dpy, win, prop, 0, (long) prop_size, False, AnyPropertyType,
-                              &prop_type, &prop_fmt, &prop_items, &prop_size, &buffer );
-         /* allocate memory to accommodate data in *txt */
-        if (*len == 0) {
-          *len = prop_items;
-          ltxt = (uchar*) malloc(*len);
-        } else {
-          *len += prop_items;
-          ltxt = (uchar*) realloc(ltxt, *len);
-        }
-        memcpy(&ltxt[*len - prop_items], buffer, prop_items); /* add data to ltxt */
 
-        *txt = ltxt;
-        XFree(buffer);
-        XDeleteProperty(dpy, win, prop); /* delete property to get the next item */
-        XFlush(dpy);
-        return (0);
-      }
-    }
-    return (0);
+XCTRL_API ulong xctrl_events_dropped(Display*disp)
+{
+  XCtrlContext*ctx=get_context(disp);
+  return ctx?ctx->events_dropped:0;
 }
 
-/* Put data into a selection, in response to a SelecionRequest event from
- * another window (and any subsequent events relating to an INCR transfer).
- *
- * Arguments are:
- *   A display
- *   A window
- *   The event to respond to
- *   A pointer to an Atom. This gets set to the property nominated by the other
- *     app in it's SelectionRequest. Things are likely to break if you change the
- *     value of this yourself.
- *   The target (UTF8_STRING or XA_STRING) to respond to
- *   A pointer to an array of chars to read selection data from.
- *   The length of the array of chars.
- *   In case of an INCR transfer, the position within the array of chars that's being processed.
- *   The context that event is the be processed within.
- */
-static int xcin( Display*dpy, Window*win, XEvent evt, Atom*prop,
-                   Atom trg, uchar*txt, ulong len, ulong*pos, uint *ctx )
+
+
+static void mirror_clear(WinListItem*rec, int which)
 {
-  ulong chunk_len;  /* length of current chunk (for incr transfers only) */
-  XEvent resp;      /* response to event */
-  static Atom inc;
-  static Atom targets;
-  static long chunk_size;
-  if (!targets) { targets = XInternAtom(dpy, "TARGETS", False); }
-  if (!inc) { inc = XInternAtom(dpy, "INCR", False); }
-  /* Treat selections larger than 1/4 of the max request size as "large" per ICCCM sect. 2.5 */
-  if (!chunk_size) {
-    chunk_size = XExtendedMaxRequestSize(dpy) / 4;
-    if (!chunk_size) { chunk_size = XMaxRequestSize(dpy) / 4; }
+  if (which&MIRROR_TITLE) {
+    sfree(rec->title);
+    rec->title=NULL;
   }
-  switch (*ctx) {
-    case XCLIB_XCIN_NONE: {
-      if (evt.type != SelectionRequest) { return (0); }
-      *win = evt.xselectionrequest.requestor;
-      *prop = evt.xselectionrequest.property;
-      *pos = 0;
-      if (evt.xselectionrequest.target == targets) {   /* put the data into an property */
-        Atom types[2];
-        int size=(int)(sizeof(types)/sizeof(Atom));
-        types[0]=targets;
-        types[1]=trg;
-        /* send data all at once (not using INCR) */
-        XChangeProperty(dpy,*win,*prop,XA_ATOM,32,PropModeReplace,(uchar*)types,size);
-      } else if (len > chunk_size) {
-        XChangeProperty(dpy,*win,*prop,inc,32,PropModeReplace,0,0); /* send INCR response */
-        /* With INCR, we need to know when requestor window changes/deletes properties */
-        XSelectInput(dpy, *win, PropertyChangeMask);
-        *ctx = XCLIB_XCIN_INCR;
-      } else {
-        XChangeProperty(dpy,*win,*prop,trg,8,PropModeReplace,(uchar*)txt,(int)len); /* All, not INCR */
-      }
+  if (which&MIRROR_CLASS) {
+    sfree(rec->class_name);
+    rec->class_name=NULL;
+  }
+  rec->valid&=~which;
+}
 
-      /* FIXME? According to ICCCM section 2.5, we should confirm that X ChangeProperty
-         succeeded without any Alloc errors before replying with SelectionNotify.
-         However, doing so would require an error handler which modifies a global
-         variable, plus doing XSync after each X ChangeProperty. */
-      resp.xselection.property = *prop;
-      resp.xselection.type = SelectionNotify;
-      resp.xselection.display = evt.xselectionrequest.display;
-      resp.xselection.requestor = *win;
-      resp.xselection.selection = evt.xselectionrequest.selection;
-      resp.xselection.target = evt.xselectionrequest.target;
-      resp.xselection.time = evt.xselectionrequest.time;
-      XSendEvent(dpy, evt.xselectionrequest.requestor, 0, 0, &resp); /* send response event */
-      XFlush(dpy);
-      return (len > chunk_size) ? 0 : 1; /* if data sent all at once, transfer is complete. */
-      break;
-    }
-    case XCLIB_XCIN_INCR: {
-      if (evt.type != PropertyNotify) { return (0); } /* ignore non-property events */
-      if (evt.xproperty.state != PropertyDelete) { return (0); }   /* only interest in deleted props */
-      chunk_len = chunk_size; /* set length to max size */
-      /* if a max-sized chunk length would extend past end, set length to remaining txt length */
-      if ((*pos + chunk_len) > len) { chunk_len = len - *pos; }
 
-      /* if start of chunk is beyond end of txt, then we've sent all data, so set length to zero */
-      if (*pos > len) { chunk_len = 0; }
-      if (chunk_len) {  /* put chunk into property */
-        XChangeProperty(dpy,*win,*prop,trg,8,PropModeReplace,&txt[*pos],(int)chunk_len);
-      } else {
-        XChangeProperty(dpy,*win,*prop,trg,8,PropModeReplace,0,0); /* empty prop shows we're done */
-      }
-      XFlush(dpy);
-      if (!chunk_len) { *ctx = XCLIB_XCIN_NONE; }   /* all data is sent, break out of the loop */
-      *pos += chunk_size;
-      return (chunk_len==0) ? 1 : 0; /* chunk_len == 0 means we finished the transfer. */
-      break;
+
+static void winset_free_all(WinSet*set)
+{
+  ulong i;
+  for (i=0; i<set->size; i++) {
+    WinListItem*p=set->buckets[i];
+    while (p) {
+      WinListItem*n=p->next;
+      mirror_clear(p, MIRROR_TITLE|MIRROR_CLASS);
+      free(p);
+      p=n;
     }
   }
-  return (0);
+  sfree(set->buckets);
+  memset(set, 0, sizeof(WinSet));
 }
 
 
 
-static Atom selarg_to_seltype(Display*dpy, char arg)
+/* Return the listener's record for a window, but only if the mirror is live. */
+static WinListItem*mirror_find(Display*disp, Window win)
 {
-  switch (arg) {
-    case 'p': return XA_PRIMARY;
-    case 's': return XA_SECONDARY;
-    case 'b': return XA_STRING;
-    case 'c': return XA_CLIPBOARD(dpy);
-    default:return XA_PRIMARY;
+  XCtrlContext*ctx=get_context(disp);
+  if (!(ctx && ctx->mirror && ctx->mirror_live)) { return NULL; }
+  return winset_find(&ctx->winlist, win);
+}
+
+
+
+static void mirror_invalidate(XCtrlContext*ctx, Window win, int which)
+{
+  WinListItem*rec=winset_find(&ctx->winlist, win);
+  if (rec) { mirror_clear(rec, which); }
+}
+
+
+
+static void mirror_property_changed(XCtrlContext*ctx, Window win, Atom a)
+{
+  int which=0;
+  if (!ctx->mirror) { return; }
+  if ((a==XA_WM_NAME)||(a==ctx->atoms[ATOM_NET_WM_NAME])) {
+    which=MIRROR_TITLE;
+  } else if (a==XA_WM_CLASS) {
+    which=MIRROR_CLASS;
+  } else if ((a==ctx->atoms[ATOM_NET_WM_DESKTOP])||(a==ctx->atoms[ATOM_WIN_WORKSPACE])) {
+    which=MIRROR_DESKTOP;
+  } else if (a==ctx->atoms[ATOM_NET_WM_STATE]) {
+    which=MIRROR_STATE;
+  } else if (a==ctx->atoms[ATOM_NET_WM_PID]) {
+    which=MIRROR_PID;
+  } else {
+    return;
   }
+  mirror_invalidate(ctx, win, which);
 }
 
 
-static Window make_selection_window(Display*dpy)
+
+static Bool client_msg(Display *disp, Window win, Atom msg, ulong d0, ulong d1, ulong d2, ulong d3, ulong d4) {
+  XEvent event;
+  long mask = SubstructureRedirectMask | SubstructureNotifyMask;
+  event.type = ClientMessage;
+  event.xclient.type = ClientMessage;
+  event.xclient.serial = 0;
+  event.xclient.send_event = True;
+  event.xclient.message_type = msg;
+  event.xclient.window = win;
+  event.xclient.format = 32;
+  event.xclient.data.l[0] = d0;
+  event.xclient.data.l[1] = d1;
+  event.xclient.data.l[2] = d2;
+  event.xclient.data.l[3] = d3;
+  event.xclient.data.l[4] = d4;
+  return stats_send_event(disp, DefRootWin, False, mask, &event)?True:False;
+}
+
+
+
+/* Like get_output_str(), converting into ctx->text_buf if need be. */
+static const char *get_output_str_buf(Display*disp, XCtrlContext*ctx, const char*str, Bool is_utf8) {
+  Bool to_utf8=display_utf8(disp)?True:False;
+  const char*out;
+  if (!str || (to_utf8==(is_utf8?True:False))) { return str; }
+  out=display_convert_buf(ctx, str, to_utf8, &ctx->text_buf);
+  return out?out:str;
+}
+
+
+
+/* Convert str to the display's output encoding, taking ownership of it. */
+static char *get_output_str(Display*disp, char*str, Bool is_utf8) {
+  if (!str) { return NULL; }
+  if (display_utf8(disp)) {
+    return is_utf8 ? str : display_convert(disp, str, True, True);
+  } else {
+    return is_utf8 ? display_convert(disp, str, False, True) : str;
+  }
+}
+
+
+
+#define get_uprop(wn,pn,sz) (ulong*)get_prop(disp, wn, XA_CARDINAL, pn, sz)
+#define get_uprop_pair(wn,pn1,pn2,sz) (ulong*)get_prop_pair(disp, wn, XA_CARDINAL, pn1, XA_CARDINAL, pn2, sz, NULL)
+
+#ifndef XCTRL_USE_XCB
+
+/*
+  Size of the first read, in 32-bit units. Nearly every property fits in
+  one request this size; for anything bigger, the first reply tells us
+  exactly how much remains, so the buffer is allocated once and the rest
+  is fetched with a single follow-up request.
+*/
+#define PROP_FIRST_READ 4096
+
+/* Bytes per item as Xlib delivers them: 32-bit data comes back as longs. */
+#define PropItemSize(format) ((format)==32?sizeof(long):(format)/8)
+
+/* Read a property into sb, which keeps its memory whether or not this succeeds. */
+static char *get_prop_buf(Display*d, Window w, Atom type, Atom a, ulong*count, Scratch*sb) {
+  Atom ret_type;
+  int format=0;
+  ulong nitems=0;
+  ulong after=0;
+  uchar *retp=NULL;
+  long offset=0;
+  long length=PROP_FIRST_READ;
+  ulong total_items=0;
+  ulong total_bytes=0;
+  ulong alloc_bytes=sb->size;
+  char*all=sb->data;
+  if (count) { *count=0; }
+  do {
+    ulong chunk_bytes;
+    ulong need_bytes;
+    retp=NULL;
+    if (stats_get_property(d,w,a,offset,length,False,type,&ret_type,&format,&nitems,&after,&retp)!=Success) {
+      return NULL;
+    }
+    if ((ret_type!=type)||(format==0)) {
+      if (retp) { XFree(retp); }
+      return NULL;
+    }
+    chunk_bytes=nitems*PropItemSize(format);
+    need_bytes=total_bytes+chunk_bytes+(after/(format/8))*PropItemSize(format)+1;
+    if (need_bytes>alloc_bytes) {
+      /* Exact on the first pass; only grows again if the property grew under us. */
+      char*tmp;
+      if (alloc_bytes && (need_bytes<alloc_bytes*2)) { need_bytes=alloc_bytes*2; }
+      tmp=scratch_reserve(sb, need_bytes);
+      if (!tmp) {
+        if (retp) { XFree(retp); }
+        return NULL;
+      }
+      all=tmp;
+      stats_alloc(d, need_bytes-alloc_bytes);
+      alloc_bytes=need_bytes;
+    }
+    if (retp) {
+      memcpy(&(all[total_bytes]), retp, chunk_bytes);
+      XFree(retp);
+    }
+    total_bytes+=chunk_bytes;
+    total_items+=nitems;
+    offset+=(nitems*(format/8))/4;
+    length=(after+3)/4;
+  } while ((after!=0)&&(nitems!=0));
+  if (total_bytes) {
+    all[total_bytes] = '\0';
+    if (count) { *count=total_items; }
+    return(all);
+  } else {
+    return NULL;
+  }
+}
+
+
+
+static char *get_prop(Display*d, Window w, Atom type, Atom a, ulong*count) {
+  Scratch sb={NULL,0};
+  char*rv=get_prop_buf(d, w, type, a, count, &sb);
+  if (!rv) { sfree(sb.data); }
+  return rv;
+}
+
+
+
+/*
+  Requests come in two halves so that several can be in flight at once:
+  *_request() sends the request and *_reply() collects the answer. Plain
+  Xlib can only wait for one reply at a time, so here the request half
+  just remembers its arguments and the reply half does all the work.
+  Every *_request() must be matched by a *_reply() or prop_discard().
+*/
+typedef struct {
+  Window win;
+  Atom type;
+  Atom atom;
+} PropCookie;
+
+typedef Window GeomCookie;
+
+
+
+static PropCookie prop_request(Display*d, Window w, Atom type, Atom a)
+{
+  PropCookie ck;
+  ck.win=w;
+  ck.type=type;
+  ck.atom=a;
+  return ck;
+}
+
+
+
+static char*prop_reply(Display*d, PropCookie ck, ulong*count)
+{
+  return get_prop(d, ck.win, ck.type, ck.atom, count);
+}
+
+
+
+static char*prop_reply_buf(Display*d, PropCookie ck, ulong*count, Scratch*sb)
+{
+  return get_prop_buf(d, ck.win, ck.type, ck.atom, count, sb);
+}
+
+
+
+static void prop_discard(Display*d, PropCookie ck)
+{
+}
+
+
+
+static GeomCookie geom_request(Display*disp, Window win)
+{
+  return win;
+}
+
+
+
+/* If "rel" isn't NULL, it is set to the window's position in its parent. */
+static Bool geom_reply(Display*disp, GeomCookie ck, Geometry*geom, XPoint*rel)
+{
+  int x, y;
+  unsigned int bw, depth;
+  Window root;
+  ulong start=StatsActive()?now_us():0;
+  Bool rv;
+  memset(geom,0,sizeof(Geometry));
+  if (!XGetGeometry(disp, ck, &root, &x, &y, &geom->w, &geom->h, &bw, &depth)) {
+    stats_count(disp, 1, 1, 0, start);
+    return False;
+  }
+  rv=XTranslateCoordinates(disp, ck, root, x, y, &geom->x, &geom->y, &root)?True:False;
+  stats_count(disp, 2, 2, 0, start);
+  if (rel) {
+    rel->x=x;
+    rel->y=y;
+  }
+  return rv;
+}
+
+#else /* XCTRL_USE_XCB */
+
+/*
+  With XCB, a property is always read in a single request no matter how
+  large it is, and requests are only waited on when their reply is needed.
+  The *_unchecked() variants are used so that any errors are delivered
+  through Xlib's error handler, exactly as they are for the Xlib backend.
+*/
+#define PROP_ALL 0x1fffffff
+
+#define PropItemSize(format) ((format)==32?sizeof(long):(format)/8)
+
+typedef struct {
+  xcb_get_property_cookie_t ck;
+  Atom type;
+} PropCookie;
+
+typedef struct {
+  xcb_get_geometry_cookie_t geom;
+  xcb_translate_coordinates_cookie_t trans;
+} GeomCookie;
+
+
+
+static void stats_xcb_sent(Display*d, unsigned int seq)
+{
+  XCtrlContext*ctx=stats_context(d);
+  if (ctx) {
+    ctx->stats_sent=seq;
+    stats_add(ctx, 1, 0, 0, 0, 0);
+  }
+}
+
+
+
+/*
+  Waiting for a reply flushes every request sent so far, so the replies to
+  those come back in the same round trip. Only a reply to a request sent
+  after the last wait costs another one.
+*/
+static void stats_xcb_reply(Display*d, unsigned int seq, ulong reply_bytes, ulong start)
+{
+  XCtrlContext*ctx=stats_context(d);
+  ulong trips=0;
+  if (!ctx) { return; }
+  if ((int)(seq-ctx->stats_waited)>0) {
+    trips=1;
+    ctx->stats_waited=((int)(ctx->stats_sent-seq)>0)?ctx->stats_sent:seq;
+  }
+  stats_add(ctx, 0, trips, reply_bytes, 0, start?now_us()-start:0);
+}
+
+
+
+static PropCookie prop_request(Display*d, Window w, Atom type, Atom a)
+{
+  PropCookie ck;
+  ck.ck=xcb_get_property_unchecked(XGetXCBConnection(d), 0, w, a, type, 0, PROP_ALL);
+  ck.type=type;
+  stats_xcb_sent(d, ck.ck.sequence);
+  return ck;
+}
+
+
+
+static char*prop_reply_buf(Display*d, PropCookie ck, ulong*count, Scratch*sb)
+{
+  ulong start=StatsActive()?now_us():0;
+  xcb_get_property_reply_t*r=xcb_get_property_reply(XGetXCBConnection(d), ck.ck, NULL);
+  char*all=NULL;
+  ulong n;
+  if (count) { *count=0; }
+  stats_xcb_reply(d, ck.ck.sequence, r?xcb_get_property_value_length(r):0, start);
+  if (!r) { return NULL; }
+  n=xcb_get_property_value_length(r)/(r->format?r->format/8:1);
+  if ((r->type==ck.type)&&(r->format!=0)&&(n>0)) {
+    ulong had=sb->size;
+    all=scratch_reserve(sb, n*PropItemSize(r->format)+1);
+    stats_alloc(d, sb->size-had);
+    if (all) {
+      if (r->format==32) { /* Xlib hands out 32-bit data as longs, so we do too */
+        uint32_t*src=(uint32_t*)xcb_get_property_value(r);
+        ulong*dst=(ulong*)all;
+        ulong i;
+        for (i=0; i<n; i++) { dst[i]=src[i]; }
+      } else {
+        memcpy(all, xcb_get_property_value(r), n*PropItemSize(r->format));
+      }
+      all[n*PropItemSize(r->format)]='\0';
+      if (count) { *count=n; }
+    }
+  }
+  free(r);
+  return all;
+}
+
+
+
+static char*prop_reply(Display*d, PropCookie ck, ulong*count)
+{
+  Scratch sb={NULL,0};
+  char*rv=prop_reply_buf(d, ck, count, &sb);
+  if (!rv) { sfree(sb.data); }
+  return rv;
+}
+
+
+
+static void prop_discard(Display*d, PropCookie ck)
+{
+  xcb_discard_reply(XGetXCBConnection(d), ck.ck.sequence);
+}
+
+
+
+static char *get_prop_buf(Display*d, Window w, Atom type, Atom a, ulong*count, Scratch*sb) {
+  return prop_reply_buf(d, prop_request(d, w, type, a), count, sb);
+}
+
+
+
+static char *get_prop(Display*d, Window w, Atom type, Atom a, ulong*count) {
+  return prop_reply(d, prop_request(d, w, type, a), count);
+}
+
+
+
+/*
+  The position is found by translating the window's origin to the root,
+  which lets both requests go out together, then adding the x/y offset
+  from the geometry reply. That gives the same answer as translating x/y
+  directly, the way the Xlib backend does.
+*/
+static GeomCookie geom_request(Display*disp, Window win)
+{
+  GeomCookie ck;
+  xcb_connection_t*c=XGetXCBConnection(disp);
+  ck.geom=xcb_get_geometry_unchecked(c, win);
+  ck.trans=xcb_translate_coordinates_unchecked(c, win, DefRootWin, 0, 0);
+  stats_xcb_sent(disp, ck.geom.sequence);
+  stats_xcb_sent(disp, ck.trans.sequence);
+  return ck;
+}
+
+
+
+static Bool geom_reply(Display*disp, GeomCookie ck, Geometry*geom, XPoint*rel)
+{
+  xcb_connection_t*c=XGetXCBConnection(disp);
+  ulong start=StatsActive()?now_us():0;
+  xcb_get_geometry_reply_t*g=xcb_get_geometry_reply(c, ck.geom, NULL);
+  xcb_translate_coordinates_reply_t*t=xcb_translate_coordinates_reply(c, ck.trans, NULL);
+  Bool rv=(g&&t)?True:False;
+  stats_xcb_reply(disp, ck.geom.sequence, 0, start);
+  stats_xcb_reply(disp, ck.trans.sequence, 0, 0);
+  memset(geom,0,sizeof(Geometry));
+  if (rv) {
+    geom->x=t->dst_x+g->x;
+    geom->y=t->dst_y+g->y;
+    geom->w=g->width;
+    geom->h=g->height;
+    if (rel) {
+      rel->x=g->x;
+      rel->y=g->y;
+    }
+  }
+  sfree(g);
+  sfree(t);
+  return rv;
+}
+
+#endif /* XCTRL_USE_XCB */
+
+
+
+/* As get_prop_pair(), into sb when it isn't NULL. */
+static char*get_prop_pair_buf(Display*d, Window w, Atom t1, Atom a1, Atom t2, Atom a2, ulong*count, int*which, Scratch*sb)
+{
+  PropCookie ck1=prop_request(d, w, t1, a1);
+  PropCookie ck2=prop_request(d, w, t2, a2);
+  char*rv=sb?prop_reply_buf(d, ck1, count, sb):prop_reply(d, ck1, count);
+  if (rv) {
+    prop_discard(d, ck2);
+    if (which) { *which=1; }
+  } else {
+    rv=sb?prop_reply_buf(d, ck2, count, sb):prop_reply(d, ck2, count);
+    if (which) { *which=rv?2:0; }
+  }
+  return rv;
+}
+
+
+
+/*
+  Read a property, or a fallback property if the first one isn't set.
+  Both requests are sent together, and which one succeeded is stored
+  in *which (1 or 2) when that pointer isn't NULL.
+*/
+static char*get_prop_pair(Display*d, Window w, Atom t1, Atom a1, Atom t2, Atom a2, ulong*count, int*which)
+{
+  return get_prop_pair_buf(d, w, t1, a1, t2, a2, count, which, NULL);
+}
+
+
+
+static char* get_prop_utf8(Display*disp, Window win, Atom what)
+{
+  Bool name_is_utf8 = True;
+  char*tmp=get_prop(disp, win, GetUTF8Atom(), what, NULL);
+  if (!tmp) {
+    name_is_utf8 = False;
+    tmp = get_prop(disp, win, XA_STRING, what, NULL);
+  }
+  return get_output_str(disp, tmp, name_is_utf8);
+}
+
+
+/*
+  Save the value of p, free p, and return the
+  saved value, or return ifnull if p is NULL.
+*/
+static ulong ptr_to_ulong(ulong*p, ulong ifnull)
+{
+  if (p) {
+    ulong rv=*p;
+    free(p);
+    return rv;
+  } else {
+    return ifnull;
+  }
+}
+
+
+
+XCTRL_API Window supporting_wm_check(Display*disp)
+{
+  Window *p=(Window*)get_prop_pair(disp, DefRootWin,
+                                   XA_WINDOW, GetAtom(ATOM_NET_SUPPORTING_WM_CHECK),
+                                   XA_CARDINAL, GetAtom(ATOM_WIN_SUPPORTING_WM_CHECK), NULL, NULL);
+  return (Window)ptr_to_ulong((ulong*)p,0);
+}
+
+
+
+XCTRL_API char* get_wm_name(Display*disp)
+{
+  Window win = supporting_wm_check(disp);
+  return win?get_prop_utf8(disp, win, GetAtom(ATOM_NET_WM_NAME)):NULL;
+}
+
+
+
+XCTRL_API char* get_wm_class(Display*disp)
+{
+  Window win = supporting_wm_check(disp);
+  return win?get_prop_utf8(disp, win, XA_WM_CLASS):NULL;
+}
+
+
+
+XCTRL_API ulong get_wm_pid(Display*disp)
+{
+  Window win = supporting_wm_check(disp);
+  if (win) {
+    ulong *wm_pid = get_uprop(win, GetAtom(ATOM_NET_WM_PID), NULL);
+    return ptr_to_ulong(wm_pid, 0);
+  } else {
+    return 0;
+  }
+}
+
+
+
+XCTRL_API int get_showing_desktop(Display*disp)
+{
+  ulong *p=get_uprop(DefRootWin, GetAtom(ATOM_NET_SHOWING_DESKTOP), NULL);
+  return ptr_to_ulong(p,-1);
+}
+
+
+
+XCTRL_API int set_showing_desktop(Display*disp, ulong state)
+{
+  return client_msg(disp, DefRootWin, GetAtom(ATOM_NET_SHOWING_DESKTOP), state, 0, 0, 0, 0);
+}
+
+
+
+XCTRL_API int change_viewport(Display*disp, ulong x, ulong y) {
+  return client_msg(disp, DefRootWin, GetAtom(ATOM_NET_DESKTOP_VIEWPORT), x, y, 0, 0, 0);
+}
+
+
+
+XCTRL_API int change_geometry(Display*disp, ulong x, ulong y) {
+  return client_msg(disp, DefRootWin, GetAtom(ATOM_NET_DESKTOP_GEOMETRY), x, y, 0, 0, 0);
+}
+
+
+
+XCTRL_API int set_number_of_desktops(Display*disp, ulong n)
+{
+  return client_msg(disp, DefRootWin, GetAtom(ATOM_NET_NUMBER_OF_DESKTOPS), n, 0, 0, 0, 0);
+}
+
+
+
+XCTRL_API long get_number_of_desktops(Display*disp)
+{
+  ulong *p = get_uprop_pair(DefRootWin, GetAtom(ATOM_NET_NUMBER_OF_DESKTOPS), GetAtom(ATOM_WIN_WORKSPACE_COUNT), NULL);
+  return ptr_to_ulong(p,-1);
+}
+
+
+
+XCTRL_API int set_current_desktop(Display*disp, ulong target) {
+  return client_msg(disp, DefRootWin, GetAtom(ATOM_NET_CURRENT_DESKTOP), target, 0, 0, 0, 0);
+}
+
+
+
+XCTRL_API long get_current_desktop(Display*disp)
+{
+  ulong *p = get_uprop_pair(DefRootWin, GetAtom(ATOM_NET_CURRENT_DESKTOP), GetAtom(ATOM_WIN_WORKSPACE), NULL);
+  return (signed long)ptr_to_ulong(p,-1);
+}
+
+
+
+static void replace_prop(Display*disp, Window win, Atom what, Atom type, char*newval)
+{
+  XChangeProperty(disp,win,what,type,8,PropModeReplace,(unsigned char*)newval,strlen(newval));
+}
+
+
+
+XCTRL_API void set_window_title(Display*disp, Window win, const char*title, char mode) {
+  char *title_utf8;
+  char *title_local;
+  Atom utf8_atom = GetUTF8Atom();
+  if (display_utf8(disp)) {
+    title_utf8 = strdup(title);
+    title_local = NULL;
+  } else {
+    title_utf8 = DisplayToUTF8(title);
+    if (!title_utf8) { title_utf8 = strdup(title); }
+    title_local = strdup(title);
+  }
+  if (mode == 'T' || mode == 'N') {
+    if (title_local) {
+      replace_prop(disp, win, XA_WM_NAME, XA_STRING,title_local);
+    } else {
+      XDeleteProperty(disp, win, XA_WM_NAME);
+    }
+    replace_prop(disp, win, GetAtom(ATOM_NET_WM_NAME), utf8_atom, title_utf8);
+  }
+  if (mode == 'T' || mode == 'I') {
+    if (title_local) {
+      replace_prop(disp, win, XA_WM_ICON_NAME, XA_STRING, title_local);
+    } else {
+      XDeleteProperty(disp, win, XA_WM_ICON_NAME);
+    }
+    replace_prop(disp, win, GetAtom(ATOM_NET_WM_ICON_NAME), utf8_atom, title_utf8);
+  }
+  sfree(title_utf8);
+  sfree(title_local);
+}
+
+
+
+XCTRL_API int send_window_to_desktop(Display*disp, Window win, int desktop) {
+  return client_msg(disp, win, GetAtom(ATOM_NET_WM_DESKTOP), (ulong)desktop, 0, 0, 0, 0);
+}
+
+
+
+XCTRL_API Bool activate_window(Display*disp, Window win, Bool switch_desk) {
+  if (switch_desk) {
+    long desktop = get_desktop_of_window(disp,win);
+    if (desktop>=0) {
+      if (desktop!=get_current_desktop(disp)) {
+        set_current_desktop(disp, desktop);
+      }
+    }
+  }
+  client_msg(disp, win, GetAtom(ATOM_NET_ACTIVE_WINDOW), 2, 0, 0, 0, 0);
+  XSetInputFocus(disp, win, RevertToNone, CurrentTime);
+  XMapRaised(disp, win);
+  return True;
+}
+
+
+
+XCTRL_API Bool iconify_window(Display*disp, Window win)
+{
+  return XIconifyWindow(disp, win, DefaultScreen(disp))?True:False;
+}
+
+
+
+XCTRL_API Window get_active_window(Display*disp) {
+  Window*win = (Window*)get_prop(disp, DefRootWin, XA_WINDOW, GetAtom(ATOM_NET_ACTIVE_WINDOW), NULL);
+  return (Window) ptr_to_ulong((ulong*)win,0);
+}
+
+
+
+XCTRL_API int close_window(Display*disp, Window win) {
+  return client_msg(disp, win, GetAtom(ATOM_NET_CLOSE_WINDOW), 0, 0, 0, 0, 0);
+}
+
+
+
+static ulong wm_state_atom(Display*disp, const char*prop) {
+  Atom atom=0;
+  char tmp_prop[64];
+  char*p;
+  memset(tmp_prop,0,sizeof(tmp_prop));
+  strcpy(tmp_prop, "_NET_WM_STATE_");
+  strncat(tmp_prop,prop,(sizeof(tmp_prop)-strlen(tmp_prop))-1);
+  for (p=tmp_prop; *p; p++) {
+    if (((signed char)*p)>0) { *p=toupper(*p); }
+  }
+  atom = xctrl_atom(disp, tmp_prop);
+  return (ulong)atom;
+}
+
+
+
+XCTRL_API int set_window_state(Display*disp, Window win, ulong action, const char*p1, const char*p2)
+{
+  ulong xa_prop1=p1?wm_state_atom(disp,p1):0;
+  ulong xa_prop2=p2?wm_state_atom(disp,p2):0;
+  return client_msg(disp,win,GetAtom(ATOM_NET_WM_STATE),action,xa_prop1,xa_prop2, 0, 0);
+}
+
+
+
+/*
+  The _NET_SUPPORTED list is read once and kept until the window manager
+  changes it. While the event loop is running, it sees the root window's
+  PropertyNotify events and drops the list when it changes. Otherwise the
+  root window's event mask belongs to the application, so rather than
+  listening, the list is read again once it is SUPPORTED_TTL_MS old; it
+  only changes when a window manager starts, so that is rarely stale.
+*/
+#define SUPPORTED_TTL_MS 1000
+
+static void supported_event(XCtrlContext*ctx, XPropertyEvent*ev)
+{
+  if ((ev->atom==ctx->atoms[ATOM_NET_SUPPORTED])||(ev->atom==ctx->atoms[ATOM_NET_SUPPORTING_WM_CHECK])) {
+    ctx->supported_valid=False;
+  }
+}
+
+
+
+static int atom_cmp(const void*a, const void*b)
+{
+  Atom x=*(const Atom*)a;
+  Atom y=*(const Atom*)b;
+  return (x<y)?-1:(x>y)?1:0;
+}
+
+
+
+static void load_supported(Display*disp, XCtrlContext*ctx)
+{
+  ulong size=0;
+  int i;
+  sfree(ctx->supported);
+  memset(ctx->supported_bits, 0, sizeof(ctx->supported_bits));
+  ctx->supported=(Atom*)get_prop(disp, DefRootWin, XA_ATOM, ctx->atoms[ATOM_NET_SUPPORTED], &size);
+  ctx->supported_count=ctx->supported?size:0;
+  if (ctx->supported_count) {
+    qsort(ctx->supported, ctx->supported_count, sizeof(Atom), atom_cmp);
+    for (i=0; i<ATOM_COUNT; i++) {
+      if (bsearch(&ctx->atoms[i], ctx->supported, ctx->supported_count, sizeof(Atom), atom_cmp)) {
+        ctx->supported_bits[i/BITS_PER_LONG]|=1UL<<(i%BITS_PER_LONG);
+      }
+    }
+  }
+  ctx->supported_valid=True;
+  ctx->supported_ms=now_ms();
+}
+
+
+
+static XCtrlContext*supported_context(Display*disp)
+{
+  XCtrlContext*ctx=get_context(disp);
+  if (ctx) {
+    if (!ctx->listening && ((now_ms()-ctx->supported_ms) >= SUPPORTED_TTL_MS)) { ctx->supported_valid=False; }
+    if (!ctx->supported_valid) { load_supported(disp, ctx); }
+  }
+  return ctx;
+}
+
+
+
+/* Check for one of our own atoms, which is just a bit test. */
+static Bool wm_supports_atom(Display*disp, int id)
+{
+  XCtrlContext*ctx=supported_context(disp);
+  if (ctx) {
+    return (ctx->supported_bits[id/BITS_PER_LONG]&(1UL<<(id%BITS_PER_LONG)))?True:False;
+  } else {
+    return wm_supports(disp, atom_names[id]);
+  }
+}
+
+
+
+XCTRL_API Bool wm_supports(Display*disp, const char*prop) {
+  Atom xa_prop = xctrl_atom(disp, prop);
+  XCtrlContext*ctx=supported_context(disp);
+  ulong size=0;
+  int i;
+  Atom *list;
+  if (ctx) {
+    if (!ctx->supported_count) { return False; }
+    return bsearch(&xa_prop, ctx->supported, ctx->supported_count, sizeof(Atom), atom_cmp)?True:False;
+  }
+  list=(Atom*)get_prop(disp, DefRootWin, XA_ATOM, GetAtom(ATOM_NET_SUPPORTED), &size);
+  if (!list) { return False; }
+  for (i = 0; i < size; i++) {
+    if (list[i] == xa_prop) {
+      free(list);
+      return True;
+    }
+  }
+  free(list);
+  return False;
+}
+
+
+/* Work out a window's type from its _NET_WM_WINDOW_TYPE and WM_TRANSIENT_FOR */
+static const char*window_type_from(Display*disp, Atom*atom, Window*transient)
+{
+  static const char*shortnames[]={
+    "desktop",
+    "dock",
+    "toolbar",
+    "menu",
+    "utility",
+    "splash",
+    "dialog",
+    "normal"
+  };
+  const char*type="";
+  if (atom) {
+    int i;
+    for (i=0; i<8;i++) {
+      if (*atom==GetAtom(ATOM_NET_WM_WINDOW_TYPE_DESKTOP+i)) {
+        type=shortnames[i];
+        break;
+      }
+    }
+  }
+  if (type[0]=='\0') {
+    type=transient?"dialog":"normal";
+  }
+  return type;
+}
+
+
+
+XCTRL_API char*get_window_type(Display*disp, Window win)
+{
+  const char*type="unsupported";
+  if (wm_supports_atom(disp,ATOM_NET_WM_WINDOW_TYPE)) {
+    PropCookie type_ck=prop_request(disp, win, XA_ATOM, GetAtom(ATOM_NET_WM_WINDOW_TYPE));
+    PropCookie trans_ck=prop_request(disp, win, XA_WINDOW, XA_WM_TRANSIENT_FOR);
+    Atom*atom=(Atom*)prop_reply(disp, type_ck, NULL);
+    Window*transient=NULL;
+    if (atom) {
+      prop_discard(disp, trans_ck);
+    } else {
+      transient=(Window*)prop_reply(disp, trans_ck, NULL);
+    }
+    type=window_type_from(disp, atom, transient);
+    sfree(atom);
+    sfree(transient);
+  }
+  return strdup(type);
+}
+
+
+
+XCTRL_API long get_window_type_into(Display*disp, Window win, char*buf, size_t size)
+{
+  XCtrlContext*ctx=get_context(disp);
+  const char*type="unsupported";
+  if (!ctx) { return copy_out_free(get_window_type(disp, win), buf, size); }
+  if (wm_supports_atom(disp,ATOM_NET_WM_WINDOW_TYPE)) {
+    PropCookie type_ck=prop_request(disp, win, XA_ATOM, GetAtom(ATOM_NET_WM_WINDOW_TYPE));
+    PropCookie trans_ck=prop_request(disp, win, XA_WINDOW, XA_WM_TRANSIENT_FOR);
+    Atom*atom=(Atom*)prop_reply_buf(disp, type_ck, NULL, &ctx->prop_buf);
+    Window*transient=NULL;
+    if (atom) {
+      prop_discard(disp, trans_ck);
+    } else {
+      transient=(Window*)prop_reply_buf(disp, trans_ck, NULL, &ctx->prop_buf);
+    }
+    type=window_type_from(disp, atom, transient);
+  }
+  return copy_out(type, buf, size);
+}
+
+
+
+typedef struct {
+  unsigned long flags;
+  unsigned long functions;
+  unsigned long decorations;
+  long inputmode;
+  unsigned long status;
+} MotifHints;
+
+
+
+XCTRL_API void set_window_mwm_hints(Display*disp, Window win, ulong flags, ulong funcs, ulong decors, ulong imode)
+{
+  Atom atom=GetAtom(ATOM_MOTIF_WM_HINTS);
+  MotifHints hints;
+  hints.flags=flags;
+  hints.functions=funcs;
+  hints.decorations=decors;
+  hints.inputmode=imode;
+  hints.status=0;
+  XChangeProperty(disp,win,atom,atom,32,PropModeReplace,(unsigned char*)&hints,4);
+}
+
+
+
+XCTRL_API void get_window_geom(Display*disp, Window win, Geometry*geom)
+{
+  WinListItem*rec=mirror_find(disp, win);
+  if (rec && (rec->valid&MIRROR_GEOM)) {
+    *geom=rec->geom;
+    return;
+  }
+  if (geom_reply(disp, geom_request(disp, win), geom, rec?&rec->parent_pos:NULL) && rec) {
+    rec->geom=*geom;
+    rec->parent_pos_valid=True;
+    rec->valid|=MIRROR_GEOM;
+  }
+}
+
+
+
+XCTRL_API Bool get_window_frame(Display*disp, Window win, long*left, long*right, long*top, long*bottom)
+{
+  if (wm_supports_atom(disp, ATOM_NET_FRAME_EXTENTS)) {
+    ulong size=0;
+    ulong*extents=get_uprop(win,GetAtom(ATOM_NET_FRAME_EXTENTS),&size);
+    *left=*right=*top=*bottom=-1;
+    if (extents) {
+      *left=extents[0];
+      *right=extents[1];
+      *top=extents[2];
+      *bottom=extents[3];
+      sfree(extents);
+      return True;
+    }
+  }
+  return False;
+}
+
+
+
+XCTRL_API int set_window_geom(Display*disp, Window win, long grav, long flags, long x, long y, long w, long h)
+{
+  if (wm_supports_atom(disp, ATOM_NET_MOVERESIZE_WINDOW)) {
+    return client_msg( disp, win, GetAtom(ATOM_NET_MOVERESIZE_WINDOW),
+                       grav|flags, (ulong)x, (ulong)y, (ulong)w, (ulong)h);
+  } else {
+    Bool move=False;
+    Bool size=False;
+    Geometry geom;
+    get_window_geom(disp,win,&geom);
+    if (flags&(XCTRL_GEOM_USE_X|XCTRL_GEOM_USE_Y)) {
+      move=True;
+      if (!(flags&XCTRL_GEOM_USE_X)) { x=geom.x; }
+      if (!(flags&XCTRL_GEOM_USE_Y)) { y=geom.y; }
+    }
+    if (flags&(XCTRL_GEOM_USE_W|XCTRL_GEOM_USE_H)) {
+      size=True;
+      if (!(flags&XCTRL_GEOM_USE_W)) { w=geom.w; }
+      if (!(flags&XCTRL_GEOM_USE_H)) { h=geom.h; }
+    }
+    if (size&&move) {
+      XMoveResizeWindow(disp, win, x, y, w, h);
+    } else if (size) {
+      XResizeWindow(disp, win, w, h);
+    } else if (move) {
+      XMoveWindow(disp, win, x, y); 
+    }
+    return True;
+  }
+}
+
+
+
+XCTRL_API Window *get_window_list(Display*disp, ulong*size)
+{
+  return (Window*)get_prop_pair(disp, DefRootWin,
+                                XA_WINDOW, GetAtom(ATOM_NET_CLIENT_LIST),
+                                XA_CARDINAL, GetAtom(ATOM_WIN_CLIENT_LIST), size, NULL);
+}
+
+
+
+/* Join the two strings of a WM_CLASS value into "instance.class", in place. */
+static char *class_join(char*wm_class, ulong size)
+{
+  char *p_0 = strchr(wm_class, '\0');
+  if (wm_class + size - 1 > p_0) { *(p_0) = '.'; }
+  return wm_class;
+}
+
+
+
+/* Convert a WM_CLASS value to "instance.class" in UTF-8, taking ownership of it. */
+static char *window_class_from(Display*disp, char*wm_class, ulong size)
+{
+  char *class_utf8;
+  if (wm_class) {
+    class_join(wm_class, size);
+    class_utf8 = display_convert(disp, wm_class, True, False);
+  } else {
+    class_utf8 = NULL;
+  }
+  return class_utf8;
+}
+
+
+
+XCTRL_API char *get_window_class(Display*disp, Window win)
+{
+  ulong size=0;
+  WinListItem*rec=mirror_find(disp, win);
+  char *wm_class;
+  if (rec && (rec->valid&MIRROR_CLASS)) {
+    return rec->class_name?strdup(rec->class_name):NULL;
+  }
+  wm_class = window_class_from(disp, get_prop(disp, win, XA_STRING, XA_WM_CLASS, &size), size);
+  if (rec) {
+    rec->class_name=wm_class?strdup(wm_class):NULL;
+    rec->valid|=MIRROR_CLASS;
+  }
+  return wm_class;
+}
+
+
+
+XCTRL_API long get_window_class_into(Display*disp, Window win, char*buf, size_t size)
+{
+  XCtrlContext*ctx=get_context(disp);
+  WinListItem*rec=mirror_find(disp, win);
+  ulong count=0;
+  char*wm_class;
+  if (rec && (rec->valid&MIRROR_CLASS)) { return copy_out(rec->class_name, buf, size); }
+  if (!ctx || rec) { return copy_out_free(get_window_class(disp, win), buf, size); }
+  wm_class=get_prop_buf(disp, win, XA_STRING, XA_WM_CLASS, &count, &ctx->prop_buf);
+  if (!wm_class) { return -1; }
+  class_join(wm_class, count);
+  return copy_out(display_convert_buf(ctx, wm_class, True, &ctx->text_buf), buf, size);
+}
+
+
+
+/*
+  Return a UTF-8 title, given either the _NET_WM_NAME (which==1)
+  or the WM_NAME (which==2) of a window. Takes ownership of the original.
+*/
+static char *window_title_from(Display*disp, char*wm_name, int which)
+{
+  if (wm_name && (which==2)) {
+    return display_convert(disp, wm_name, True, False);
+  } else {
+    return wm_name;
+  }
+}
+
+
+
+XCTRL_API char *get_window_title(Display*disp, Window win)
+{
+  int which=0;
+  WinListItem*rec=mirror_find(disp, win);
+  char *wm_name;
+  if (rec && (rec->valid&MIRROR_TITLE)) {
+    return rec->title?strdup(rec->title):NULL;
+  }
+  wm_name = get_prop_pair(disp, win, GetUTF8Atom(), GetAtom(ATOM_NET_WM_NAME),
+                          XA_STRING, XA_WM_NAME, NULL, &which);
+  wm_name = window_title_from(disp, wm_name, which);
+  if (rec) {
+    rec->title=wm_name?strdup(wm_name):NULL;
+    rec->valid|=MIRROR_TITLE;
+  }
+  return wm_name;
+}
+
+
+
+XCTRL_API long get_window_title_into(Display*disp, Window win, char*buf, size_t size)
+{
+  XCtrlContext*ctx=get_context(disp);
+  WinListItem*rec=mirror_find(disp, win);
+  int which=0;
+  const char*wm_name;
+  if (rec && (rec->valid&MIRROR_TITLE)) { return copy_out(rec->title, buf, size); }
+  if (!ctx || rec) { return copy_out_free(get_window_title(disp, win), buf, size); }
+  wm_name = get_prop_pair_buf(disp, win, GetUTF8Atom(), GetAtom(ATOM_NET_WM_NAME),
+                              XA_STRING, XA_WM_NAME, NULL, &which, &ctx->prop_buf);
+  if (wm_name && (which==2)) { wm_name=display_convert_buf(ctx, wm_name, True, &ctx->text_buf); }
+  return copy_out(wm_name, buf, size);
+}
+
+
+
+static void pass_click_to_client(Display*disp, Window root, XEvent*event, int mask, Cursor cursor)
+{
+  usleep(1000);
+  stats_sync(disp);
+  event->xbutton.window=event->xbutton.subwindow;
+  stats_send_event(disp, event->xbutton.subwindow, True, mask, event);
+  usleep(1000);
+  stats_sync(disp);
+}
+
+
+#define GrabMouse() ( \
+  XGrabPointer(disp,root,False,ButtonPressMask|ButtonReleaseMask, \
+    GrabModeSync,GrabModeAsync,root,cursor,CurrentTime) == GrabSuccess )
+
+
+/* Routine to let user select a window using the mouse adapted from xfree86. */
+XCTRL_API Window select_window(Display*disp, int button)
+{
+  Cursor cursor;
+  XEvent event;
+  Window target_win = None;
+  Window root = DefaultRootWindow(disp);
+  int buttons = 0;
+  int dumi;
+  unsigned int dum;
+  cursor = XCreateFontCursor(disp, XC_crosshair);
+  if (!GrabMouse()) {
+    XFreeCursor(disp,cursor);
+    return 0;
+  }
+  while ((target_win == None) || (buttons != 0)) {
+    XAllowEvents(disp, SyncPointer, CurrentTime);
+    XWindowEvent(disp, root, ButtonPressMask|ButtonReleaseMask, &event);
+    switch (event.type) {
+      case ButtonPress:
+        if ((button==-1)||(event.xbutton.button==button)) {
+          if (target_win == None) {
+            target_win = event.xbutton.subwindow; /* window selected */
+            if (target_win == None) target_win = root;
+          }
+        } else {
+          pass_click_to_client(disp,root,&event,ButtonPressMask,cursor);
+        }
+        buttons++;
+        break;
+      case ButtonRelease:
+        if (buttons > 0) { buttons--; }
+        if ((button!=-1)&&(event.xbutton.button!=button)) {
+          pass_click_to_client(disp,root,&event,ButtonReleaseMask,cursor);
+        }
+        break;
+    }
+  }
+  XUngrabPointer(disp, CurrentTime);
+  if (XGetGeometry(disp,target_win,&root,&dumi,&dumi,&dum,&dum,&dum,&dum)&&target_win!=root) {
+    target_win = XmuClientWindow(disp, target_win);
+  }
+  return(target_win);
+}
+
+
+
+XCTRL_API char* get_desktop_name(Display*disp, int desknum, Bool force_utf8)
+{
+  char *name_list = NULL;
+  ulong name_list_size = 0;
+  char *name = NULL;
+  Bool names_are_utf8 = True;
+  Window root = DefRootWin;
+  char*rv=NULL;
+  if (desknum<0) { return NULL; }
+  if (force_utf8) {
+    name_list = get_prop(disp, root, GetUTF8Atom(), GetAtom(ATOM_NET_DESKTOP_NAMES), &name_list_size);
+  }
+  if (!name_list) {
+    names_are_utf8 = False;
+    name_list = get_prop(disp, root, XA_STRING, GetAtom(ATOM_WIN_WORKSPACE_NAMES), &name_list_size);
+  }
+  if (name_list) {
+    if (desknum>0) {
+      int id=1;
+      char*p=name_list;
+      do {
+        p=strchr(p,'\0')+1;
+        if (id==desknum) {
+          name=p;
+          break;
+        }
+        id++;
+      } while (p<(name_list+name_list_size));
+    } else { name=name_list; }
+    if (name && *name) { rv = get_output_str(disp, strdup(name), names_are_utf8); }
+    free(name_list);
+  }
+  return rv;
+}
+
+
+
+XCTRL_API long get_desktop_name_into(Display*disp, int desknum, Bool force_utf8, char*buf, size_t size)
+{
+  XCtrlContext*ctx=get_context(disp);
+  char *name_list = NULL;
+  ulong name_list_size = 0;
+  char *name = NULL;
+  Bool names_are_utf8 = True;
+  Window root = DefRootWin;
+  if (desknum<0) { return -1; }
+  if (!ctx) { return copy_out_free(get_desktop_name(disp, desknum, force_utf8), buf, size); }
+  if (force_utf8) {
+    name_list = get_prop_buf(disp, root, GetUTF8Atom(), GetAtom(ATOM_NET_DESKTOP_NAMES), &name_list_size, &ctx->prop_buf);
+  }
+  if (!name_list) {
+    names_are_utf8 = False;
+    name_list = get_prop_buf(disp, root, XA_STRING, GetAtom(ATOM_WIN_WORKSPACE_NAMES), &name_list_size, &ctx->prop_buf);
+  }
+  if (!name_list) { return -1; }
+  if (desknum>0) {
+    int id=1;
+    char*p=name_list;
+    do {
+      p=strchr(p,'\0')+1;
+      if (id==desknum) {
+        name=p;
+        break;
+      }
+      id++;
+    } while (p<(name_list+name_list_size));
+  } else { name=name_list; }
+  if (!name || !*name) { return -1; }
+  return copy_out(get_output_str_buf(disp, ctx, name, names_are_utf8), buf, size);
+}
+
+
+
+XCTRL_API int get_workarea_geom(Display*disp, Geometry*geom, int desknum)
+{
+  ulong *wkarea = NULL;
+  ulong wkarea_size = 0;
+  int rv=0;
+  if (desknum<0) { return 0; }
+  if (get_number_of_desktops(disp)<=desknum) { return 0; }
+  wkarea = get_uprop(DefRootWin, GetAtom(ATOM_NET_WORKAREA), &wkarea_size);
+  if (!wkarea) {
+    wkarea = get_uprop(DefRootWin, GetAtom(ATOM_WIN_WORKAREA), &wkarea_size);
+  }
+  if (wkarea && wkarea_size > 0) {
+    if (wkarea_size == (4*sizeof(*wkarea))) {
+      geom->x=wkarea[0];
+      geom->y=wkarea[1];
+      geom->w=wkarea[2];
+      geom->h=wkarea[3];
+      rv=1;
+    } else {
+      if (desknum < (wkarea_size/4)) {
+        geom->x=wkarea[desknum*4];
+        geom->y=wkarea[desknum*4+1];
+        geom->w=wkarea[desknum*4+2];
+        geom->h=wkarea[desknum*4+3];
+        rv=1;
+      }
+    }
+    sfree(wkarea);
+  }
+  return rv;
+}
+
+
+
+XCTRL_API int get_desktop_geom(Display*disp, int desknum, Geometry*geom)
+{
+  ulong *desk_geom   =  NULL;
+  ulong geom_size = 0;
+  ulong *vport  = NULL;
+  ulong vport_size = 0;
+  int rv=0;
+  if (desknum<0) { return 0; }
+  if (get_number_of_desktops(disp)<=desknum) { return 0; }
+  desk_geom = get_uprop(DefRootWin, GetAtom(ATOM_NET_DESKTOP_GEOMETRY), &geom_size);
+  vport = get_uprop(DefRootWin, GetAtom(ATOM_NET_DESKTOP_VIEWPORT), &vport_size);
+  if (desk_geom && geom_size > 0) {
+    if (geom_size == 2 * sizeof(*desk_geom)) {
+      geom->w=desk_geom[0];
+      geom->h=desk_geom[1];
+    } else {
+      geom->w=desk_geom[desknum*2];
+      geom->h=desk_geom[desknum*2+1];
+    }
+    rv=1;
+  }
+  if (vport && vport_size > 0) {
+    if (vport_size == 2 * sizeof(*vport)) {
+      geom->x=vport[0];
+      geom->y=vport[1];
+    } else {
+      if (desknum < vport_size / sizeof(*vport) / 2) {
+        geom->x=vport[desknum*2];
+        geom->y=vport[desknum*2+1];
+      }
+    }
+    rv=1;
+  }
+  sfree(desk_geom);
+  sfree(vport);
+  return rv;
+}
+
+
+
+XCTRL_API long get_desktop_of_window(Display*disp, Window win)
+{
+  WinListItem*rec=mirror_find(disp, win);
+  ulong *p;
+  long desk;
+  if (rec && (rec->valid&MIRROR_DESKTOP)) { return rec->desktop; }
+  p = get_uprop_pair(win, GetAtom(ATOM_NET_WM_DESKTOP), GetAtom(ATOM_WIN_WORKSPACE), NULL);
+  desk = (signed long)ptr_to_ulong(p,-2);
+  if (rec) {
+    rec->desktop=desk;
+    rec->valid|=MIRROR_DESKTOP;
+  }
+  return desk;
+}
+
+
+
+XCTRL_API ulong get_win_pid(Display*disp, Window win)
+{
+  WinListItem*rec=mirror_find(disp, win);
+  ulong *p;
+  ulong pid;
+  if (rec && (rec->valid&MIRROR_PID)) { return rec->pid; }
+  p=get_uprop(win, GetAtom(ATOM_NET_WM_PID), NULL);
+  pid=ptr_to_ulong(p,0);
+  if (rec) {
+    rec->pid=pid;
+    rec->valid|=MIRROR_PID;
+  }
+  return pid;
+}
+
+
+XCTRL_API char*get_client_machine(Display *disp, Window win)
+{
+  return get_prop(disp, win, XA_STRING, XA_WM_CLIENT_MACHINE, NULL);
+}
+
+
+
+XCTRL_API long get_client_machine_into(Display *disp, Window win, char*buf, size_t size)
+{
+  XCtrlContext*ctx=get_context(disp);
+  if (!ctx) { return copy_out_free(get_client_machine(disp, win), buf, size); }
+  return copy_out(get_prop_buf(disp, win, XA_STRING, XA_WM_CLIENT_MACHINE, NULL, &ctx->prop_buf), buf, size);
+}
+
+
+
+static ulong window_state_from(Display*disp, Atom*states, ulong size)
+{
+  Atom known[XCTRL_STATE_COUNT];
+  ulong flags=0;
+  ulong i;
+  int j;
+  if (!states) { return 0; }
+  for (j=0; j<XCTRL_STATE_COUNT; j++) { known[j]=GetAtom(ATOM_NET_WM_STATE_MODAL+j); }
+  for (i=0; i<size; i++) {
+    for (j=0; j<XCTRL_STATE_COUNT; j++) {
+      if (states[i]==known[j]) {
+        flags|=1UL<<j;
+        break;
+      }
+    }
+  }
+  return flags;
+}
+
+
+
+XCTRL_API ulong get_window_state(Display*disp, Window win)
+{
+  ulong size=0;
+  WinListItem*rec=mirror_find(disp, win);
+  Atom*states;
+  ulong flags;
+  if (rec && (rec->valid&MIRROR_STATE)) { return rec->state; }
+  states=(Atom*)get_prop(disp, win, XA_ATOM, GetAtom(ATOM_NET_WM_STATE), &size);
+  flags=window_state_from(disp, states, size);
+  sfree(states);
+  if (rec) {
+    rec->state=flags;
+    rec->valid|=MIRROR_STATE;
+  }
+  return flags;
+}
+
+
+
+static size_t strsize(const char*s)
+{
+  return s?strlen(s)+1:0;
+}
+
+
+
+static char*strpack(char**dst, const char*s)
+{
+  char*rv=NULL;
+  if (s) {
+    size_t n=strlen(s)+1;
+    rv=memcpy(*dst, s, n);
+    *dst+=n;
+  }
+  return rv;
+}
+
+
+
+/* Everything xctrl_snapshot() asks the server about a single window */
+typedef struct {
+  GeomCookie geom;
+  PropCookie net_name;
+  PropCookie wm_name;
+  PropCookie wm_class;
+  PropCookie pid;
+  PropCookie net_desk;
+  PropCookie win_desk;
+  PropCookie type;
+  PropCookie transient;
+  PropCookie state;
+  PropCookie frame;
+} SnapshotCookies;
+
+
+
+/* Throw away the replies for a window that has gone away. */
+static void snapshot_discard(Display*disp, SnapshotCookies*ck, Bool has_types, Bool has_frames)
+{
+  prop_discard(disp, ck->net_name);
+  prop_discard(disp, ck->wm_name);
+  prop_discard(disp, ck->wm_class);
+  prop_discard(disp, ck->pid);
+  prop_discard(disp, ck->net_desk);
+  prop_discard(disp, ck->win_desk);
+  if (has_types) {
+    prop_discard(disp, ck->type);
+    prop_discard(disp, ck->transient);
+  }
+  prop_discard(disp, ck->state);
+  if (has_frames) { prop_discard(disp, ck->frame); }
+}
+
+
+
+/* The first value of a property read by prop_reply_buf(), or "ifnull". */
+#define BufToUlong(p,ifnull) ((p)?*(ulong*)(p):(ifnull))
+
+
+
+/*
+  Collect everything we know about each client window. All of the requests
+  for every window are sent first, and the replies are collected afterwards,
+  so with the XCB backend the whole snapshot costs about one round trip.
+  Replies are read into the display's scratch buffers and everything kept
+  until the end comes from its arena, so that the only allocation, once
+  those have grown big enough, is the result. The records and their strings
+  are packed into that one block, which the caller frees with free().
+  Windows that disappear while the snapshot is being taken are left out.
+*/
+XCTRL_API WindowInfo*xctrl_snapshot(Display*disp, ulong*count)
+{
+  ulong n=0;
+  ulong i;
+  ulong found=0;
+  size_t strbytes=0;
+  Bool has_types=wm_supports_atom(disp, ATOM_NET_WM_WINDOW_TYPE);
+  Bool has_frames=wm_supports_atom(disp, ATOM_NET_FRAME_EXTENTS);
+  Atom utf8=GetUTF8Atom();
+  Atom net_wm_name=GetAtom(ATOM_NET_WM_NAME);
+  Atom net_wm_pid=GetAtom(ATOM_NET_WM_PID);
+  Atom net_wm_desktop=GetAtom(ATOM_NET_WM_DESKTOP);
+  Atom win_workspace=GetAtom(ATOM_WIN_WORKSPACE);
+  Atom net_wm_window_type=GetAtom(ATOM_NET_WM_WINDOW_TYPE);
+  Atom net_wm_state=GetAtom(ATOM_NET_WM_STATE);
+  Atom net_frame_extents=GetAtom(ATOM_NET_FRAME_EXTENTS);
+  XCtrlContext*ctx=get_context(disp);
+  Window*list=get_window_list(disp, &n);
+  SnapshotCookies*cks;
+  WindowInfo*tmp;
+  WindowInfo*rv=NULL;
+  *count=0;
+  if (!(ctx&&list)) {
+    sfree(list);
+    return NULL;
+  }
+  arena_reset(&ctx->arena);
+  tmp=(WindowInfo*)arena_alloc(&ctx->arena, n*sizeof(WindowInfo));
+  cks=(SnapshotCookies*)arena_alloc(&ctx->arena, n*sizeof(SnapshotCookies));
+  if (!(tmp&&cks)) {
+    free(list);
+    return NULL;
+  }
+  memset(tmp, 0, n*sizeof(WindowInfo));
+  for (i=0; i<n; i++) {
+    Window win=list[i];
+    cks[i].geom=geom_request(disp, win);
+    cks[i].net_name=prop_request(disp, win, utf8, net_wm_name);
+    cks[i].wm_name=prop_request(disp, win, XA_STRING, XA_WM_NAME);
+    cks[i].wm_class=prop_request(disp, win, XA_STRING, XA_WM_CLASS);
+    cks[i].pid=prop_request(disp, win, XA_CARDINAL, net_wm_pid);
+    cks[i].net_desk=prop_request(disp, win, XA_CARDINAL, net_wm_desktop);
+    cks[i].win_desk=prop_request(disp, win, XA_CARDINAL, win_workspace);
+    if (has_types) {
+      cks[i].type=prop_request(disp, win, XA_ATOM, net_wm_window_type);
+      cks[i].transient=prop_request(disp, win, XA_WINDOW, XA_WM_TRANSIENT_FOR);
+    }
+    cks[i].state=prop_request(disp, win, XA_ATOM, net_wm_state);
+    if (has_frames) { cks[i].frame=prop_request(disp, win, XA_CARDINAL, net_frame_extents); }
+  }
+  for (i=0; i<n; i++) {
+    WindowInfo*wi=&tmp[found];
+    SnapshotCookies*ck=&cks[i];
+    ulong size=0;
+    char*name;
+    const char*text;
+    ulong*val;
+    Atom*atoms;
+    Window*transient;
+    if (!geom_reply(disp, ck->geom, &wi->geom, NULL)) { /* it has gone, don't ask any more */
+      snapshot_discard(disp, ck, has_types, has_frames);
+      continue;
+    }
+    text=prop_reply_buf(disp, ck->net_name, NULL, &ctx->prop_buf);
+    if (text) {
+      prop_discard(disp, ck->wm_name);
+    } else {
+      text=prop_reply_buf(disp, ck->wm_name, NULL, &ctx->prop_buf);
+      if (text) { text=display_convert_buf(ctx, text, True, &ctx->text_buf); }
+    }
+    wi->title=arena_strdup(&ctx->arena, text);
+    name=prop_reply_buf(disp, ck->wm_class, &size, &ctx->prop_buf);
+    text=name?display_convert_buf(ctx, class_join(name, size), True, &ctx->text_buf):NULL;
+    wi->class_name=arena_strdup(&ctx->arena, text);
+    wi->pid=BufToUlong(prop_reply_buf(disp, ck->pid, NULL, &ctx->prop_buf), 0);
+    val=(ulong*)prop_reply_buf(disp, ck->net_desk, NULL, &ctx->prop_buf);
+    if (val) {
+      prop_discard(disp, ck->win_desk);
+    } else {
+      val=(ulong*)prop_reply_buf(disp, ck->win_desk, NULL, &ctx->prop_buf);
+    }
+    wi->desktop=(signed long)BufToUlong(val, -2);
+    wi->type="unsupported";
+    if (has_types) {
+      atoms=(Atom*)prop_reply_buf(disp, ck->type, NULL, &ctx->prop_buf);
+      transient=NULL;
+      if (atoms) {
+        prop_discard(disp, ck->transient);
+      } else {
+        transient=(Window*)prop_reply_buf(disp, ck->transient, NULL, &ctx->prop_buf);
+      }
+      wi->type=window_type_from(disp, atoms, transient);
+    }
+    atoms=(Atom*)prop_reply_buf(disp, ck->state, &size, &ctx->prop_buf);
+    wi->state=window_state_from(disp, atoms, size);
+    wi->frame_left=wi->frame_right=wi->frame_top=wi->frame_bottom=-1;
+    val=has_frames?(ulong*)prop_reply_buf(disp, ck->frame, &size, &ctx->prop_buf):NULL;
+    if (val && (size>=4)) {
+      wi->frame_left=val[0];
+      wi->frame_right=val[1];
+      wi->frame_top=val[2];
+      wi->frame_bottom=val[3];
+    }
+    wi->win=list[i];
+    strbytes+=strsize(wi->title)+strsize(wi->class_name);
+    found++;
+  }
+  free(list);
+  stats_sync(disp); /* so errors about windows that vanished arrive before we return */
+  rv=(WindowInfo*)malloc(found*sizeof(WindowInfo)+strbytes+1);
+  if (rv) {
+    char*strings=(char*)&rv[found];
+    for (i=0; i<found; i++) {
+      rv[i]=tmp[i];
+      rv[i].title=strpack(&strings, tmp[i].title);
+      rv[i].class_name=strpack(&strings, tmp[i].class_name);
+    }
+    *count=found;
+  }
+  stats_alloc(disp, ctx->arena.grown);
+  ctx->arena.grown=0;
+  arena_reset(&ctx->arena);
+  return rv;
+}
+
+
+
+/*
+  Send "fake" keystroke events to an X window.
+  Adapted from the (public domain) example by by Adam Pierce --
+    http://www.doctort.org/adam/nerd-notes/x11-fake-keypress-event.html
+*/
+XCTRL_API void send_keystrokes(Display*disp, Window win, const char*keys)
+{
+  Bool escaped=0;
+  const char* numkeys_upper="~!@#$%^&*()_+|";
+  const char* numkeys_lower="`1234567890-=\\";
+  int navkeys[]={XK_Insert,XK_End,XK_Down,XK_Page_Down,XK_Left,-1,XK_Right,XK_Home,XK_Up,XK_Page_Up};
+  int funkeys[]={XK_F1,XK_F2,XK_F3,XK_F4,XK_F5,XK_F6,XK_F7,XK_F8,XK_F9,XK_F10,XK_F11,XK_F12};
+  unsigned const char*p;
+  char*n;
+  XEvent ev;
+  memset(&ev.xkey,0,sizeof(XKeyEvent));
+  ev.xkey.subwindow=None;
+  ev.xkey.serial=1;
+  ev.xkey.display=disp;
+  ev.xkey.window=win;
+  ev.xkey.root=DefRootWin;
+  ev.xkey.same_screen=1;
+  for (p=(unsigned const char*)keys; *p; p++) {
+    int c;
+    switch (*p) {
+      case '\n':
+        c=XK_Return;
+        break;
+      case '\t':
+        c=XK_Tab;
+        break;
+      case '\033':
+        c=XK_Escape;
+        break;
+      case '\b':
+        c=XK_BackSpace;
+        break;
+      case '%':
+        if (!escaped) {
+          escaped=True;
+          continue;
+        } else {
+          c=*p;
+          break;
+        }
+      case '^':
+        if (!escaped) {
+          ev.xkey.state|=ControlMask;
+          continue;
+        }
+      case '~':
+        if (!escaped) {
+          ev.xkey.state|=Mod1Mask;
+          continue;
+        }
+      case '+':
+        if (!escaped) {
+          ev.xkey.state|=ShiftMask;
+          continue;
+        }
+      case 'f':
+      case 'F': {
+        int f;
+        if (escaped && p[1] && strchr("01", p[1]) && (p[2]>='0') && (p[2]<='9')) {
+          char num[3]={0,0,0};
+          if (p[1]=='1') {
+            strncpy(num,(char*)p+1,2);
+          } else {
+            num[0]=p[2];
+          }
+          f=atoi(num);
+          c= ((f>0)&&(f<13)) ? funkeys[f-1] : *p;
+          p+=2;
+        } else {
+          c=*p;
+        }
+        break;
+      }
+      case '.':
+        c=escaped?XK_Delete:*p;
+        break;
+      default:
+      c=*p;
+    }
+    n=strchr(numkeys_upper,c);
+    if (n) {
+      c=numkeys_lower[n-numkeys_upper];
+      ev.xkey.state|=ShiftMask;
+    } else {
+      if (escaped && (c>='0') && (c<='9') && (c!='5')) {
+        c=navkeys[c-48];
+      } else {
+        ev.xkey.state|=isupper(c)?ShiftMask:0;
+      }
+    }
+    ev.xkey.keycode=XKeysymToKeycode(disp,c);
+    ev.xkey.type=KeyPress;
+    stats_send_event(disp, win, True, KeyPressMask,&ev);
+    usleep(1000);
+    stats_sync(disp);
+    ev.xkey.time=CurrentTime;
+    ev.xkey.type=KeyRelease;
+    stats_send_event(disp, win, True, KeyPressMask,&ev);
+    usleep(1000);
+    stats_sync(disp);
+    ev.xkey.state=0;
+    escaped=False;
+  }
+}
+
+/*********************************************************************/
+/* * * * * * * * * Clipboard and selection functions * * * * * * * * */
+/*********************************************************************/
+/* xcout() contexts */
+#define XCLIB_XCOUT_NONE  0  /* no context */
+#define XCLIB_XCOUT_SENTCONVSEL  1  /* sent a request */
+#define XCLIB_XCOUT_INCR  2  /* in an incr loop */
+#define XCLIB_XCOUT_FALLBACK  3  /* UTF8_STRING failed, need fallback to XA_STRING */
+
+/* xcin() contexts */
+#define XCLIB_XCIN_NONE    0
+#define XCLIB_XCIN_INCR    2
+
+/* Retrieves the contents of a selections. Arguments are:
+ *
+ * A display that has been opened.
+ * A window
+ * An event to process
+ * The selection to return
+ * The target(UTF8_STRING or XA_STRING) to return
+ * A pointer to a char array to put the selection into.
+ * A pointer to a long to record the length of the char array
+ * A pointer to an int to record the context in which to process the event
+ * Returns ONE if retrieval of selection data is complete, or ZERO otherwise.
+ */
+static int xcout(Display*dpy, Window win, XEvent evt, Atom sel, Atom trg, uchar**txt, ulong*len, uint*ctx)
+{
+    Atom prop = get_atom(dpy, ATOM_XCLIP_OUT); /* for other windows to put their selection into */
+    Atom inc = get_atom(dpy, ATOM_INCR);
+    Atom prop_type;
+    Atom atomUTF8String;
+    int prop_fmt;
+    uchar *buffer;  /* buffer for XGetWindowProperty to dump data into */
+    ulong prop_size;
+    ulong prop_items;
+    uchar *ltxt = *txt;   /* local buffer of text to return */
+
+
+    switch (*ctx) {
+      case XCLIB_XCOUT_NONE: { /* there is no context, do an XConvertSelection() */
+        if (*len > 0) {   /* initialise return length to 0 */
+          free(*txt);
+          *len = 0;
+        }
+        XConvertSelection(dpy, sel, trg, prop, win, CurrentTime);   /* send selection request */
+        *ctx = XCLIB_XCOUT_SENTCONVSEL;
+        return (0);
+      }
+      case XCLIB_XCOUT_SENTCONVSEL: {
+        atomUTF8String = get_atom(dpy, ATOM_UTF8_STRING);
+        if (evt.type != SelectionNotify)
+            return (0);
+
+        /* fallback to XA_STRING when UTF8_STRING failed */
+        if (trg == atomUTF8String && evt.xselection.property == None) {
+            *ctx = XCLIB_XCOUT_FALLBACK;
+            return (0);
+        }
+
+        /* find the size and format of the data in property */
+        stats_get_property( dpy, win, prop, 0, 0, False, AnyPropertyType,
+                              &prop_type, &prop_fmt, &prop_items, &prop_size, &buffer );
+        XFree(buffer);
+
+        if (prop_type == inc) {
+          XDeleteProperty(dpy, win, prop);  /* start INCR mechanism by deleting property */
+          XFlush(dpy);
+          *ctx = XCLIB_XCOUT_INCR;
+          return (0);
+        }
+
+        /* if not incr, and not format == 8, it's nothing we understand anyway. */
+        if (prop_fmt != 8) {
+          *ctx = XCLIB_XCOUT_NONE;
+          return (0);
+        }
+
+        /* not using INCR mechanism, just read the property */
+        stats_get_property( dpy, win, prop, 0, (long) prop_size, False, AnyPropertyType,
+                              &prop_type, &prop_fmt, &prop_items, &prop_size, &buffer );
+
+        /* finished with property, delete it */
+        XDeleteProperty(dpy, win, prop);
+
+        /* copy the buffer to the pointer for returned data */
+        ltxt = (uchar*) malloc(prop_items);
+        memcpy(ltxt, buffer, prop_items);
+
+        /* set the length of the returned data */
+        *len = prop_items;
+        *txt = ltxt;
+
+        /* free the buffer */
+        XFree(buffer);
+
+        *ctx = XCLIB_XCOUT_NONE;
+
+        /* complete contents of selection fetched, return 1 */
+        return (1);
+      }
+      case XCLIB_XCOUT_INCR: {
+        /* To use the INCR method, we delete the property with the selection in it,
+           wait for an event indicating that the property has been created,
+           then read it, delete it, etc. */
+
+        if (evt.type != PropertyNotify) { return (0); }
+        if (evt.xproperty.state != PropertyNewValue) { return (0); }
+
+        /* check size and format of the property */
+        stats_get_property( dpy, win, prop, 0, 0, False, AnyPropertyType,
+                              &prop_type, &prop_fmt, &prop_items, &prop_size, &buffer );
+
+        if (prop_fmt != 8) {
+          /* property is not text, deleting tells other client to send next property */
+          XFree(buffer);
+          XDeleteProperty(dpy, win, prop);
+          return (0);
+        }
+
+        if (prop_size == 0) { /* no more data, exit from loop */
+          XFree(buffer);
+          XDeleteProperty(dpy, win, prop);
+          *ctx = XCLIB_XCOUT_NONE;
+          return (1); /* INCR transfer completed */
+        }
+        XFree(buffer);
+
+        /* if we have come this far, the propery contains text, and we know the size. */
+        stats_get_property( dpy, win, prop, 0, (long) prop_size, False, AnyPropertyType,
+                              &prop_type, &prop_fmt, &prop_items, &prop_size, &buffer );
+         /* allocate memory to accommodate data in *txt */
+        if (*len == 0) {
+          *len = prop_items;
+          ltxt = (uchar*) malloc(*len);
+        } else {
+          *len += prop_items;
+          ltxt = (uchar*) realloc(ltxt, *len);
+        }
+        memcpy(&ltxt[*len - prop_items], buffer, prop_items); /* add data to ltxt */
+
+        *txt = ltxt;
+        XFree(buffer);
+        XDeleteProperty(dpy, win, prop); /* delete property to get the next item */
+        XFlush(dpy);
+        return (0);
+      }
+    }
+    return (0);
+}
+
+/* Put data into a selection, in response to a SelecionRequest event from
+ * another window (and any subsequent events relating to an INCR transfer).
+ *
+ * Arguments are:
+ *   A display
+ *   A window
+ *   The event to respond to
+ *   A pointer to an Atom. This gets set to the property nominated by the other
+ *     app in it's SelectionRequest. Things are likely to break if you change the
+ *     value of this yourself.
+ *   The target (UTF8_STRING or XA_STRING) to respond to
+ *   A pointer to an array of chars to read selection data from.
+ *   The length of the array of chars.
+ *   In case of an INCR transfer, the position within the array of chars that's being processed.
+ *   The context that event is the be processed within.
+ */
+static int xcin( Display*dpy, Window*win, XEvent evt, Atom*prop,
+                   Atom trg, uchar*txt, ulong len, ulong*pos, uint *ctx )
+{
+  ulong chunk_len;  /* length of current chunk (for incr transfers only) */
+  XEvent resp;      /* response to event */
+  Atom inc = get_atom(dpy, ATOM_INCR);
+  Atom targets = get_atom(dpy, ATOM_TARGETS);
+  /* Treat selections larger than 1/4 of the max request size as "large" per ICCCM sect. 2.5 */
+  long chunk_size = XExtendedMaxRequestSize(dpy) / 4;
+  if (!chunk_size) { chunk_size = XMaxRequestSize(dpy) / 4; }
+  switch (*ctx) {
+    case XCLIB_XCIN_NONE: {
+      if (evt.type != SelectionRequest) { return (0); }
+      *win = evt.xselectionrequest.requestor;
+      *prop = evt.xselectionrequest.property;
+      *pos = 0;
+      if (evt.xselectionrequest.target == targets) {   /* put the data into an property */
+        Atom types[2];
+        int size=(int)(sizeof(types)/sizeof(Atom));
+        types[0]=targets;
+        types[1]=trg;
+        /* send data all at once (not using INCR) */
+        XChangeProperty(dpy,*win,*prop,XA_ATOM,32,PropModeReplace,(uchar*)types,size);
+      } else if (len > chunk_size) {
+        XChangeProperty(dpy,*win,*prop,inc,32,PropModeReplace,0,0); /* send INCR response */
+        /* With INCR, we need to know when requestor window changes/deletes properties */
+        XSelectInput(dpy, *win, PropertyChangeMask);
+        *ctx = XCLIB_XCIN_INCR;
+      } else {
+        XChangeProperty(dpy,*win,*prop,trg,8,PropModeReplace,(uchar*)txt,(int)len); /* All, not INCR */
+      }
+
+      /* FIXME? According to ICCCM section 2.5, we should confirm that X ChangeProperty
+         succeeded without any Alloc errors before replying with SelectionNotify.
+         However, doing so would require an error handler which modifies a global
+         variable, plus doing XSync after each X ChangeProperty. */
+      resp.xselection.property = *prop;
+      resp.xselection.type = SelectionNotify;
+      resp.xselection.display = evt.xselectionrequest.display;
+      resp.xselection.requestor = *win;
+      resp.xselection.selection = evt.xselectionrequest.selection;
+      resp.xselection.target = evt.xselectionrequest.target;
+      resp.xselection.time = evt.xselectionrequest.time;
+      stats_send_event(dpy, evt.xselectionrequest.requestor, 0, 0, &resp); /* send response event */
+      XFlush(dpy);
+      return (len > chunk_size) ? 0 : 1; /* if data sent all at once, transfer is complete. */
+      break;
+    }
+    case XCLIB_XCIN_INCR: {
+      if (evt.type != PropertyNotify) { return (0); } /* ignore non-property events */
+      if (evt.xproperty.state != PropertyDelete) { return (0); }   /* only interest in deleted props */
+      chunk_len = chunk_size; /* set length to max size */
+      /* if a max-sized chunk length would extend past end, set length to remaining txt length */
+      if ((*pos + chunk_len) > len) { chunk_len = len - *pos; }
+
+      /* if start of chunk is beyond end of txt, then we've sent all data, so set length to zero */
+      if (*pos > len) { chunk_len = 0; }
+      if (chunk_len) {  /* put chunk into property */
+        XChangeProperty(dpy,*win,*prop,trg,8,PropModeReplace,&txt[*pos],(int)chunk_len);
+      } else {
+        XChangeProperty(dpy,*win,*prop,trg,8,PropModeReplace,0,0); /* empty prop shows we're done */
+      }
+      XFlush(dpy);
+      if (!chunk_len) { *ctx = XCLIB_XCIN_NONE; }   /* all data is sent, break out of the loop */
+      *pos += chunk_size;
+      return (chunk_len==0) ? 1 : 0; /* chunk_len == 0 means we finished the transfer. */
+      break;
+    }
+  }
+  return (0);
+}
+
+
+
+static Atom selarg_to_seltype(Display*dpy, char arg)
+{
+  switch (arg) {
+    case 'p': return XA_PRIMARY;
+    case 's': return XA_SECONDARY;
+    case 'b': return XA_STRING;
+    case 'c': return get_atom(dpy, ATOM_CLIPBOARD);
+    default:return XA_PRIMARY;
+  }
+}
+
+
+static Window make_selection_window(Display*dpy)
+{
+  Window win = XCreateSimpleWindow(dpy, DefaultRootWindow(dpy), 0, 0, 1, 1, 0, 0, 0);
+  XSelectInput(dpy, win, PropertyChangeMask);
+  return win;
+}
+
+
+
+XCTRL_API void set_selection(Display*dpy, char kind, char*sel_buf, Bool utf8)
+{
+  Atom seltype=selarg_to_seltype(dpy,kind);
+  long sel_len=strlen(sel_buf);
+  if (seltype == XA_STRING) {
+    XStoreBuffer(dpy, (char*)sel_buf, (int)sel_len, 0);
+  } else {
+    XEvent evt;
+    Window win = make_selection_window(dpy);
+    Atom target = utf8 ? get_atom(dpy, ATOM_UTF8_STRING) : XA_STRING;
+    uint clear = 0;
+    uint context = XCLIB_XCIN_NONE;
+    ulong sel_pos = 0;
+    Window cwin = None;
+    Atom pty = None;
+    /* FIXME: Should not use CurrentTime per ICCCM section 2.1 */
+    XSetSelectionOwner(dpy, seltype, win, CurrentTime);
+    while (1) {  /* wait for a SelectionRequest event */
+      int finished;
+      XNextEvent(dpy, &evt);
+      finished = xcin(dpy, &cwin, evt, &pty, target, (uchar*)sel_buf, sel_len, &sel_pos, &context);
+      if (evt.type == SelectionClear) { clear = 1; }
+      if ((context == XCLIB_XCIN_NONE) && clear) { break; }
+      if (finished) { break; }
+    }
+    XDestroyWindow(dpy,win);
+  }
+}
+
+
+
+XCTRL_API uchar* get_selection(Display*dpy, char kind, Bool utf8)
+{
+  uchar *sel_buf=NULL;  /* buffer for selection data */
+  ulong sel_len = 0;  /* length of sel_buf */
+  XEvent evt;      /* X Event Structures */
+  uchar*result=NULL;       /* null-terminated copy of sel_buf */
+  uint context = XCLIB_XCOUT_NONE;
+  Window win = make_selection_window(dpy);
+  Atom seltype = selarg_to_seltype(dpy,kind);
+  Atom target = utf8 ? get_atom(dpy, ATOM_UTF8_STRING) : XA_STRING;
+  if (seltype == XA_STRING) {
+    sel_buf = (uchar*) XFetchBuffer(dpy, (int *) &sel_len, 0);
+  } else {
+    while (1) {
+      if (context != XCLIB_XCOUT_NONE) { XNextEvent(dpy, &evt); }
+      xcout(dpy, win, evt, seltype, target, &sel_buf, &sel_len, &context);
+      if (context == XCLIB_XCOUT_FALLBACK) {
+        context = XCLIB_XCOUT_NONE;
+        target = XA_STRING;
+        continue;
+      }
+      if (context == XCLIB_XCOUT_NONE) { break; }
+    }
+  }
+  if (sel_buf) {
+    result=(uchar*)calloc(sel_len+1,1);
+    strncpy((char*)result, (char*)sel_buf, sel_len);
+    result[sel_len]='\0';
+    if (seltype == XA_STRING) { XFree(sel_buf); } else { free(sel_buf); }
+  }
+  XDestroyWindow(dpy,win);
+  return result;
+}
+
+
+/*********************************************************************/
+/* * * * * * * * * * * * *  Event Listener * * * * * * * * * * * * * */
+/*********************************************************************/
+
+/*
+  Portions of the event listener were adapted from "F***ing Small Panel" 
+  Copyright (c) 2000-2002 by Peter Zelezny, which was released under a 
+  MIT/X style license.
+*/
+
+/*
+  The listener's copy of _NET_CLIENT_LIST, kept between updates so the
+  buffer is only reallocated when the list outgrows it.
+*/
+typedef struct _ClientList {
+  Window*items;
+  ulong count;
+  ulong size;  /* allocated length of items */
+  ulong hint;  /* how many longs to ask for on the next read */
+} ClientList;
+
+#define CLIENT_LIST_FIRST_READ 1024
+#define CLIENT_LIST_SLACK 64
+
+
+
+/*
+  Read the whole client list. The read is sized from the previous one, so it
+  normally takes one round trip; if the list has grown past that, the reply
+  tells us by how much and we ask again for exactly that many. If the list
+  can't be read, the previous one is kept and False is returned.
+*/
+static Bool read_client_list(Display*disp, ClientList*list) {
+  Atom a=GetAtom(ATOM_NET_CLIENT_LIST);
+  Atom ret_type;
+  int format;
+  ulong nitems=0;
+  ulong after=0;
+  unsigned char*retp=NULL;
+  long len=list->hint?(long)list->hint:CLIENT_LIST_FIRST_READ;
+  for (;;) {
+    if (stats_get_property(disp,DefRootWin,a,0,len,False,XA_WINDOW,&ret_type,&format,&nitems,&after,&retp) != Success) {
+      return False;
+    }
+    if ((ret_type != XA_WINDOW) || (format != 32)) {
+      if (retp) { XFree(retp); }
+      list->count=0;
+      return True;
+    }
+    if (!after) { break; }
+    XFree(retp);
+    len=(long)(nitems+(after+3)/4);
+  }
+  if (nitems > list->size) {
+    Window*items=(Window*)realloc(list->items, (nitems+CLIENT_LIST_SLACK)*sizeof(Window));
+    if (!items) {
+      XFree(retp);
+      return False;
+    }
+    list->items=items;
+    list->size=nitems+CLIENT_LIST_SLACK;
+  }
+  if (nitems) { memcpy(list->items, retp, nitems*sizeof(Window)); }
+  list->count=nitems;
+  list->hint=nitems+CLIENT_LIST_SLACK;
+  XFree(retp);
+  return True;
+}
+
+
+
+static int window_has_prop(Display*disp, Window w, Atom a, Atom type) {
+  Atom ret_type;
+  int format;
+  ulong nitems;
+  ulong after;
+  unsigned char *retp;
+  int ret=0;
+  if (stats_get_property(disp,w,a,0,1024,False,type,&ret_type,&format,&nitems,&after,&retp) == Success) {
+    if (retp) {
+      XFree(retp);
+      if (ret_type == type) { ret=1; }
+    }
+  }
+  return ret;
+}
+
+
+
+static int has_net_wm_name(Display*disp, Window w) {
+  return window_has_prop(disp, w, GetAtom(ATOM_NET_WM_NAME), GetUTF8Atom());
+}
+
+
+
+static int has_net_wm_state(Display*disp, Window w) {
+  return window_has_prop(disp, w, GetAtom(ATOM_NET_WM_STATE), XA_ATOM);
+}
+
+
+
+/* Set this to 1 to print unhandled events to stderr */
+#define PRINT_UNHANDLED_EVENTS 0
+
+enum {
+  EV_NET_ACTIVE_WINDOW,
+  EV_NET_CLIENT_LIST,
+  EV_NET_CURRENT_DESKTOP,
+  EV_NET_WM_NAME,
+  EV_NET_WM_ICON_NAME,
+  EV_NET_WM_STATE,
+  EV_WM_NAME,
+  EV_WM_ICON_NAME,
+  EV_WM_STATE,
+  EVENT_ATOM_COUNT
+};
+
+static const int event_ids[EVENT_ATOM_COUNT]={
+  ATOM_NET_ACTIVE_WINDOW,
+  ATOM_NET_CLIENT_LIST,
+  ATOM_NET_CURRENT_DESKTOP,
+  ATOM_NET_WM_NAME,
+  ATOM_NET_WM_ICON_NAME,
+  ATOM_NET_WM_STATE,
+  -1, /* WM_NAME */
+  -1, /* WM_ICON_NAME */
+  ATOM_WM_STATE
+};
+
+
+/* What the event listener keeps between calls to xctrl_event_dispatch() */
+/*
+  PropertyNotify atoms are looked up in a small open-addressed table, keyed
+  on the atom, that gives the EV_* tag directly.
+*/
+#define EVENT_SLOTS 32
+
+typedef struct _EventSlot {
+  Atom atom;
+  int tag;
+} EventSlot;
+
+/* The header of each record in an event log, see "Recording and replay" */
+typedef struct _RecHeader {
+  uint32_t kind;
+  uint32_t size;
+  uint64_t time_us;
+} RecHeader;
+
+struct _Listener {
+  EventCallback cb;
+  EventCallbackEx cb_ex; /* used instead of cb if set */
+  void*cb_data;
+  long desktop;          /* the current desktop, for XCTRL_EVENT_DESKTOP_SWITCH */
+  ulong generation;
+  ClientList clients;
+  EventSlot event_slots[EVENT_SLOTS];
+  ulong mask;            /* XCTRL_EVENT_MASK() bits the caller wants */
+  Window only;           /* if set, the one client we are interested in */
+  long client_mask;      /* what we select on each client, may be zero */
+  Bool track_clients;    /* keep following _NET_CLIENT_LIST */
+  Bool stopped; /* the callback has returned zero */
+  Bool dispatching;      /* inside xctrl_event_dispatch() */
+  Bool ended;            /* xctrl_listen_end() was called from a callback */
+  Window root;
+  long root_mask;        /* what the root window selected before we started */
+  FILE*record;           /* log being written, see xctrl_listen_record() */
+  FILE*replay;           /* log being read back, instead of asking the server */
+  RecHeader peek;        /* the next record's header, if "peeked" is set */
+  Bool peeked;
+  ulong start_us;        /* when the recording started */
+  Arena arena;           /* memory for the event being delivered */
+};
+
+#define Wants(lst,ev) ((lst)->mask&XCTRL_EVENT_MASK(ev))
+
+
+
+/* Are the clients selected for the events that keep the mirror up to date? */
+static Bool listener_mirror_ok(XCtrlContext*ctx)
+{
+  long need=PropertyChangeMask|StructureNotifyMask;
+  return (ctx->listener->client_mask&need)==need;
+}
+
+
+
+static void event_slot_add(Listener*lst, Atom atom, int tag)
+{
+  ulong h=atom&(EVENT_SLOTS-1);
+  while (lst->event_slots[h].atom!=None) { h=(h+1)&(EVENT_SLOTS-1); }
+  lst->event_slots[h].atom=atom;
+  lst->event_slots[h].tag=tag;
+}
+
+
+
+static int event_slot_find(Listener*lst, Atom atom)
+{
+  ulong h=atom&(EVENT_SLOTS-1);
+  while (lst->event_slots[h].atom!=None) {
+    if (lst->event_slots[h].atom==atom) { return lst->event_slots[h].tag; }
+    h=(h+1)&(EVENT_SLOTS-1);
+  }
+  return -1;
+}
+
+
+
+/* The X events we need from each client to produce the events in "mask" */
+static long client_event_mask(XCtrlContext*ctx, ulong mask)
+{
+  long xmask=0;
+  if (ctx->mirror || (mask&(XCTRL_EVENT_MASK(XCTRL_EVENT_WINDOW_TITLE)|XCTRL_EVENT_MASK(XCTRL_EVENT_WINDOW_STATE)))) {
+    xmask|=PropertyChangeMask;
+  }
+  if (mask&(XCTRL_EVENT_MASK(XCTRL_EVENT_WINDOW_FOCUS_GAINED)|XCTRL_EVENT_MASK(XCTRL_EVENT_WINDOW_FOCUS_LOST))) {
+    xmask|=FocusChangeMask;
+  }
+  if (ctx->mirror || (mask&XCTRL_EVENT_MASK(XCTRL_EVENT_WINDOW_MOVE_RESIZE))) {
+    xmask|=StructureNotifyMask;
+  }
+  return xmask;
+}
+
+
+
+/*********************************************************************/
+/* * * * * * * * * * * *  Recording and replay  * * * * * * * * * * * */
+/*********************************************************************/
+
+/*
+  An event log is the magic string followed by records, each one a RecHeader
+  and "size" bytes of payload, in host byte order. It holds every event the
+  listener received, along with the answer to every question the listener
+  asked the server while handling them, in the order it asked. Replaying
+  the log through the same dispatch code gives the callbacks exactly the
+  same sequence without a display.
+*/
+#define REC_MAGIC "XCTRLEV1"
+
+enum {
+  REC_START,       /* root window, event mask, window filter, track_clients, then the atom for each EV_* tag */
+  REC_EVENT,       /* a RecEvent */
+  REC_CLIENT_LIST, /* the client list, as 64-bit ids */
+  REC_DESKTOP,     /* the current desktop */
+  REC_HAS_PROP,    /* the answer from has_net_wm_name() or has_net_wm_state() */
+  REC_TITLE        /* a window title, empty for none */
+};
+
+#define REC_START_SIZE (4+EVENT_ATOM_COUNT)
+
+/* Only the fields the listener looks at are kept. */
+typedef struct _RecEvent {
+  int32_t type;
+  int32_t send_event;
+  uint64_t window;
+  uint64_t atom;
+  int32_t x, y, width, height;
+  int32_t mode, detail;
+} RecEvent;
+
+
+
+static void rec_write(Listener*lst, int kind, const void*data, size_t size)
+{
+  RecHeader hdr;
+  hdr.kind=kind;
+  hdr.size=size;
+  hdr.time_us=now_us()-lst->start_us;
+  if ((fwrite(&hdr, sizeof(hdr), 1, lst->record)!=1) || (size && (fwrite(data, size, 1, lst->record)!=1))) {
+    fclose(lst->record); /* disk full, most likely: stop recording */
+    lst->record=NULL;
+  }
+}
+
+
+
+/*
+  Read the next record, which must be of the given kind. Returns a newly
+  allocated payload, or NULL if the log doesn't match what we are doing,
+  in which case the replay stops.
+*/
+static void*rec_read(Listener*lst, int kind, RecHeader*hdr)
+{
+  void*data;
+  if (lst->peeked) {
+    *hdr=lst->peek;
+    lst->peeked=False;
+  } else if (lst->stopped || (fread(hdr, sizeof(RecHeader), 1, lst->replay)!=1)) {
+    lst->stopped=True;
+    return NULL;
+  }
+  if (lst->stopped || (hdr->kind!=(uint32_t)kind)) {
+    lst->stopped=True;
+    return NULL;
+  }
+  data=malloc(hdr->size+1);
+  if (!data || (hdr->size && (fread(data, hdr->size, 1, lst->replay)!=1))) {
+    sfree(data);
+    lst->stopped=True;
+    return NULL;
+  }
+  ((char*)data)[hdr->size]='\0';
+  return data;
+}
+
+
+
+/*
+  Is the next record of this kind? Its header is kept for rec_read(), so
+  the log is never read twice and can come from a pipe.
+*/
+static Bool rec_next_is(Listener*lst, int kind)
+{
+  if (lst->stopped) { return False; }
+  if (!lst->peeked) {
+    if (fread(&lst->peek, sizeof(RecHeader), 1, lst->replay)!=1) { return False; }
+    lst->peeked=True;
+  }
+  return (lst->peek.kind==(uint32_t)kind);
+}
+
+
+
+static void rec_write_event(Listener*lst, XEvent*ev)
+{
+  RecEvent re;
+  memset(&re, 0, sizeof(re));
+  re.type=ev->type;
+  re.send_event=ev->xany.send_event;
+  re.window=ev->xany.window;
+  switch (ev->type) {
+    case PropertyNotify: {
+      re.window=ev->xproperty.window;
+      re.atom=ev->xproperty.atom;
+      break;
+    }
+    case ConfigureNotify: {
+      re.window=ev->xconfigure.window;
+      re.x=ev->xconfigure.x;
+      re.y=ev->xconfigure.y;
+      re.width=ev->xconfigure.width;
+      re.height=ev->xconfigure.height;
+      break;
+    }
+    case FocusIn:
+    case FocusOut: {
+      re.mode=ev->xfocus.mode;
+      re.detail=ev->xfocus.detail;
+      break;
+    }
+  }
+  rec_write(lst, REC_EVENT, &re, sizeof(re));
+}
+
+
+
+static void rec_event_to_xevent(RecEvent*re, XEvent*ev)
+{
+  memset(ev, 0, sizeof(XEvent));
+  ev->type=re->type;
+  ev->xany.send_event=re->send_event;
+  ev->xany.window=re->window;
+  switch (re->type) {
+    case PropertyNotify: {
+      ev->xproperty.window=re->window;
+      ev->xproperty.atom=re->atom;
+      break;
+    }
+    case ConfigureNotify: {
+      ev->xconfigure.window=re->window;
+      ev->xconfigure.x=re->x;
+      ev->xconfigure.y=re->y;
+      ev->xconfigure.width=re->width;
+      ev->xconfigure.height=re->height;
+      break;
+    }
+    case FocusIn:
+    case FocusOut: {
+      ev->xfocus.mode=re->mode;
+      ev->xfocus.detail=re->detail;
+      break;
+    }
+  }
+}
+
+
+
+/*
+  The listener asks the server its questions through these, so that a
+  recording captures the answers and a replay can give them back.
+  A client list that can't be read leaves the previous one in place, and
+  returns False so the caller doesn't take it as news. The unchanged list
+  is still recorded, to keep a replay in step.
+*/
+static Bool listener_read_clients(Display*disp, Listener*lst)
+{
+  ulong i;
+  Bool ok;
+  if (lst->replay) {
+    RecHeader hdr;
+    uint64_t*ids=(uint64_t*)rec_read(lst, REC_CLIENT_LIST, &hdr);
+    ulong n=ids?hdr.size/sizeof(uint64_t):0;
+    if (n>lst->clients.size) {
+      Window*items=(Window*)realloc(lst->clients.items, n*sizeof(Window));
+      if (!items) {
+        free(ids);
+        return False;
+      }
+      lst->clients.items=items;
+      lst->clients.size=n;
+    }
+    for (i=0; i<n; i++) { lst->clients.items[i]=ids[i]; }
+    lst->clients.count=n;
+    sfree(ids);
+    return True;
+  }
+  ok=read_client_list(disp, &lst->clients);
+  if (lst->record) {
+    uint64_t*ids=(uint64_t*)malloc((lst->clients.count+1)*sizeof(uint64_t));
+    if (ids) {
+      for (i=0; i<lst->clients.count; i++) { ids[i]=lst->clients.items[i]; }
+      rec_write(lst, REC_CLIENT_LIST, ids, lst->clients.count*sizeof(uint64_t));
+      free(ids);
+    }
+  }
+  return ok;
+}
+
+
+
+static long listener_desktop(Display*disp, Listener*lst)
+{
+  int64_t desk;
+  if (lst->replay) {
+    RecHeader hdr;
+    int64_t*p=(int64_t*)rec_read(lst, REC_DESKTOP, &hdr);
+    desk=(p && (hdr.size==sizeof(desk)))?*p:-1;
+    sfree(p);
+    return desk;
+  }
+  desk=get_current_desktop(disp);
+  if (lst->record) { rec_write(lst, REC_DESKTOP, &desk, sizeof(desk)); }
+  return desk;
+}
+
+
+
+static Bool listener_has_prop(Display*disp, Listener*lst, Window win, Bool state)
+{
+  int32_t has;
+  if (lst->replay) {
+    RecHeader hdr;
+    int32_t*p=(int32_t*)rec_read(lst, REC_HAS_PROP, &hdr);
+    has=(p && (hdr.size==sizeof(has)))?*p:0;
+    sfree(p);
+    return has;
+  }
+  has=state?has_net_wm_state(disp, win):has_net_wm_name(disp, win);
+  if (lst->record) { rec_write(lst, REC_HAS_PROP, &has, sizeof(has)); }
+  return has;
+}
+
+
+
+#define LISTENER_TITLE_SIZE 256
+
+/* The title for an event, in the listener's arena. */
+static const char*listener_title(Display*disp, Listener*lst, Window win)
+{
+  char*title;
+  long len;
+  if (lst->replay) { /* logs made before titles were always recorded may not have one */
+    RecHeader hdr;
+    char*rec=rec_next_is(lst, REC_TITLE)?(char*)rec_read(lst, REC_TITLE, &hdr):NULL;
+    title=(rec && *rec)?arena_strdup(&lst->arena, rec):NULL;
+    sfree(rec);
+    return title;
+  }
+  title=(char*)arena_alloc(&lst->arena, LISTENER_TITLE_SIZE);
+  len=title?get_window_title_into(disp, win, title, LISTENER_TITLE_SIZE):-1;
+  if (len>=LISTENER_TITLE_SIZE) {
+    title=(char*)arena_alloc(&lst->arena, len+1);
+    len=title?get_window_title_into(disp, win, title, len+1):-1;
+  }
+  if (len<0) { title=NULL; }
+  if (lst->record) { rec_write(lst, REC_TITLE, title?title:"", title?strlen(title):0); }
+  return title;
+}
+
+
+
+/*
+  Record everything the next listener on this display does to "path",
+  or stop recording if "path" is NULL. Returns False if the file can't be
+  created.
+*/
+XCTRL_API Bool xctrl_listen_record(Display*disp, const char*path)
+{
+  XCtrlContext*ctx=get_context(disp);
+  if (!ctx) { return False; }
+  if (ctx->listen_record) {
+    fclose(ctx->listen_record);
+    ctx->listen_record=NULL;
+  }
+  if (path) {
+    ctx->listen_record=fopen(path, "wb");
+    return ctx->listen_record!=NULL;
+  }
+  return True;
+}
+
+
+
+static void listener_start_record(Listener*lst, FILE*f)
+{
+  uint64_t start[REC_START_SIZE];
+  int i;
+  lst->record=f;
+  lst->start_us=now_us();
+  if (fwrite(REC_MAGIC, strlen(REC_MAGIC), 1, f)!=1) {
+    fclose(f);
+    lst->record=NULL;
+    return;
+  }
+  start[0]=lst->root;
+  start[1]=lst->mask;
+  start[2]=lst->only;
+  start[3]=lst->track_clients;
+  for (i=0; i<EVENT_ATOM_COUNT; i++) { start[i+4]=None; }
+  for (i=0; i<EVENT_SLOTS; i++) {
+    if (lst->event_slots[i].atom!=None) { start[lst->event_slots[i].tag+4]=lst->event_slots[i].atom; }
+  }
+  rec_write(lst, REC_START, start, sizeof(start));
+}
+
+
+
+/*
+  Hand an event to whichever callback the listener was started with. The
+  title is only fetched here, and only for the extended callback or while
+  recording, so that plain callbacks never pay for it otherwise. Recording
+  it either way lets the log be replayed with either kind of callback.
+*/
+static int listener_emit(Display*disp, Listener*lst, EventInfo*info)
+{
+  int rv;
+  if (!Wants(lst, info->ev)) { return 1; }
+  if ((info->ev==XCTRL_EVENT_WINDOW_TITLE) && !info->title && (lst->cb_ex||lst->record||lst->replay)) {
+    info->title=listener_title(disp, lst, info->win);
+  }
+  if (lst->cb_ex) {
+    info->version=XCTRL_EVENT_INFO_VERSION;
+    rv=lst->cb_ex(info, lst->cb_data);
+  } else {
+    rv=lst->cb(info->ev, info->win, lst->cb_data);
+  }
+  if (lst->stopped) { rv=0; } /* ended from the callback */
+  if (disp && lst->arena.grown) {
+    stats_alloc(disp, lst->arena.grown);
+    lst->arena.grown=0;
+  }
+  arena_reset(&lst->arena);
+  return rv;
+}
+
+
+
+static int emit_simple(Display*disp, Listener*lst, int ev, Window win)
+{
+  EventInfo info;
+  memset(&info, 0, sizeof(info));
+  info.ev=ev;
+  info.win=win;
+  return listener_emit(disp, lst, &info);
+}
+
+
+
+static int emit_configure(Display*disp, Listener*lst, WinListItem*rec, Window win, XConfigureEvent*ce)
+{
+  EventInfo info;
+  memset(&info, 0, sizeof(info));
+  info.ev=XCTRL_EVENT_WINDOW_MOVE_RESIZE;
+  info.win=win;
+  if (rec) {
+    info.geom=rec->configure_geom;
+    info.geom_root=rec->configure_root;
+  } else if (ce) {
+    info.geom.x=ce->x;
+    info.geom.y=ce->y;
+    info.geom.w=ce->width;
+    info.geom.h=ce->height;
+    info.geom_root=ce->send_event;
+  }
+  return listener_emit(disp, lst, &info);
+}
+
+
+
+static void record_configure(WinListItem*rec, XConfigureEvent*ce)
 {
-  Window win = XCreateSimpleWindow(dpy, DefaultRootWindow(dpy), 0, 0, 1, 1, 0, 0, 0);
-  XSelectInput(dpy, win, PropertyChangeMask);
-  return win;
+  rec->configure_geom.x=ce->x;
+  rec->configure_geom.y=ce->y;
+  rec->configure_geom.w=ce->width;
+  rec->configure_geom.h=ce->height;
+  rec->configure_root=ce->send_event;
 }
 
 
 
-XCTRL_API void set_selection(Display*dpy, char kind, char*sel_buf, Bool utf8)
+/*
+  Keep the mirror's geometry in step with a configure event, giving the
+  same answer as get_window_geom(): the window's root origin plus its
+  position in its parent. A synthetic event from the window manager has
+  the outer corner in root coordinates (ICCCM 4.1.5). A real one only has
+  the position in the parent, and the parent may have moved too, so it
+  just updates that and leaves the geometry to be read again.
+*/
+static void mirror_configure(WinListItem*rec, XConfigureEvent*ce)
 {
-  Atom seltype=selarg_to_seltype(dpy,kind);
-  long sel_len=strlen(sel_buf);
-  if (seltype == XA_STRING) {
-    XStoreBuffer(dpy, (char*)sel_buf, (int)sel_len, 0);
+  if (!ce->send_event) {
+    rec->parent_pos.x=ce->x;
+    rec->parent_pos.y=ce->y;
+    rec->parent_pos_valid=True;
+    rec->valid&=~MIRROR_GEOM;
+  } else if (rec->parent_pos_valid) {
+    rec->geom.x=ce->x+ce->border_width+rec->parent_pos.x;
+    rec->geom.y=ce->y+ce->border_width+rec->parent_pos.y;
+    rec->geom.w=ce->width;
+    rec->geom.h=ce->height;
+    rec->valid|=MIRROR_GEOM;
   } else {
-    XEvent evt;
-    Window win = make_selection_window(dpy);
-    Atom target = utf8 ? XA_UTF8_STRING(dpy) : XA_STRING;
-    /* FIXME: Should not use CurrentTime per ICCCM section 2.1 */
-    XSetSelectionOwner(dpy, seltype, win, CurrentTime);
-    while (1) {  /* wait for a SelectionRequest event */
-      static uint clear = 0;
-      static uint context = XCLIB_XCIN_NONE;
-      static ulong sel_pos = 0;
-      static Window cwin;
-      static Atom pty;
-      int finished;
-      XNextEvent(dpy, &evt);
-      finished = xcin(dpy, &cwin, evt, &pty, target, (uchar*)sel_buf, sel_len, &sel_pos, &context);
-      if (evt.type == SelectionClear) { clear = 1; }
-      if ((context == XCLIB_XCIN_NONE) && clear) { break; }
-      if (finished) { break; }
-    }
-    XDestroyWindow(dpy,win);
+    rec->valid&=~MIRROR_GEOM;
   }
 }
 
 
 
-XCTRL_API uchar* get_selection(Display*dpy, char kind, Bool utf8)
+static void mirror_configure_window(XCtrlContext*ctx, XConfigureEvent*ce)
 {
-  uchar *sel_buf=NULL;  /* buffer for selection data */
-  ulong sel_len = 0;  /* length of sel_buf */
-  XEvent evt;      /* X Event Structures */
-  uchar*result=NULL;       /* null-terminated copy of sel_buf */
-  uint context = XCLIB_XCOUT_NONE;
-  Window win = make_selection_window(dpy);
-  Atom seltype = selarg_to_seltype(dpy,kind);
-  Atom target = utf8 ? XA_UTF8_STRING(dpy) : XA_STRING;
-  if (seltype == XA_STRING) {
-    sel_buf = (uchar*) XFetchBuffer(dpy, (int *) &sel_len, 0);
-  } else {
-    while (1) {
-      if (context != XCLIB_XCOUT_NONE) { XNextEvent(dpy, &evt); }
-      xcout(dpy, win, evt, seltype, target, &sel_buf, &sel_len, &context);
-      if (context == XCLIB_XCOUT_FALLBACK) {
-        context = XCLIB_XCOUT_NONE;
-        target = XA_STRING;
-        continue;
-      }
-      if (context == XCLIB_XCOUT_NONE) { break; }
+  WinListItem*rec=winset_find(&ctx->winlist, ce->window);
+  if (rec) { mirror_configure(rec, ce); }
+}
+
+
+
+static int coalesce_configure(Display*disp, XCtrlContext*ctx, XEvent*ev)
+{
+  Window win=ev->xconfigure.window;
+  WinListItem*rec=winset_find(&ctx->winlist, win);
+  if (rec && ctx->mirror) { mirror_configure(rec, &ev->xconfigure); }
+  while (XCheckTypedWindowEvent(disp, win, ConfigureNotify, ev)) {
+    if (ctx->listener->record) { rec_write_event(ctx->listener, ev); }
+    if (rec && ctx->mirror) { mirror_configure(rec, &ev->xconfigure); }
+    ctx->events_dropped++;
+  }
+  if (!rec) { return emit_configure(disp, ctx->listener, NULL, win, &ev->xconfigure); }
+  record_configure(rec, &ev->xconfigure);
+  if (rec->configure_pending) { /* the held-back one is superseded */
+    ctx->events_dropped++;
+  }
+  if ((now_ms()-rec->configure_time) >= (ulong)ctx->coalesce_ms) {
+    if (rec->configure_pending) {
+      rec->configure_pending=False;
+      ctx->winlist.pending--;
     }
+    rec->configure_time=now_ms();
+    return emit_configure(disp, ctx->listener, rec, win, NULL);
   }
-  if (sel_buf) {
-    result=(uchar*)calloc(sel_len+1,1);
-    strncpy((char*)result, (char*)sel_buf, sel_len);
-    result[sel_len]='\0';
-    if (seltype == XA_STRING) { XFree(sel_buf); } else { free(sel_buf); }
+  if (!rec->configure_pending) {
+    rec->configure_pending=True;
+    ctx->winlist.pending++;
   }
-  XDestroyWindow(dpy,win);
-  return result;
+  return 1;
 }
 
 
-/*********************************************************************/
-/* * * * * * * * * * * * *  Event Listener * * * * * * * * * * * * * */
-/*********************************************************************/
 
 /*
-  Portions of the event listener were adapted from "F***ing Small Panel" 
-  Copyright (c) 2000-2002 by Peter Zelezny, which was released under a 
-  MIT/X style license.
+  Deliver any held-back MOVE_RESIZE events whose interval has passed. Sets
+  "wait" to the milliseconds until the next one falls due.
 */
-
-static Window*get_net_client_list(Display*disp, ulong*nitems) {
-  Atom type=XA_WINDOW;
-  static Atom a=0;
-  static Display*old_disp=NULL;
-  Atom ret_type;
-  int format;
-  ulong after=0;
-  unsigned char *retp;
-  if (disp!=old_disp) { 
-    old_disp=disp;
-    a=XInternAtom(disp, "_NET_CLIENT_LIST", False);
-  }
-  if (XGetWindowProperty(disp,DefRootWin,a,0,1024,False,type,&ret_type,&format,nitems,&after,&retp) != Success) {
-    *nitems=0;
-    return NULL;
-  }
-  if (ret_type != type) {
-    XFree(retp);
-    *nitems=0;
-    return NULL;
+static int flush_configures(Display*disp, XCtrlContext*ctx, int*wait)
+{
+  WinSet*set=&ctx->winlist;
+  ulong now=now_ms();
+  ulong next=(ulong)ctx->coalesce_ms;
+  ulong i;
+  for (i=0; i<set->size && set->pending; i++) {
+    WinListItem*p;
+    for (p=set->buckets[i]; p; p=p->next) {
+      if (p->configure_pending) {
+        ulong elapsed=now-p->configure_time;
+        if (elapsed >= (ulong)ctx->coalesce_ms) {
+          p->configure_pending=False;
+          set->pending--;
+          p->configure_time=now;
+          if (!emit_configure(disp, ctx->listener, p, p->win, NULL)) { return 0; }
+        } else if (((ulong)ctx->coalesce_ms-elapsed) < next) {
+          next=(ulong)ctx->coalesce_ms-elapsed;
+        }
+      }
+    }
   }
-  return (Window*)retp;
+  *wait=(int)next;
+  return 1;
 }
 
 
 
-static int window_has_prop(Display*disp, Window w, Atom a, Atom type) {
-  Atom ret_type;
-  int format;
-  ulong nitems;
-  ulong after;
-  unsigned char *retp;
-  int ret=0;
-  if (XGetWindowProperty(disp,w,a,0,1024,False,type,&ret_type,&format,&nitems,&after,&retp) == Success) {
-    if (retp) {
-      XFree(retp);
-      if (ret_type == type) { ret=1; }
-    }
+static void watch_client(WinSet*set, Display*dpy, Window win, ulong generation, long xmask)
+{
+  WinListItem*t=winset_add(set, win);
+  if (t) {
+    t->generation=generation;
+    if (xmask && dpy) { XSelectInput(dpy,win,xmask); }
   }
-  return ret;
 }
 
 
 
-static int has_net_wm_name(Display*disp, Window w) {
-  static Display*old_disp=NULL;
-  static Atom type=0;
-  static Atom a=0;
-  if (disp!=old_disp) {
-    old_disp=disp;
-    a=XInternAtom(disp, "_NET_WM_NAME", False);
-    type=XInternAtom(disp, "UTF8_STRING", False);
+static void listener_free(XCtrlContext*ctx)
+{
+  if (ctx->listener) {
+    winset_free_all(&ctx->winlist);
+    sfree(ctx->listener->clients.items);
+    if (ctx->listener->record) { fclose(ctx->listener->record); }
+    arena_free(&ctx->listener->arena);
+    free(ctx->listener);
+    ctx->listener=NULL;
   }
-  return window_has_prop(disp, w, a, type);
+  ctx->listening=False;
+  ctx->mirror_live=False;
 }
 
 
 
-static int has_net_wm_state(Display*disp, Window w) {
-  static Display*old_disp=NULL;
-  static Atom a=0;
-  if (disp!=old_disp) {
-    old_disp=disp;
-    a=XInternAtom(disp, "_NET_WM_STATE", False);
+/*
+  Start listening for events on the display. Events are delivered to "cb"
+  from xctrl_event_dispatch(). Returns False if the listener could not be
+  set up, or if one is already running on this display.
+*/
+static Bool listen_begin(Display*disp, EventCallback cb, EventCallbackEx cb_ex, void*cb_data)
+{
+  XCtrlContext*ctx=get_context(disp);
+  Listener*lst;
+  WinSet*ev_winlist;
+  XWindowAttributes attr;
+  ulong i;
+  if (!ctx || ctx->listener) { return False; }
+  lst=(Listener*)calloc(1,sizeof(Listener));
+  if (!lst) { return False; }
+  lst->cb=cb;
+  lst->cb_ex=cb_ex;
+  lst->cb_data=cb_data;
+  lst->root=DefRootWin;
+  lst->mask=XCTRL_EVENT_MASK_ALL&~ctx->listen_ignore;
+  lst->only=ctx->listen_window;
+  lst->client_mask=client_event_mask(ctx, lst->mask);
+  lst->track_clients=lst->client_mask ||
+    (lst->mask&(XCTRL_EVENT_MASK(XCTRL_EVENT_WINDOW_LIST_INSERT)|XCTRL_EVENT_MASK(XCTRL_EVENT_WINDOW_LIST_DELETE)));
+  ctx->listener=lst;
+  ev_winlist=&ctx->winlist;
+  for (i=0; i<EVENT_ATOM_COUNT; i++) {
+    if (event_ids[i]>=0) { event_slot_add(lst, GetAtom(event_ids[i]), i); }
+  }
+  event_slot_add(lst, XA_WM_NAME, EV_WM_NAME);  /* predefined atoms */
+  event_slot_add(lst, XA_WM_ICON_NAME, EV_WM_ICON_NAME);
+  if (ctx->listen_record) {
+    listener_start_record(lst, ctx->listen_record);
+    ctx->listen_record=NULL;
+  }
+  lst->desktop=listener_desktop(disp, lst);
+  if (lst->track_clients) {
+    listener_read_clients(disp, lst);
+    for (i=0; i<lst->clients.count; i++) {
+      if (lst->only && (lst->clients.items[i]!=lst->only)) { continue; }
+      watch_client(ev_winlist,disp,lst->clients.items[i],lst->generation,lst->client_mask);
+    }
   }
-  return window_has_prop(disp, w, a, XA_ATOM);
+  ctx->listening=True;
+  ctx->mirror_live=ctx->mirror;
+  if (XGetWindowAttributes(disp, DefRootWin, &attr)) { lst->root_mask=attr.your_event_mask; }
+  XSelectInput(disp, DefRootWin, lst->root_mask|PropertyChangeMask);
+  XFlush(disp);
+  return True;
 }
 
 
 
-typedef struct _WinListItem {
-  struct _WinListItem*next;
-  Window win;
-} WinListItem;
+XCTRL_API Bool xctrl_listen_begin(Display*disp, EventCallback cb, void*cb_data)
+{
+  return listen_begin(disp, cb, NULL, cb_data);
+}
 
 
 
-static void winlist_add_item(WinListItem**list, Display*dpy, Window win)
+/* Like xctrl_listen_begin(), but with an extended callback. */
+XCTRL_API Bool xctrl_listen_begin_ex(Display*disp, EventCallbackEx cb, void*cb_data)
 {
-  WinListItem*t=calloc(1,sizeof(WinListItem));
-  t->win=win;
-  XSelectInput(dpy,win,PropertyChangeMask|FocusChangeMask|StructureNotifyMask);
-  if (!*list) {
-    *list=t;
-    return;
-  } else {
-    WinListItem*p=*list;
-    while (p->next) { p=p->next; }
-    p->next=t;
-  }
+  return listen_begin(disp, NULL, cb, cb_data);
 }
 
 
 
-static void winlist_del_item(WinListItem**list, Window win)
+/*
+  Stop listening and forget the watched windows. The root window gets back
+  the event mask it had before, and any root PropertyNotify events that
+  were only queued because the listener asked for them are dropped. Called
+  from a callback, it only stops the listener, and xctrl_event_dispatch()
+  does the rest once nothing is using the listener any more.
+*/
+XCTRL_API void xctrl_listen_end(Display*disp)
 {
-  WinListItem*cur;
-  WinListItem*prv=NULL;
-  for (cur=*list; cur; cur=cur->next) {
-    if (cur->win==win) {
-      if (prv) {
-        prv->next=cur->next;
-      } else {
-        *list=cur->next;
-      }
-      free(cur);
-      return;
+  XCtrlContext*ctx=get_context(disp);
+  if (ctx && ctx->listener && ctx->listener->dispatching) {
+    ctx->listener->stopped=True;
+    ctx->listener->ended=True;
+    return;
+  }
+  if (ctx && ctx->listener) {
+    long mask=ctx->listener->root_mask;
+    XSelectInput(disp, DefRootWin, mask);
+    if (!(mask&PropertyChangeMask)) {
+      XEvent ev;
+      stats_sync(disp);
+      while (XCheckTypedWindowEvent(disp, DefRootWin, PropertyNotify, &ev)) { }
     }
-    prv=cur;
+    ctx->supported_ms=now_ms(); /* the listener kept it up to date until now */
   }
+  if (ctx) { listener_free(ctx); }
 }
 
 
 
-static void winlist_free_all(WinListItem*list)
+/* The file descriptor to poll for readability while listening. */
+XCTRL_API int xctrl_listen_fd(Display*disp)
 {
-  WinListItem*p=list;
-  while (p) {
-    WinListItem*n=p->next;
-    free(p);
-    p=n;
-  }
+  return ConnectionNumber(disp);
 }
 
 
-/* Set this to 1 to print unhandled events to stderr */
-#define PRINT_UNHANDLED_EVENTS 0
 
-#define EVENT_ATOM_COUNT (sizeof(event_names)/sizeof(char*))
+/*
+  Milliseconds until a held-back MOVE_RESIZE event falls due, or -1 if
+  there is none, so a caller's own poll() can wake up in time for it.
+*/
+XCTRL_API int xctrl_listen_timeout(Display*disp)
+{
+  XCtrlContext*ctx=get_context(disp);
+  ulong now;
+  ulong next;
+  ulong i;
+  if (ctx && ctx->listener && XEventsQueued(disp, QueuedAlready)) { return 0; } /* left by dispatch */
+  if (!(ctx && ctx->listener && ctx->winlist.pending)) { return -1; }
+  now=now_ms();
+  next=(ulong)ctx->coalesce_ms;
+  for (i=0; i<ctx->winlist.size; i++) {
+    WinListItem*p;
+    for (p=ctx->winlist.buckets[i]; p; p=p->next) {
+      if (p->configure_pending) {
+        ulong elapsed=now-p->configure_time;
+        if (elapsed >= (ulong)ctx->coalesce_ms) { return 0; }
+        if (((ulong)ctx->coalesce_ms-elapsed) < next) { next=(ulong)ctx->coalesce_ms-elapsed; }
+      }
+    }
+  }
+  return (int)next;
+}
+
 
 
-XCTRL_API void event_loop(Display*disp, EventCallback cb, void*cb_data)
+static int handle_event(Display*disp, XCtrlContext*ctx, XEvent*ev)
 {
-  XEvent ev;
-  enum {
-    EV_NET_ACTIVE_WINDOW,
-    EV_NET_CLIENT_LIST,
-    EV_NET_CURRENT_DESKTOP,
-    EV_NET_WM_NAME,
-    EV_NET_WM_ICON_NAME,
-    EV_NET_WM_STATE,
-    EV_WM_NAME,
-    EV_WM_ICON_NAME,
-    EV_WM_STATE
-  };
-  static char*event_names[]={
-    "_NET_ACTIVE_WINDOW",
-    "_NET_CLIENT_LIST",
-    "_NET_CURRENT_DESKTOP",
-    "_NET_WM_NAME",
-    "_NET_WM_ICON_NAME",
-    "_NET_WM_STATE",
-    "WM_NAME",
-    "WM_ICON_NAME",
-    "WM_STATE"
-  };
-  static Display*old_disp=NULL;
-  static Atom event_atoms[EVENT_ATOM_COUNT]={0,};
-  WinListItem*ev_winlist=NULL;
-  ulong n=0;
+  Listener*lst=ctx->listener;
+  WinSet*ev_winlist=&ctx->winlist;
   ulong i;
-  Window*clients=get_net_client_list(disp, &n);
-  for (i=0; i<n; i++) { winlist_add_item(&ev_winlist,disp,clients[i]); }
-  if (clients) { XFree(clients); }
-  
-  if (disp!=old_disp) { /* re-initialize event atoms if we are on a different display */
-    old_disp=disp;
-    XInternAtoms(disp,event_names,EVENT_ATOM_COUNT,False,&event_atoms[0]);
-  }
-  XSelectInput(disp, DefRootWin, PropertyChangeMask);
-  while (1) {
-    int rv=1;
-    XNextEvent(disp, &ev);
-    switch (ev.type) {
-      case PropertyNotify: {
-        int ev_tag=-1;
-        for (i=0; i<EVENT_ATOM_COUNT; i++) {
-          if (ev.xproperty.atom==event_atoms[i]) {
-            ev_tag=i;
-            break;
+  int rv=1;
+  switch (ev->type) {
+    case PropertyNotify: {
+      int ev_tag=-1;
+      if (ev->xproperty.window==lst->root) {
+        if (disp) { supported_event(ctx, &ev->xproperty); }
+      } else {
+        mirror_property_changed(ctx, ev->xproperty.window, ev->xproperty.atom);
+      }
+      ev_tag=event_slot_find(lst, ev->xproperty.atom);
+      switch (ev_tag) {
+        case EV_NET_CLIENT_LIST: {
+          /*
+            Mark every window that is still listed, then anything left
+            unmarked has gone away, and anything we don't know yet is new.
+          */
+          if (!lst->track_clients || !listener_read_clients(disp, lst)) { break; }
+          lst->generation++;
+          for (i=0; i<lst->clients.count; i++) {
+            WinListItem*p=winset_find(ev_winlist, lst->clients.items[i]);
+            if (p) { p->generation=lst->generation; }
           }
-        }
-        switch (ev_tag) {
-          case EV_NET_CLIENT_LIST: {
-            WinListItem*p1=ev_winlist;
-            WinListItem*p2=NULL;
-            clients=get_net_client_list(disp, &n);
-            while (p1) { /* Remove any deleted windows */
-              int do_del=1;
-              p2=p1->next;
-              for (i=0; i<n; i++) {
-                if (p1->win == clients[i]) {
-                  do_del=0;
-                  break;
-                }
-              }
-              if ( do_del ) {
-                Window x=p1->win;
-                winlist_del_item(&ev_winlist, p1->win);
-                rv=cb(XCTRL_EVENT_WINDOW_LIST_DELETE,x,cb_data);
-              }
-              p1=p2;
-            }
-            for (i = 0; i < n; i++) { /* Add any new windows */
-              int found=0;
-              for (p1=ev_winlist;p1;p1=p1->next) {
-                if (clients[i]==p1->win) {
-                  found=1;
-                  break;
-                }
-              }
-              if (!found) {
-                winlist_add_item(&ev_winlist,disp,clients[i]);
-                rv=cb(XCTRL_EVENT_WINDOW_LIST_INSERT,clients[i],cb_data);
+          for (i=0; rv && (i<ev_winlist->size); i++) { /* Remove any deleted windows */
+            WinListItem*p=ev_winlist->buckets[i];
+            while (p && rv) {
+              WinListItem*next=p->next;
+              if (p->generation!=lst->generation) {
+                Window x=p->win;
+                winset_unlink(ev_winlist, p);
+                mirror_clear(p, MIRROR_TITLE|MIRROR_CLASS);
+                free(p);
+                rv=emit_simple(disp,lst,XCTRL_EVENT_WINDOW_LIST_DELETE,x);
               }
+              p=next;
             }
-            if (clients) { XFree(clients); }
-            break;
-          }
-          case EV_NET_CURRENT_DESKTOP: {
-            rv=cb(XCTRL_EVENT_DESKTOP_SWITCH,get_current_desktop(disp),cb_data);
-            break;
-          }
-          case EV_NET_WM_NAME: {
-            rv=cb(XCTRL_EVENT_WINDOW_TITLE,ev.xproperty.window,cb_data);
-            break;
           }
-          case EV_NET_WM_STATE: {
-            rv=cb(XCTRL_EVENT_WINDOW_STATE,ev.xproperty.window,cb_data);
-            break;
-          }
-          case EV_WM_NAME: { /* ignore WM_NAME if we can use _NET_WM_NAME instead */
-            if (!has_net_wm_name(disp,ev.xproperty.window)) {
-              rv=cb(XCTRL_EVENT_WINDOW_TITLE,ev.xproperty.window,cb_data);
+          for (i = 0; rv && (i < lst->clients.count); i++) { /* Add any new windows */
+            if (lst->only && (lst->clients.items[i]!=lst->only)) { continue; }
+            if (!winset_find(ev_winlist, lst->clients.items[i])) {
+              watch_client(ev_winlist,disp,lst->clients.items[i],lst->generation,lst->client_mask);
+              rv=emit_simple(disp,lst,XCTRL_EVENT_WINDOW_LIST_INSERT,lst->clients.items[i]);
             }
-            break;
           }
-          case EV_WM_STATE: { /* ignore WM_STATE if we can use _NET_WM_STATE instead */
-            if (!has_net_wm_state(disp,ev.xproperty.window)) {
-              rv=cb(XCTRL_EVENT_WINDOW_STATE,ev.xproperty.window,cb_data);
-            }
-            break;
+          break;
+        }
+        case EV_NET_CURRENT_DESKTOP: {
+          EventInfo info;
+          if (!Wants(lst, XCTRL_EVENT_DESKTOP_SWITCH)) { break; }
+          memset(&info, 0, sizeof(info));
+          info.ev=XCTRL_EVENT_DESKTOP_SWITCH;
+          info.old_desktop=lst->desktop;
+          info.new_desktop=lst->desktop=listener_desktop(disp, lst);
+          info.win=(Window)info.new_desktop;
+          rv=listener_emit(disp,lst,&info);
+          break;
+        }
+        case EV_NET_WM_NAME: {
+          rv=emit_simple(disp,lst,XCTRL_EVENT_WINDOW_TITLE,ev->xproperty.window);
+          break;
+        }
+        case EV_NET_WM_STATE: {
+          rv=emit_simple(disp,lst,XCTRL_EVENT_WINDOW_STATE,ev->xproperty.window);
+          break;
+        }
+        case EV_WM_NAME: { /* ignore WM_NAME if we can use _NET_WM_NAME instead */
+          if (Wants(lst, XCTRL_EVENT_WINDOW_TITLE) && !listener_has_prop(disp,lst,ev->xproperty.window,False)) {
+            rv=emit_simple(disp,lst,XCTRL_EVENT_WINDOW_TITLE,ev->xproperty.window);
+          }
+          break;
+        }
+        case EV_WM_STATE: { /* ignore WM_STATE if we can use _NET_WM_STATE instead */
+          if (Wants(lst, XCTRL_EVENT_WINDOW_STATE) && !listener_has_prop(disp,lst,ev->xproperty.window,True)) {
+            rv=emit_simple(disp,lst,XCTRL_EVENT_WINDOW_STATE,ev->xproperty.window);
           }
-          case EV_NET_WM_ICON_NAME:  { break; }  /* unused */
-          case EV_WM_ICON_NAME:      { break; }  /* unused */
-          default: {
+          break;
+        }
+        case EV_NET_WM_ICON_NAME:  { break; }  /* unused */
+        case EV_WM_ICON_NAME:      { break; }  /* unused */
+        default: {
 #          if PRINT_UNHANDLED_EVENTS
-            char*nm=XGetAtomName(disp, ev.xproperty.atom);
-            fprintf(stderr, "PropertyNotify: unhandled atom \"%s\" for window %ld\n", nm, ev.xproperty.window);
-            XFree(nm);
+          char*nm=XGetAtomName(disp, ev->xproperty.atom);
+          fprintf(stderr, "PropertyNotify: unhandled atom \"%s\" for window %ld\n", nm, ev->xproperty.window);
+          XFree(nm);
 #          endif
-          }
         }
-        break;
       }
-      case ConfigureNotify: {
-        rv=cb(XCTRL_EVENT_WINDOW_MOVE_RESIZE,ev.xconfigure.window,cb_data);
+      break;
+    }
+    case ConfigureNotify: {
+      if (!Wants(lst, XCTRL_EVENT_WINDOW_MOVE_RESIZE)) { /* only selected for the mirror */
+        mirror_configure_window(ctx, &ev->xconfigure);
         break;
       }
-      case FocusIn: {
-        rv=cb(XCTRL_EVENT_WINDOW_FOCUS_GAINED,ev.xfocus.window,cb_data);
+      if (ctx->coalesce_ms) {
+        rv=coalesce_configure(disp, ctx, ev);
         break;
       }
-      case FocusOut: {
-        rv=cb(XCTRL_EVENT_WINDOW_FOCUS_LOST,ev.xfocus.window,cb_data);
-        break;
+      if (ctx->mirror) { mirror_configure_window(ctx, &ev->xconfigure); }
+      rv=emit_configure(disp,lst,NULL,ev->xconfigure.window,&ev->xconfigure);
+      break;
+    }
+    case FocusIn: {
+      EventInfo info;
+      memset(&info, 0, sizeof(info));
+      info.ev=XCTRL_EVENT_WINDOW_FOCUS_GAINED;
+      info.win=ev->xfocus.window;
+      info.focus_mode=ev->xfocus.mode;
+      info.focus_detail=ev->xfocus.detail;
+      rv=listener_emit(disp,lst,&info);
+      break;
+    }
+    case FocusOut: {
+      EventInfo info;
+      memset(&info, 0, sizeof(info));
+      info.ev=XCTRL_EVENT_WINDOW_FOCUS_LOST;
+      info.win=ev->xfocus.window;
+      info.focus_mode=ev->xfocus.mode;
+      info.focus_detail=ev->xfocus.detail;
+      rv=listener_emit(disp,lst,&info);
+      break;
+    }
+    case ReparentNotify: {
+      WinListItem*rec=ctx->mirror?winset_find(&ctx->winlist, ev->xreparent.window):NULL;
+      if (rec) { /* the window has a new place in a new parent */
+        rec->parent_pos.x=ev->xreparent.x;
+        rec->parent_pos.y=ev->xreparent.y;
+        rec->parent_pos_valid=True;
+        rec->valid&=~MIRROR_GEOM;
       }
-      case DestroyNotify: { break; } /* unused */
-      case UnmapNotify:   { break; } /* unused */
-      case MapNotify:     { break; } /* unused */
-      default: {
+      break;
+    }
+    case DestroyNotify: { break; } /* unused */
+    case UnmapNotify:   { break; } /* unused */
+    case MapNotify:     { break; } /* unused */
+    default: {
 #      if PRINT_UNHANDLED_EVENTS
-        fprintf(stderr, "Unhandled event of type %d\n", ev.type);
+      fprintf(stderr, "Unhandled event of type %d\n", ev->type);
 #      endif
-      }
     }
-    if (!rv) { break; }
   }
-  winlist_free_all(ev_winlist);
+  return rv;
+}
+
+
+
+/*
+  Wait up to "timeout_ms" milliseconds for something to arrive (-1 waits
+  indefinitely, 0 does not wait at all), then hand every queued event to
+  the callback without blocking. Returns 1 while listening, or 0 once the
+  callback has returned zero or no listener is running.
+*/
+XCTRL_API int xctrl_event_dispatch(Display*disp, int timeout_ms)
+{
+  XCtrlContext*ctx=get_context(disp);
+  Listener*lst=ctx?ctx->listener:NULL;
+  int wait;
+  int count;
+  if (!lst || lst->stopped) { return 0; }
+  if (!XPending(disp)) {
+    wait=xctrl_listen_timeout(disp);
+    if ((wait<0) || ((timeout_ms>=0) && (timeout_ms<wait))) { wait=timeout_ms; }
+    if (wait) {
+      struct pollfd pfd;
+      pfd.fd=ConnectionNumber(disp);
+      pfd.events=POLLIN;
+      poll(&pfd, 1, wait);
+    }
+  }
+  /* Only what is queued now: the handlers' own round trips can queue more */
+  lst->dispatching=True;
+  for (count=XPending(disp); count>0 && XEventsQueued(disp, QueuedAlready); count--) {
+    XEvent ev;
+    XNextEvent(disp, &ev);
+    if (lst->record) { rec_write_event(lst, &ev); }
+    if (!handle_event(disp, ctx, &ev)) {
+      lst->stopped=True;
+      break;
+    }
+  }
+  if (!lst->stopped && ctx->winlist.pending && !flush_configures(disp, ctx, &wait)) {
+    lst->stopped=True;
+  }
+  lst->dispatching=False;
+  if (lst->ended) { /* a callback asked for it, and lst is freed here */
+    xctrl_listen_end(disp);
+    return 0;
+  }
+  return lst->stopped?0:1;
+}
+
+
+
+XCTRL_API void event_loop(Display*disp, EventCallback cb, void*cb_data)
+{
+  if (!xctrl_listen_begin(disp, cb, cb_data)) { return; }
+  while (xctrl_event_dispatch(disp, -1)) { }
+  xctrl_listen_end(disp);
+}
+
+
+
+XCTRL_API void event_loop_ex(Display*disp, EventCallbackEx cb, void*cb_data)
+{
+  if (!xctrl_listen_begin_ex(disp, cb, cb_data)) { return; }
+  while (xctrl_event_dispatch(disp, -1)) { }
+  xctrl_listen_end(disp);
+}
+
+
+
+/*
+  Feed a log made with xctrl_listen_record() back through the listener,
+  without a display. With "realtime" the events are spaced out as they
+  were recorded, otherwise they are delivered as fast as possible. Events
+  are delivered as recorded: coalescing and the mirror are not applied.
+  Returns the number of events replayed, or -1 if the log can't be read.
+*/
+static long replay(const char*path, EventCallback cb, EventCallbackEx cb_ex, void*cb_data, Bool realtime)
+{
+  XCtrlContext ctx;
+  Listener lst;
+  RecHeader hdr;
+  uint64_t*start;
+  char magic[sizeof(REC_MAGIC)];
+  long count=0;
+  ulong i;
+  memset(&ctx, 0, sizeof(ctx));
+  memset(&lst, 0, sizeof(lst));
+  lst.replay=fopen(path, "rb");
+  if (!lst.replay) { return -1; }
+  if ((fread(magic, strlen(REC_MAGIC), 1, lst.replay)!=1) || strncmp(magic, REC_MAGIC, strlen(REC_MAGIC))) {
+    fclose(lst.replay);
+    return -1;
+  }
+  start=(uint64_t*)rec_read(&lst, REC_START, &hdr);
+  if (!start || (hdr.size!=REC_START_SIZE*sizeof(uint64_t))) {
+    sfree(start);
+    fclose(lst.replay);
+    return -1;
+  }
+  lst.root=start[0];
+  lst.mask=start[1];
+  lst.only=start[2];
+  lst.track_clients=start[3];
+  for (i=0; i<EVENT_ATOM_COUNT; i++) {
+    if (start[i+4]!=None) { event_slot_add(&lst, start[i+4], i); }
+  }
+  free(start);
+  lst.cb=cb;
+  lst.cb_ex=cb_ex;
+  lst.cb_data=cb_data;
+  ctx.listener=&lst;
+  lst.desktop=listener_desktop(NULL, &lst);
+  if (lst.track_clients) { listener_read_clients(NULL, &lst); }
+  for (i=0; i<lst.clients.count; i++) {
+    if (lst.only && (lst.clients.items[i]!=lst.only)) { continue; }
+    watch_client(&ctx.winlist,NULL,lst.clients.items[i],0,0);
+  }
+  lst.start_us=now_us();
+  while (!lst.stopped) {
+    XEvent ev;
+    RecEvent*re;
+    while (rec_next_is(&lst, REC_TITLE)) { sfree(rec_read(&lst, REC_TITLE, &hdr)); } /* not needed */
+    re=(RecEvent*)rec_read(&lst, REC_EVENT, &hdr);
+    if (!re) { break; }
+    if (hdr.size!=sizeof(RecEvent)) {
+      free(re);
+      break;
+    }
+    if (realtime) {
+      ulong elapsed=now_us()-lst.start_us;
+      if (hdr.time_us>elapsed) { usleep(hdr.time_us-elapsed); }
+    }
+    rec_event_to_xevent(re, &ev);
+    free(re);
+    count++;
+    if (!handle_event(NULL, &ctx, &ev)) { break; }
+  }
+  winset_free_all(&ctx.winlist);
+  sfree(lst.clients.items);
+  arena_free(&lst.arena);
+  fclose(lst.replay);
+  return count;
+}
+
+
+
+XCTRL_API long xctrl_replay(const char*path, EventCallback cb, void*cb_data, Bool realtime)
+{
+  return replay(path, cb, NULL, cb_data, realtime);
+}
+
+
+
+XCTRL_API long xctrl_replay_ex(const char*path, EventCallbackEx cb, void*cb_data, Bool realtime)
+{
+  return replay(path, NULL, cb, cb_data, realtime);
+}
+
+
+
+
+#ifdef XCTRL_THREADS
+
+/*********************************************************************/
+/* * * * * * * * * * * * * *  Fan-out  * * * * * * * * * * * * * * * */
+/*********************************************************************/
+
+typedef struct {
+  FanoutTarget*targets;
+  int count;
+  int next;
+  FanoutFunc op;
+  void*data;
+  pthread_mutex_t lock;
+} Fanout;
+
+
+
+static void*fanout_worker(void*arg)
+{
+  Fanout*fo=(Fanout*)arg;
+  for (;;) {
+    FanoutTarget*t=NULL;
+    ulong start;
+    pthread_mutex_lock(&fo->lock);
+    if (fo->next<fo->count) { t=&fo->targets[fo->next++]; }
+    pthread_mutex_unlock(&fo->lock);
+    if (!t) { return NULL; }
+    t->result=NULL;
+    t->connect_ms=0;
+    t->run_ms=0;
+    if (!t->disp) {
+      start=now_us();
+      t->disp=XOpenDisplay(t->dpyname);
+      if (t->disp) { xctrl_init(t->disp); }
+      t->connect_ms=(now_us()-start)/1000.0;
+      if (!t->disp) { continue; }
+    }
+    start=now_us();
+    t->result=fo->op(t->disp, fo->data);
+    t->run_ms=(now_us()-start)/1000.0;
+  }
+}
+
+
+
+XCTRL_API void xctrl_fanout(FanoutTarget*targets, int count, int threads, FanoutFunc op, void*data)
+{
+  Fanout fo;
+  pthread_t*tids;
+  int i;
+  int started=0;
+  if (count<=0) { return; }
+  if (threads>count) { threads=count; }
+  if (threads<1) { threads=1; }
+  fo.targets=targets;
+  fo.count=count;
+  fo.next=0;
+  fo.op=op;
+  fo.data=data;
+  pthread_mutex_init(&fo.lock, NULL);
+  tids=(pthread_t*)calloc(threads,sizeof(pthread_t));
+  if (tids) { /* the calling thread is one of the workers */
+    for (i=1; i<threads; i++) {
+      if (pthread_create(&tids[started], NULL, fanout_worker, &fo)!=0) { break; }
+      started++;
+    }
+  }
+  fanout_worker(&fo);
+  for (i=0; i<started; i++) { pthread_join(tids[i], NULL); }
+  sfree(tids);
+  pthread_mutex_destroy(&fo.lock);
 }
 
+#endif
@@ -91,13 +91,51 @@ typedef struct _Geometry {
   unsigned int h;
 } Geometry;
 
+/* Flags returned by get_window_state(), from the window's _NET_WM_STATE */
+#define XCTRL_STATE_MODAL             (1L << 0)
+#define XCTRL_STATE_STICKY            (1L << 1)
+#define XCTRL_STATE_MAXIMIZED_VERT    (1L << 2)
+#define XCTRL_STATE_MAXIMIZED_HORZ    (1L << 3)
+#define XCTRL_STATE_SHADED            (1L << 4)
+#define XCTRL_STATE_SKIP_TASKBAR      (1L << 5)
+#define XCTRL_STATE_SKIP_PAGER        (1L << 6)
+#define XCTRL_STATE_HIDDEN            (1L << 7)
+#define XCTRL_STATE_FULLSCREEN        (1L << 8)
+#define XCTRL_STATE_ABOVE             (1L << 9)
+#define XCTRL_STATE_BELOW             (1L << 10)
+#define XCTRL_STATE_DEMANDS_ATTENTION (1L << 11)
+#define XCTRL_STATE_COUNT 12
+
+
+/* One record of the array returned by xctrl_snapshot() */
+typedef struct _WindowInfo {
+  Window win;
+  char*title;        /* UTF-8, or NULL */
+  char*class_name;   /* UTF-8, or NULL */
+  ulong pid;         /* 0 if unknown */
+  long desktop;      /* zero-based, -1 means all desktops, -2 if unknown */
+  Geometry geom;
+  long frame_left;   /* frame extents are -1 if unknown */
+  long frame_right;
+  long frame_top;
+  long frame_bottom;
+  const char*type;   /* same as get_window_type(), but not to be freed */
+  ulong state;       /* XCTRL_STATE_* flags */
+} WindowInfo;
+
 /*
   Any functions that return a pointer should
   be disposed of by the caller with free()
 */
 
+/* Per-display context functions */
+XCTRL_API Bool xctrl_init(Display*disp); /* optional, interns all atoms up front */
+XCTRL_API Atom xctrl_atom(Display*disp, const char*name);
+XCTRL_API ulong xctrl_atom_trips_saved(Display*disp);
+
 /* Charset functions */
 XCTRL_API void init_charset(Bool force_utf8, char*charset);
+XCTRL_API void xctrl_set_charset(Display*disp, Bool force_utf8, const char*charset);
 XCTRL_API char* convert_locale(const char*src, const char*from, const char*to);
 XCTRL_API char* locale_to_utf8(const char*src);
 XCTRL_API char* utf8_to_locale(const char*src);
@@ -128,6 +166,8 @@ XCTRL_API long get_desktop_of_window(Display*disp, Window win);
 
 XCTRL_API ulong get_win_pid(Display*disp, Window win);
 XCTRL_API char* get_client_machine(Display*disp, Window win);
+XCTRL_API ulong get_window_state(Display*disp, Window win);
+XCTRL_API WindowInfo* xctrl_snapshot(Display*disp, ulong*count);
 XCTRL_API void send_keystrokes(Display*disp, Window win, const char*keys);
 
 /* Desktop information and manipulation functions */
@@ -137,6 +177,19 @@ XCTRL_API int set_showing_desktop(Display*disp, ulong state);
 XCTRL_API char* get_desktop_name(Display*disp, int desknum, Bool force_utf8);
 XCTRL_API int get_workarea_geom(Display*disp, Geometry*geom, int desknum);
 
+/*
+  The *_into() variants of the string getters write into buf instead of
+  returning allocated memory, truncating to fit and always terminating it.
+  They return the full length, so if that is "size" or more the caller
+  can retry with a bigger buffer, or -1 if there is no value. Working
+  memory is kept with the display and reused between calls.
+*/
+XCTRL_API long get_window_title_into(Display*disp, Window win, char*buf, size_t size);
+XCTRL_API long get_window_class_into(Display*disp, Window win, char*buf, size_t size);
+XCTRL_API long get_window_type_into(Display*disp, Window win, char*buf, size_t size);
+XCTRL_API long get_client_machine_into(Display*disp, Window win, char*buf, size_t size);
+XCTRL_API long get_desktop_name_into(Display*disp, int desknum, Bool force_utf8, char*buf, size_t size);
+
 XCTRL_API int get_desktop_geom(Display*disp, int desknum, Geometry*geom);
 XCTRL_API int change_geometry(Display*disp, ulong x, ulong y);
 XCTRL_API int change_viewport(Display*disp, ulong x, ulong y);
@@ -171,10 +224,163 @@ enum {
   XCTRL_EVENT_DESKTOP_SWITCH
 };
 
+/* Bits for xctrl_listen_select() */
+#define XCTRL_EVENT_MASK(ev) (1UL<<(ev))
+#define XCTRL_EVENT_MASK_ALL (XCTRL_EVENT_MASK(XCTRL_EVENT_DESKTOP_SWITCH+1)-1)
+
 /* Event listener callback type */
 typedef int (*EventCallback) (int ev, Window win, void*cb_data);
 
 /* Event listener function */
 XCTRL_API void event_loop(Display*disp, EventCallback cb, void*cb_data);
 
+/*
+  Extended event details, for callbacks that would otherwise have to ask
+  the server about the event they were just told about. Fields that don't
+  apply to the event are zero. New fields are only ever added at the end,
+  and "version" says which of them are present.
+*/
+#define XCTRL_EVENT_INFO_VERSION 1
+
+typedef struct _EventInfo {
+  int version;
+  int ev;
+  Window win;
+  /* XCTRL_EVENT_WINDOW_MOVE_RESIZE: the geometry from the ConfigureNotify,
+     with x and y relative to the root window if geom_root is set, or to
+     the window's frame if not. */
+  Geometry geom;
+  Bool geom_root;
+  /* XCTRL_EVENT_WINDOW_TITLE: the new title, valid during the callback */
+  const char*title;
+  /* XCTRL_EVENT_DESKTOP_SWITCH */
+  long old_desktop;
+  long new_desktop;
+  /* XCTRL_EVENT_WINDOW_FOCUS_GAINED / LOST: NotifyNormal etc. */
+  int focus_mode;
+  int focus_detail;
+} EventInfo;
+
+typedef int (*EventCallbackEx) (const EventInfo*info, void*cb_data);
+
+XCTRL_API void event_loop_ex(Display*disp, EventCallbackEx cb, void*cb_data);
+
+/*
+  The same listener, one step at a time: begin, then poll the descriptor
+  and call dispatch whenever it is readable (or the timeout says a held-back
+  event is due), and end when done. Dispatch returns 0 once the callback
+  has returned 0. It handles at most the events queued when it is called;
+  if any are left over, the timeout is 0. A callback may call end itself:
+  dispatch then stops, tears the listener down on its way out and returns 0.
+*/
+XCTRL_API Bool xctrl_listen_begin(Display*disp, EventCallback cb, void*cb_data);
+XCTRL_API Bool xctrl_listen_begin_ex(Display*disp, EventCallbackEx cb, void*cb_data);
+XCTRL_API int xctrl_listen_fd(Display*disp);
+XCTRL_API int xctrl_listen_timeout(Display*disp);
+XCTRL_API int xctrl_event_dispatch(Display*disp, int timeout_ms);
+XCTRL_API void xctrl_listen_end(Display*disp);
+
+/*
+  Only deliver the events in "mask" to the next listener, and only for
+  window "win" unless it is None. Clients are only asked for the X events
+  needed, or not at all if no per-window events are wanted.
+*/
+XCTRL_API void xctrl_listen_select(Display*disp, ulong mask, Window win);
+
+/*
+  Record what the next listener receives to a file, and play such a file
+  back through the same callbacks without a display. The replay functions
+  return the number of events delivered, or -1 if the file can't be read.
+  Only what the listener looks up is recorded; getters that a callback
+  calls are not, and still need a display when the log is replayed.
+*/
+XCTRL_API Bool xctrl_listen_record(Display*disp, const char*path);
+XCTRL_API long xctrl_replay(const char*path, EventCallback cb, void*cb_data, Bool realtime);
+XCTRL_API long xctrl_replay_ex(const char*path, EventCallbackEx cb, void*cb_data, Bool realtime);
+
+/*
+  When enabled, the window getters called while event_loop() is running
+  are answered from memory, and only go to the server after an event says
+  the value has changed.
+*/
+XCTRL_API void xctrl_set_mirror(Display*disp, Bool enable);
 
+/* Coalesce MOVE_RESIZE events to one per window per interval (0 = off) */
+XCTRL_API void xctrl_set_coalesce(Display*disp, int interval_ms);
+XCTRL_API ulong xctrl_events_dropped(Display*disp);
+
+
+/* Statistics and tracing functions */
+
+/*
+  Optional per-display counters of what the library asks of the server.
+  Calls made between xctrl_stats_begin() and xctrl_stats_end() are also
+  counted under the given API name; xctrl_get_stats() returns the totals
+  when "api" is NULL, and xctrl_stats_api() lists the names in use.
+  The pairs may nest, and requests count towards the innermost one.
+  xctrl_reset_stats() zeroes every counter, even inside such a pair, but
+  the API names stay listed.
+*/
+typedef struct _XCtrlStats {
+  ulong calls;        /* xctrl_stats_begin()/end() pairs */
+  ulong requests;     /* X requests sent */
+  ulong round_trips;  /* waits for replies; with XCB, replies sent together count once */
+  ulong reply_bytes;  /* property data received */
+  ulong alloc_bytes;  /* memory allocated for returned values */
+  ulong wait_us;      /* time spent waiting for replies */
+  ulong time_us;      /* wall time between xctrl_stats_begin() and end() */
+} XCtrlStats;
+
+XCTRL_API void xctrl_set_stats(Display*disp, Bool enable);
+XCTRL_API void xctrl_reset_stats(Display*disp);
+XCTRL_API void xctrl_stats_begin(Display*disp, const char*api);
+XCTRL_API void xctrl_stats_end(Display*disp);
+XCTRL_API Bool xctrl_get_stats(Display*disp, const char*api, XCtrlStats*stats);
+XCTRL_API const char*xctrl_stats_api(Display*disp, int index);
+
+/*
+  Tracing keeps a ring of the last "size" calls made between
+  xctrl_stats_begin() and _end(), with their times, window and round
+  trips, and of every XSync(), tagged with the call that made it.
+  xctrl_trace_dump() writes them out as Chrome trace-event JSON and
+  returns how many it wrote, or -1.
+*/
+XCTRL_API Bool xctrl_set_trace(Display*disp, ulong size);
+XCTRL_API void xctrl_stats_window(Display*disp, Window win);
+XCTRL_API long xctrl_trace_dump(Display*disp, const char*path);
+
+
+/* Thread-safety and fan-out functions */
+#ifdef XCTRL_THREADS
+
+/*
+  Thread-safe mode, enabled by building with XCTRL_THREADS defined.
+  xctrl_threads_init() must be the first Xlib call the program makes.
+  A connection is then safe to use from one thread at a time; the pool
+  gives each worker thread a connection of its own.
+*/
+typedef struct _XCtrlPool XCtrlPool;
+XCTRL_API Bool xctrl_threads_init(void);
+XCTRL_API XCtrlPool*xctrl_pool_new(const char*dpyname, int size);
+XCTRL_API Display*xctrl_pool_get(XCtrlPool*pool);
+XCTRL_API void xctrl_pool_put(XCtrlPool*pool, Display*disp);
+XCTRL_API void xctrl_pool_free(XCtrlPool*pool);
+
+/*
+  Run "op" once for each target, on up to "threads" threads at a time.
+  A target's display is opened (and left open) unless it is already set,
+  so the same array can be passed again to reuse the connections. If the
+  display is still NULL afterwards, it could not be opened.
+*/
+typedef void*(*FanoutFunc)(Display*disp, void*data);
+
+typedef struct _FanoutTarget {
+  const char*dpyname;  /* NULL for the default display */
+  Display*disp;
+  void*result;         /* whatever op returned */
+  double connect_ms;   /* time spent opening the display, 0 if reused */
+  double run_ms;       /* time spent in op */
+} FanoutTarget;
+
+XCTRL_API void xctrl_fanout(FanoutTarget*targets, int count, int threads, FanoutFunc op, void*data);
+#endif
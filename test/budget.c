@@ -0,0 +1,330 @@
+/*
+Round-trip budget test for the xctrl library.
+
+  Usage: budget
+
+Calls each public function that talks to the server on $DISPLAY, with the
+request accounting turned on, and fails if any of them waits for more
+replies than its budget. A function that got slower by taking an extra
+round trip, such as get_window_title() reading its property twice, shows
+up here even on a fast local server, where a timing would not.
+
+Each function is called once to fill the caches, then counted a few times,
+and the cheapest of those is what must be within budget, so that a cache
+expiring during the run doesn't fail it. The budgets allow for the
+fallback properties being read where the stand-in window manager doesn't
+set the preferred one. Built with XCB=1, the functions that send their
+requests together wait only once, so xctrl_snapshot() costs the same
+however many windows there are. The selection functions wait for other clients and
+get_selection() isn't counted, so they are left out, as is close_window().
+
+The display needs an EWMH window manager, such as ../tools/wm.c; "make
+check" runs it under ../tools/xrun.sh. The exit status is 0 if every
+function was within budget, and 1 if not.
+
+This program is free software, released under the GNU General Public
+License. You may redistribute and/or modify this program under the terms
+of that license as published by the Free Software Foundation; either
+version 2 of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+*/
+
+#include <X11/Xlib.h>
+#define XCTRL_API static
+#include "../src/xctrl.c"
+
+#define CLIENTS 3
+#define TRIES 3
+#define CLIENT_WAIT_MS 10000
+
+enum {
+  API_GET_WINDOW_LIST,
+  API_GET_ACTIVE_WINDOW,
+  API_GET_WINDOW_CLASS,
+  API_GET_WINDOW_TITLE,
+  API_GET_WINDOW_GEOM,
+  API_GET_WINDOW_FRAME,
+  API_GET_WINDOW_TYPE,
+  API_GET_DESKTOP_OF_WINDOW,
+  API_GET_WIN_PID,
+  API_GET_CLIENT_MACHINE,
+  API_GET_WINDOW_STATE,
+  API_XCTRL_SNAPSHOT,
+  API_GET_WINDOW_TITLE_INTO,
+  API_GET_WINDOW_CLASS_INTO,
+  API_GET_WINDOW_TYPE_INTO,
+  API_GET_CLIENT_MACHINE_INTO,
+  API_GET_DESKTOP_NAME_INTO,
+  API_GET_SHOWING_DESKTOP,
+  API_GET_DESKTOP_NAME,
+  API_GET_WORKAREA_GEOM,
+  API_GET_DESKTOP_GEOM,
+  API_GET_NUMBER_OF_DESKTOPS,
+  API_GET_CURRENT_DESKTOP,
+  API_SUPPORTING_WM_CHECK,
+  API_GET_WM_NAME,
+  API_GET_WM_CLASS,
+  API_GET_WM_PID,
+  API_WM_SUPPORTS,
+  API_XCTRL_ATOM,
+  API_ACTIVATE_WINDOW,
+  API_SET_WINDOW_STATE,
+  API_ICONIFY_WINDOW,
+  API_SET_WINDOW_TITLE,
+  API_SET_WINDOW_GEOM,
+  API_SET_WINDOW_MWM_HINTS,
+  API_SEND_WINDOW_TO_DESKTOP,
+  API_SEND_KEYSTROKES,
+  API_SET_SHOWING_DESKTOP,
+  API_CHANGE_GEOMETRY,
+  API_CHANGE_VIEWPORT,
+  API_SET_NUMBER_OF_DESKTOPS,
+  API_SET_CURRENT_DESKTOP,
+  API_COUNT
+};
+
+/* The most round trips a call may take: "trips", plus "per_window" for each listed client */
+typedef struct {
+  const char*name;
+  ulong trips;
+  ulong per_window;
+} Budget;
+
+/* Requests the XCB backend sends together, to wait for only once */
+#ifdef XCTRL_USE_XCB
+#define Pipelined(xlib,xcb) (xcb)
+#else
+#define Pipelined(xlib,xcb) (xlib)
+#endif
+
+static const Budget budgets[API_COUNT]={
+  {"get_window_list", 1, 0},
+  {"get_active_window", 1, 0},
+  {"get_window_class", 1, 0},
+  {"get_window_title", 1, 0},
+  {"get_window_geom", Pipelined(2,1), 0}, /* the geometry, and its position on the root */
+  {"get_window_frame", 1, 0},
+  {"get_window_type", Pipelined(2,1), 0}, /* no type set, so WM_TRANSIENT_FOR too */
+  {"get_desktop_of_window", 1, 0},
+  {"get_win_pid", 1, 0},
+  {"get_client_machine", 1, 0},
+  {"get_window_state", 1, 0},
+  {"xctrl_snapshot", Pipelined(2,3), Pipelined(12,0)}, /* the list, a sync, and everything per window */
+  {"get_window_title_into", 1, 0},
+  {"get_window_class_into", 1, 0},
+  {"get_window_type_into", Pipelined(2,1), 0},
+  {"get_client_machine_into", 1, 0},
+  {"get_desktop_name_into", 2, 0},
+  {"get_showing_desktop", 1, 0},
+  {"get_desktop_name", 2, 0},
+  {"get_workarea_geom", 2, 0},        /* the number of desktops, then the workarea */
+  {"get_desktop_geom", 3, 0},
+  {"get_number_of_desktops", 1, 0},
+  {"get_current_desktop", 1, 0},
+  {"supporting_wm_check", 1, 0},
+  {"get_wm_name", 2, 0},
+  {"get_wm_class", 3, 0},             /* WM_CLASS is tried as UTF-8 first */
+  {"get_wm_pid", 2, 0},
+  {"wm_supports", 0, 0},
+  {"xctrl_atom", 0, 0},
+  {"activate_window", 0, 0},
+  {"set_window_state", 0, 0},
+  {"iconify_window", 0, 0},
+  {"set_window_title", 0, 0},
+  {"set_window_geom", 0, 0},
+  {"set_window_mwm_hints", 0, 0},
+  {"send_window_to_desktop", 0, 0},
+  {"send_keystrokes", 2, 0},          /* a sync after the press and the release */
+  {"set_showing_desktop", 0, 0},
+  {"change_geometry", 0, 0},
+  {"change_viewport", 0, 0},
+  {"set_number_of_desktops", 0, 0},
+  {"set_current_desktop", 0, 0},
+};
+
+typedef struct {
+  Display*disp;
+  Window wins[CLIENTS];
+  ulong listed;         /* clients the window manager lists */
+  long desktops;
+  char buf[1024];
+} Test;
+
+
+
+static int on_error(Display*disp, XErrorEvent*ev)
+{
+  return 0;
+}
+
+
+
+static Window make_client(Display*disp, ulong n)
+{
+  Window win=XCreateSimpleWindow(disp, DefaultRootWindow(disp), 50+n*20, 50+n*20, 200, 100, 0, 0, 0);
+  XClassHint hint;
+  long pid=getpid();
+  const char*title="budget window";
+  const char*host="localhost";
+  hint.res_name="budget";
+  hint.res_class="Budget";
+  XStoreName(disp, win, title);
+  XChangeProperty(disp, win, XInternAtom(disp, "_NET_WM_NAME", False), XInternAtom(disp, "UTF8_STRING", False),
+    8, PropModeReplace, (uchar*)title, strlen(title));
+  XSetClassHint(disp, win, &hint);
+  XChangeProperty(disp, win, XInternAtom(disp, "_NET_WM_PID", False), XA_CARDINAL, 32, PropModeReplace, (uchar*)&pid, 1);
+  XChangeProperty(disp, win, XA_WM_CLIENT_MACHINE, XA_STRING, 8, PropModeReplace, (uchar*)host, strlen(host));
+  XMapWindow(disp, win);
+  return win;
+}
+
+
+
+/* Wait until the window manager lists at least "count" clients */
+static ulong wait_clients(Display*disp, ulong count)
+{
+  ulong start=now_ms();
+  XSync(disp, False);
+  for (;;) {
+    ulong size=0;
+    Window*list=get_window_list(disp, &size);
+    sfree(list);
+    if (size>=count) { return size; }
+    if (now_ms()-start>CLIENT_WAIT_MS) {
+      fprintf(stderr, "budget: only %lu of %lu windows were listed by the window manager\n", size, count);
+      return 0;
+    }
+    usleep(10000);
+  }
+}
+
+
+
+static void api_call(Test*t, int api)
+{
+  Display*disp=t->disp;
+  Window win=t->wins[0];
+  Geometry geom;
+  long l[4];
+  ulong n=0;
+  switch (api) {
+    case API_GET_WINDOW_LIST: free(get_window_list(disp, &n)); break;
+    case API_GET_ACTIVE_WINDOW: get_active_window(disp); break;
+    case API_GET_WINDOW_CLASS: free(get_window_class(disp, win)); break;
+    case API_GET_WINDOW_TITLE: free(get_window_title(disp, win)); break;
+    case API_GET_WINDOW_GEOM: get_window_geom(disp, win, &geom); break;
+    case API_GET_WINDOW_FRAME: get_window_frame(disp, win, &l[0], &l[1], &l[2], &l[3]); break;
+    case API_GET_WINDOW_TYPE: free(get_window_type(disp, win)); break;
+    case API_GET_DESKTOP_OF_WINDOW: get_desktop_of_window(disp, win); break;
+    case API_GET_WIN_PID: get_win_pid(disp, win); break;
+    case API_GET_CLIENT_MACHINE: free(get_client_machine(disp, win)); break;
+    case API_GET_WINDOW_STATE: get_window_state(disp, win); break;
+    case API_XCTRL_SNAPSHOT: free(xctrl_snapshot(disp, &n)); break;
+    case API_GET_WINDOW_TITLE_INTO: get_window_title_into(disp, win, t->buf, sizeof(t->buf)); break;
+    case API_GET_WINDOW_CLASS_INTO: get_window_class_into(disp, win, t->buf, sizeof(t->buf)); break;
+    case API_GET_WINDOW_TYPE_INTO: get_window_type_into(disp, win, t->buf, sizeof(t->buf)); break;
+    case API_GET_CLIENT_MACHINE_INTO: get_client_machine_into(disp, win, t->buf, sizeof(t->buf)); break;
+    case API_GET_DESKTOP_NAME_INTO: get_desktop_name_into(disp, 0, True, t->buf, sizeof(t->buf)); break;
+    case API_GET_SHOWING_DESKTOP: get_showing_desktop(disp); break;
+    case API_GET_DESKTOP_NAME: free(get_desktop_name(disp, 0, True)); break;
+    case API_GET_WORKAREA_GEOM: get_workarea_geom(disp, &geom, 0); break;
+    case API_GET_DESKTOP_GEOM: get_desktop_geom(disp, 0, &geom); break;
+    case API_GET_NUMBER_OF_DESKTOPS: get_number_of_desktops(disp); break;
+    case API_GET_CURRENT_DESKTOP: get_current_desktop(disp); break;
+    case API_SUPPORTING_WM_CHECK: supporting_wm_check(disp); break;
+    case API_GET_WM_NAME: free(get_wm_name(disp)); break;
+    case API_GET_WM_CLASS: free(get_wm_class(disp)); break;
+    case API_GET_WM_PID: get_wm_pid(disp); break;
+    case API_WM_SUPPORTS: wm_supports(disp, "_NET_WM_STATE_HIDDEN"); break;
+    case API_XCTRL_ATOM: xctrl_atom(disp, "_NET_WM_STATE_ABOVE"); break;
+    case API_ACTIVATE_WINDOW: activate_window(disp, win, False); break;
+    case API_SET_WINDOW_STATE: set_window_state(disp, win, 2, "_NET_WM_STATE_ABOVE", NULL); break;
+    case API_ICONIFY_WINDOW: iconify_window(disp, t->wins[1]); break;
+    case API_SET_WINDOW_TITLE: set_window_title(disp, win, "budget window", 'T'); break;
+    case API_SET_WINDOW_GEOM: set_window_geom(disp, win, 0, 0, 50, 50, 200, 100); break;
+    case API_SET_WINDOW_MWM_HINTS: set_window_mwm_hints(disp, win, 2, 0, 1, 0); break;
+    case API_SEND_WINDOW_TO_DESKTOP: send_window_to_desktop(disp, win, 0); break;
+    case API_SEND_KEYSTROKES: send_keystrokes(disp, win, "a"); break;
+    case API_SET_SHOWING_DESKTOP: set_showing_desktop(disp, 0); break;
+    case API_CHANGE_GEOMETRY: change_geometry(disp, DisplayWidth(disp, DefaultScreen(disp)), DisplayHeight(disp, DefaultScreen(disp))); break;
+    case API_CHANGE_VIEWPORT: change_viewport(disp, 0, 0); break;
+    case API_SET_NUMBER_OF_DESKTOPS: set_number_of_desktops(disp, t->desktops); break;
+    case API_SET_CURRENT_DESKTOP: set_current_desktop(disp, 0); break;
+  }
+}
+
+
+
+/* The fewest round trips any of TRIES calls took */
+static ulong api_trips(Test*t, int api)
+{
+  ulong least=(ulong)-1;
+  int i;
+  api_call(t, api);
+  XSync(t->disp, False);
+  for (i=0; i<TRIES; i++) {
+    XCtrlStats st;
+    xctrl_reset_stats(t->disp);
+    xctrl_stats_begin(t->disp, budgets[api].name);
+    api_call(t, api);
+    xctrl_stats_end(t->disp);
+    if (xctrl_get_stats(t->disp, budgets[api].name, &st) && (st.round_trips<least)) { least=st.round_trips; }
+    XSync(t->disp, False);
+  }
+  return least;
+}
+
+
+
+int main(int argc, char*argv[])
+{
+  Test t;
+  ulong before=0;
+  ulong over=0;
+  Window*list;
+  int i;
+  if (argc>1) {
+    fprintf(stderr, "usage: %s\n", argv[0]);
+    return 2;
+  }
+  memset(&t, 0, sizeof(t));
+  t.disp=XOpenDisplay(NULL);
+  if (!t.disp) {
+    fprintf(stderr, "budget: can't open display\n");
+    return 1;
+  }
+  if (!supporting_wm_check(t.disp)) {
+    fprintf(stderr, "budget: no EWMH window manager is running\n");
+    return 1;
+  }
+  XSetErrorHandler(on_error);
+  xctrl_init(t.disp);
+  list=get_window_list(t.disp, &before);
+  sfree(list);
+  for (i=0; i<CLIENTS; i++) { t.wins[i]=make_client(t.disp, i); }
+  t.listed=wait_clients(t.disp, before+CLIENTS);
+  if (!t.listed) { return 1; }
+  t.desktops=get_number_of_desktops(t.disp);
+  xctrl_set_stats(t.disp, True);
+  for (i=0; i<API_COUNT; i++) {
+    const Budget*b=&budgets[i];
+    ulong budget=b->trips+b->per_window*t.listed;
+    ulong trips=api_trips(&t, i);
+    if (trips==(ulong)-1) {
+      printf("budget: %-26s not counted\n", b->name);
+      over++;
+    } else if (trips>budget) {
+      printf("budget: %-26s %lu round trips, over its budget of %lu\n", b->name, trips, budget);
+      over++;
+    }
+  }
+  xctrl_set_stats(t.disp, False);
+  for (i=0; i<CLIENTS; i++) { XDestroyWindow(t.disp, t.wins[i]); }
+  XCloseDisplay(t.disp);
+  printf("budget: %d functions, %lu over budget\n", API_COUNT, over);
+  return over?1:0;
+}
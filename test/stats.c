@@ -0,0 +1,124 @@
+/*
+Test for resetting the request accounting in the middle of a counted call.
+
+  Usage: stats
+
+Opens $DISPLAY, turns on the counters and the trace, and calls
+xctrl_reset_stats() inside nested xctrl_stats_begin()/_end() pairs, the
+way the Lua module's reset_stats() used to be called from inside its own
+count. The calls still open must carry on counting from the reset, and
+what they leave in the counters and the trace must be what was done
+after it. "make check" runs it under ../tools/xrun.sh.
+
+The exit status is 0 if everything added up, and 1 if not.
+
+This program is free software, released under the GNU General Public
+License. You may redistribute and/or modify this program under the terms
+of that license as published by the Free Software Foundation; either
+version 2 of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+*/
+
+#include <X11/Xlib.h>
+#define XCTRL_API static
+#include "../src/xctrl.c"
+
+static int failures=0;
+
+
+
+static void expect(const char*what, ulong got, ulong want)
+{
+  if (got!=want) {
+    printf("stats: %s is %lu, not %lu\n", what, got, want);
+    failures++;
+  }
+}
+
+
+
+/* The counters for "api", or all zeroes if it has none */
+static XCtrlStats api_stats(Display*disp, const char*api)
+{
+  XCtrlStats st;
+  if (!xctrl_get_stats(disp, api, &st)) { memset(&st, 0, sizeof(st)); }
+  return st;
+}
+
+
+
+int main(int argc, char*argv[])
+{
+  Display*disp;
+  XCtrlContext*ctx;
+  XCtrlStats st;
+  ulong size=0;
+  if (argc>1) {
+    fprintf(stderr, "usage: %s\n", argv[0]);
+    return 2;
+  }
+  disp=XOpenDisplay(NULL);
+  if (!disp) {
+    fprintf(stderr, "stats: can't open display\n");
+    return 1;
+  }
+  xctrl_init(disp);
+  xctrl_set_stats(disp, True);
+  if (!xctrl_set_trace(disp, 64)) {
+    fprintf(stderr, "stats: can't turn on the trace\n");
+    return 1;
+  }
+  ctx=get_context(disp);
+
+  /* outer { round trip; inner { round trip; reset; round trip } round trip } */
+  xctrl_stats_begin(disp, "outer");
+  stats_sync(disp);
+  xctrl_stats_begin(disp, "inner");
+  stats_sync(disp);
+  xctrl_reset_stats(disp);
+  stats_sync(disp);
+  xctrl_stats_end(disp);
+  stats_sync(disp);
+  xctrl_stats_end(disp);
+
+  st=api_stats(disp, "inner");
+  expect("inner calls", st.calls, 1);
+  expect("inner round trips", st.round_trips, 1);
+  st=api_stats(disp, "outer");
+  expect("outer calls", st.calls, 1);
+  expect("outer round trips", st.round_trips, 1);
+  xctrl_get_stats(disp, NULL, &st);
+  expect("total calls", st.calls, 2);
+  expect("total round trips", st.round_trips, 2);
+
+  /* Since the reset: an XSync(), inner, another XSync(), then outer */
+  expect("trace entries", ctx->trace_next, 4);
+  if (ctx->trace_next==4) {
+    expect("inner's traced round trips", ctx->trace[1].round_trips, 1);
+    expect("outer's traced round trips", ctx->trace[3].round_trips, 2);
+    if (strcmp(ctx->trace[3].name, "outer")!=0) {
+      printf("stats: the last trace entry is \"%s\", not \"outer\"\n", ctx->trace[3].name);
+      failures++;
+    }
+  }
+
+  /* The names are still there after a reset, and count again as before */
+  xctrl_reset_stats(disp);
+  xctrl_stats_begin(disp, "outer");
+  free(get_window_list(disp, &size));
+  xctrl_stats_end(disp);
+  st=api_stats(disp, "outer");
+  expect("outer calls after a reset", st.calls, 1);
+  expect("outer round trips after a reset", st.round_trips, 1);
+  expect("inner calls after a reset", api_stats(disp, "inner").calls, 0);
+
+  xctrl_set_trace(disp, 0);
+  xctrl_set_stats(disp, False);
+  XCloseDisplay(disp);
+  printf("stats: %d failures\n", failures);
+  return failures?1:0;
+}
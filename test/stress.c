@@ -0,0 +1,277 @@
+/*
+Stress test for the xctrl event listener's window list.
+
+  Usage: stress [-w windows]
+
+Opens "windows" windows (default 5000) on $DISPLAY, a batch at a time,
+then closes them all, while a listener on a second connection counts the
+INSERT and DELETE events it is given. Every window must get exactly one
+of each, and no other window any. Then a listener that ends itself from
+its first DELETE callback must get no more events, and be gone once
+dispatch returns. The display needs an EWMH window
+manager that keeps _NET_CLIENT_LIST, such as ../tools/wm.c; "make check"
+runs it under ../tools/xrun.sh.
+
+The exit status is 0 if every window's events were right, 1 if not, and
+2 for a usage error.
+
+This program is free software, released under the GNU General Public
+License. You may redistribute and/or modify this program under the terms
+of that license as published by the Free Software Foundation; either
+version 2 of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+*/
+
+#include <X11/Xlib.h>
+#define XCTRL_API static
+#include "../src/xctrl.c"
+
+#define BATCH 100            /* windows opened or closed between dispatches */
+#define QUIET_MS 500         /* how long nothing must arrive once all is in */
+#define WAIT_MS 120000
+#define MAX_REPORTED 10
+
+/* One event the listener was given */
+typedef struct {
+  Window win;
+  int ev;
+} Seen;
+
+typedef struct {
+  Seen*seen;
+  ulong count;
+  ulong size;
+  ulong inserts;
+  ulong deletes;
+} Stress;
+
+
+
+static int on_event(int ev, Window win, void*cb_data)
+{
+  Stress*st=(Stress*)cb_data;
+  if (st->count==st->size) {
+    ulong size=st->size?st->size*2:1024;
+    Seen*tmp=(Seen*)realloc(st->seen, size*sizeof(Seen));
+    if (!tmp) {
+      fprintf(stderr, "stress: out of memory\n");
+      return 0;
+    }
+    st->seen=tmp;
+    st->size=size;
+  }
+  st->seen[st->count].win=win;
+  st->seen[st->count].ev=ev;
+  st->count++;
+  if (ev==XCTRL_EVENT_WINDOW_LIST_INSERT) { st->inserts++; }
+  if (ev==XCTRL_EVENT_WINDOW_LIST_DELETE) { st->deletes++; }
+  return 1;
+}
+
+
+
+/* End the listener from inside its own callback, while it walks the window list */
+static int end_on_delete(int ev, Window win, void*cb_data)
+{
+  Display*ldisp=(Display*)cb_data;
+  if (ev!=XCTRL_EVENT_WINDOW_LIST_DELETE) { return 1; }
+  if (!get_context(ldisp)->listener) {
+    fprintf(stderr, "stress: DELETE for 0x%lx after the listener ended\n", win);
+    exit(1);
+  }
+  xctrl_listen_end(ldisp);
+  return 1;
+}
+
+
+
+/* Open BATCH windows, then close them under a listener that ends itself */
+static Bool end_from_callback(Display*disp, Display*ldisp)
+{
+  Window wins[BATCH];
+  ulong start;
+  int i;
+  for (i=0; i<BATCH; i++) {
+    wins[i]=XCreateSimpleWindow(disp, DefaultRootWindow(disp), i*5, i*3, 100, 50, 0, 0, 0);
+    XMapWindow(disp, wins[i]);
+  }
+  XSync(disp, False);
+  usleep(QUIET_MS*1000); /* for the window manager to list them */
+  xctrl_listen_select(ldisp, XCTRL_EVENT_MASK(XCTRL_EVENT_WINDOW_LIST_DELETE), None);
+  if (!xctrl_listen_begin(ldisp, end_on_delete, ldisp)) {
+    fprintf(stderr, "stress: can't start the listener\n");
+    return False;
+  }
+  for (i=0; i<BATCH; i++) { XDestroyWindow(disp, wins[i]); }
+  XSync(disp, False);
+  start=now_ms();
+  while (xctrl_event_dispatch(ldisp, 100)) {
+    if (now_ms()-start>=WAIT_MS) {
+      fprintf(stderr, "stress: no DELETE event ended the listener\n");
+      xctrl_listen_end(ldisp);
+      return False;
+    }
+  }
+  if (get_context(ldisp)->listener) {
+    fprintf(stderr, "stress: the listener is still there after it was ended\n");
+    return False;
+  }
+  printf("stress: ending the listener from its callback worked\n");
+  return True;
+}
+
+
+
+/*
+  Dispatch until at least the given number of each event has come and then
+  nothing more for QUIET_MS, so that a late duplicate is caught too.
+*/
+static Bool settle(Display*ldisp, Stress*st, ulong inserts, ulong deletes)
+{
+  ulong start=now_ms();
+  ulong last=start;
+  while (now_ms()-start<WAIT_MS) {
+    ulong before=st->count;
+    if (!xctrl_event_dispatch(ldisp, 100)) { return False; }
+    if (st->count!=before) {
+      last=now_ms();
+    } else if ((st->inserts>=inserts) && (st->deletes>=deletes) && (now_ms()-last>=QUIET_MS)) {
+      return True;
+    }
+  }
+  fprintf(stderr, "stress: gave up waiting with %lu of %lu inserts and %lu of %lu deletes\n",
+    st->inserts, inserts, st->deletes, deletes);
+  return False;
+}
+
+
+
+static int cmp_window(const void*a, const void*b)
+{
+  Window x=*(const Window*)a;
+  Window y=*(const Window*)b;
+  return (x<y)?-1:(x>y)?1:0;
+}
+
+
+
+/* Check that each window got one INSERT and one DELETE, and nothing else did */
+static Bool check(Stress*st, Window*wins, ulong count)
+{
+  uchar*ins=(uchar*)calloc(count, 1);
+  uchar*del=(uchar*)calloc(count, 1);
+  ulong strays=0;
+  ulong bad=0;
+  ulong i;
+  if (!ins || !del) {
+    sfree(ins);
+    sfree(del);
+    fprintf(stderr, "stress: out of memory\n");
+    return False;
+  }
+  qsort(wins, count, sizeof(Window), cmp_window);
+  for (i=0; i<st->count; i++) {
+    Window*w=(Window*)bsearch(&st->seen[i].win, wins, count, sizeof(Window), cmp_window);
+    if (!w) {
+      if (strays++<MAX_REPORTED) { fprintf(stderr, "stress: event %d for unknown window 0x%lx\n", st->seen[i].ev, st->seen[i].win); }
+    } else if (st->seen[i].ev==XCTRL_EVENT_WINDOW_LIST_INSERT) {
+      if (ins[w-wins]<2) { ins[w-wins]++; }
+    } else if (st->seen[i].ev==XCTRL_EVENT_WINDOW_LIST_DELETE) {
+      if (del[w-wins]<2) { del[w-wins]++; }
+    }
+  }
+  for (i=0; i<count; i++) {
+    if ((ins[i]!=1) || (del[i]!=1)) {
+      if (bad++<MAX_REPORTED) {
+        fprintf(stderr, "stress: window 0x%lx got %s%d INSERT and %s%d DELETE events\n",
+          wins[i], (ins[i]>1)?">=":"", ins[i], (del[i]>1)?">=":"", del[i]);
+      }
+    }
+  }
+  free(ins);
+  free(del);
+  printf("stress: %lu windows, %lu inserts, %lu deletes, %lu wrong, %lu for unknown windows\n",
+    count, st->inserts, st->deletes, bad, strays);
+  return (bad==0) && (strays==0);
+}
+
+
+
+static void usage(const char*argv0)
+{
+  fprintf(stderr, "usage: %s [-w windows]\n", argv0);
+  exit(2);
+}
+
+
+
+int main(int argc, char*argv[])
+{
+  Display*disp;
+  Display*ldisp;
+  Window*wins;
+  Stress st;
+  ulong count=5000;
+  ulong i;
+  int opt;
+  Bool ok;
+  while ((opt=getopt(argc, argv, "w:"))!=-1) {
+    switch (opt) {
+      case 'w': count=strtoul(optarg, NULL, 10); break;
+      default: usage(argv[0]);
+    }
+  }
+  if ((count<1) || (optind!=argc)) { usage(argv[0]); }
+  disp=XOpenDisplay(NULL);
+  ldisp=XOpenDisplay(NULL);
+  if (!disp || !ldisp) {
+    fprintf(stderr, "stress: can't open display\n");
+    return 1;
+  }
+  if (!supporting_wm_check(disp)) {
+    fprintf(stderr, "stress: no EWMH window manager is running\n");
+    return 1;
+  }
+  wins=(Window*)calloc(count, sizeof(Window));
+  if (!wins) {
+    fprintf(stderr, "stress: out of memory\n");
+    return 1;
+  }
+  memset(&st, 0, sizeof(st));
+  xctrl_listen_select(ldisp, XCTRL_EVENT_MASK(XCTRL_EVENT_WINDOW_LIST_INSERT)|XCTRL_EVENT_MASK(XCTRL_EVENT_WINDOW_LIST_DELETE), None);
+  if (!xctrl_listen_begin(ldisp, on_event, &st)) {
+    fprintf(stderr, "stress: can't start the listener\n");
+    return 1;
+  }
+  for (i=0; i<count; i++) {
+    wins[i]=XCreateSimpleWindow(disp, DefaultRootWindow(disp), (i*13)%800, (i*7)%600, 100, 50, 0, 0, 0);
+    XMapWindow(disp, wins[i]);
+    if ((i+1)%BATCH==0) {
+      XFlush(disp);
+      xctrl_event_dispatch(ldisp, 0);
+    }
+  }
+  XSync(disp, False);
+  ok=settle(ldisp, &st, count, 0);
+  for (i=0; ok && (i<count); i++) {
+    XDestroyWindow(disp, wins[i]);
+    if ((i+1)%BATCH==0) {
+      XFlush(disp);
+      xctrl_event_dispatch(ldisp, 0);
+    }
+  }
+  XSync(disp, False);
+  ok=ok && settle(ldisp, &st, count, count);
+  xctrl_listen_end(ldisp);
+  ok=check(&st, wins, count) && ok;
+  ok=end_from_callback(disp, ldisp) && ok;
+  free(wins);
+  sfree(st.seen);
+  XCloseDisplay(ldisp);
+  XCloseDisplay(disp);
+  return ok?0:1;
+}
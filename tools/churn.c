@@ -0,0 +1,605 @@
+/*
+Window churn generator for stress testing the xctrl event listener.
+
+  Usage: churn [-r rate] [-R max_rate] [-d seconds] [-w max_windows]
+               [-L min_life_ms] [-m mix] [-l latency_ms] [-s seed] [-o file]
+
+Creates, retitles, moves and destroys windows on $DISPLAY at "rate"
+operations per second for "seconds" seconds, while a child process runs
+event_loop_ex() on a connection of its own and timestamps every event it
+is given. Afterwards each operation is matched with the event it should
+have produced: INSERT for a window being mapped, DELETE for it being
+destroyed, TITLE for a change to _NET_WM_NAME and MOVE_RESIZE for a move.
+It reports how many were delivered, missed or unexpected, and the latency
+from the request to the callback.
+
+With -R, the run is repeated at double the rate each time up to max_rate,
+and the highest rate at which every event arrived with a 99th percentile
+latency under "latency_ms" is reported as the maximum sustainable rate.
+
+The mix is the relative weight of creates, destroys, retitles and moves,
+as "c:d:t:m" (default 1:1:4:4). There are never more than max_windows at
+once, and a window is only destroyed once it is min_life_ms old. Title
+and move events can only be seen once the listener knows of the window,
+so operations before its INSERT are counted as unobservable, not missed.
+With -o, every operation and event is written to "file", one per line,
+as "op time_us step kind window" and "event time_us kind window".
+
+The exit status is 0 if the first rate was sustained, 1 if not, and 2 for
+a usage error. The display needs an EWMH window manager that keeps
+_NET_CLIENT_LIST, such as wm.c; see xrun.sh.
+
+This program is free software, released under the GNU General Public
+License. You may redistribute and/or modify this program under the terms
+of that license as published by the Free Software Foundation; either
+version 2 of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+*/
+
+#include <X11/Xlib.h>
+#define XCTRL_API static
+#include "../src/xctrl.c"
+
+#include <signal.h>
+#include <sys/wait.h>
+
+#define END_TITLE "churn: end"
+#define KINDS 4
+#define HANDSHAKE_TRIES 50
+#define SETTLE_MS 30000
+
+static const int kind_events[KINDS]={
+  XCTRL_EVENT_WINDOW_LIST_INSERT,
+  XCTRL_EVENT_WINDOW_LIST_DELETE,
+  XCTRL_EVENT_WINDOW_TITLE,
+  XCTRL_EVENT_WINDOW_MOVE_RESIZE
+};
+
+static const char*kind_names[KINDS]={"insert", "delete", "title", "move"};
+
+/* One thing we did, or one event the listener saw */
+typedef struct {
+  ulong t;      /* now_us() */
+  Window win;
+  int kind;     /* index into kind_events */
+  int step;     /* for operations, which rate it was done at */
+} Record;
+
+typedef struct {
+  Record*items;
+  ulong count;
+  ulong size;
+} RecordList;
+
+typedef struct {
+  Window win;
+  ulong born;
+  int x;
+} Live;
+
+typedef struct {
+  ulong rate;
+  double achieved;
+  ulong expected[KINDS];
+  ulong delivered[KINDS];
+  ulong missed[KINDS];
+  ulong unexpected;
+  ulong unobservable;
+  double*lat;   /* latencies in ms */
+  ulong nlat;
+} Step;
+
+typedef struct {
+  Display*disp;
+  Atom net_wm_name;
+  Atom utf8;
+  Live*live;    /* a ring, oldest first */
+  ulong head;
+  ulong count;
+  ulong max;
+  ulong min_life_us;
+  int weights[KINDS];
+  ulong titles;
+  RecordList ops;
+} Driver;
+
+
+/* Windows are destroyed under the listener all the time */
+static int on_error(Display*disp, XErrorEvent*ev)
+{
+  return 0;
+}
+
+
+
+static void record_add(RecordList*list, ulong t, Window win, int kind, int step)
+{
+  if (list->count==list->size) {
+    ulong size=list->size?list->size*2:4096;
+    Record*items=(Record*)realloc(list->items, size*sizeof(Record));
+    if (!items) {
+      fprintf(stderr, "churn: out of memory\n");
+      exit(1);
+    }
+    list->items=items;
+    list->size=size;
+  }
+  list->items[list->count].t=t;
+  list->items[list->count].win=win;
+  list->items[list->count].kind=kind;
+  list->items[list->count].step=step;
+  list->count++;
+}
+
+
+
+/*********************************************************************/
+/* * * * * * * * * * * * * * * * Listener  * * * * * * * * * * * * * * */
+/*********************************************************************/
+
+typedef struct {
+  RecordList events;
+  int fd;
+  Bool ready;
+} Listen;
+
+
+
+static int listen_cb(const EventInfo*info, void*cb_data)
+{
+  Listen*l=(Listen*)cb_data;
+  ulong t=now_us();
+  int k;
+  if ((info->ev==XCTRL_EVENT_WINDOW_TITLE) && info->title && !strcmp(info->title, END_TITLE)) { return 0; }
+  for (k=0; k<KINDS; k++) {
+    if (kind_events[k]==info->ev) { record_add(&l->events, t, info->win, k, 0); }
+  }
+  if (!l->ready) { /* the first event says we are listening */
+    l->ready=(write(l->fd, "r", 1)==1);
+  }
+  return 1;
+}
+
+
+
+/* The child: listen until the end title, then send back what we saw. */
+static int listener_main(int fd)
+{
+  Display*disp=XOpenDisplay(NULL);
+  Listen l;
+  ulong mask=0;
+  ulong done=0;
+  int k;
+  if (!disp) { return 1; }
+  XSetErrorHandler(on_error);
+  memset(&l, 0, sizeof(l));
+  l.fd=fd;
+  for (k=0; k<KINDS; k++) { mask|=XCTRL_EVENT_MASK(kind_events[k]); }
+  xctrl_listen_select(disp, mask, None);
+  event_loop_ex(disp, listen_cb, &l);
+  while (done<l.events.count*sizeof(Record)) {
+    ssize_t n=write(fd, ((char*)l.events.items)+done, l.events.count*sizeof(Record)-done);
+    if (n<=0) { return 1; }
+    done+=n;
+  }
+  XCloseDisplay(disp);
+  return 0;
+}
+
+
+
+/* Wait up to timeout_ms for the child to say something */
+static Bool child_readable(int fd, int timeout_ms)
+{
+  struct pollfd pfd;
+  pfd.fd=fd;
+  pfd.events=POLLIN;
+  pfd.revents=0;
+  return (poll(&pfd, 1, timeout_ms)>0);
+}
+
+
+
+/*********************************************************************/
+/* * * * * * * * * * * * * * * * * Driver  * * * * * * * * * * * * * * */
+/*********************************************************************/
+
+static Window new_window(Driver*d, int x, const char*title)
+{
+  Window win=XCreateSimpleWindow(d->disp, DefaultRootWindow(d->disp), x, 100, 100, 50, 0, 0, 0);
+  XChangeProperty(d->disp, win, d->net_wm_name, d->utf8, 8, PropModeReplace, (uchar*)title, strlen(title));
+  return win;
+}
+
+
+
+static void op_create(Driver*d, int step)
+{
+  Live*w=&d->live[(d->head+d->count)%d->max];
+  w->x=rand()%1000;
+  w->win=new_window(d, w->x, "churn");
+  w->born=now_us();
+  XMapWindow(d->disp, w->win);
+  record_add(&d->ops, w->born, w->win, 0, step);
+  d->count++;
+}
+
+
+
+static void op_destroy(Driver*d, int step)
+{
+  Live*w=&d->live[d->head];
+  record_add(&d->ops, now_us(), w->win, 1, step);
+  XDestroyWindow(d->disp, w->win);
+  d->head=(d->head+1)%d->max;
+  d->count--;
+}
+
+
+
+static void op_title(Driver*d, int step)
+{
+  Live*w=&d->live[(d->head+rand()%d->count)%d->max];
+  char title[32];
+  sprintf(title, "churn %lu", ++d->titles);
+  record_add(&d->ops, now_us(), w->win, 2, step);
+  XChangeProperty(d->disp, w->win, d->net_wm_name, d->utf8, 8, PropModeReplace, (uchar*)title, strlen(title));
+}
+
+
+
+static void op_move(Driver*d, int step)
+{
+  Live*w=&d->live[(d->head+rand()%d->count)%d->max];
+  w->x=(w->x+1+rand()%50)%1000; /* always somewhere new, so there is always an event */
+  record_add(&d->ops, now_us(), w->win, 3, step);
+  XMoveWindow(d->disp, w->win, w->x, 100);
+}
+
+
+
+/* Pick an operation by weight, then settle for one that is possible now. */
+static void do_op(Driver*d, int step, int total)
+{
+  int r=rand()%total;
+  int k=0;
+  Bool can_destroy=d->count && (now_us()-d->live[d->head].born>=d->min_life_us);
+  while (r>=d->weights[k]) { r-=d->weights[k++]; }
+  if ((k==0) && (d->count==d->max)) { k=can_destroy?1:2; }
+  if ((k==1) && !can_destroy) { k=(d->count<d->max)?0:2; }
+  if ((k>=2) && !d->count) { k=0; }
+  switch (k) {
+    case 0: op_create(d, step); break;
+    case 1: op_destroy(d, step); break;
+    case 2: op_title(d, step); break;
+    case 3: op_move(d, step); break;
+  }
+}
+
+
+
+/* Issue rate*seconds operations on schedule; returns the rate achieved. */
+static double run_step(Driver*d, int step, ulong rate, ulong seconds)
+{
+  ulong total=rate*seconds;
+  ulong start=now_us();
+  ulong n=0;
+  int weight=0;
+  int k;
+  for (k=0; k<KINDS; k++) { weight+=d->weights[k]; }
+  while (n<total) {
+    ulong due=start+(ulong)((double)n*1e6/rate);
+    ulong now=now_us();
+    if (now<due) {
+      XFlush(d->disp);
+      usleep((due-now)<1000?(due-now):1000);
+      continue;
+    }
+    do_op(d, step, weight);
+    n++;
+  }
+  XFlush(d->disp);
+  return total*1e6/(now_us()-start);
+}
+
+
+
+/* Wait until the window manager lists "count" windows, so none of its updates are still to come */
+static Bool wait_listed(Display*disp, ulong count)
+{
+  ulong start=now_ms();
+  XSync(disp, False);
+  for (;;) {
+    ulong size=0;
+    Window*list=get_window_list(disp, &size);
+    sfree(list);
+    if (size==count) { return True; }
+    if (now_ms()-start>SETTLE_MS) { return False; }
+    usleep(10000);
+  }
+}
+
+
+
+/*********************************************************************/
+/* * * * * * * * * * * * * * * *  Matching  * * * * * * * * * * * * * * */
+/*********************************************************************/
+
+static int cmp_record(const void*a, const void*b)
+{
+  const Record*x=(const Record*)a;
+  const Record*y=(const Record*)b;
+  if (x->win!=y->win) { return (x->win>y->win)?1:-1; }
+  if (x->kind!=y->kind) { return x->kind-y->kind; }
+  return (x->t>y->t)-(x->t<y->t);
+}
+
+
+
+static int cmp_double(const void*a, const void*b)
+{
+  double x=*(const double*)a;
+  double y=*(const double*)b;
+  return (x>y)-(x<y);
+}
+
+
+
+/*
+  Match the operations on each window with its events, kind by kind. Once
+  the listener is watching a window it sees everything that happens to it,
+  so the events belong to the last operations of each kind: any earlier
+  ones without an event are missed if they came after the INSERT event,
+  and unobservable if they came before it.
+*/
+static void match(RecordList*ops, RecordList*evs, Step*steps)
+{
+  ulong i=0;
+  ulong j=0;
+  qsort(ops->items, ops->count, sizeof(Record), cmp_record);
+  qsort(evs->items, evs->count, sizeof(Record), cmp_record);
+  while (i<ops->count) {
+    Window win=ops->items[i].win;
+    ulong inserted=0;
+    Bool known=False;
+    int k;
+    while ((j<evs->count) && (evs->items[j].win<win)) { j++; } /* not one of ours */
+    if ((j<evs->count) && (evs->items[j].win==win) && (evs->items[j].kind==0)) {
+      known=True;
+      inserted=evs->items[j].t;
+    }
+    for (k=0; k<KINDS; k++) {
+      ulong o0=i, o1, e0=j, e1, n;
+      while ((i<ops->count) && (ops->items[i].win==win) && (ops->items[i].kind==k)) { i++; }
+      while ((j<evs->count) && (evs->items[j].win==win) && (evs->items[j].kind==k)) { j++; }
+      o1=i;
+      e1=j;
+      n=((o1-o0)<(e1-e0))?(o1-o0):(e1-e0);
+      if (e1-e0>n) { steps[o0<o1?ops->items[o0].step:0].unexpected+=e1-e0-n; }
+      for (; o0<o1; o0++) {
+        Record*op=&ops->items[o0];
+        Step*st=&steps[op->step];
+        st->expected[k]++;
+        if (o1-o0<=n) { /* matched */
+          Record*ev=&evs->items[e1-(o1-o0)];
+          st->delivered[k]++;
+          st->lat[st->nlat++]=(ev->t>op->t)?(ev->t-op->t)/1000.0:0;
+        } else if ((k==0) || (known && ((k==1) || (op->t>=inserted)))) {
+          st->missed[k]++;
+        } else {
+          st->expected[k]--;
+          st->unobservable++;
+        }
+      }
+    }
+  }
+}
+
+
+
+static double percentile(const double*sorted, ulong n, int pct)
+{
+  ulong rank=(n*pct+99)/100;
+  return n?sorted[rank?rank-1:0]:0;
+}
+
+
+
+static void write_truth(const char*path, RecordList*ops, RecordList*evs)
+{
+  FILE*f=fopen(path, "w");
+  ulong i;
+  if (!f) {
+    fprintf(stderr, "churn: can't write %s\n", path);
+    return;
+  }
+  for (i=0; i<ops->count; i++) {
+    Record*r=&ops->items[i];
+    fprintf(f, "op %lu %d %s 0x%lx\n", r->t, r->step, kind_names[r->kind], r->win);
+  }
+  for (i=0; i<evs->count; i++) {
+    Record*r=&evs->items[i];
+    fprintf(f, "event %lu %s 0x%lx\n", r->t, kind_names[r->kind], r->win);
+  }
+  fclose(f);
+}
+
+
+
+/*********************************************************************/
+/* * * * * * * * * * * * * * * * * * Main  * * * * * * * * * * * * * * */
+/*********************************************************************/
+
+static void usage(const char*argv0)
+{
+  fprintf(stderr, "usage: %s [-r rate] [-R max_rate] [-d seconds] [-w max_windows]\n"
+                  "       [-L min_life_ms] [-m c:d:t:m] [-l latency_ms] [-s seed] [-o file]\n", argv0);
+  exit(2);
+}
+
+
+
+int main(int argc, char*argv[])
+{
+  Driver d;
+  RecordList evs;
+  Step*steps;
+  ulong rate=1000;
+  ulong max_rate=0;
+  ulong seconds=5;
+  ulong life_ms=1000;
+  double limit_ms=100;
+  const char*truth=NULL;
+  int nsteps=0;
+  int fds[2];
+  int opt, k, s;
+  pid_t pid;
+  ulong base=0;
+  ulong sustained=0;
+  Bool ok=True;
+  Window end;
+  memset(&d, 0, sizeof(d));
+  d.max=500;
+  d.weights[0]=1;
+  d.weights[1]=1;
+  d.weights[2]=4;
+  d.weights[3]=4;
+  srand(getpid());
+  while ((opt=getopt(argc, argv, "r:R:d:w:L:m:l:s:o:"))!=-1) {
+    switch (opt) {
+      case 'r': rate=strtoul(optarg, NULL, 10); break;
+      case 'R': max_rate=strtoul(optarg, NULL, 10); break;
+      case 'd': seconds=strtoul(optarg, NULL, 10); break;
+      case 'w': d.max=strtoul(optarg, NULL, 10); break;
+      case 'L': life_ms=strtoul(optarg, NULL, 10); break;
+      case 'l': limit_ms=strtod(optarg, NULL); break;
+      case 's': srand(strtoul(optarg, NULL, 10)); break;
+      case 'o': truth=optarg; break;
+      case 'm': {
+        if (sscanf(optarg, "%d:%d:%d:%d", &d.weights[0], &d.weights[1], &d.weights[2], &d.weights[3])!=4) { usage(argv[0]); }
+        break;
+      }
+      default: usage(argv[0]);
+    }
+  }
+  if ((optind<argc) || !rate || !seconds || !d.max) { usage(argv[0]); }
+  if ((d.weights[0]<=0) || (d.weights[1]<0) || (d.weights[2]<0) || (d.weights[3]<0)) { usage(argv[0]); }
+  if (max_rate<rate) { max_rate=rate; }
+  for (s=0; (rate<<s)<=max_rate; s++) { nsteps++; }
+  d.min_life_us=life_ms*1000;
+  d.live=(Live*)calloc(d.max, sizeof(Live));
+  steps=(Step*)calloc(nsteps, sizeof(Step));
+  if (!d.live || !steps) { return 1; }
+
+  if (pipe(fds)) { return 1; }
+  pid=fork();
+  if (pid<0) { return 1; }
+  if (pid==0) {
+    close(fds[0]);
+    _exit(listener_main(fds[1]));
+  }
+  close(fds[1]);
+  d.disp=XOpenDisplay(NULL);
+  if (!d.disp) {
+    fprintf(stderr, "churn: can't open display\n");
+    kill(pid, SIGTERM);
+    return 1;
+  }
+  XSetErrorHandler(on_error);
+  d.net_wm_name=XInternAtom(d.disp, "_NET_WM_NAME", False);
+  d.utf8=XInternAtom(d.disp, "UTF8_STRING", False);
+  free(get_window_list(d.disp, &base));
+
+  /* Open windows until the listener sees one, so we know it has started */
+  for (k=0; k<HANDSHAKE_TRIES; k++) {
+    Window hello=new_window(&d, 0, "churn: hello");
+    char c;
+    XMapWindow(d.disp, hello);
+    XFlush(d.disp);
+    if (child_readable(fds[0], 200) && (read(fds[0], &c, 1)==1)) {
+      XDestroyWindow(d.disp, hello);
+      break;
+    }
+    XDestroyWindow(d.disp, hello);
+  }
+  if (k==HANDSHAKE_TRIES) {
+    fprintf(stderr, "churn: the listener did not start\n");
+    kill(pid, SIGTERM);
+    return 1;
+  }
+  if (!wait_listed(d.disp, base)) { fprintf(stderr, "churn: the window manager did not settle\n"); }
+
+  for (s=0; s<nsteps; s++) {
+    steps[s].rate=rate<<s;
+    steps[s].achieved=run_step(&d, s, steps[s].rate, seconds);
+  }
+  if (!wait_listed(d.disp, base+d.count)) { fprintf(stderr, "churn: the window manager did not settle\n"); }
+
+  /* Keep giving the end title until the listener stops and sends its events */
+  end=new_window(&d, 0, "churn: ending");
+  XMapWindow(d.disp, end);
+  memset(&evs, 0, sizeof(evs));
+  for (k=0; k<SETTLE_MS/100; k++) {
+    XChangeProperty(d.disp, end, d.net_wm_name, d.utf8, 8, PropModeReplace, (uchar*)END_TITLE, strlen(END_TITLE));
+    XFlush(d.disp);
+    if (child_readable(fds[0], 100)) { break; }
+  }
+  if (k==SETTLE_MS/100) {
+    fprintf(stderr, "churn: the listener did not finish\n");
+    kill(pid, SIGTERM);
+    return 1;
+  }
+  for (;;) {
+    Record r;
+    ulong got=0;
+    while (got<sizeof(r)) {
+      ssize_t n=read(fds[0], ((char*)&r)+got, sizeof(r)-got);
+      if (n<=0) { break; }
+      got+=n;
+    }
+    if (got<sizeof(r)) { break; }
+    record_add(&evs, r.t, r.win, r.kind, 0);
+  }
+  waitpid(pid, NULL, 0);
+  XDestroyWindow(d.disp, end);
+  for (; d.count; d.count--, d.head=(d.head+1)%d.max) { XDestroyWindow(d.disp, d.live[d.head].win); }
+  XSync(d.disp, False);
+
+  if (truth) { write_truth(truth, &d.ops, &evs); }
+  for (s=0; s<nsteps; s++) {
+    steps[s].lat=(double*)calloc(d.ops.count+1, sizeof(double));
+    if (!steps[s].lat) { return 1; }
+  }
+  match(&d.ops, &evs, steps);
+
+  for (s=0; s<nsteps; s++) {
+    Step*st=&steps[s];
+    ulong missed=0;
+    Bool good;
+    for (k=0; k<KINDS; k++) { missed+=st->missed[k]; }
+    qsort(st->lat, st->nlat, sizeof(double), cmp_double);
+    good=!missed && !st->unexpected && (percentile(st->lat, st->nlat, 99)<=limit_ms);
+    if (good && (!s || (sustained==(st->rate>>1)))) { sustained=st->rate; } /* every rate up to here */
+    if (!s) { ok=good; }
+    printf("rate %lu/s (achieved %.0f/s): %s\n", st->rate, st->achieved, good?"sustained":"NOT SUSTAINED");
+    printf("  delivered/expected:");
+    for (k=0; k<KINDS; k++) { printf(" %s %lu/%lu", kind_names[k], st->delivered[k], st->expected[k]); }
+    printf("\n  missed %lu, unexpected %lu, unobservable %lu\n", missed, st->unexpected, st->unobservable);
+    printf("  latency ms: p50 %.2f  p90 %.2f  p99 %.2f  max %.2f\n",
+      percentile(st->lat, st->nlat, 50), percentile(st->lat, st->nlat, 90),
+      percentile(st->lat, st->nlat, 99), st->nlat?st->lat[st->nlat-1]:0);
+  }
+  if (nsteps>1) {
+    if (sustained) {
+      printf("maximum sustainable rate: %lu/s\n", sustained);
+    } else {
+      printf("maximum sustainable rate: below %lu/s\n", rate);
+    }
+  }
+  XCloseDisplay(d.disp);
+  return ok?0:1;
+}
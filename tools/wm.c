@@ -0,0 +1,469 @@
+/*
+A minimal stand-in EWMH window manager for the xctrl benchmarks and tests.
+
+It draws nothing and never reparents, but it keeps the root window
+properties that xctrl reads (_NET_CLIENT_LIST, _NET_ACTIVE_WINDOW, the
+desktops, workarea and viewport) and each client's _NET_WM_DESKTOP,
+_NET_WM_STATE and _NET_FRAME_EXTENTS, and it acts on every client message
+that xctrl sends. That is enough to give the library a realistic server
+to talk to on Xvfb, without depending on whichever window manager the
+machine happens to have installed.
+
+  Usage: wm [-r ready_file]
+
+Once it owns the display it creates ready_file, if given, so that a script
+can wait for it before starting the clients.
+
+This program is free software, released under the GNU General Public
+License. You may redistribute and/or modify this program under the terms
+of that license as published by the Free Software Foundation; either
+version 2 of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <X11/Xlib.h>
+#include <X11/Xatom.h>
+#include <X11/Xutil.h>
+
+
+#define DESKTOPS 4
+#define MAX_DESKTOPS 32
+
+enum {
+  NET_SUPPORTED,
+  NET_SUPPORTING_WM_CHECK,
+  NET_CLIENT_LIST,
+  NET_ACTIVE_WINDOW,
+  NET_NUMBER_OF_DESKTOPS,
+  NET_CURRENT_DESKTOP,
+  NET_DESKTOP_NAMES,
+  NET_DESKTOP_GEOMETRY,
+  NET_DESKTOP_VIEWPORT,
+  NET_WORKAREA,
+  NET_SHOWING_DESKTOP,
+  NET_CLOSE_WINDOW,
+  NET_MOVERESIZE_WINDOW,
+  NET_REQUEST_FRAME_EXTENTS,
+  NET_FRAME_EXTENTS,
+  NET_WM_NAME,
+  NET_WM_PID,
+  NET_WM_DESKTOP,
+  NET_WM_STATE,
+  NET_WM_STATE_HIDDEN,
+  NET_WM_WINDOW_TYPE,
+  WM_STATE,
+  WM_CHANGE_STATE,
+  UTF8_STRING,
+  ATOM_COUNT
+};
+
+static const char*atom_names[ATOM_COUNT]={
+  "_NET_SUPPORTED",
+  "_NET_SUPPORTING_WM_CHECK",
+  "_NET_CLIENT_LIST",
+  "_NET_ACTIVE_WINDOW",
+  "_NET_NUMBER_OF_DESKTOPS",
+  "_NET_CURRENT_DESKTOP",
+  "_NET_DESKTOP_NAMES",
+  "_NET_DESKTOP_GEOMETRY",
+  "_NET_DESKTOP_VIEWPORT",
+  "_NET_WORKAREA",
+  "_NET_SHOWING_DESKTOP",
+  "_NET_CLOSE_WINDOW",
+  "_NET_MOVERESIZE_WINDOW",
+  "_NET_REQUEST_FRAME_EXTENTS",
+  "_NET_FRAME_EXTENTS",
+  "_NET_WM_NAME",
+  "_NET_WM_PID",
+  "_NET_WM_DESKTOP",
+  "_NET_WM_STATE",
+  "_NET_WM_STATE_HIDDEN",
+  "_NET_WM_WINDOW_TYPE",
+  "WM_STATE",
+  "WM_CHANGE_STATE",
+  "UTF8_STRING"
+};
+
+/* Everything up to here goes in _NET_SUPPORTED */
+#define SUPPORTED_COUNT (NET_WM_WINDOW_TYPE+1)
+
+static Atom atoms[ATOM_COUNT];
+
+typedef struct {
+  Window win;
+  Bool iconic;  /* we unmapped it, so it stays in the list */
+} Client;
+
+static Display*disp;
+static Window root;
+static Client*clients=NULL;
+static unsigned long client_count=0;
+static unsigned long client_size=0;
+static long desktops=DESKTOPS;
+static long current=0;
+static unsigned long ignore_unmaps=0;
+
+
+
+static int on_error(Display*d, XErrorEvent*ev)
+{
+  return 0; /* clients come and go while we are talking to them */
+}
+
+
+
+static int on_other_wm(Display*d, XErrorEvent*ev)
+{
+  fprintf(stderr, "wm: another window manager is already running\n");
+  exit(1);
+  return 0;
+}
+
+
+
+static void set_cardinals(Window win, int id, const long*values, int count)
+{
+  XChangeProperty(disp, win, atoms[id], XA_CARDINAL, 32, PropModeReplace, (unsigned char*)values, count);
+}
+
+
+
+static void set_cardinal(Window win, int id, long value)
+{
+  set_cardinals(win, id, &value, 1);
+}
+
+
+
+static void set_desktop_props(void)
+{
+  long work[MAX_DESKTOPS*4];
+  char names[MAX_DESKTOPS*12];
+  int len=0;
+  long i;
+  for (i=0; i<desktops; i++) {
+    work[i*4]=0;
+    work[i*4+1]=0;
+    work[i*4+2]=DisplayWidth(disp, DefaultScreen(disp));
+    work[i*4+3]=DisplayHeight(disp, DefaultScreen(disp));
+    len+=sprintf(names+len, "Desk %ld", i+1)+1;
+  }
+  set_cardinal(root, NET_NUMBER_OF_DESKTOPS, desktops);
+  set_cardinals(root, NET_WORKAREA, work, desktops*4);
+  XChangeProperty(disp, root, atoms[NET_DESKTOP_NAMES], atoms[UTF8_STRING], 8, PropModeReplace, (unsigned char*)names, len);
+  if (current>=desktops) {
+    current=desktops-1;
+    set_cardinal(root, NET_CURRENT_DESKTOP, current);
+  }
+}
+
+
+
+static void setup(void)
+{
+  Window check=XCreateSimpleWindow(disp, root, -10, -10, 1, 1, 0, 0, 0);
+  Window none=None;
+  long geom[2];
+  long vport[2]={0,0};
+  long pid=getpid();
+  const char*name="xctrl-bench-wm";
+  const char class_name[]="wm\0XctrlBenchWM";
+  geom[0]=DisplayWidth(disp, DefaultScreen(disp));
+  geom[1]=DisplayHeight(disp, DefaultScreen(disp));
+  XChangeProperty(disp, root, atoms[NET_SUPPORTED], XA_ATOM, 32, PropModeReplace, (unsigned char*)atoms, SUPPORTED_COUNT);
+  XChangeProperty(disp, check, atoms[NET_SUPPORTING_WM_CHECK], XA_WINDOW, 32, PropModeReplace, (unsigned char*)&check, 1);
+  XChangeProperty(disp, check, atoms[NET_WM_NAME], atoms[UTF8_STRING], 8, PropModeReplace, (unsigned char*)name, strlen(name));
+  XChangeProperty(disp, check, XA_WM_CLASS, XA_STRING, 8, PropModeReplace, (unsigned char*)class_name, sizeof(class_name));
+  set_cardinal(check, NET_WM_PID, pid);
+  XChangeProperty(disp, root, atoms[NET_CLIENT_LIST], XA_WINDOW, 32, PropModeReplace, NULL, 0);
+  XChangeProperty(disp, root, atoms[NET_ACTIVE_WINDOW], XA_WINDOW, 32, PropModeReplace, (unsigned char*)&none, 1);
+  set_cardinal(root, NET_CURRENT_DESKTOP, current);
+  set_cardinals(root, NET_DESKTOP_GEOMETRY, geom, 2);
+  set_cardinals(root, NET_DESKTOP_VIEWPORT, vport, 2);
+  set_cardinal(root, NET_SHOWING_DESKTOP, 0);
+  set_desktop_props();
+  /* Set the check last, since clients take it to mean the rest is there */
+  XChangeProperty(disp, root, atoms[NET_SUPPORTING_WM_CHECK], XA_WINDOW, 32, PropModeReplace, (unsigned char*)&check, 1);
+}
+
+
+
+static Client*find_client(Window win)
+{
+  unsigned long i;
+  for (i=0; i<client_count; i++) {
+    if (clients[i].win==win) { return &clients[i]; }
+  }
+  return NULL;
+}
+
+
+
+static void write_client_list(void)
+{
+  Window*list=(Window*)malloc((client_count+1)*sizeof(Window));
+  unsigned long i;
+  if (!list) { return; }
+  for (i=0; i<client_count; i++) { list[i]=clients[i].win; }
+  XChangeProperty(disp, root, atoms[NET_CLIENT_LIST], XA_WINDOW, 32, PropModeReplace, (unsigned char*)list, client_count);
+  free(list);
+}
+
+
+
+static void set_wm_state(Window win, long state)
+{
+  long data[2];
+  data[0]=state;
+  data[1]=None;
+  XChangeProperty(disp, win, atoms[WM_STATE], atoms[WM_STATE], 32, PropModeReplace, (unsigned char*)data, 2);
+}
+
+
+
+static void manage(Window win)
+{
+  long extents[4]={0,0,0,0};
+  Atom type;
+  int format;
+  unsigned long n, after;
+  unsigned char*desk=NULL;
+  Client*c=find_client(win);
+  if (c) {
+    if (c->iconic) {
+      c->iconic=False;
+      set_wm_state(win, NormalState);
+    }
+    XMapWindow(disp, win);
+    return;
+  }
+  if (client_count==client_size) {
+    unsigned long size=client_size?client_size*2:256;
+    Client*tmp=(Client*)realloc(clients, size*sizeof(Client));
+    if (!tmp) { return; }
+    clients=tmp;
+    client_size=size;
+  }
+  clients[client_count].win=win;
+  clients[client_count].iconic=False;
+  client_count++;
+  XGetWindowProperty(disp, win, atoms[NET_WM_DESKTOP], 0, 1, False, XA_CARDINAL, &type, &format, &n, &after, &desk);
+  if (desk) {
+    XFree(desk);
+  } else {
+    set_cardinal(win, NET_WM_DESKTOP, current);
+  }
+  set_cardinals(win, NET_FRAME_EXTENTS, extents, 4);
+  set_wm_state(win, NormalState);
+  XMapWindow(disp, win);
+  /* Appending costs the server less than rewriting a long list */
+  XChangeProperty(disp, root, atoms[NET_CLIENT_LIST], XA_WINDOW, 32, PropModeAppend, (unsigned char*)&win, 1);
+}
+
+
+
+static void unmanage(Window win)
+{
+  Client*c=find_client(win);
+  if (!c) { return; }
+  memmove(c, c+1, (client_count-(c-clients)-1)*sizeof(Client));
+  client_count--;
+  write_client_list();
+}
+
+
+
+static void iconify(Window win)
+{
+  Client*c=find_client(win);
+  if (!c || c->iconic) { return; }
+  c->iconic=True;
+  ignore_unmaps++;
+  set_wm_state(win, IconicState);
+  XUnmapWindow(disp, win);
+}
+
+
+
+/* Apply a _NET_WM_STATE request: 0 removes, 1 adds, 2 toggles. */
+static void change_state(Window win, long action, Atom p1, Atom p2)
+{
+  Atom type;
+  int format;
+  unsigned long n=0;
+  unsigned long after;
+  Atom*old=NULL;
+  Atom states[64];
+  unsigned long count=0;
+  unsigned long i;
+  Atom req[2];
+  int r;
+  XGetWindowProperty(disp, win, atoms[NET_WM_STATE], 0, 64, False, XA_ATOM, &type, &format, &n, &after, (unsigned char**)&old);
+  for (i=0; old && i<n; i++) { states[count++]=old[i]; }
+  if (old) { XFree(old); }
+  req[0]=p1;
+  req[1]=p2;
+  for (r=0; r<2; r++) {
+    Bool found=False;
+    if (req[r]==None) { continue; }
+    for (i=0; i<count; i++) {
+      if (states[i]==req[r]) {
+        found=True;
+        break;
+      }
+    }
+    if (found && (action!=1)) {
+      states[i]=states[--count];
+    } else if (!found && (action!=0) && (count<64)) {
+      states[count++]=req[r];
+    }
+  }
+  XChangeProperty(disp, win, atoms[NET_WM_STATE], XA_ATOM, 32, PropModeReplace, (unsigned char*)states, count);
+}
+
+
+
+static void moveresize(Window win, long flags, long x, long y, long w, long h)
+{
+  XWindowChanges wc;
+  unsigned int mask=0;
+  if (flags&(1<<8)) { wc.x=x; mask|=CWX; }
+  if (flags&(1<<9)) { wc.y=y; mask|=CWY; }
+  if ((flags&(1<<10)) && (w>0)) { wc.width=w; mask|=CWWidth; }
+  if ((flags&(1<<11)) && (h>0)) { wc.height=h; mask|=CWHeight; }
+  if (mask) { XConfigureWindow(disp, win, mask, &wc); }
+}
+
+
+
+static void client_message(XClientMessageEvent*ev)
+{
+  Atom msg=ev->message_type;
+  Window win=ev->window;
+  long*l=ev->data.l;
+  if (msg==atoms[NET_ACTIVE_WINDOW]) {
+    if (!find_client(win)) { return; }
+    manage(win); /* maps it again if it was iconic */
+    XRaiseWindow(disp, win);
+    XSetInputFocus(disp, win, RevertToPointerRoot, CurrentTime);
+    XChangeProperty(disp, root, atoms[NET_ACTIVE_WINDOW], XA_WINDOW, 32, PropModeReplace, (unsigned char*)&win, 1);
+  } else if (msg==atoms[NET_CLOSE_WINDOW]) {
+    if (find_client(win)) { XDestroyWindow(disp, win); }
+  } else if (msg==atoms[NET_WM_DESKTOP]) {
+    if (find_client(win)) { set_cardinal(win, NET_WM_DESKTOP, l[0]); }
+  } else if (msg==atoms[NET_CURRENT_DESKTOP]) {
+    if ((l[0]>=0) && (l[0]<desktops) && (l[0]!=current)) {
+      current=l[0];
+      set_cardinal(root, NET_CURRENT_DESKTOP, current);
+    }
+  } else if (msg==atoms[NET_NUMBER_OF_DESKTOPS]) {
+    if ((l[0]>0) && (l[0]<=MAX_DESKTOPS)) {
+      desktops=l[0];
+      set_desktop_props();
+    }
+  } else if (msg==atoms[NET_SHOWING_DESKTOP]) {
+    set_cardinal(root, NET_SHOWING_DESKTOP, l[0]?1:0);
+  } else if (msg==atoms[NET_DESKTOP_VIEWPORT]) {
+    set_cardinals(root, NET_DESKTOP_VIEWPORT, l, 2);
+  } else if (msg==atoms[NET_DESKTOP_GEOMETRY]) {
+    set_cardinals(root, NET_DESKTOP_GEOMETRY, l, 2);
+  } else if (msg==atoms[NET_WM_STATE]) {
+    if (find_client(win)) { change_state(win, l[0], l[1], l[2]); }
+  } else if (msg==atoms[NET_MOVERESIZE_WINDOW]) {
+    if (find_client(win)) { moveresize(win, l[0], l[1], l[2], l[3], l[4]); }
+  } else if (msg==atoms[NET_REQUEST_FRAME_EXTENTS]) {
+    long extents[4]={0,0,0,0};
+    set_cardinals(win, NET_FRAME_EXTENTS, extents, 4);
+  } else if (msg==atoms[WM_CHANGE_STATE]) {
+    if (l[0]==IconicState) { iconify(win); }
+  }
+}
+
+
+
+static void configure_request(XConfigureRequestEvent*ev)
+{
+  XWindowChanges wc;
+  wc.x=ev->x;
+  wc.y=ev->y;
+  wc.width=ev->width;
+  wc.height=ev->height;
+  wc.border_width=ev->border_width;
+  wc.sibling=ev->above;
+  wc.stack_mode=ev->detail;
+  XConfigureWindow(disp, ev->window, ev->value_mask, &wc);
+}
+
+
+
+int main(int argc, char*argv[])
+{
+  const char*ready=NULL;
+  int opt;
+  while ((opt=getopt(argc, argv, "r:"))!=-1) {
+    switch (opt) {
+      case 'r': ready=optarg; break;
+      default:
+        fprintf(stderr, "usage: %s [-r ready_file]\n", argv[0]);
+        return 2;
+    }
+  }
+  disp=XOpenDisplay(NULL);
+  if (!disp) {
+    fprintf(stderr, "wm: can't open display\n");
+    return 1;
+  }
+  root=DefaultRootWindow(disp);
+  XInternAtoms(disp, (char**)atom_names, ATOM_COUNT, False, atoms);
+  XSetErrorHandler(on_other_wm);
+  XSelectInput(disp, root, SubstructureRedirectMask|SubstructureNotifyMask);
+  XSync(disp, False);
+  XSetErrorHandler(on_error);
+  setup();
+  XSync(disp, False);
+  if (ready) {
+    FILE*f=fopen(ready, "w");
+    if (f) { fclose(f); }
+  }
+  for (;;) {
+    XEvent ev;
+    XNextEvent(disp, &ev);
+    switch (ev.type) {
+      case MapRequest: {
+        manage(ev.xmaprequest.window);
+        break;
+      }
+      case UnmapNotify: {
+        Client*c=find_client(ev.xunmap.window);
+        if (c && c->iconic && ignore_unmaps && !ev.xunmap.send_event) {
+          ignore_unmaps--;
+        } else if (c) {
+          unmanage(ev.xunmap.window); /* withdrawn */
+        }
+        break;
+      }
+      case DestroyNotify: {
+        unmanage(ev.xdestroywindow.window);
+        break;
+      }
+      case ConfigureRequest: {
+        configure_request(&ev.xconfigurerequest);
+        break;
+      }
+      case ClientMessage: {
+        client_message(&ev.xclient);
+        break;
+      }
+    }
+  }
+  return 0;
+}
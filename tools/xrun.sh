@@ -0,0 +1,82 @@
+#!/bin/sh
+#
+# Run a command on a private Xvfb server with the stand-in window manager.
+#
+#   xrun.sh command [args...]
+#
+# The command gets DISPLAY pointing at the new server and the server and
+# window manager are shut down when it exits. If Xvfb is not installed,
+# nothing is run and the exit status is 77, the usual "skipped" code.
+#
+# XRUN_SCREEN sets the screen size (default 1920x1080x24), and XRUN_NO_WM=1
+# leaves the window manager out.
+#
+
+TOOLS=`dirname "$0"`
+
+if ! command -v Xvfb >/dev/null 2>&1; then
+  echo "xrun: Xvfb is not installed, skipping" >&2
+  exit 77
+fi
+
+if [ -z "$XRUN_NO_WM" ] && [ ! -x "$TOOLS/wm" ]; then
+  echo "xrun: $TOOLS/wm has not been built" >&2
+  exit 1
+fi
+
+# Find a free display number
+num=99
+while [ -e /tmp/.X$num-lock ] || [ -e /tmp/.X11-unix/X$num ]; do
+  num=`expr $num + 1`
+done
+
+tmp=`mktemp -d /tmp/xrun.XXXXXX` || exit 1
+xpid=
+wpid=
+
+cleanup() {
+  [ -n "$wpid" ] && kill $wpid 2>/dev/null
+  [ -n "$xpid" ] && kill $xpid 2>/dev/null
+  wait 2>/dev/null
+  rm -rf "$tmp"
+}
+trap cleanup EXIT
+trap 'exit 130' INT TERM
+
+Xvfb :$num -screen 0 "${XRUN_SCREEN:-1920x1080x24}" -nolisten tcp -noreset >"$tmp/xvfb.log" 2>&1 &
+xpid=$!
+
+# Wait up to 10 seconds for each of the server and the window manager
+wait_for() {
+  i=0
+  while [ ! -e "$1" ]; do
+    if ! kill -0 $2 2>/dev/null || [ $i -ge 100 ]; then
+      return 1
+    fi
+    sleep 0.1
+    i=`expr $i + 1`
+  done
+  return 0
+}
+
+if ! wait_for /tmp/.X11-unix/X$num $xpid; then
+  echo "xrun: Xvfb did not start:" >&2
+  cat "$tmp/xvfb.log" >&2
+  exit 1
+fi
+
+DISPLAY=:$num
+export DISPLAY
+
+if [ -z "$XRUN_NO_WM" ]; then
+  "$TOOLS/wm" -r "$tmp/wm.ready" &
+  wpid=$!
+  if ! wait_for "$tmp/wm.ready" $wpid; then
+    echo "xrun: the window manager did not start" >&2
+    exit 1
+  fi
+fi
+
+"$@"
+status=$?
+exit $status